@@ -0,0 +1,74 @@
+#include "cpufeatures.h"
+
+#if defined(HAVE_AVX2_KERNELS) && defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+// Helper functions
+static bool detectAVX2() {
+#if !defined(HAVE_AVX2_KERNELS)
+    return false;
+#elif defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return false;
+    }
+    // The OS must save the YMM registers too
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6) {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+bool CpuFeatures::hasAVX2() {
+    static const bool supported = detectAVX2();
+    return supported;
+}
+
+bool CpuFeatures::hasNEON() {
+#if defined(HAVE_NEON_KERNELS)
+    return true;  // Part of the AArch64 baseline
+#else
+    return false;
+#endif
+}
+
+QString CpuFeatures::describe() {
+    return kernelName(resolve(SimdKernel::Auto));
+}
+
+SimdKernel CpuFeatures::resolve(SimdKernel kernel) {
+    switch (kernel) {
+    case SimdKernel::Auto:
+        if (hasAVX2()) {
+            return SimdKernel::AVX2;
+        }
+        return hasNEON() ? SimdKernel::NEON : SimdKernel::Scalar;
+    case SimdKernel::AVX2:
+        return hasAVX2() ? kernel : SimdKernel::Scalar;
+    case SimdKernel::NEON:
+        return hasNEON() ? kernel : SimdKernel::Scalar;
+    default:
+        return SimdKernel::Scalar;
+    }
+}
+
+QString CpuFeatures::kernelName(SimdKernel kernel) {
+    switch (kernel) {
+    case SimdKernel::Auto: return "Auto";
+    case SimdKernel::Scalar: return "Scalar";
+    case SimdKernel::AVX2: return "AVX2";
+    case SimdKernel::NEON: return "NEON";
+    }
+    return QString();
+}
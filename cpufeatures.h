@@ -0,0 +1,40 @@
+#pragma once
+
+#include <QString>
+#include <QtGlobal>
+
+// Instruction sets for hand-written kernels, detected at run time so one
+// build runs everywhere and uses the widest path the CPU has.
+#if defined(Q_PROCESSOR_X86_64) && (defined(__GNUC__) || defined(__clang__) || defined(_MSC_VER))
+#define HAVE_AVX2_KERNELS 1
+#if defined(_MSC_VER) && !defined(__clang__)
+#define AVX2_TARGET
+#else
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#endif
+
+#if defined(Q_PROCESSOR_ARM_64)
+#define HAVE_NEON_KERNELS 1
+#endif
+
+// Which implementation of a kernel to run
+enum class SimdKernel {
+    Auto,    // The widest the CPU supports
+    Scalar,
+    AVX2,
+    NEON
+};
+
+class CpuFeatures {
+public:
+    static bool hasAVX2();
+    static bool hasNEON();
+
+    // Widest kernel set available, for logs and benchmarks
+    static QString describe();
+
+    // Auto becomes the best kernel; sets the CPU lacks become Scalar
+    static SimdKernel resolve(SimdKernel kernel);
+    static QString kernelName(SimdKernel kernel);
+};
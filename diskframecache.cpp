@@ -0,0 +1,590 @@
+#include "diskframecache.h"
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QDataStream>
+#include <QSaveFile>
+#include <QCryptographicHash>
+#include <QDebug>
+#include <cstring>
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+extern "C" {
+#include <libavutil/imgutils.h>
+}
+
+const qint64 DiskFrameCache::MIN_SEGMENT_SIZE = 64LL * 1024 * 1024;   // 64MB
+const qint64 DiskFrameCache::MAX_SEGMENT_SIZE = 512LL * 1024 * 1024;  // 512MB
+const int DiskFrameCache::MAX_PENDING_WRITES = 32;
+const int DiskFrameCache::INDEX_SAVE_INTERVAL = 64;
+
+namespace {
+
+const quint32 INDEX_MAGIC = 0x46434458;   // "FCDX"
+const quint32 INDEX_VERSION = 1;
+const quint32 RECORD_MAGIC = 0x46524D45;  // "FRME"
+const qint64 RECORD_ALIGNMENT = 64;
+
+enum class RecordKind : qint32 {
+    Image = 0,   // QImage pixels, one plane
+    Planar = 1   // AVFrame planes in the codec's pixel format
+};
+
+// Stored in front of every frame inside a segment
+struct RecordHeader {
+    quint32 magic;
+    RecordKind kind;
+    qint32 width;
+    qint32 height;
+    qint32 format;
+    qint32 colorSpace;
+    qint32 colorRange;
+    qint32 planeCount;
+    qint32 linesize[4];
+    qint64 planeOffset[4];
+    qint64 planeSize[4];
+    qint64 totalSize;
+};
+
+qint64 alignUp(qint64 value) {
+    return (value + RECORD_ALIGNMENT - 1) & ~(RECORD_ALIGNMENT - 1);
+}
+
+// What makes a source file the same file: any change to it gives another
+// identity. Read from the file system on every lookup, since a file can
+// be rendered again under the same name while the cache is open.
+QByteArray sourceIdentity(const QString& filePath) {
+    QFileInfo info(filePath);
+    return info.absoluteFilePath().toUtf8() + '|' +
+           QByteArray::number(info.size()) + '|' +
+           QByteArray::number(info.lastModified().toMSecsSinceEpoch());
+}
+
+} // namespace
+
+// One memory-mapped segment file. The file is removed once the segment has
+// been recycled and the last frame referencing its mapping is gone.
+struct DiskFrameCache::Segment {
+    int id = 0;
+    QFile file;
+    uchar* data = nullptr;
+    qint64 size = 0;
+    qint64 used = 0;
+    qint64 synced = 0;  // Bytes known to be on disk; guarded by saveMutex
+    bool discarded = false;
+
+    // Writes the mapped pages up to `end` to disk, so that an index saved
+    // afterwards never points at frames that only ever reached memory
+    bool sync(qint64 end) {
+        if (!data || end <= synced) {
+            return true;
+        }
+#ifdef Q_OS_WIN
+        bool done = FlushViewOfFile(data + synced, SIZE_T(end - synced)) != 0;
+#else
+        // msync wants a page-aligned start
+        qint64 start = synced & ~qint64(sysconf(_SC_PAGESIZE) - 1);
+        bool done = msync(data + start, size_t(end - start), MS_SYNC) == 0;
+#endif
+        if (done) {
+            synced = end;
+        }
+        return done;
+    }
+
+    ~Segment() {
+        if (data) {
+            file.unmap(data);
+        }
+        file.close();
+        if (discarded) {
+            file.remove();
+        }
+    }
+};
+
+DiskFrameCache::DiskFrameCache(const QString& directory, qint64 maxSizeMB)
+    : directory(directory)
+    , valid(false)
+    , maxSize(maxSizeMB * 1024 * 1024)
+    , segmentSize(qBound(MIN_SEGMENT_SIZE, maxSize / 8, MAX_SEGMENT_SIZE))
+    , nextSegmentId(0)
+    , writesSinceSave(0)
+    , writing(false)
+    , running(true)
+{
+    QDir dir(directory);
+    if (!dir.exists() && !dir.mkpath(".")) {
+        qDebug() << "Failed to create disk cache directory:" << directory;
+        return;
+    }
+
+    loadIndex();
+    valid = true;
+
+    writer.reset(QThread::create([this] { writerLoop(); }));
+    writer->start(QThread::LowPriority);
+}
+
+DiskFrameCache::~DiskFrameCache() {
+    if (writer) {
+        flush();
+        {
+            QMutexLocker locker(&mutex);
+            running = false;
+            writeAvailable.wakeAll();
+        }
+        writer->wait();
+    }
+}
+
+void DiskFrameCache::setMaxSize(qint64 megabytes) {
+    QMutexLocker locker(&mutex);
+    maxSize = megabytes * 1024 * 1024;
+    enforceQuota();
+}
+
+qint64 DiskFrameCache::getMaxSize() const {
+    QMutexLocker locker(&mutex);
+    return maxSize / (1024 * 1024);
+}
+
+qint64 DiskFrameCache::getSize() const {
+    QMutexLocker locker(&mutex);
+    qint64 size = 0;
+    for (const auto& segment : segments) {
+        size += segment->size;
+    }
+    return size;
+}
+
+int DiskFrameCache::getEntryCount() const {
+    QMutexLocker locker(&mutex);
+    return index.size();
+}
+
+bool DiskFrameCache::contains(const QString& filePath, qint64 frameIndex, int downscale) {
+    QByteArray identity = sourceIdentity(filePath);
+    QMutexLocker locker(&mutex);
+    return index.contains({sourceIdFor(identity, downscale), frameIndex});
+}
+
+VideoFrame DiskFrameCache::lookup(const QString& filePath, qint64 frameIndex, int downscale) {
+    std::shared_ptr<Segment> segment;
+    Entry entry;
+    QByteArray identity = sourceIdentity(filePath);
+    {
+        QMutexLocker locker(&mutex);
+        auto it = index.constFind({sourceIdFor(identity, downscale), frameIndex});
+        if (it == index.constEnd()) {
+            return VideoFrame();
+        }
+        entry = *it;
+        segment = segments.value(entry.segmentId);
+    }
+
+    if (!segment) {
+        return VideoFrame();
+    }
+    return readRecord(segment, entry);
+}
+
+void DiskFrameCache::store(const QString& filePath, qint64 frameIndex,
+                           const VideoFrame& frame, int downscale) {
+    if (!valid || frame.isNull()) {
+        return;
+    }
+
+    QByteArray identity = sourceIdentity(filePath);
+    QMutexLocker locker(&mutex);
+    EntryKey key{sourceIdFor(identity, downscale), frameIndex};
+    if (index.contains(key) || pendingWrites.size() >= MAX_PENDING_WRITES) {
+        return;
+    }
+    for (const PendingWrite& pending : pendingWrites) {
+        if (pending.key == key) {
+            return;
+        }
+    }
+
+    pendingWrites.append({key, frame});
+    writeAvailable.wakeOne();
+}
+
+void DiskFrameCache::flush() {
+    QMutexLocker locker(&mutex);
+    while (!pendingWrites.isEmpty() || writing) {
+        writesDone.wait(&mutex);
+    }
+    locker.unlock();
+    saveIndex();
+}
+
+void DiskFrameCache::clear() {
+    QMutexLocker locker(&mutex);
+    pendingWrites.clear();
+    for (int id : segments.keys()) {
+        dropSegment(id);
+    }
+    index.clear();
+    locker.unlock();
+    saveIndex();
+}
+
+QByteArray DiskFrameCache::sourceIdFor(const QByteArray& identity, int downscale) {
+    QByteArray id = sourceIds.value(identity);
+    if (id.isEmpty()) {
+        id = QCryptographicHash::hash(identity, QCryptographicHash::Md5);
+        sourceIds.insert(identity, id);
+    }
+
+    // Each frame size is its own source; full size keeps the plain id
+    return downscale > 1 ? id + '/' + QByteArray::number(downscale) : id;
+}
+
+void DiskFrameCache::writerLoop() {
+    while (true) {
+        PendingWrite pending;
+        {
+            QMutexLocker locker(&mutex);
+            while (running && pendingWrites.isEmpty()) {
+                writeAvailable.wait(&mutex);
+            }
+            if (!running) {
+                break;
+            }
+            pending = pendingWrites.takeFirst();
+            writing = true;
+        }
+
+        writeRecord(pending.key, pending.frame);
+
+        QMutexLocker locker(&mutex);
+        writing = false;
+        if (pendingWrites.isEmpty()) {
+            writesDone.wakeAll();
+        }
+    }
+}
+
+bool DiskFrameCache::writeRecord(const EntryKey& key, const VideoFrame& frame) {
+    RecordHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.magic = RECORD_MAGIC;
+    header.width = frame.width();
+    header.height = frame.height();
+
+    const uint8_t* planes[4] = {};
+    QImage image;
+    if (frame.isNative()) {
+        const AVFrame* source = frame.getAVFrame();
+        size_t sizes[4] = {};
+        ptrdiff_t linesizes[4];
+        for (int i = 0; i < 4; i++) {
+            linesizes[i] = source->linesize[i];
+        }
+        if (av_image_fill_plane_sizes(sizes, static_cast<AVPixelFormat>(source->format),
+                                      source->height, linesizes) < 0) {
+            return false;
+        }
+
+        header.kind = RecordKind::Planar;
+        header.format = source->format;
+        header.colorSpace = source->colorspace;
+        header.colorRange = source->color_range;
+        for (int i = 0; i < 4 && sizes[i] > 0; i++) {
+            if (source->linesize[i] <= 0) {
+                return false;
+            }
+            planes[i] = source->data[i];
+            header.linesize[i] = source->linesize[i];
+            header.planeSize[i] = qint64(sizes[i]);
+            header.planeCount++;
+        }
+    } else {
+        image = frame.toImage();
+        header.kind = RecordKind::Image;
+        header.format = image.format();
+        header.planeCount = 1;
+        planes[0] = image.constBits();
+        header.linesize[0] = int(image.bytesPerLine());
+        header.planeSize[0] = image.sizeInBytes();
+    }
+
+    // Lay out the planes after the header, each aligned for SIMD access
+    qint64 position = alignUp(sizeof(RecordHeader));
+    for (int i = 0; i < header.planeCount; i++) {
+        header.planeOffset[i] = position;
+        position = alignUp(position + header.planeSize[i]);
+    }
+    header.totalSize = position;
+
+    qint64 offset = 0;
+    std::shared_ptr<Segment> segment;
+    {
+        QMutexLocker locker(&mutex);
+        segment = reserveSpace(header.totalSize, offset);
+    }
+    if (!segment) {
+        return false;
+    }
+
+    uchar* record = segment->data + offset;
+    std::memcpy(record, &header, sizeof(header));
+    for (int i = 0; i < header.planeCount; i++) {
+        std::memcpy(record + header.planeOffset[i], planes[i], header.planeSize[i]);
+    }
+
+    // Publish the entry only once the data is in place
+    QMutexLocker locker(&mutex);
+    if (!segments.contains(segment->id)) {
+        return false;  // Recycled while we were writing
+    }
+    index.insert(key, {segment->id, offset, header.totalSize});
+    bool save = ++writesSinceSave >= INDEX_SAVE_INTERVAL;
+    if (save) {
+        writesSinceSave = 0;
+    }
+    locker.unlock();
+    
+    if (save) {
+        saveIndex();
+    }
+    return true;
+}
+
+VideoFrame DiskFrameCache::readRecord(const std::shared_ptr<Segment>& segment,
+                                      const Entry& entry) const {
+    if (entry.offset + entry.size > segment->used) {
+        return VideoFrame();
+    }
+
+    const uchar* record = segment->data + entry.offset;
+    RecordHeader header;
+    std::memcpy(&header, record, sizeof(header));
+    if (header.magic != RECORD_MAGIC || header.totalSize != entry.size ||
+        header.planeCount < 1 || header.planeCount > 4) {
+        return VideoFrame();
+    }
+
+    // Each frame handed out keeps the segment mapped
+    auto holder = new std::shared_ptr<Segment>(segment);
+
+    if (header.kind == RecordKind::Image) {
+        QImage image(record + header.planeOffset[0], header.width, header.height,
+                     header.linesize[0], static_cast<QImage::Format>(header.format),
+                     &DiskFrameCache::releaseImage, holder);
+        return VideoFrame(image);
+    }
+
+    AVFrame* frame = av_frame_alloc();
+    if (!frame) {
+        delete holder;
+        return VideoFrame();
+    }
+    frame->buf[0] = av_buffer_create(const_cast<uint8_t*>(record), entry.size,
+                                     &DiskFrameCache::releaseBuffer, holder,
+                                     AV_BUFFER_FLAG_READONLY);
+    if (!frame->buf[0]) {
+        delete holder;
+        av_frame_free(&frame);
+        return VideoFrame();
+    }
+
+    frame->format = header.format;
+    frame->width = header.width;
+    frame->height = header.height;
+    frame->colorspace = static_cast<AVColorSpace>(header.colorSpace);
+    frame->color_range = static_cast<AVColorRange>(header.colorRange);
+    for (int i = 0; i < header.planeCount; i++) {
+        frame->data[i] = const_cast<uint8_t*>(record) + header.planeOffset[i];
+        frame->linesize[i] = header.linesize[i];
+    }
+
+    VideoFrame result = VideoFrame::fromAVFrame(frame);
+    av_frame_free(&frame);
+    return result;
+}
+
+std::shared_ptr<DiskFrameCache::Segment> DiskFrameCache::openSegment(int id, bool create) {
+    auto segment = std::make_shared<Segment>();
+    segment->id = id;
+    segment->file.setFileName(segmentPath(id));
+    if (!segment->file.open(QIODevice::ReadWrite)) {
+        return nullptr;
+    }
+
+    if (create && !segment->file.resize(segmentSize)) {
+        segment->discarded = true;
+        return nullptr;
+    }
+
+    segment->size = segment->file.size();
+    segment->data = segment->file.map(0, segment->size);
+    if (!segment->data) {
+        segment->discarded = create;
+        return nullptr;
+    }
+    return segment;
+}
+
+std::shared_ptr<DiskFrameCache::Segment> DiskFrameCache::reserveSpace(qint64 size,
+                                                                      qint64& offset) {
+    std::shared_ptr<Segment> active = segments.isEmpty() ? nullptr : segments.last();
+    if (!active || active->used + size > active->size) {
+        if (size > segmentSize) {
+            return nullptr;
+        }
+        active = openSegment(nextSegmentId++, true);
+        if (!active) {
+            qDebug() << "Failed to create disk cache segment in" << directory;
+            return nullptr;
+        }
+        segments.insert(active->id, active);
+        enforceQuota();
+    }
+
+    offset = active->used;
+    active->used = alignUp(active->used + size);
+    return active;
+}
+
+void DiskFrameCache::enforceQuota() {
+    // Recycle whole segments, oldest first, keeping the active one
+    qint64 total = 0;
+    for (const auto& segment : segments) {
+        total += segment->size;
+    }
+    while (total > maxSize && segments.size() > 1) {
+        total -= segments.first()->size;
+        dropSegment(segments.firstKey());
+    }
+}
+
+void DiskFrameCache::dropSegment(int id) {
+    std::shared_ptr<Segment> segment = segments.take(id);
+    if (!segment) {
+        return;
+    }
+    segment->discarded = true;
+
+    for (auto it = index.begin(); it != index.end();) {
+        if (it->segmentId == id) {
+            it = index.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+bool DiskFrameCache::loadIndex() {
+    QFile file(QDir(directory).filePath("index.dat"));
+    QList<int> loaded;
+
+    if (file.open(QIODevice::ReadOnly)) {
+        QDataStream in(&file);
+        quint32 magic, version;
+        qint64 storedSegmentSize;
+        in >> magic >> version >> storedSegmentSize;
+
+        if (magic == INDEX_MAGIC && version == INDEX_VERSION) {
+            segmentSize = storedSegmentSize;
+            qint32 segmentCount;
+            in >> nextSegmentId >> segmentCount;
+            for (int i = 0; i < segmentCount && in.status() == QDataStream::Ok; i++) {
+                qint32 id;
+                qint64 used;
+                in >> id >> used;
+                std::shared_ptr<Segment> segment = openSegment(id, false);
+                if (segment && used <= segment->size) {
+                    segment->used = used;
+                    segments.insert(id, segment);
+                    loaded << id;
+                }
+            }
+
+            qint32 entryCount;
+            in >> entryCount;
+            for (int i = 0; i < entryCount && in.status() == QDataStream::Ok; i++) {
+                EntryKey key;
+                Entry entry;
+                in >> key.sourceId >> key.frameIndex
+                   >> entry.segmentId >> entry.offset >> entry.size;
+                auto segment = segments.value(entry.segmentId);
+                if (segment && entry.offset + entry.size <= segment->used) {
+                    index.insert(key, entry);
+                }
+            }
+        }
+    }
+
+    // Segment files the index does not know about are leftovers
+    QDir dir(directory);
+    for (const QString& name : dir.entryList({"segment_*.dat"}, QDir::Files)) {
+        int id = name.mid(8, name.size() - 12).toInt();
+        if (!loaded.contains(id)) {
+            dir.remove(name);
+        }
+    }
+
+    enforceQuota();
+    return !segments.isEmpty();
+}
+
+bool DiskFrameCache::saveIndex() {
+    // One save at a time; lookups only wait for the snapshot below
+    QMutexLocker saving(&saveMutex);
+
+    QByteArray snapshot;
+    QList<QPair<std::shared_ptr<Segment>, qint64>> written;
+    {
+        QMutexLocker locker(&mutex);
+        QDataStream out(&snapshot, QIODevice::WriteOnly);
+        out << INDEX_MAGIC << INDEX_VERSION << segmentSize;
+        out << qint32(nextSegmentId) << qint32(segments.size());
+        for (const auto& segment : segments) {
+            out << qint32(segment->id) << segment->used;
+            written.append({segment, segment->used});
+        }
+
+        out << qint32(index.size());
+        for (auto it = index.constBegin(); it != index.constEnd(); ++it) {
+            out << it.key().sourceId << it.key().frameIndex
+                << qint32(it->segmentId) << it->offset << it->size;
+        }
+    }
+
+    // The frames first, and only what changed since the last save; an
+    // index committed ahead of them could survive a crash that they do not
+    for (const auto& segment : written) {
+        if (!segment.first->sync(segment.second)) {
+            qDebug() << "Failed to flush disk cache segment" << segment.first->id;
+            return false;
+        }
+    }
+
+    QSaveFile file(QDir(directory).filePath("index.dat"));
+    if (!file.open(QIODevice::WriteOnly) || file.write(snapshot) != snapshot.size()) {
+        return false;
+    }
+    return file.commit();
+}
+
+QString DiskFrameCache::segmentPath(int id) const {
+    return QDir(directory).filePath(QString("segment_%1.dat").arg(id));
+}
+
+void DiskFrameCache::releaseImage(void* holder) {
+    delete static_cast<std::shared_ptr<Segment>*>(holder);
+}
+
+void DiskFrameCache::releaseBuffer(void* holder, uint8_t*) {
+    delete static_cast<std::shared_ptr<Segment>*>(holder);
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <QString>
+#include <QByteArray>
+#include <QHash>
+#include <QMap>
+#include <QList>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QThread>
+#include <memory>
+#include "videoframe.h"
+
+// Second cache tier on local disk. Frames are stored as raw planar data
+// in fixed-size segment files that are memory-mapped for both writing and
+// reading; a hit hands out a zero-copy frame backed by the mapping. The
+// index is saved alongside the segments, so the cache survives restarts.
+// When over quota the oldest segment is recycled as a whole.
+//
+// Sources are identified by path, size and modification time, so edited
+// media never serves stale frames. Thread-safe; writes happen on a
+// background thread.
+class DiskFrameCache {
+public:
+    explicit DiskFrameCache(const QString& directory, qint64 maxSizeMB = 4096);
+    ~DiskFrameCache();
+
+    DiskFrameCache(const DiskFrameCache&) = delete;
+    DiskFrameCache& operator=(const DiskFrameCache&) = delete;
+
+    QString getDirectory() const { return directory; }
+    bool isValid() const { return valid; }
+
+    // Quota in megabytes; takes effect as new segments are created
+    void setMaxSize(qint64 megabytes);
+    qint64 getMaxSize() const;
+    qint64 getSize() const;     // Bytes held by live segments
+    int getEntryCount() const;
+
+    // Reduced-size frames (downscale > 1) are stored apart from full-size ones
+    bool contains(const QString& filePath, qint64 frameIndex, int downscale = 1);
+    VideoFrame lookup(const QString& filePath, qint64 frameIndex, int downscale = 1);
+
+    // Queue a frame for writing; dropped when the writer falls behind
+    void store(const QString& filePath, qint64 frameIndex, const VideoFrame& frame,
+               int downscale = 1);
+
+    // Wait for queued writes and save the index
+    void flush();
+    void clear();
+
+private:
+    struct Segment;
+
+    struct EntryKey {
+        QByteArray sourceId;
+        qint64 frameIndex;
+
+        bool operator==(const EntryKey& other) const {
+            return frameIndex == other.frameIndex && sourceId == other.sourceId;
+        }
+    };
+    friend uint qHash(const EntryKey& key) {
+        return qHash(key.sourceId) ^ qHash(key.frameIndex);
+    }
+
+    struct Entry {
+        int segmentId;
+        qint64 offset;
+        qint64 size;
+    };
+
+    struct PendingWrite {
+        EntryKey key;
+        VideoFrame frame;
+    };
+
+    QString directory;
+    bool valid;
+    qint64 maxSize;
+    qint64 segmentSize;
+    int nextSegmentId;
+    int writesSinceSave;
+
+    QMap<int, std::shared_ptr<Segment>> segments;  // Oldest first
+    QHash<EntryKey, Entry> index;
+    QHash<QByteArray, QByteArray> sourceIds;  // By sourceIdentity: path, size, mtime
+
+    // Background writer
+    QList<PendingWrite> pendingWrites;
+    std::unique_ptr<QThread> writer;
+    QWaitCondition writeAvailable;
+    QWaitCondition writesDone;
+    bool writing;
+    bool running;
+    mutable QMutex mutex;
+    QMutex saveMutex;  // Serializes saveIndex, which flushes without the lock
+
+    // Helper functions
+    QByteArray sourceIdFor(const QByteArray& identity, int downscale);
+    void writerLoop();
+    bool writeRecord(const EntryKey& key, const VideoFrame& frame);
+    VideoFrame readRecord(const std::shared_ptr<Segment>& segment, const Entry& entry) const;
+    std::shared_ptr<Segment> openSegment(int id, bool create);
+    std::shared_ptr<Segment> reserveSpace(qint64 size, qint64& offset);
+    void enforceQuota();
+    void dropSegment(int id);
+    bool loadIndex();
+    bool saveIndex();  // Takes the lock itself; does its I/O without it
+    QString segmentPath(int id) const;
+
+    // Mapping lifetime is tied to the frames handed out
+    static void releaseImage(void* holder);
+    static void releaseBuffer(void* holder, uint8_t* data);
+
+    // Constants
+    static const qint64 MIN_SEGMENT_SIZE;
+    static const qint64 MAX_SEGMENT_SIZE;
+    static const int MAX_PENDING_WRITES;
+    static const int INDEX_SAVE_INTERVAL;
+};
@@ -1,57 +1,410 @@
 #include "framecache.h"
 #include <QProcess>
 #include <QTemporaryFile>
+#include <QSet>
 #include <QDebug>
+#include <limits>
+
+const int FrameLoader::DEFAULT_SESSION_IDLE_TIMEOUT = 30000; // 30 seconds
+const int FrameLoader::SESSION_SWEEP_INTERVAL = 1000;
+const int FrameLoader::MAX_SESSIONS = 8;
+const int FrameLoader::MAX_WORKERS = 4;
+
+const double FrameCache::PAUSED_SPEED = 0.1;
+const int FrameCache::PLAYBACK_IDLE_TIMEOUT = 500; // ms without requests = paused
+const int FrameCache::MAX_TRACKED_PREFETCHES = 4096;
 
 // FrameLoader implementation
 FrameLoader::FrameLoader(QObject* parent)
-    : QThread(parent)
+    : QObject(parent)
+    , sessionCount(0)
     , running(true)
+    , backend(Backend::InProcess)
+    , outputFormat(FrameDecoder::OutputFormat::RGB)
+    , workerCount(qBound(1, QThread::idealThreadCount() / 2, MAX_WORKERS))
+    , sessionIdleTimeout(DEFAULT_SESSION_IDLE_TIMEOUT)
+    , seekIndexes(nullptr)
+    , playheadTime(0)
+    , generation(0)
 {
 }
 
 FrameLoader::~FrameLoader() {
     stop();
-    wait();
+    for (auto& worker : workers) {
+        worker->wait();
+    }
+}
+
+void FrameLoader::requestFrame(const QString& filePath, qint64 timestamp,
+                               Priority priority, int downscale) {
+    QMutexLocker locker(&mutex);
+    if (!running) {
+        return;
+    }
+    
+    requestQueue.append({filePath, timestamp, priority, downscale});
+    if (workers.empty()) {
+        startWorkers();
+    }
+    requestAvailable.wakeOne();
 }
 
-void FrameLoader::requestFrame(const QString& filePath, qint64 timestamp) {
+bool FrameLoader::raisePriority(const QString& filePath, qint64 timestamp, int downscale,
+                                Priority priority) {
     QMutexLocker locker(&mutex);
-    requestQueue.enqueue({filePath, timestamp});
-    if (!isRunning()) {
-        start();
+    for (LoadRequest& request : requestQueue) {
+        if (request.timestamp == timestamp && request.downscale == downscale &&
+            request.filePath == filePath) {
+            if (priority == Priority::Visible) {
+                request.priority = priority;
+            }
+            return true;
+        }
     }
+    return false;
 }
 
 void FrameLoader::stop() {
     QMutexLocker locker(&mutex);
     running = false;
     requestQueue.clear();
+    requestAvailable.wakeAll();
+}
+
+void FrameLoader::setPlayhead(const QString& filePath, qint64 timestamp) {
+    QMutexLocker locker(&mutex);
+    playheadFile = filePath;
+    playheadTime = timestamp;
+}
+
+quint64 FrameLoader::bumpGeneration() {
+    QList<LoadRequest> dropped;
+    quint64 current;
+    {
+        QMutexLocker locker(&mutex);
+        current = generation.fetchAndAddOrdered(1) + 1;
+        dropped.swap(requestQueue);
+    }
+    
+    // Signals are emitted outside the lock so receivers may re-request
+    for (const LoadRequest& request : dropped) {
+        emit frameLoadCancelled(request.filePath, request.timestamp, request.downscale);
+    }
+    return current;
+}
+
+void FrameLoader::setOutputFormat(FrameDecoder::OutputFormat format) {
+    QMutexLocker locker(&mutex);
+    outputFormat = format;
+}
+
+FrameDecoder::OutputFormat FrameLoader::getOutputFormat() const {
+    QMutexLocker locker(&mutex);
+    return outputFormat;
+}
+
+void FrameLoader::setWorkerCount(int count) {
+    QMutexLocker locker(&mutex);
+    workerCount = qBound(1, count, MAX_WORKERS);
+}
+
+int FrameLoader::getWorkerCount() const {
+    QMutexLocker locker(&mutex);
+    return workerCount;
+}
+
+void FrameLoader::setSessionIdleTimeout(int msecs) {
+    QMutexLocker locker(&mutex);
+    sessionIdleTimeout = msecs;
+}
+
+int FrameLoader::getSessionIdleTimeout() const {
+    QMutexLocker locker(&mutex);
+    return sessionIdleTimeout;
+}
+
+void FrameLoader::setSeekIndexStore(SeekIndexStore* store) {
+    QMutexLocker locker(&mutex);
+    seekIndexes = store;
+}
+
+SeekIndexStore* FrameLoader::getSeekIndexStore() const {
+    QMutexLocker locker(&mutex);
+    return seekIndexes;
 }
 
-void FrameLoader::run() {
-    while (running) {
+void FrameLoader::startWorkers() {
+    for (int i = 0; i < workerCount; i++) {
+        workers.emplace_back(QThread::create([this] { workerLoop(); }));
+        workers.back()->start();
+    }
+}
+
+void FrameLoader::workerLoop() {
+    while (true) {
         LoadRequest request;
+        quint64 batchGeneration;
         {
             QMutexLocker locker(&mutex);
+            if (running && requestQueue.isEmpty()) {
+                // Wake up periodically to close idle decoder sessions
+                requestAvailable.wait(&mutex, SESSION_SWEEP_INTERVAL);
+            }
+            if (!running) {
+                break;
+            }
             if (requestQueue.isEmpty()) {
-                // No more requests, exit thread
-                return;
+                locker.unlock();
+                closeIdleSessions();
+                continue;
             }
-            request = requestQueue.dequeue();
+            
+            request = requestQueue.takeAt(nextRequestIndex());
+            batchGeneration = generation.loadAcquire();
         }
         
-        QImage frame = loadFrame(request.filePath, request.timestamp);
-        if (!frame.isNull()) {
-            emit frameLoaded(request.filePath, request.timestamp, frame);
+        if (backend == Backend::ExternalProcess) {
+            loadBatch(request, {request.timestamp}, nullptr, batchGeneration);
+            continue;
+        }
+        
+        // Check out a decoder, then take the rest of the queued requests that
+        // fall in the same GOP: they are decoded on the way anyway
+        QList<qint64> timestamps{request.timestamp};
+        auto session = acquireSession(request);
+        if (session) {
+            qint64 gopStart, gopEnd;
+            session->decoder.getGopBounds(request.timestamp, gopStart, gopEnd);
+            for (const LoadRequest& other : takeBatch(request, gopStart, gopEnd)) {
+                timestamps << other.timestamp;
+            }
+        }
+        
+        bool success = loadBatch(request, timestamps, session.get(), batchGeneration);
+        if (session && success) {
+            releaseSession(request.filePath, session);
+        } else if (session) {
+            // A failed pass leaves the decoder in an unknown state
+            QMutexLocker locker(&mutex);
+            sessionCount--;
+        }
+        closeIdleSessions();
+    }
+}
+
+int FrameLoader::nextRequestIndex() const {
+    // Visible frames first, then the closest to the playhead, then FIFO
+    auto distance = [this](const LoadRequest& request) {
+        if (request.filePath != playheadFile) {
+            return std::numeric_limits<qint64>::max();
+        }
+        return qAbs(request.timestamp - playheadTime);
+    };
+    
+    int best = 0;
+    for (int i = 1; i < requestQueue.size(); i++) {
+        const LoadRequest& candidate = requestQueue[i];
+        const LoadRequest& current = requestQueue[best];
+        if (candidate.priority != current.priority) {
+            if (candidate.priority == Priority::Visible) {
+                best = i;
+            }
+        } else if (distance(candidate) < distance(current)) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+QList<FrameLoader::LoadRequest> FrameLoader::takeBatch(const LoadRequest& first,
+                                                       qint64 gopStart, qint64 gopEnd) {
+    QMutexLocker locker(&mutex);
+    QList<LoadRequest> batch;
+    for (auto it = requestQueue.begin(); it != requestQueue.end();) {
+        if (it->filePath == first.filePath && it->downscale == first.downscale &&
+            it->timestamp >= gopStart && it->timestamp < gopEnd) {
+            batch << *it;
+            it = requestQueue.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    return batch;
+}
+
+bool FrameLoader::loadBatch(const LoadRequest& first, const QList<qint64>& timestamps,
+                            DecoderSession* session, quint64 batchGeneration) {
+    auto cancelled = [this, batchGeneration] {
+        return generation.loadAcquire() != batchGeneration;
+    };
+    
+    const QString& filePath = first.filePath;
+    int downscale = first.downscale;
+    QSet<qint64> pending(timestamps.begin(), timestamps.end());
+    if (backend == Backend::ExternalProcess) {
+        for (qint64 timestamp : timestamps) {
+            if (cancelled()) {
+                break;
+            }
+            QImage frame = loadFrameExternal(filePath, timestamp);
+            if (!frame.isNull()) {
+                if (downscale > 1) {
+                    frame = frame.scaled(frame.size() / downscale, Qt::IgnoreAspectRatio,
+                                         Qt::FastTransformation);
+                }
+                pending.remove(timestamp);
+                emit frameLoaded(filePath, timestamp, downscale, VideoFrame(frame));
+            }
+        }
+    } else if (session) {
+        session->decoder.setOutputFormat(getOutputFormat());
+        session->decoder.setDownscale(downscale);
+        session->decoder.decodeFrames(timestamps, [&](qint64 timestamp, const VideoFrame& frame) {
+            pending.remove(timestamp);
+            emit frameLoaded(filePath, timestamp, downscale, frame);
+        }, cancelled);
+    }
+    
+    bool wasCancelled = cancelled();
+    for (qint64 timestamp : pending) {
+        if (wasCancelled) {
+            emit frameLoadCancelled(filePath, timestamp, downscale);
         } else {
-            emit frameLoadError(request.filePath, request.timestamp, 
-                              "Failed to load frame");
+            emit frameLoadError(filePath, timestamp, downscale, "Failed to load frame");
         }
     }
+    return pending.isEmpty() || wasCancelled;
+}
+
+std::shared_ptr<FrameLoader::DecoderSession> FrameLoader::acquireSession(const LoadRequest& request) {
+    const QString& filePath = request.filePath;
+    qint64 timestamp = request.timestamp;
+    std::shared_ptr<DecoderSession> evicted;
+    {
+        QMutexLocker locker(&mutex);
+        auto it = idleSessions.find(filePath);
+        if (it != idleSessions.end() && !it->isEmpty()) {
+            // Prefer a session at the same size (switching may reopen the
+            // codec), then the one positioned closest before the frame
+            int best = 0;
+            bool bestMatches = false;
+            qint64 bestDistance = std::numeric_limits<qint64>::max();
+            for (int i = 0; i < it->size(); i++) {
+                const FrameDecoder& decoder = it->at(i)->decoder;
+                bool matches = decoder.getDownscale() == request.downscale;
+                qint64 position = decoder.getPosition();
+                qint64 distance = position >= 0 && position <= timestamp
+                    ? timestamp - position : std::numeric_limits<qint64>::max();
+                if ((matches && !bestMatches) ||
+                    (matches == bestMatches && distance < bestDistance)) {
+                    best = i;
+                    bestMatches = matches;
+                    bestDistance = distance;
+                }
+            }
+            
+            std::shared_ptr<DecoderSession> session = it->takeAt(best);
+            if (it->isEmpty()) {
+                idleSessions.erase(it);
+            }
+            session->lastUsed.start();
+            
+            // The index may have finished building since the file was opened
+            SeekIndexStore* store = seekIndexes;
+            locker.unlock();
+            if (store && !session->decoder.hasSeekIndex()) {
+                session->decoder.setSeekIndex(store->indexFor(filePath));
+            }
+            return session;
+        }
+        
+        // Make room by closing the least recently used idle session
+        if (sessionCount >= MAX_SESSIONS) {
+            QString oldestFile;
+            int oldestIndex = -1;
+            qint64 oldestAge = -1;
+            for (auto s = idleSessions.begin(); s != idleSessions.end(); ++s) {
+                for (int i = 0; i < s->size(); i++) {
+                    if (s->at(i)->lastUsed.elapsed() > oldestAge) {
+                        oldestFile = s.key();
+                        oldestIndex = i;
+                        oldestAge = s->at(i)->lastUsed.elapsed();
+                    }
+                }
+            }
+            if (oldestIndex >= 0) {
+                evicted = idleSessions[oldestFile].takeAt(oldestIndex);
+                if (idleSessions[oldestFile].isEmpty()) {
+                    idleSessions.remove(oldestFile);
+                }
+                sessionCount--;
+            }
+        }
+        sessionCount++;
+    }
+    evicted.reset();
+    
+    auto session = std::make_shared<DecoderSession>();
+    if (!session->decoder.open(filePath)) {
+        QMutexLocker locker(&mutex);
+        sessionCount--;
+        return nullptr;
+    }
+    if (SeekIndexStore* store = getSeekIndexStore()) {
+        session->decoder.setSeekIndex(store->indexFor(filePath));
+    }
+    session->lastUsed.start();
+    return session;
+}
+
+void FrameLoader::releaseSession(const QString& filePath,
+                                 std::shared_ptr<DecoderSession> session) {
+    QMutexLocker locker(&mutex);
+    session->lastUsed.start();
+    idleSessions[filePath].append(session);
+}
+
+void FrameLoader::closeIdleSessions() {
+    QList<std::shared_ptr<DecoderSession>> expired;
+    {
+        QMutexLocker locker(&mutex);
+        for (auto it = idleSessions.begin(); it != idleSessions.end();) {
+            for (int i = it->size() - 1; i >= 0; i--) {
+                if (it->at(i)->lastUsed.hasExpired(sessionIdleTimeout)) {
+                    expired << it->takeAt(i);
+                    sessionCount--;
+                }
+            }
+            if (it->isEmpty()) {
+                it = idleSessions.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    // Decoders are closed here, outside the lock
 }
 
 QImage FrameLoader::loadFrame(const QString& filePath, qint64 timestamp) {
+    if (backend == Backend::ExternalProcess) {
+        return loadFrameExternal(filePath, timestamp);
+    }
+    return loadFrameInProcess(filePath, timestamp);
+}
+
+QImage FrameLoader::loadFrameInProcess(const QString& filePath, qint64 timestamp) {
+    FrameDecoder decoder;
+    if (!decoder.open(filePath)) {
+        return QImage();
+    }
+    if (SeekIndexStore* store = getSeekIndexStore()) {
+        decoder.setSeekIndex(store->indexFor(filePath));
+    }
+    return decoder.decodeFrame(timestamp);
+}
+
+QImage FrameLoader::loadFrameExternal(const QString& filePath, qint64 timestamp) {
     // Create temporary file for the frame
     QTemporaryFile tempFile;
     if (!tempFile.open()) {
@@ -66,7 +419,7 @@ QImage FrameLoader::loadFrame(const QString& filePath, qint64 timestamp) {
     arguments << "-vframes" << "1";
     arguments << "-f" << "image2";
     arguments << "-c:v" << "png";
-    arguments << tempFile.fileName();
+    arguments << "-y" << tempFile.fileName();  // The temporary file already exists
     
     // Run FFmpeg
     QProcess process;
@@ -86,89 +439,518 @@ QImage FrameLoader::loadFrame(const QString& filePath, qint64 timestamp) {
 FrameCache::FrameCache(QObject* parent)
     : QObject(parent)
     , frameLoader(std::make_unique<FrameLoader>())
+    , storageFormat(StorageFormat::RGB)
     , maxCacheSize(512)  // Default to 512MB
     , cacheAhead(30)     // Cache 1 second ahead at 30fps
     , cacheBehind(30)    // Cache 1 second behind at 30fps
+    , scrubMode(false)
+    , playheadFrame(0)
+    , explicitSpeed(false)
+    , playbackSpeed(0.0)
+    , measuredSpeed(0.0)
+    , lastRequestTime(-1)
+    , lastRequestFrame(0)
+    , prefetchRequested(0)
+    , prefetchUsed(0)
     , cacheHits(0)
     , cacheMisses(0)
+    , diskCacheHits(0)
+    , approximateHits(0)
+    , duplicatesSuppressed(0)
+    , framesDecoded(0)
+    , loadErrors(0)
+    , loadsCancelled(0)
+    , pixelsDecoded(0)
+    , bytesDecoded(0)
+    , bytesServed(0)
+    , bytesEvicted(0)
+    , peakInFlight(0)
 {
+    playbackClock.start();
+    statsClock.start();
+    for (auto& count : evictions) {
+        count.storeRelaxed(0);
+    }
+    
+    connect(&statsTimer, &QTimer::timeout, this, [this] {
+        emit statisticsUpdated(getStatistics());
+    });
+    
     // Set up frame cache
-    frameCache.setMaxCost(maxCacheSize * 1024 * 1024);  // Convert MB to bytes
+    frameCache.setMaxCost(qint64(maxCacheSize) * 1024 * 1024);  // Convert MB to bytes
     
-    // Connect frame loader signals
+    // Loader results are handled on the loader threads, so waiting callers
+    // are released even when this object's thread is the one blocked
     connect(frameLoader.get(), &FrameLoader::frameLoaded,
-            this, &FrameCache::handleFrameLoaded);
+            this, &FrameCache::handleFrameLoaded, Qt::DirectConnection);
     connect(frameLoader.get(), &FrameLoader::frameLoadError,
-            this, &FrameCache::handleFrameLoadError);
+            this, &FrameCache::handleFrameLoadError, Qt::DirectConnection);
+    connect(frameLoader.get(), &FrameLoader::frameLoadCancelled,
+            this, &FrameCache::handleFrameLoadCancelled, Qt::DirectConnection);
 }
 
 FrameCache::~FrameCache() {
-    frameLoader->stop();
+    // Workers call back into this object, so they must finish first
+    frameLoader.reset();
+    
+    // Release anyone still waiting
+    QMutexLocker locker(&mutex);
+    for (const QList<FramePromise>& promises : std::as_const(waiters)) {
+        for (const FramePromise& promise : promises) {
+            promise->set_value(VideoFrame());
+        }
+    }
+    waiters.clear();
+    if (diskCache) {
+        diskCache->flush();
+    }
+}
+
+void FrameCache::setDiskCache(const QString& directory, int megabytes) {
+    QMutexLocker locker(&mutex);
+    if (directory.isEmpty()) {
+        diskCache.reset();
+        return;
+    }
+    
+    if (!diskCache || diskCache->getDirectory() != directory) {
+        diskCache = std::make_shared<DiskFrameCache>(directory, megabytes);
+        if (!diskCache->isValid()) {
+            diskCache.reset();
+            locker.unlock();
+            emit cacheError("Could not open disk cache in " + directory);
+            return;
+        }
+    }
+    diskCache->setMaxSize(megabytes);
+}
+
+void FrameCache::setSeekIndexStore(SeekIndexStore* store) {
+    frameLoader->setSeekIndexStore(store);
+}
+
+void FrameCache::setStorageFormat(StorageFormat format) {
+    QMutexLocker locker(&mutex);
+    storageFormat = format;
+    frameLoader->setOutputFormat(format == StorageFormat::NativeYUV
+                                 ? FrameDecoder::OutputFormat::Native
+                                 : FrameDecoder::OutputFormat::RGB);
 }
 
 void FrameCache::setMaxCacheSize(int megabytes) {
+    QMutexLocker locker(&mutex);
+    int countBefore = frameCache.count();
+    qint64 costBefore = frameCache.totalCost();
     maxCacheSize = megabytes;
-    frameCache.setMaxCost(megabytes * 1024 * 1024);
+    frameCache.setMaxCost(qint64(megabytes) * 1024 * 1024);
+    recordEvictions(EvictionReason::Resized, countBefore, costBefore);
+}
+
+void FrameCache::setScrubMode(bool enabled) {
+    QMutexLocker locker(&mutex);
+    scrubMode = enabled;
 }
 
-QImage FrameCache::getFrame(const QString& filePath, qint64 timestamp) {
-    CacheKey key{filePath, timestamp};
+bool FrameCache::isScrubMode() const {
+    QMutexLocker locker(&mutex);
+    return scrubMode;
+}
+
+void FrameCache::setEvictionPolicy(FrameStore::Policy policy) {
+    QMutexLocker locker(&mutex);
+    frameCache.setPolicy(policy);
+}
+
+FrameStore::Policy FrameCache::getEvictionPolicy() const {
+    QMutexLocker locker(&mutex);
+    return frameCache.getPolicy();
+}
+
+void FrameCache::setViewerSize(const QSize& size) {
+    QMutexLocker locker(&mutex);
+    viewerSize = size;
+}
+
+QSize FrameCache::getViewerSize() const {
+    QMutexLocker locker(&mutex);
+    return viewerSize;
+}
+
+void FrameCache::setCacheAhead(int frames) {
+    QMutexLocker locker(&mutex);
+    cacheAhead = frames;
+}
+
+void FrameCache::setCacheBehind(int frames) {
+    QMutexLocker locker(&mutex);
+    cacheBehind = frames;
+}
+
+QImage FrameCache::getFrame(const QString& filePath, qint64 timestamp, bool* approximate) {
+    if (approximate) {
+        *approximate = false;
+    }
     
-    // Try to get frame from cache
-    QImage* frame = frameCache.object(key);
+    // File and disk I/O happens with the lock released, so the loaders'
+    // callbacks are never held up behind it
+    probeStream(filePath);
+    QMutexLocker locker(&mutex);
+    const VideoStreamInfo& info = streamInfoFor(filePath);
+    qint64 frameIndex = info.nearestFrame(timestamp);
+    CacheKey key{filePath, frameIndex, viewerDownscale(filePath)};
+    updatePlaybackEstimate(filePath, frameIndex);
+    updatePlayhead(filePath, frameIndex);
+    if (traceFile) {
+        traceFile->write(QString("%1\t%2\t%3\t%4\n")
+                         .arg(statsClock.elapsed()).arg(filePath)
+                         .arg(frameIndex).arg(key.downscale).toUtf8());
+    }
+    
+    // Try to get frame from cache; native frames are converted here
+    VideoFrame* frame = frameCache.object(key);
     if (frame) {
         cacheHits++;
-        return *frame;
+        fileStats[filePath].hits++;
+        if (prefetchedKeys.remove(key)) {
+            prefetchUsed++;
+        }
+        // Keep the window ahead of playback topped up
+        QList<CacheKey> prefetch = schedulePrefetch(filePath, frameIndex, true);
+        VideoFrame result = *frame;
+        recordServed(filePath, result);
+        std::shared_ptr<DiskFrameCache> disk = diskCache;
+        locker.unlock();
+        fetchPrefetches(disk, prefetch);
+        return result.toImage();
+    }
+    
+    // Second tier: promote straight from the disk cache
+    std::shared_ptr<DiskFrameCache> disk = diskCache;
+    locker.unlock();
+    VideoFrame result = readFromDisk(disk.get(), key);
+    locker.relock();
+    if (!result.isNull()) {
+        diskCacheHits++;
+        insertFrame(key, result);
+    } else if (VideoFrame* loaded = frameCache.object(key)) {
+        cacheHits++;  // Decoded while the disk was being read
+        result = *loaded;
+    }
+    if (!result.isNull()) {
+        fileStats[filePath].hits++;
+        QList<CacheKey> prefetch = schedulePrefetch(filePath, frameIndex, true);
+        recordServed(filePath, result);
+        locker.unlock();
+        fetchPrefetches(disk, prefetch);
+        return result.toImage();
     }
     
     // Frame not in cache
     cacheMisses++;
+    fileStats[filePath].misses++;
     
-    // Request frame loading
-    frameLoader->requestFrame(filePath, timestamp);
+    // Request frame loading ahead of any prefetch
+    requestLoad(key, FrameLoader::Priority::Visible);
+    QList<CacheKey> prefetch = schedulePrefetch(filePath, frameIndex, false);
     
-    // Prefetch nearby frames
-    qint64 frameInterval = 1000 / 30;  // Assume 30fps
-    for (int i = 1; i <= cacheAhead; i++) {
-        prefetchFrame(filePath, timestamp + i * frameInterval);
-    }
-    for (int i = 1; i <= cacheBehind; i++) {
-        prefetchFrame(filePath, timestamp - i * frameInterval);
+    // While scrubbing, something close now beats the exact frame later
+    CacheKey nearest;
+    bool close = scrubMode && frameCache.findNearest(key, nearest);
+    if (close) {
+        approximateHits++;
+        result = *frameCache.object(nearest);
+        recordServed(filePath, result);
     }
+    locker.unlock();
+    fetchPrefetches(disk, prefetch);
     
-    return QImage();  // Return empty image, frame will be available later
+    if (!close) {
+        return QImage();  // Return empty image, frame will be available later
+    }
+    if (approximate) {
+        *approximate = true;
+    }
+    return result.toImage();
 }
 
 void FrameCache::prefetchFrames(const QString& filePath, qint64 startTime, 
                               qint64 endTime) {
-    qint64 frameInterval = 1000 / 30;  // Assume 30fps
-    for (qint64 time = startTime; time <= endTime; time += frameInterval) {
-        prefetchFrame(filePath, time);
+    probeStream(filePath);
+    QMutexLocker locker(&mutex);
+    const VideoStreamInfo& info = streamInfoFor(filePath);
+    qint64 lastFrame = info.nearestFrame(endTime);
+    QList<CacheKey> prefetch;
+    for (qint64 index = info.nearestFrame(startTime); index <= lastFrame; index++) {
+        addPrefetch(prefetch, filePath, index);
     }
+    std::shared_ptr<DiskFrameCache> disk = diskCache;
+    locker.unlock();
+    fetchPrefetches(disk, prefetch);
+}
+
+std::shared_future<VideoFrame> FrameCache::requestFrame(const QString& filePath,
+                                                      qint64 timestamp, const QSize& size) {
+    // Any thread may call this; file and disk I/O happen without the lock
+    probeStream(filePath);
+    QMutexLocker locker(&mutex);
+    const VideoStreamInfo& info = streamInfoFor(filePath);
+    CacheKey key{filePath, info.nearestFrame(timestamp), FrameDecoder::downscaleFor(info, size)};
+    auto promise = std::make_shared<std::promise<VideoFrame>>();
+    std::shared_future<VideoFrame> future = promise->get_future().share();
+    
+    if (VideoFrame* frame = frameCache.object(key)) {
+        cacheHits++;
+        fileStats[filePath].hits++;
+        recordServed(filePath, *frame);
+        promise->set_value(*frame);
+        return future;
+    }
+    
+    std::shared_ptr<DiskFrameCache> disk = diskCache;
+    locker.unlock();
+    VideoFrame result = readFromDisk(disk.get(), key);
+    locker.relock();
+    if (!result.isNull()) {
+        diskCacheHits++;
+        insertFrame(key, result);
+    } else if (VideoFrame* loaded = frameCache.object(key)) {
+        cacheHits++;  // Decoded while the disk was being read
+        result = *loaded;
+    }
+    if (!result.isNull()) {
+        fileStats[filePath].hits++;
+        recordServed(filePath, result);
+        promise->set_value(result);
+        return future;
+    }
+    
+    cacheMisses++;
+    fileStats[filePath].misses++;
+    waiters[key].append(promise);
+    requestLoad(key, FrameLoader::Priority::Visible);
+    return future;
+}
+
+VideoFrame FrameCache::waitForFrame(const QString& filePath, qint64 timestamp, int msecs,
+                                    const QSize& size) {
+    std::shared_future<VideoFrame> future = requestFrame(filePath, timestamp, size);
+    if (msecs >= 0 &&
+        future.wait_for(std::chrono::milliseconds(msecs)) != std::future_status::ready) {
+        return VideoFrame();
+    }
+    return future.get();
 }
 
 void FrameCache::clearCache() {
+    // The disk tier is kept: it is what makes reopened projects warm
+    // Statistics carry on across clears so whole sessions can be measured
+    QMutexLocker locker(&mutex);
+    int countBefore = frameCache.count();
+    qint64 costBefore = frameCache.totalCost();
     frameCache.clear();
-    resetStatistics();
+    recordEvictions(EvictionReason::Cleared, countBefore, costBefore);
+}
+
+void FrameCache::setPlaybackSpeed(double speed) {
+    QMutexLocker locker(&mutex);
+    explicitSpeed = true;
+    playbackSpeed = speed;
+}
+
+void FrameCache::clearPlaybackSpeed() {
+    QMutexLocker locker(&mutex);
+    explicitSpeed = false;
+    playbackSpeed = 0.0;
+}
+
+double FrameCache::getPlaybackSpeed() const {
+    QMutexLocker locker(&mutex);
+    if (explicitSpeed) {
+        return playbackSpeed;
+    }
+    // No requests for a while means playback has stopped
+    if (lastRequestTime < 0 ||
+        playbackClock.elapsed() - lastRequestTime > PLAYBACK_IDLE_TIMEOUT) {
+        return 0.0;
+    }
+    return measuredSpeed;
+}
+
+FrameCache::PrefetchStats FrameCache::getPrefetchStats() const {
+    QMutexLocker locker(&mutex);
+    PrefetchStats stats;
+    stats.speed = getPlaybackSpeed();
+    stats.speedMeasured = !explicitSpeed;
+    stats.window = prefetchWindow();
+    stats.requested = prefetchRequested;
+    stats.used = prefetchUsed;
+    return stats;
+}
+
+VideoStreamInfo FrameCache::getStreamInfo(const QString& filePath) {
+    probeStream(filePath);
+    QMutexLocker locker(&mutex);
+    return streamInfoFor(filePath);
 }
 
 int FrameCache::getCacheSize() const {
+    QMutexLocker locker(&mutex);
     return frameCache.totalCost() / (1024 * 1024);  // Convert bytes to MB
 }
 
+int FrameCache::getInFlightCount() const {
+    QMutexLocker locker(&mutex);
+    return inFlight.size();
+}
+
+FrameCacheStats FrameCache::getStatistics() const {
+    QMutexLocker locker(&mutex);
+    FrameCacheStats stats;
+    stats.hits = cacheHits.loadRelaxed();
+    stats.misses = cacheMisses.loadRelaxed();
+    stats.diskHits = diskCacheHits.loadRelaxed();
+    stats.approximateHits = approximateHits.loadRelaxed();
+    stats.duplicatesSuppressed = duplicatesSuppressed.loadRelaxed();
+    stats.framesDecoded = framesDecoded.loadRelaxed();
+    stats.loadErrors = loadErrors.loadRelaxed();
+    stats.loadsCancelled = loadsCancelled.loadRelaxed();
+    stats.pixelsDecoded = pixelsDecoded.loadRelaxed();
+    stats.bytesDecoded = bytesDecoded.loadRelaxed();
+    stats.bytesServed = bytesServed.loadRelaxed();
+    stats.bytesEvicted = bytesEvicted.loadRelaxed();
+    for (int i = 0; i < int(EvictionReason::ReasonCount); i++) {
+        stats.evictions[i] = evictions[i].loadRelaxed();
+    }
+    stats.inFlight = inFlight.size();
+    stats.peakInFlight = peakInFlight;
+    stats.cachedFrames = frameCache.count();
+    stats.cachedBytes = frameCache.totalCost();
+    stats.visibleLatency = visibleLatency.summarize();
+    stats.prefetchLatency = prefetchLatency.summarize();
+    stats.files = fileStats;
+    return stats;
+}
+
+bool FrameCache::startAccessTrace(const QString& tracePath) {
+    QMutexLocker locker(&mutex);
+    auto file = std::make_unique<QFile>(tracePath);
+    if (!file->open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text)) {
+        return false;
+    }
+    traceFile = std::move(file);
+    return true;
+}
+
+void FrameCache::stopAccessTrace() {
+    QMutexLocker locker(&mutex);
+    traceFile.reset();
+}
+
+void FrameCache::setStatisticsInterval(int msecs) {
+    if (msecs > 0) {
+        statsTimer.start(msecs);
+    } else {
+        statsTimer.stop();
+    }
+}
+
+int FrameCache::getStatisticsInterval() const {
+    return statsTimer.isActive() ? statsTimer.interval() : 0;
+}
+
 void FrameCache::resetStatistics() {
-    cacheHits = 0;
-    cacheMisses = 0;
+    QMutexLocker locker(&mutex);
+    cacheHits.storeRelaxed(0);
+    cacheMisses.storeRelaxed(0);
+    diskCacheHits.storeRelaxed(0);
+    approximateHits.storeRelaxed(0);
+    duplicatesSuppressed.storeRelaxed(0);
+    framesDecoded.storeRelaxed(0);
+    loadErrors.storeRelaxed(0);
+    loadsCancelled.storeRelaxed(0);
+    pixelsDecoded.storeRelaxed(0);
+    bytesDecoded.storeRelaxed(0);
+    bytesServed.storeRelaxed(0);
+    bytesEvicted.storeRelaxed(0);
+    for (auto& count : evictions) {
+        count.storeRelaxed(0);
+    }
+    visibleLatency.reset();
+    prefetchLatency.reset();
+    fileStats.clear();
+    peakInFlight = inFlight.size();
+    prefetchRequested = 0;
+    prefetchUsed = 0;
+    prefetchedKeys.clear();
 }
 
-void FrameCache::handleFrameLoaded(const QString& filePath, qint64 timestamp, 
-                                 const QImage& frame) {
-    insertFrame(filePath, timestamp, frame);
-    emit frameAvailable(filePath, timestamp);
+void FrameCache::handleFrameLoaded(const QString& filePath, qint64 timestamp, int downscale,
+                                 const VideoFrame& frame) {
+    // Runs on loader threads; only the bookkeeping is done under the lock
+    probeStream(filePath);
+    QMutexLocker locker(&mutex);
+    const VideoStreamInfo& info = streamInfoFor(filePath);
+    CacheKey key{filePath, info.frameAt(timestamp), downscale};
+    qint64 frameStart = info.frameStart(key.frameIndex);
+    
+    // Every caller waiting on this frame is notified by one signal
+    auto pending = inFlight.find(key);
+    if (pending == inFlight.end() && frameCache.contains(key)) {
+        return;
+    }
+    
+    qint64 pixels = qint64(frame.width()) * frame.height();
+    framesDecoded++;
+    pixelsDecoded += pixels;
+    bytesDecoded += frame.sizeInBytes();
+    FrameCacheStats::FileStats& perFile = fileStats[filePath];
+    perFile.framesDecoded++;
+    perFile.pixelsDecoded += pixels;
+    perFile.bytesDecoded += frame.sizeInBytes();
+    if (pending != inFlight.end()) {
+        qint64 latency = statsClock.elapsed() - pending->requestedAt;
+        if (pending->priority == FrameLoader::Priority::Visible) {
+            visibleLatency.record(latency);
+        } else {
+            prefetchLatency.record(latency);
+        }
+        inFlight.erase(pending);
+    }
+    
+    insertFrame(key, frame);
+    std::shared_ptr<DiskFrameCache> disk = diskCache;
+    QList<FramePromise> promises = waiters.take(key);
+    for (int i = 0; i < promises.size(); i++) {
+        recordServed(filePath, frame);
+    }
+    locker.unlock();
+    
+    for (const FramePromise& promise : promises) {
+        promise->set_value(frame);
+    }
+    
+    // Storing stats the source and copies the frame into the mapping
+    if (disk) {
+        disk->store(filePath, key.frameIndex, frame, downscale);
+    }
+    emit frameAvailable(filePath, frameStart);
 }
 
-void FrameCache::handleFrameLoadError(const QString& filePath, qint64 timestamp, 
+void FrameCache::handleFrameLoadError(const QString& filePath, qint64 timestamp, int downscale,
                                     const QString& error) {
+    QList<FramePromise> promises;
+    probeStream(filePath);
+    {
+        QMutexLocker locker(&mutex);
+        CacheKey key{filePath, streamInfoFor(filePath).frameAt(timestamp), downscale};
+        inFlight.remove(key);
+        promises = waiters.take(key);
+        loadErrors++;
+    }
+    for (const FramePromise& promise : promises) {
+        promise->set_value(VideoFrame());
+    }
+    
     QString message = QString("Failed to load frame at %1ms from %2: %3")
         .arg(timestamp)
         .arg(filePath)
@@ -176,22 +958,253 @@ void FrameCache::handleFrameLoadError(const QString& filePath, qint64 timestamp,
     emit cacheError(message);
 }
 
-void FrameCache::insertFrame(const QString& filePath, qint64 timestamp, 
-                           const QImage& frame) {
-    CacheKey key{filePath, timestamp};
+void FrameCache::handleFrameLoadCancelled(const QString& filePath, qint64 timestamp,
+                                          int downscale) {
+    probeStream(filePath);
+    QMutexLocker locker(&mutex);
+    CacheKey key{filePath, streamInfoFor(filePath).frameAt(timestamp), downscale};
+    inFlight.remove(key);
+    loadsCancelled++;
+    
+    // A playhead jump doesn't cancel what a blocked caller asked for
+    if (waiters.contains(key)) {
+        requestLoad(key, FrameLoader::Priority::Visible);
+    }
+}
+
+void FrameCache::probeStream(const QString& filePath) {
+    {
+        QMutexLocker locker(&mutex);
+        if (streamInfos.contains(filePath)) {
+            return;
+        }
+    }
+    
+    // Probing opens the file; two callers may both probe, the first wins
+    VideoStreamInfo info = FrameDecoder::probe(filePath);
+    {
+        QMutexLocker locker(&mutex);
+        if (streamInfos.contains(filePath)) {
+            return;
+        }
+        streamInfos.insert(filePath, info);
+    }
     
-    // Calculate frame size in bytes (approximate)
-    int cost = frame.sizeInBytes();
+    // First sight of a file, whether or not it gets a proxy: index its
+    // keyframes in the background so later seeks are exact
+    SeekIndexStore* store = frameLoader->getSeekIndexStore();
+    if (store && info.probed) {
+        store->buildIndex(filePath);
+    }
+}
+
+const VideoStreamInfo& FrameCache::streamInfoFor(const QString& filePath) {
+    auto it = streamInfos.find(filePath);
+    if (it == streamInfos.end()) {
+        it = streamInfos.insert(filePath, FrameDecoder::probe(filePath));
+    }
+    return *it;
+}
+
+void FrameCache::updatePlaybackEstimate(const QString& filePath, qint64 frameIndex) {
+    qint64 now = playbackClock.elapsed();
+    qint64 elapsed = now - lastRequestTime;
+    qint64 frames = frameIndex - lastRequestFrame;
+    
+    if (lastRequestTime < 0 || filePath != playheadFile || elapsed > PLAYBACK_IDLE_TIMEOUT) {
+        // Start of a new gesture
+        measuredSpeed = 0.0;
+    } else if (elapsed > 0) {
+        // Smooth the instantaneous rate; a big jump is a seek, not playback
+        AVRational rate = streamInfoFor(filePath).frameRate;
+        double instantaneous = frames * 1000.0 * rate.den / (double(elapsed) * rate.num);
+        PrefetchWindow window = prefetchWindow();
+        if (qAbs(frames) > 4 * (window.ahead + window.behind) * window.step) {
+            measuredSpeed = 0.0;
+        } else {
+            measuredSpeed = 0.7 * measuredSpeed + 0.3 * instantaneous;
+        }
+    }
+    
+    lastRequestTime = now;
+    lastRequestFrame = frameIndex;
+}
+
+FrameCache::PrefetchWindow FrameCache::prefetchWindow() const {
+    double speed = getPlaybackSpeed();
+    if (qAbs(speed) < PAUSED_SPEED) {
+        // Paused or scrubbing: either direction is equally likely
+        return {cacheAhead, cacheBehind, 1};
+    }
+    
+    // Skew the budget towards the direction of travel and, when shuttling,
+    // only fetch the frames that will actually be shown
+    int budget = cacheAhead + cacheBehind;
+    int leading = budget * 7 / 8;
+    int trailing = budget - leading;
+    int step = qAbs(speed) >= 2.0 ? int(qAbs(speed) + 0.5) : 1;
+    if (speed > 0) {
+        return {leading, trailing, step};
+    }
+    return {trailing, leading, step};
+}
+
+QList<CacheKey> FrameCache::schedulePrefetch(const QString& filePath, qint64 frameIndex,
+                                             bool topUpOnly) {
+    PrefetchWindow window = prefetchWindow();
+    double speed = getPlaybackSpeed();
+    QList<CacheKey> keys;
+    
+    if (topUpOnly) {
+        // While playing, each shown frame extends the leading edge by one
+        if (qAbs(speed) >= PAUSED_SPEED) {
+            int direction = speed > 0 ? 1 : -1;
+            int leading = direction > 0 ? window.ahead : window.behind;
+            addPrefetch(keys, filePath, frameIndex + direction * leading * window.step);
+        }
+        return keys;
+    }
+    
+    // Interleave both sides, nearest first
+    int count = qMax(window.ahead, window.behind);
+    for (int i = 1; i <= count; i++) {
+        if (i <= window.ahead) {
+            addPrefetch(keys, filePath, frameIndex + i * window.step);
+        }
+        if (i <= window.behind) {
+            addPrefetch(keys, filePath, frameIndex - i * window.step);
+        }
+    }
+    return keys;
+}
+
+void FrameCache::updatePlayhead(const QString& filePath, qint64 frameIndex) {
+    // A jump outside the prefetch window makes every queued load stale
+    PrefetchWindow window = prefetchWindow();
+    if (filePath != playheadFile ||
+        frameIndex > playheadFrame + window.ahead * window.step ||
+        frameIndex < playheadFrame - window.behind * window.step) {
+        frameLoader->bumpGeneration();
+    }
+    
+    playheadFile = filePath;
+    playheadFrame = frameIndex;
+    frameCache.setPlayhead(filePath, frameIndex);
+    frameLoader->setPlayhead(filePath, streamInfoFor(filePath).frameCenter(frameIndex));
+}
+
+void FrameCache::insertFrame(const CacheKey& key, const VideoFrame& frame) {
+    // Cost is the size of the buffers actually held
+    qint64 cost = frame.sizeInBytes();
+    
+    // Replacing an entry is not an eviction
+    frameCache.remove(key);
+    int countBefore = frameCache.count();
+    qint64 costBefore = frameCache.totalCost();
     
     // Store frame in cache
-    frameCache.insert(key, new QImage(frame), cost);
+    frameCache.insert(key, frame, cost);
+    recordEvictions(EvictionReason::Capacity, countBefore + 1, costBefore + cost);
+}
+
+void FrameCache::addPrefetch(QList<CacheKey>& keys, const QString& filePath, qint64 frameIndex) {
+    const VideoStreamInfo& info = streamInfoFor(filePath);
+    if (frameIndex < 0 || (info.frameCount > 0 && frameIndex >= info.frameCount)) {
+        return;
+    }
+    
+    // Only prefetch if frame is not already in cache or on its way
+    CacheKey key{filePath, frameIndex, viewerDownscale(filePath)};
+    if (inFlight.contains(key)) {
+        duplicatesSuppressed++;
+    } else if (!frameCache.contains(key)) {
+        keys.append(key);
+    }
+}
+
+void FrameCache::fetchPrefetches(const std::shared_ptr<DiskFrameCache>& disk,
+                                 const QList<CacheKey>& keys) {
+    if (keys.isEmpty()) {
+        return;
+    }
+    
+    // Frames on disk are promoted without decoding (the mapping makes this
+    // zero-copy); reading them may fault pages in, so without the lock
+    QList<VideoFrame> fromDisk;
+    for (const CacheKey& key : keys) {
+        fromDisk.append(readFromDisk(disk.get(), key));
+    }
+    
+    QMutexLocker locker(&mutex);
+    for (int i = 0; i < keys.size(); i++) {
+        const CacheKey& key = keys[i];
+        if (frameCache.contains(key)) {
+            continue;  // Arrived meanwhile
+        }
+        if (!fromDisk[i].isNull()) {
+            insertFrame(key, fromDisk[i]);
+            continue;
+        }
+        if (requestLoad(key, FrameLoader::Priority::Prefetch)) {
+            prefetchRequested++;
+            if (prefetchedKeys.size() >= MAX_TRACKED_PREFETCHES) {
+                prefetchedKeys.clear();
+            }
+            prefetchedKeys.insert(key);
+        }
+    }
 }
 
-void FrameCache::prefetchFrame(const QString& filePath, qint64 timestamp) {
-    CacheKey key{filePath, timestamp};
+bool FrameCache::requestLoad(const CacheKey& key, FrameLoader::Priority priority) {
+    qint64 timestamp = streamInfoFor(key.filePath).frameCenter(key.frameIndex);
     
-    // Only prefetch if frame is not already in cache
-    if (!frameCache.contains(key)) {
-        frameLoader->requestFrame(filePath, timestamp);
+    auto it = inFlight.find(key);
+    if (it != inFlight.end()) {
+        // Attach to the pending load; a prefetch that becomes visible jumps
+        // the queue if it has not started decoding yet
+        duplicatesSuppressed++;
+        if (priority == FrameLoader::Priority::Visible && it->priority != priority) {
+            it->priority = priority;
+            frameLoader->raisePriority(key.filePath, timestamp, key.downscale, priority);
+        }
+        return false;
     }
+    
+    inFlight.insert(key, {priority, statsClock.elapsed()});
+    peakInFlight = qMax(peakInFlight, int(inFlight.size()));
+    frameLoader->requestFrame(key.filePath, timestamp, priority, key.downscale);
+    return true;
+}
+
+int FrameCache::viewerDownscale(const QString& filePath) {
+    return FrameDecoder::downscaleFor(streamInfoFor(filePath), viewerSize);
+}
+
+void FrameCache::recordServed(const QString& filePath, const VideoFrame& frame) {
+    bytesServed += frame.sizeInBytes();
+    fileStats[filePath].bytesServed += frame.sizeInBytes();
+}
+
+void FrameCache::recordEvictions(EvictionReason reason, int countBefore, qint64 costBefore) {
+    int evicted = countBefore - frameCache.count();
+    if (evicted > 0) {
+        evictions[int(reason)] += evicted;
+        bytesEvicted += costBefore - frameCache.totalCost();
+    }
+}
+
+VideoFrame FrameCache::readFromDisk(DiskFrameCache* disk, const CacheKey& key) {
+    if (!disk) {
+        return VideoFrame();
+    }
+    
+    QElapsedTimer timer;
+    timer.start();
+    VideoFrame frame = disk->lookup(key.filePath, key.frameIndex, key.downscale);
+    
+    // Reading back from the mapping is what it would cost again
+    if (!frame.isNull()) {
+        frame.setDecodeCost(timer.nsecsElapsed() / 1000);
+    }
+    return frame;
 }
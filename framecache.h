@@ -1,103 +1,358 @@
 #pragma once
 
 #include <QObject>
-#include <QCache>
 #include <QImage>
 #include <QMutex>
+#include <QWaitCondition>
 #include <QThread>
-#include <QQueue>
+#include <QHash>
+#include <QSet>
+#include <QElapsedTimer>
+#include <QAtomicInteger>
+#include <QRecursiveMutex>
+#include <QTimer>
+#include <QFile>
 #include <memory>
+#include <vector>
+#include <future>
+#include "framedecoder.h"
+#include "videoframe.h"
+#include "diskframecache.h"
+#include "framecachestats.h"
+#include "framestore.h"
+#include "seekindex.h"
 
-struct CacheKey {
-    QString filePath;
-    qint64 timestamp;
-    
-    bool operator==(const CacheKey& other) const {
-        return filePath == other.filePath && timestamp == other.timestamp;
-    }
-};
-
-// Hash function for CacheKey
-inline uint qHash(const CacheKey& key) {
-    return qHash(key.filePath) ^ qHash(key.timestamp);
-}
-
-class FrameLoader : public QThread {
+// Decodes frames on a pool of worker threads. Pending requests are served
+// in priority order: visible frames first, then by distance from the
+// playhead. Bumping the playhead generation cancels everything queued.
+class FrameLoader : public QObject {
     Q_OBJECT
     
 public:
+    // How frames are extracted from the source file
+    enum class Backend {
+        InProcess,       // libavformat/libavcodec decode straight into memory
+        ExternalProcess  // Legacy: spawn ffmpeg and read back a PNG
+    };
+    
+    enum class Priority {
+        Visible,   // The frame on screen right now
+        Prefetch   // Neighbouring frames loaded ahead of time
+    };
+
     explicit FrameLoader(QObject* parent = nullptr);
     ~FrameLoader();
     
-    void requestFrame(const QString& filePath, qint64 timestamp);
+    // downscale shrinks the frame by a power of two (see FrameDecoder)
+    void requestFrame(const QString& filePath, qint64 timestamp,
+                      Priority priority = Priority::Prefetch, int downscale = 1);
+    
+    // Move a queued request up to the given priority. Returns false when
+    // it is no longer queued (already decoding, or never requested).
+    bool raisePriority(const QString& filePath, qint64 timestamp, int downscale,
+                       Priority priority);
     void stop();
+    
+    // Playhead used to order prefetches by distance
+    void setPlayhead(const QString& filePath, qint64 timestamp);
+    
+    // Drop every queued request and stop in-progress passes at the next
+    // frame. Returns the new generation.
+    quint64 bumpGeneration();
+    quint64 getGeneration() const { return generation.loadAcquire(); }
+    
+    void setBackend(Backend value) { backend = value; }
+    Backend getBackend() const { return backend; }
+    
+    // Representation of loaded frames; Native skips the RGB conversion
+    void setOutputFormat(FrameDecoder::OutputFormat format);
+    FrameDecoder::OutputFormat getOutputFormat() const;
+    
+    // Number of loader threads; takes effect before the first request
+    void setWorkerCount(int count);
+    int getWorkerCount() const;
+    
+    // Decoder sessions unused for this long are closed
+    void setSessionIdleTimeout(int msecs);
+    int getSessionIdleTimeout() const;
+    
+    // Keyframe indexes handed to decoders as they open files; not owned
+    void setSeekIndexStore(SeekIndexStore* store);
+    SeekIndexStore* getSeekIndexStore() const;
+    
+    // Synchronous load on the calling thread (used for benchmarks)
+    QImage loadFrame(const QString& filePath, qint64 timestamp);
 
 signals:
-    void frameLoaded(const QString& filePath, qint64 timestamp, const QImage& frame);
-    void frameLoadError(const QString& filePath, qint64 timestamp, const QString& error);
-
-protected:
-    void run() override;
+    void frameLoaded(const QString& filePath, qint64 timestamp, int downscale,
+                     const VideoFrame& frame);
+    void frameLoadError(const QString& filePath, qint64 timestamp, int downscale,
+                        const QString& error);
+    void frameLoadCancelled(const QString& filePath, qint64 timestamp, int downscale);
 
 private:
     struct LoadRequest {
         QString filePath;
         qint64 timestamp;
+        Priority priority;
+        int downscale;
     };
     
-    QQueue<LoadRequest> requestQueue;
-    QMutex mutex;
+    // Open decoder for one source file, checked out by one worker at a time
+    struct DecoderSession {
+        FrameDecoder decoder;
+        QElapsedTimer lastUsed;
+    };
+    
+    QList<LoadRequest> requestQueue;
+    QHash<QString, QList<std::shared_ptr<DecoderSession>>> idleSessions;
+    int sessionCount;
+    std::vector<std::unique_ptr<QThread>> workers;
+    mutable QMutex mutex;
+    QWaitCondition requestAvailable;
     bool running;
+    Backend backend;
+    FrameDecoder::OutputFormat outputFormat;
+    int workerCount;
+    int sessionIdleTimeout;
+    SeekIndexStore* seekIndexes;
     
-    QImage loadFrame(const QString& filePath, qint64 timestamp);
+    // Playhead state
+    QString playheadFile;
+    qint64 playheadTime;
+    QAtomicInteger<quint64> generation;
+    
+    void startWorkers();
+    void workerLoop();
+    int nextRequestIndex() const;
+    QList<LoadRequest> takeBatch(const LoadRequest& first, qint64 gopStart, qint64 gopEnd);
+    bool loadBatch(const LoadRequest& first, const QList<qint64>& timestamps,
+                   DecoderSession* session, quint64 batchGeneration);
+    std::shared_ptr<DecoderSession> acquireSession(const LoadRequest& request);
+    void releaseSession(const QString& filePath, std::shared_ptr<DecoderSession> session);
+    void closeIdleSessions();
+    QImage loadFrameInProcess(const QString& filePath, qint64 timestamp);
+    QImage loadFrameExternal(const QString& filePath, qint64 timestamp);
+    
+    // Constants
+    static const int DEFAULT_SESSION_IDLE_TIMEOUT;
+    static const int SESSION_SWEEP_INTERVAL;
+    static const int MAX_SESSIONS;
+    static const int MAX_WORKERS;
 };
 
+// Thread-safe: frames may be requested from any thread. Loads complete on
+// the loader threads, so frameAvailable is delivered queued to receivers
+// in other threads and a blocked caller never waits on the event loop.
 class FrameCache : public QObject {
     Q_OBJECT
 
 public:
+    // How cached frames are held in memory
+    enum class StorageFormat {
+        RGB,        // RGB32 images, ready to display
+        NativeYUV   // Refcounted planar frames, converted at display time
+    };
+
+    // Prefetch window derived from the playback state
+    struct PrefetchWindow {
+        int ahead;    // Frames fetched in the playback direction
+        int behind;   // Frames fetched against it
+        int step;     // Source frames between fetched frames
+    };
+    
+    // How well prefetching kept up with playback
+    struct PrefetchStats {
+        double speed;          // Signed playback speed in use (0 = paused)
+        bool speedMeasured;    // Measured from requests rather than supplied
+        PrefetchWindow window;
+        int requested;         // Prefetch loads issued
+        int used;              // Prefetched frames later shown
+        double efficiency() const { return requested > 0 ? double(used) / requested : 0.0; }
+    };
+
     explicit FrameCache(QObject* parent = nullptr);
     ~FrameCache();
     
     // Cache settings
+    void setStorageFormat(StorageFormat format);
+    StorageFormat getStorageFormat() const { return storageFormat; }
+    
     void setMaxCacheSize(int megabytes);
     int getMaxCacheSize() const { return maxCacheSize; }
     
-    void setCacheAhead(int frames) { cacheAhead = frames; }
+    // Which frames make room for new ones; see FrameStore
+    void setEvictionPolicy(FrameStore::Policy policy);
+    FrameStore::Policy getEvictionPolicy() const;
+    
+    void setCacheAhead(int frames);
     int getCacheAhead() const { return cacheAhead; }
     
-    void setCacheBehind(int frames) { cacheBehind = frames; }
+    void setCacheBehind(int frames);
     int getCacheBehind() const { return cacheBehind; }
     
-    // Frame access
-    QImage getFrame(const QString& filePath, qint64 timestamp);
+    // Size of the preview; getFrame() decodes just large enough to fill
+    // it. An empty size means full resolution.
+    void setViewerSize(const QSize& size);
+    QSize getViewerSize() const;
+    
+    // Playback state from the player: 1.0 = play, -4.0 = shuttle back at
+    // 4x (J/K/L), 0 = paused. Without it, speed is measured from requests.
+    void setPlaybackSpeed(double speed);
+    void clearPlaybackSpeed();
+    double getPlaybackSpeed() const;
+    
+    // Answer misses with the nearest cached frame while the user drags
+    void setScrubMode(bool enabled);
+    bool isScrubMode() const;
+    
+    // Second tier on local disk; an empty directory disables it
+    void setDiskCache(const QString& directory, int megabytes = 4096);
+    DiskFrameCache* getDiskCache() const { return diskCache.get(); }
+    
+    // Keyframe indexes for exact seeks, usually the proxy manager's; a
+    // build is queued for each file the cache opens
+    void setSeekIndexStore(SeekIndexStore* store);
+    
+    // Frame access. On a miss the frame is loaded and frameAvailable is
+    // emitted; meanwhile an empty image is returned, or in scrub mode the
+    // closest cached frame, with approximate set.
+    QImage getFrame(const QString& filePath, qint64 timestamp, bool* approximate = nullptr);
     void prefetchFrames(const QString& filePath, qint64 startTime, qint64 endTime);
+    
+    // Request a frame without waiting for it. The future is ready at once
+    // on a hit; a failed load yields a null frame. Does not move the
+    // playhead, so exports and thumbnails don't disturb playback prefetch.
+    // A size decodes at the smallest reduction that still covers it.
+    std::shared_future<VideoFrame> requestFrame(const QString& filePath, qint64 timestamp,
+                                                const QSize& size = QSize());
+    
+    // Block until the frame is loaded or the timeout passes (-1 waits
+    // forever). Returns a null frame on timeout or failure.
+    VideoFrame waitForFrame(const QString& filePath, qint64 timestamp, int msecs = 30000,
+                            const QSize& size = QSize());
     void clearCache();
     
+    // Stream timing used to map timestamps to frames (probed on first use)
+    VideoStreamInfo getStreamInfo(const QString& filePath);
+    
     // Cache statistics
     int getCacheSize() const;
-    int getCacheHits() const { return cacheHits; }
-    int getCacheMisses() const { return cacheMisses; }
+    int getCacheHits() const { return int(cacheHits.loadRelaxed()); }
+    int getCacheMisses() const { return int(cacheMisses.loadRelaxed()); }
+    int getDiskCacheHits() const { return int(diskCacheHits.loadRelaxed()); }
+    int getDuplicatesSuppressed() const { return int(duplicatesSuppressed.loadRelaxed()); }
+    int getInFlightCount() const;
+    PrefetchStats getPrefetchStats() const;
+    FrameCacheStats getStatistics() const;
     void resetStatistics();
+    
+    // Record every getFrame() access to a file, one line per access:
+    // elapsed msecs, file path, frame index and downscale, tab-separated.
+    // Traces can be replayed against the eviction policies.
+    bool startAccessTrace(const QString& tracePath);
+    void stopAccessTrace();
+    
+    // Emit statisticsUpdated every interval; 0 turns it off
+    void setStatisticsInterval(int msecs);
+    int getStatisticsInterval() const;
 
 signals:
     void frameAvailable(const QString& filePath, qint64 timestamp);
     void cacheError(const QString& error);
+    void statisticsUpdated(const FrameCacheStats& stats);
 
 private slots:
-    void handleFrameLoaded(const QString& filePath, qint64 timestamp, const QImage& frame);
-    void handleFrameLoadError(const QString& filePath, qint64 timestamp, const QString& error);
+    void handleFrameLoaded(const QString& filePath, qint64 timestamp, int downscale,
+                           const VideoFrame& frame);
+    void handleFrameLoadError(const QString& filePath, qint64 timestamp, int downscale,
+                              const QString& error);
+    void handleFrameLoadCancelled(const QString& filePath, qint64 timestamp, int downscale);
 
 private:
-    QCache<CacheKey, QImage> frameCache;
+    using FramePromise = std::shared_ptr<std::promise<VideoFrame>>;
+    
+    struct PendingLoad {
+        FrameLoader::Priority priority;
+        qint64 requestedAt;  // On statsClock
+    };
+    
+    FrameStore frameCache;
+    QHash<QString, VideoStreamInfo> streamInfos;
     std::unique_ptr<FrameLoader> frameLoader;
+    std::shared_ptr<DiskFrameCache> diskCache;  // Shared with lookups made without the lock
+    StorageFormat storageFormat;
     int maxCacheSize;
     int cacheAhead;
     int cacheBehind;
-    int cacheHits;
-    int cacheMisses;
+    QSize viewerSize;
+    bool scrubMode;
+    
+    QString playheadFile;
+    qint64 playheadFrame;
+    
+    // Playback direction and speed
+    bool explicitSpeed;
+    double playbackSpeed;
+    double measuredSpeed;
+    QElapsedTimer playbackClock;
+    qint64 lastRequestTime;
+    qint64 lastRequestFrame;
+    
+    // Loads requested but not yet delivered; repeats attach to these
+    QHash<CacheKey, PendingLoad> inFlight;
+    QHash<CacheKey, QList<FramePromise>> waiters;
+    
+    // Prefetch effectiveness
+    QSet<CacheKey> prefetchedKeys;
+    int prefetchRequested;
+    int prefetchUsed;
+    
+    // Counters; atomic so they can be read without the lock
+    QAtomicInteger<qint64> cacheHits;
+    QAtomicInteger<qint64> cacheMisses;
+    QAtomicInteger<qint64> diskCacheHits;
+    QAtomicInteger<qint64> approximateHits;
+    QAtomicInteger<qint64> duplicatesSuppressed;
+    QAtomicInteger<qint64> framesDecoded;
+    QAtomicInteger<qint64> loadErrors;
+    QAtomicInteger<qint64> loadsCancelled;
+    QAtomicInteger<qint64> pixelsDecoded;
+    QAtomicInteger<qint64> bytesDecoded;
+    QAtomicInteger<qint64> bytesServed;
+    QAtomicInteger<qint64> bytesEvicted;
+    std::array<QAtomicInteger<qint64>, int(EvictionReason::ReasonCount)> evictions;
+    LatencyHistogram visibleLatency;
+    LatencyHistogram prefetchLatency;
+    QHash<QString, FrameCacheStats::FileStats> fileStats;
+    int peakInFlight;
+    QElapsedTimer statsClock;
+    QTimer statsTimer;
+    std::unique_ptr<QFile> traceFile;
+    
+    // Guards everything above; recursive because cancellations triggered
+    // by a playhead jump are delivered on the requesting thread
+    mutable QRecursiveMutex mutex;
     
     // Helper functions
-    void insertFrame(const QString& filePath, qint64 timestamp, const QImage& frame);
-    void prefetchFrame(const QString& filePath, qint64 timestamp);
+    void probeStream(const QString& filePath);  // Without the lock held
+    const VideoStreamInfo& streamInfoFor(const QString& filePath);
+    void updatePlaybackEstimate(const QString& filePath, qint64 frameIndex);
+    PrefetchWindow prefetchWindow() const;
+    QList<CacheKey> schedulePrefetch(const QString& filePath, qint64 frameIndex, bool topUpOnly);
+    void updatePlayhead(const QString& filePath, qint64 frameIndex);
+    void insertFrame(const CacheKey& key, const VideoFrame& frame);
+    static VideoFrame readFromDisk(DiskFrameCache* disk, const CacheKey& key);  // Without the lock
+    void addPrefetch(QList<CacheKey>& keys, const QString& filePath, qint64 frameIndex);
+    void fetchPrefetches(const std::shared_ptr<DiskFrameCache>& disk,
+                         const QList<CacheKey>& keys);  // Without the lock held
+    bool requestLoad(const CacheKey& key, FrameLoader::Priority priority);
+    int viewerDownscale(const QString& filePath);
+    void recordServed(const QString& filePath, const VideoFrame& frame);
+    void recordEvictions(EvictionReason reason, int countBefore, qint64 costBefore);
+    
+    // Constants
+    static const double PAUSED_SPEED;
+    static const int PLAYBACK_IDLE_TIMEOUT;
+    static const int MAX_TRACKED_PREFETCHES;
 };
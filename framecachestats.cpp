@@ -0,0 +1,77 @@
+#include "framecachestats.h"
+#include <cmath>
+
+LatencyHistogram::LatencyHistogram()
+    : count(0)
+    , total(0)
+    , max(0)
+{
+    for (auto& bucket : buckets) {
+        bucket.storeRelaxed(0);
+    }
+}
+
+void LatencyHistogram::record(qint64 msecs) {
+    msecs = qMax<qint64>(msecs, 0);
+    buckets[bucketFor(msecs)].fetchAndAddRelaxed(1);
+    count.fetchAndAddRelaxed(1);
+    total.fetchAndAddRelaxed(msecs);
+
+    qint64 current = max.loadRelaxed();
+    while (msecs > current && !max.testAndSetRelaxed(current, msecs, current)) {
+    }
+}
+
+void LatencyHistogram::reset() {
+    for (auto& bucket : buckets) {
+        bucket.storeRelaxed(0);
+    }
+    count.storeRelaxed(0);
+    total.storeRelaxed(0);
+    max.storeRelaxed(0);
+}
+
+LatencyHistogram::Summary LatencyHistogram::summarize() const {
+    Summary summary;
+    std::array<qint64, BUCKET_COUNT> snapshot;
+    for (int i = 0; i < BUCKET_COUNT; i++) {
+        snapshot[i] = buckets[i].loadRelaxed();
+        summary.count += snapshot[i];
+    }
+    if (summary.count == 0) {
+        return summary;
+    }
+
+    summary.mean = double(total.loadRelaxed()) / summary.count;
+    summary.max = max.loadRelaxed();
+
+    // Report each percentile as the upper edge of the bucket it falls in
+    auto percentile = [&](double fraction) {
+        qint64 rank = qint64(std::ceil(fraction * summary.count));
+        qint64 seen = 0;
+        for (int i = 0; i < BUCKET_COUNT; i++) {
+            seen += snapshot[i];
+            if (seen >= rank) {
+                return qMin(bucketUpperBound(i), summary.max);
+            }
+        }
+        return summary.max;
+    };
+    summary.p50 = percentile(0.50);
+    summary.p95 = percentile(0.95);
+    summary.p99 = percentile(0.99);
+    return summary;
+}
+
+int LatencyHistogram::bucketFor(qint64 msecs) {
+    // Four buckets per power of two above 1ms
+    if (msecs <= 1) {
+        return 0;
+    }
+    int bucket = int(std::ceil(4.0 * std::log2(double(msecs))));
+    return qMin(bucket, BUCKET_COUNT - 1);
+}
+
+qint64 LatencyHistogram::bucketUpperBound(int bucket) {
+    return qint64(std::floor(std::pow(2.0, bucket / 4.0)));
+}
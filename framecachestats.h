@@ -0,0 +1,92 @@
+#pragma once
+
+#include <QString>
+#include <QHash>
+#include <QMetaType>
+#include <QAtomicInteger>
+#include <array>
+
+// Latency distribution with lock-free recording. Buckets grow by about
+// 19% each (four per power of two) from 1ms to a minute, which keeps
+// percentiles within a bucket's width without storing samples.
+class LatencyHistogram {
+public:
+    struct Summary {
+        qint64 count = 0;
+        double mean = 0.0;   // Milliseconds
+        qint64 p50 = 0;
+        qint64 p95 = 0;
+        qint64 p99 = 0;
+        qint64 max = 0;
+    };
+
+    LatencyHistogram();
+
+    void record(qint64 msecs);
+    void reset();
+    Summary summarize() const;
+
+private:
+    static const int BUCKET_COUNT = 64;
+
+    static int bucketFor(qint64 msecs);
+    static qint64 bucketUpperBound(int bucket);
+
+    std::array<QAtomicInteger<qint64>, BUCKET_COUNT> buckets;
+    QAtomicInteger<qint64> count;
+    QAtomicInteger<qint64> total;
+    QAtomicInteger<qint64> max;
+};
+
+// Why frames left the memory cache
+enum class EvictionReason {
+    Capacity,   // Pushed out by newer frames
+    Resized,    // The cache limit was lowered
+    Cleared,    // clearCache()
+    ReasonCount
+};
+
+// Point-in-time copy of the frame cache counters. Counters accumulate
+// until resetStatistics(); clearing the cache does not reset them.
+struct FrameCacheStats {
+    struct FileStats {
+        qint64 hits = 0;
+        qint64 misses = 0;
+        qint64 framesDecoded = 0;
+        qint64 pixelsDecoded = 0;
+        qint64 bytesDecoded = 0;
+        qint64 bytesServed = 0;
+    };
+
+    qint64 hits = 0;
+    qint64 misses = 0;
+    qint64 diskHits = 0;
+    qint64 approximateHits = 0;  // Scrub-mode misses answered by a neighbour
+    qint64 duplicatesSuppressed = 0;
+    qint64 framesDecoded = 0;
+    qint64 loadErrors = 0;
+    qint64 loadsCancelled = 0;
+    qint64 pixelsDecoded = 0;   // Pixels in the frames delivered
+    qint64 bytesDecoded = 0;    // Size of frames delivered by the loader
+    qint64 bytesServed = 0;     // Size of frames handed to callers
+    std::array<qint64, int(EvictionReason::ReasonCount)> evictions{};
+    qint64 bytesEvicted = 0;
+
+    int inFlight = 0;
+    int peakInFlight = 0;
+    int cachedFrames = 0;
+    qint64 cachedBytes = 0;
+
+    LatencyHistogram::Summary visibleLatency;   // Request to available, on screen
+    LatencyHistogram::Summary prefetchLatency;  // Request to available, prefetch
+
+    QHash<QString, FileStats> files;
+
+    qint64 evictionCount(EvictionReason reason) const { return evictions[int(reason)]; }
+    double hitRate() const {
+        qint64 lookups = hits + diskHits + misses;
+        return lookups > 0 ? double(hits + diskHits) / lookups : 0.0;
+    }
+};
+
+Q_DECLARE_METATYPE(FrameCacheStats)
@@ -0,0 +1,473 @@
+#include "framedecoder.h"
+#include <QDebug>
+#include <QFileInfo>
+#include <algorithm>
+#include <iterator>
+
+const qint64 FrameDecoder::DEFAULT_GOP_DURATION = 2000; // 2 seconds
+const int FrameDecoder::MAX_DOWNSCALE = 8;
+
+FrameDecoder::FrameDecoder()
+    : formatContext(nullptr)
+    , codec(nullptr)
+    , decoderContext(nullptr)
+    , frame(nullptr)
+    , packet(nullptr)
+    , streamIndex(-1)
+    , endOfStream(false)
+    , packetPending(false)
+    , hasFrame(false)
+    , currentTimestamp(0)
+    , costSinceKeyframe(0)
+    , outputFormat(OutputFormat::RGB)
+    , downscale(1)
+{
+}
+
+FrameDecoder::~FrameDecoder() {
+    close();
+}
+
+bool FrameDecoder::open(const QString& path) {
+    close();
+    filePath = path;
+
+    // Open container and read stream parameters
+    int ret = avformat_open_input(&formatContext, path.toUtf8().constData(),
+                                  nullptr, nullptr);
+    if (ret < 0) {
+        reportError("Could not open input file", ret);
+        close();
+        return false;
+    }
+
+    ret = avformat_find_stream_info(formatContext, nullptr);
+    if (ret < 0) {
+        reportError("Could not find stream info", ret);
+        close();
+        return false;
+    }
+
+    // Find the video stream and its decoder
+    streamIndex = av_find_best_stream(formatContext, AVMEDIA_TYPE_VIDEO,
+                                      -1, -1, &codec, 0);
+    if (streamIndex < 0 || !codec) {
+        reportError("Could not find video stream", streamIndex);
+        close();
+        return false;
+    }
+
+    if (!openCodec()) {
+        close();
+        return false;
+    }
+
+    frame = av_frame_alloc();
+    packet = av_packet_alloc();
+    if (!frame || !packet) {
+        reportError("Could not allocate frame buffers");
+        close();
+        return false;
+    }
+
+    streamInfo = readStreamInfo(formatContext, streamIndex);
+    endOfStream = false;
+    packetPending = false;
+    return true;
+}
+
+void FrameDecoder::close() {
+    if (frame) {
+        av_frame_free(&frame);
+    }
+    if (packet) {
+        av_packet_free(&packet);
+    }
+    if (decoderContext) {
+        avcodec_free_context(&decoderContext);
+    }
+    if (formatContext) {
+        avformat_close_input(&formatContext);
+    }
+    codec = nullptr;
+
+    streamIndex = -1;
+    endOfStream = false;
+    packetPending = false;
+    hasFrame = false;
+    currentTimestamp = 0;
+    keyframeTimestamps.clear();
+    seekIndex.reset();
+    streamInfo = VideoStreamInfo();
+    filePath.clear();
+}
+
+bool FrameDecoder::openCodec() {
+    decoderContext = avcodec_alloc_context3(codec);
+    if (!decoderContext) {
+        reportError("Could not allocate decoder context");
+        return false;
+    }
+
+    int ret = avcodec_parameters_to_context(decoderContext,
+                                            formatContext->streams[streamIndex]->codecpar);
+    if (ret < 0) {
+        reportError("Could not copy codec params", ret);
+        return false;
+    }
+
+    // Slice threading keeps single-frame latency low while scrubbing
+    decoderContext->thread_type = FF_THREAD_SLICE;
+    decoderContext->thread_count = 0;
+
+    // Reduced-size decoding; deblocking is invisible once downscaled
+    decoderContext->lowres = lowresLevel();
+    if (downscale > 1) {
+        decoderContext->skip_loop_filter = AVDISCARD_ALL;
+    }
+
+    ret = avcodec_open2(decoderContext, codec, nullptr);
+    if (ret < 0) {
+        reportError("Could not open codec", ret);
+        return false;
+    }
+    return true;
+}
+
+void FrameDecoder::setDownscale(int factor) {
+    // Round down to a power of two
+    int value = 1;
+    while (value * 2 <= qMin(factor, MAX_DOWNSCALE)) {
+        value *= 2;
+    }
+    if (value == downscale) {
+        return;
+    }
+
+    int previousLowres = lowresLevel();
+    downscale = value;
+    if (!isOpen()) {
+        return;
+    }
+
+    if (lowresLevel() != previousLowres) {
+        // lowres is fixed when the codec opens; the position is lost
+        avcodec_free_context(&decoderContext);
+        if (!openCodec()) {
+            close();
+            return;
+        }
+        hasFrame = false;
+        endOfStream = false;
+        dropPendingPacket();
+    } else {
+        decoderContext->skip_loop_filter = downscale > 1 ? AVDISCARD_ALL : AVDISCARD_DEFAULT;
+    }
+}
+
+int FrameDecoder::downscaleFor(const VideoStreamInfo& info, const QSize& viewer) {
+    if (!viewer.isValid() || viewer.isEmpty() || info.width <= 0 || info.height <= 0) {
+        return 1;
+    }
+
+    // Largest reduction that still covers the viewer
+    int factor = 1;
+    while (factor < MAX_DOWNSCALE &&
+           info.width / (factor * 2) >= viewer.width() &&
+           info.height / (factor * 2) >= viewer.height()) {
+        factor *= 2;
+    }
+    return factor;
+}
+
+int FrameDecoder::lowresLevel() const {
+    int level = 0;
+    while ((2 << level) <= downscale) {
+        level++;
+    }
+    return codec ? qMin(level, int(codec->max_lowres)) : 0;
+}
+
+VideoStreamInfo FrameDecoder::probe(const QString& filePath) {
+    AVFormatContext* context = nullptr;
+    if (avformat_open_input(&context, filePath.toUtf8().constData(), nullptr, nullptr) < 0) {
+        return VideoStreamInfo();
+    }
+
+    VideoStreamInfo info;
+    if (avformat_find_stream_info(context, nullptr) >= 0) {
+        int index = av_find_best_stream(context, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+        if (index >= 0) {
+            info = readStreamInfo(context, index);
+        }
+    }
+
+    avformat_close_input(&context);
+    return info;
+}
+
+void FrameDecoder::setSeekIndex(std::shared_ptr<const SeekIndex> index) {
+    seekIndex.reset();
+    if (!index || !isOpen() || index->getStreamIndex() != streamIndex ||
+        index->getSourcePath() != QFileInfo(filePath).absoluteFilePath()) {
+        return;
+    }
+
+    seekIndex = std::move(index);
+    for (const SeekIndex::Keyframe& keyframe : seekIndex->getKeyframes()) {
+        keyframeTimestamps.insert(keyframe.timestamp);
+    }
+}
+
+VideoStreamInfo FrameDecoder::readStreamInfo(AVFormatContext* context, int index) {
+    AVStream* stream = context->streams[index];
+    VideoStreamInfo info;
+    info.timeBase = stream->time_base;
+    info.startTime = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+    info.width = stream->codecpar->width;
+    info.height = stream->codecpar->height;
+
+    AVRational frameRate = av_guess_frame_rate(context, stream, nullptr);
+    if (frameRate.num > 0 && frameRate.den > 0) {
+        info.frameRate = frameRate;
+    }
+
+    if (stream->duration != AV_NOPTS_VALUE) {
+        info.duration = av_rescale_q(stream->duration, stream->time_base, AVRational{1, 1000});
+    } else if (context->duration != AV_NOPTS_VALUE) {
+        info.duration = av_rescale(context->duration, 1000, AV_TIME_BASE);
+    }
+
+    info.frameCount = stream->nb_frames > 0 ? stream->nb_frames
+                                            : info.frameAt(info.duration);
+    info.probed = true;
+    return info;
+}
+
+QImage FrameDecoder::decodeFrame(qint64 timestamp) {
+    QImage result;
+    decodeFrames({timestamp}, [&result](qint64, const VideoFrame& decoded) {
+        result = decoded.toImage();
+    });
+    return result;
+}
+
+int FrameDecoder::decodeFrames(QList<qint64> timestamps, const FrameCallback& callback,
+                               const CancelCheck& cancelled) {
+    if (!isOpen()) {
+        reportError("Decoder not open");
+        return 0;
+    }
+
+    std::sort(timestamps.begin(), timestamps.end());
+    timestamps.erase(std::unique(timestamps.begin(), timestamps.end()), timestamps.end());
+
+    qint64 duration = frameDuration();
+    int delivered = 0;
+    int next = 0;
+    while (next < timestamps.size()) {
+        if (cancelled && cancelled()) {
+            break;
+        }
+
+        qint64 target = timestamps[next];
+        if (needsSeek(target) && !seek(target)) {
+            break;
+        }
+
+        // Decode forward until the current frame covers the target
+        bool covered = hasFrame && currentTimestamp + duration > target;
+        while (!covered && decodeNextFrame()) {
+            covered = currentTimestamp + duration > target;
+        }
+        if (!covered) {
+            if (endOfStream) {
+                reportError(QString("No frame at %1ms").arg(target));
+            }
+            break;
+        }
+
+        // Hand the frame to every target it covers
+        VideoFrame output = wrapFrame(frame);
+        if (output.isNull()) {
+            reportError("Could not convert frame");
+            break;
+        }
+        while (next < timestamps.size() && timestamps[next] < currentTimestamp + duration) {
+            callback(timestamps[next], output);
+            delivered++;
+            next++;
+        }
+    }
+
+    return delivered;
+}
+
+void FrameDecoder::getGopBounds(qint64 timestamp, qint64& start, qint64& end) const {
+    qint64 gop = estimatedGopDuration();
+    auto after = keyframeTimestamps.upper_bound(timestamp);
+    end = after != keyframeTimestamps.end() ? *after : timestamp + gop;
+    start = after != keyframeTimestamps.begin() ? *std::prev(after) : timestamp - gop;
+}
+
+bool FrameDecoder::needsSeek(qint64 timestamp) const {
+    if (!hasFrame || timestamp < currentTimestamp) {
+        return true;
+    }
+
+    // Past a known keyframe, seeking is cheaper than decoding through
+    auto keyframe = keyframeTimestamps.upper_bound(currentTimestamp);
+    if (keyframe != keyframeTimestamps.end() && *keyframe <= timestamp) {
+        return true;
+    }
+
+    return timestamp - currentTimestamp > estimatedGopDuration();
+}
+
+qint64 FrameDecoder::estimatedGopDuration() const {
+    if (keyframeTimestamps.size() < 2) {
+        return DEFAULT_GOP_DURATION;
+    }
+    qint64 span = *keyframeTimestamps.rbegin() - *keyframeTimestamps.begin();
+    return span / qint64(keyframeTimestamps.size() - 1);
+}
+
+bool FrameDecoder::seek(qint64 timestamp) {
+    int64_t target = streamInfo.startTime + av_rescale_q(timestamp, AVRational{1, 1000},
+                                                         streamInfo.timeBase);
+
+    int ret = seekIndex ? seekIndex->seek(formatContext, timestamp)
+                        : av_seek_frame(formatContext, streamIndex, target, AVSEEK_FLAG_BACKWARD);
+    if (ret < 0) {
+        reportError("Seek failed", ret);
+        return false;
+    }
+
+    avcodec_flush_buffers(decoderContext);
+    dropPendingPacket();
+    endOfStream = false;
+    hasFrame = false;
+    costSinceKeyframe = 0;
+    return true;
+}
+
+bool FrameDecoder::decodeNextFrame() {
+    QElapsedTimer timer;
+    timer.start();
+    while (true) {
+        int ret = avcodec_receive_frame(decoderContext, frame);
+        if (ret == 0) {
+            hasFrame = true;
+            currentTimestamp = frameTimestamp(frame);
+            
+            // Rebuilding a frame means decoding again from its keyframe
+            qint64 elapsed = timer.nsecsElapsed() / 1000;
+            if (frame->pict_type == AV_PICTURE_TYPE_I) {
+                costSinceKeyframe = elapsed;
+            } else {
+                costSinceKeyframe += elapsed;
+            }
+            return true;
+        }
+
+        // The frame buffer has been released; the position is gone
+        hasFrame = false;
+        if (ret == AVERROR_EOF) {
+            return false;
+        }
+        if (ret != AVERROR(EAGAIN)) {
+            reportError("Error decoding frame", ret);
+            return false;
+        }
+
+        // Decoder needs more input; a packet it turned away goes first
+        if (!packetPending) {
+            ret = av_read_frame(formatContext, packet);
+            if (ret < 0) {
+                if (endOfStream) {
+                    return false;
+                }
+                // Drain the frames still buffered in the decoder
+                endOfStream = true;
+                avcodec_send_packet(decoderContext, nullptr);
+                continue;
+            }
+            if (packet->stream_index != streamIndex) {
+                av_packet_unref(packet);
+                continue;
+            }
+            if ((packet->flags & AV_PKT_FLAG_KEY) && packet->pts != AV_NOPTS_VALUE) {
+                keyframeTimestamps.insert(toMilliseconds(packet->pts));
+            }
+        }
+
+        // EAGAIN: output is waiting to be received; keep the packet and
+        // send it again once it has been
+        ret = avcodec_send_packet(decoderContext, packet);
+        packetPending = ret == AVERROR(EAGAIN);
+        if (packetPending) {
+            continue;
+        }
+        av_packet_unref(packet);
+        if (ret < 0) {
+            reportError("Error sending packet to decoder", ret);
+            return false;
+        }
+    }
+}
+
+void FrameDecoder::dropPendingPacket() {
+    if (packetPending) {
+        av_packet_unref(packet);
+        packetPending = false;
+    }
+}
+
+qint64 FrameDecoder::frameTimestamp(const AVFrame* decoded) const {
+    int64_t pts = decoded->best_effort_timestamp != AV_NOPTS_VALUE
+        ? decoded->best_effort_timestamp : decoded->pts;
+    if (pts == AV_NOPTS_VALUE) {
+        return 0;
+    }
+    return toMilliseconds(pts);
+}
+
+qint64 FrameDecoder::toMilliseconds(int64_t pts) const {
+    return av_rescale_q(pts - streamInfo.startTime, streamInfo.timeBase, AVRational{1, 1000});
+}
+
+qint64 FrameDecoder::frameDuration() const {
+    return qMax<qint64>(1, streamInfo.frameDuration());
+}
+
+VideoFrame FrameDecoder::wrapFrame(const AVFrame* decoded) const {
+    // Whatever lowres did not cover is made up by scaling
+    QSize size;
+    if (downscale > 1) {
+        int width = qMax(2, (streamInfo.width / downscale) & ~1);
+        int height = qMax(2, (streamInfo.height / downscale) & ~1);
+        if (width < decoded->width || height < decoded->height) {
+            size = QSize(width, height);
+        }
+    }
+
+    VideoFrame output;
+    if (outputFormat == OutputFormat::Native) {
+        output = size.isValid() ? VideoFrame::scaled(decoded, size)
+                                : VideoFrame::fromAVFrame(decoded);
+    } else {
+        output = VideoFrame(VideoFrame::convertToImage(decoded, size));
+    }
+    output.setDecodeCost(costSinceKeyframe);
+    return output;
+}
+
+void FrameDecoder::reportError(const QString& error, int code) {
+    lastError = error;
+    if (code < 0) {
+        char errbuf[AV_ERROR_MAX_STRING_SIZE];
+        av_strerror(code, errbuf, AV_ERROR_MAX_STRING_SIZE);
+        lastError += ": " + QString::fromUtf8(errbuf);
+    }
+    qDebug() << "FrameDecoder error:" << lastError << filePath;
+}
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <QString>
+#include <QImage>
+#include <QList>
+#include <QElapsedTimer>
+#include <functional>
+#include <set>
+#include <memory>
+#include "videoframe.h"
+#include "seekindex.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+// Timing of a video stream, probed once per file. Frames are addressed by
+// index in the stream's own cadence rather than by rounded milliseconds.
+struct VideoStreamInfo {
+    AVRational timeBase{1, 1000};
+    AVRational frameRate{30, 1};   // Falls back to 30fps when unknown
+    int64_t startTime{0};          // In timeBase units
+    qint64 duration{0};            // Milliseconds, 0 when unknown
+    qint64 frameCount{0};          // 0 when unknown
+    int width{0};
+    int height{0};
+    bool probed{false};
+
+    // Frame nearest to a timeline position (milliseconds)
+    qint64 nearestFrame(qint64 timestamp) const {
+        return av_rescale_rnd(timestamp, frameRate.num, int64_t(frameRate.den) * 1000,
+                              AV_ROUND_NEAR_INF);
+    }
+    // Frame on screen at a decode position (milliseconds)
+    qint64 frameAt(qint64 timestamp) const {
+        return av_rescale_rnd(timestamp, frameRate.num, int64_t(frameRate.den) * 1000,
+                              AV_ROUND_DOWN);
+    }
+    qint64 frameStart(qint64 index) const {
+        return av_rescale(index, int64_t(frameRate.den) * 1000, frameRate.num);
+    }
+    // Middle of a frame's display interval; unambiguous to decode
+    qint64 frameCenter(qint64 index) const {
+        return av_rescale_rnd(2 * index + 1, int64_t(frameRate.den) * 1000,
+                              2 * int64_t(frameRate.num), AV_ROUND_DOWN);
+    }
+    qint64 frameDuration() const { return frameStart(1); }
+};
+
+// In-process decoder for the first video stream of a media file.
+// Frames are decoded with libavcodec straight into memory; no temporary
+// files or external processes are involved. Not thread-safe: use one
+// decoder per thread.
+class FrameDecoder {
+public:
+    using FrameCallback = std::function<void(qint64 timestamp, const VideoFrame& frame)>;
+    using CancelCheck = std::function<bool()>;
+
+    // Representation handed to callbacks
+    enum class OutputFormat {
+        RGB,     // Converted to an RGB32 QImage on the decoding thread
+        Native   // Refcounted AVFrame in the codec's pixel format
+    };
+
+    FrameDecoder();
+    ~FrameDecoder();
+
+    FrameDecoder(const FrameDecoder&) = delete;
+    FrameDecoder& operator=(const FrameDecoder&) = delete;
+
+    bool open(const QString& filePath);
+    void close();
+    bool isOpen() const { return decoderContext != nullptr; }
+    QString getFilePath() const { return filePath; }
+    const VideoStreamInfo& getStreamInfo() const { return streamInfo; }
+
+    void setOutputFormat(OutputFormat format) { outputFormat = format; }
+    OutputFormat getOutputFormat() const { return outputFormat; }
+
+    // Deliver frames shrunk by a power of two (1 = full size, up to 8).
+    // Codecs with lowres support decode at the reduced size directly;
+    // others skip the loop filter and are downscaled after decoding.
+    void setDownscale(int factor);
+    int getDownscale() const { return downscale; }
+    static int downscaleFor(const VideoStreamInfo& info, const QSize& viewer);
+
+    // Keyframe index of the open file. Seeks then land on the right
+    // keyframe directly, and GOP bounds are exact from the first request.
+    // Ignored when it was built for another file or stream.
+    void setSeekIndex(std::shared_ptr<const SeekIndex> index);
+    bool hasSeekIndex() const { return seekIndex != nullptr; }
+
+    // Read stream timing without opening a decoder
+    static VideoStreamInfo probe(const QString& filePath);
+
+    // Decode the frame that is on screen at the given time (milliseconds)
+    QImage decodeFrame(qint64 timestamp);
+
+    // Decode the frames covering each of the given times. Targets are served
+    // in ascending order by decoding forward, emitting every requested frame
+    // on the way; a seek is only issued when a target lies behind the
+    // decoder or past the next keyframe. Decoding stops early once
+    // cancelled() returns true. Returns the number delivered.
+    int decodeFrames(QList<qint64> timestamps, const FrameCallback& callback,
+                     const CancelCheck& cancelled = CancelCheck());
+
+    // Time of the last decoded frame, or -1 when a seek is needed first
+    qint64 getPosition() const { return hasFrame ? currentTimestamp : -1; }
+
+    // Best known bounds of the GOP containing the given time: the keyframe
+    // at or before it and the next keyframe after it
+    void getGopBounds(qint64 timestamp, qint64& start, qint64& end) const;
+
+    QString getLastError() const { return lastError; }
+
+private:
+    QString filePath;
+    QString lastError;
+
+    AVFormatContext* formatContext;
+    const AVCodec* codec;
+    AVCodecContext* decoderContext;
+    AVFrame* frame;
+    AVPacket* packet;
+    int streamIndex;
+    bool endOfStream;
+    bool packetPending;  // Sent and refused with EAGAIN; sent again first
+    VideoStreamInfo streamInfo;
+    OutputFormat outputFormat;
+    int downscale;
+
+    // Decoder position, used to decide between decoding forward and seeking
+    bool hasFrame;
+    qint64 currentTimestamp;
+    qint64 costSinceKeyframe;  // Microseconds spent reaching the current frame
+    std::set<qint64> keyframeTimestamps;  // Keyframes seen while demuxing
+    std::shared_ptr<const SeekIndex> seekIndex;
+
+    // Helper functions
+    bool openCodec();
+    int lowresLevel() const;
+    bool needsSeek(qint64 timestamp) const;
+    qint64 estimatedGopDuration() const;
+    bool seek(qint64 timestamp);
+    bool decodeNextFrame();
+    void dropPendingPacket();
+    qint64 frameTimestamp(const AVFrame* decoded) const;
+    qint64 toMilliseconds(int64_t pts) const;
+    qint64 frameDuration() const;
+    VideoFrame wrapFrame(const AVFrame* decoded) const;
+    void reportError(const QString& error, int code = 0);
+    static VideoStreamInfo readStreamInfo(AVFormatContext* context, int index);
+
+    // Forward decode budget when no keyframe has been seen yet
+    static const qint64 DEFAULT_GOP_DURATION;
+    static const int MAX_DOWNSCALE;
+};
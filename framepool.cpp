@@ -0,0 +1,158 @@
+#include "framepool.h"
+
+extern "C" {
+#include <libavutil/imgutils.h>
+}
+
+const int FramePool::BUFFER_ALIGNMENT = 64;  // Wide enough for AVX-512 rows
+const int FramePool::MAX_GEOMETRIES = 8;
+
+FramePool::FramePool()
+    : width(0)
+    , height(0)
+    , format(AV_PIX_FMT_NONE)
+    , allocations(0)
+{
+}
+
+FramePool::~FramePool() {
+    for (AVFrame* frame : frames) {
+        av_frame_free(&frame);
+    }
+    for (AVPacket* packet : packets) {
+        av_packet_free(&packet);
+    }
+    // Buffers still out are freed when their last reference goes
+    for (auto& entry : bufferPools) {
+        av_buffer_pool_uninit(&entry.second);
+    }
+}
+
+bool FramePool::setGeometry(int newWidth, int newHeight, AVPixelFormat newFormat) {
+    QMutexLocker locker(&mutex);
+    width = newWidth;
+    height = newHeight;
+    format = newFormat;
+    return poolFor(width, height, format) != nullptr;
+}
+
+AVFrame* FramePool::acquireFrame() {
+    {
+        QMutexLocker locker(&mutex);
+        if (!frames.empty()) {
+            AVFrame* frame = frames.back();
+            frames.pop_back();
+            return frame;
+        }
+    }
+    allocations.fetchAndAddRelaxed(1);
+    return av_frame_alloc();
+}
+
+AVFrame* FramePool::acquireBuffer() {
+    int defaultWidth, defaultHeight;
+    AVPixelFormat defaultFormat;
+    {
+        QMutexLocker locker(&mutex);
+        defaultWidth = width;
+        defaultHeight = height;
+        defaultFormat = format;
+    }
+    return acquireBuffer(defaultWidth, defaultHeight, defaultFormat);
+}
+
+AVFrame* FramePool::acquireBuffer(int frameWidth, int frameHeight, AVPixelFormat frameFormat) {
+    AVBufferRef* buffer;
+    {
+        QMutexLocker locker(&mutex);
+        AVBufferPool* pool = poolFor(frameWidth, frameHeight, frameFormat);
+        buffer = pool ? av_buffer_pool_get(pool) : nullptr;
+    }
+    if (!buffer) {
+        return nullptr;
+    }
+
+    AVFrame* frame = acquireFrame();
+    if (!frame) {
+        av_buffer_unref(&buffer);
+        return nullptr;
+    }
+
+    // One pooled block holds every plane
+    frame->width = frameWidth;
+    frame->height = frameHeight;
+    frame->format = frameFormat;
+    int ret = av_image_fill_arrays(frame->data, frame->linesize, buffer->data,
+                                   frameFormat, frameWidth, frameHeight, BUFFER_ALIGNMENT);
+    if (ret < 0) {
+        av_buffer_unref(&buffer);
+        release(frame);
+        return nullptr;
+    }
+    frame->buf[0] = buffer;
+    return frame;
+}
+
+AVPacket* FramePool::acquirePacket() {
+    {
+        QMutexLocker locker(&mutex);
+        if (!packets.empty()) {
+            AVPacket* packet = packets.back();
+            packets.pop_back();
+            return packet;
+        }
+    }
+    allocations.fetchAndAddRelaxed(1);
+    return av_packet_alloc();
+}
+
+void FramePool::release(AVFrame* frame) {
+    if (!frame) {
+        return;
+    }
+    av_frame_unref(frame);
+    QMutexLocker locker(&mutex);
+    frames.push_back(frame);
+}
+
+void FramePool::release(AVPacket* packet) {
+    if (!packet) {
+        return;
+    }
+    av_packet_unref(packet);
+    QMutexLocker locker(&mutex);
+    packets.push_back(packet);
+}
+
+AVBufferPool* FramePool::poolFor(int frameWidth, int frameHeight, AVPixelFormat frameFormat) {
+    // Called with the lock held
+    auto key = std::make_tuple(frameWidth, frameHeight, int(frameFormat));
+    auto it = bufferPools.find(key);
+    if (it != bufferPools.end()) {
+        return it->second;
+    }
+
+    int size = av_image_get_buffer_size(frameFormat, frameWidth, frameHeight, BUFFER_ALIGNMENT);
+    if (size <= 0) {
+        return nullptr;
+    }
+
+    // A job uses a handful of geometries; beyond that, start over
+    if (int(bufferPools.size()) >= MAX_GEOMETRIES) {
+        for (auto& entry : bufferPools) {
+            av_buffer_pool_uninit(&entry.second);
+        }
+        bufferPools.clear();
+    }
+
+    AVBufferPool* pool = av_buffer_pool_init2(size, this, allocateBuffer, nullptr);
+    if (pool) {
+        bufferPools.emplace(key, pool);
+    }
+    return pool;
+}
+
+AVBufferRef* FramePool::allocateBuffer(void* opaque, size_t size) {
+    static_cast<FramePool*>(opaque)->allocations.fetchAndAddRelaxed(1);
+    return av_buffer_alloc(size);
+}
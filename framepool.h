@@ -0,0 +1,60 @@
+#pragma once
+
+#include <QMutex>
+#include <QAtomicInteger>
+#include <vector>
+#include <map>
+#include <tuple>
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/buffer.h>
+#include <libavcodec/packet.h>
+}
+
+// Recycles AVFrame and AVPacket structs, and pixel buffers per frame
+// geometry, so a processing loop stops allocating once every
+// stage holds its share of frames. Released objects are unreferenced and
+// kept for the next acquire; buffers still referenced elsewhere (by an
+// encoder, say) return to the pool when the last reference goes.
+// Thread-safe.
+class FramePool {
+public:
+    FramePool();
+    ~FramePool();
+
+    FramePool(const FramePool&) = delete;
+    FramePool& operator=(const FramePool&) = delete;
+
+    // Default geometry of acquireBuffer(); its pool is created up front
+    bool setGeometry(int width, int height, AVPixelFormat format);
+
+    AVFrame* acquireFrame();    // Without buffers, for a decoder to fill
+    AVFrame* acquireBuffer();   // With pooled buffers of the default geometry
+    AVFrame* acquireBuffer(int width, int height, AVPixelFormat format);
+    AVPacket* acquirePacket();
+
+    void release(AVFrame* frame);
+    void release(AVPacket* packet);
+
+    // Frame and packet structs and pixel buffers created so far; flat once
+    // the pool has warmed up
+    qint64 getAllocationCount() const { return allocations.loadRelaxed(); }
+
+private:
+    std::vector<AVFrame*> frames;
+    std::vector<AVPacket*> packets;
+    std::map<std::tuple<int, int, int>, AVBufferPool*> bufferPools;  // By geometry
+    int width;
+    int height;
+    AVPixelFormat format;
+    QAtomicInteger<qint64> allocations;
+    QMutex mutex;
+
+    AVBufferPool* poolFor(int width, int height, AVPixelFormat format);
+    static AVBufferRef* allocateBuffer(void* opaque, size_t size);
+
+    // Constants
+    static const int BUFFER_ALIGNMENT;
+    static const int MAX_GEOMETRIES;
+};
@@ -0,0 +1,145 @@
+#include "framestore.h"
+#include <limits>
+
+const int FrameStore::CANDIDATE_WINDOW = 32;     // Oldest entries considered per eviction
+const double FrameStore::DISTANCE_SCALE = 30.0;  // Frames from the playhead that halve the value
+
+FrameStore::FrameStore(qint64 maxCost)
+    : policy(Policy::DecodeCost)
+    , maxTotalCost(maxCost)
+    , currentCost(0)
+    , playheadFrame(0)
+{
+}
+
+void FrameStore::setMaxCost(qint64 bytes) {
+    maxTotalCost = bytes;
+    trim(maxTotalCost);
+}
+
+VideoFrame* FrameStore::object(const CacheKey& key) {
+    auto it = entries.find(key);
+    if (it == entries.end()) {
+        return nullptr;
+    }
+    recency.splice(recency.begin(), recency, it->position);
+    return &it->frame;
+}
+
+bool FrameStore::insert(const CacheKey& key, const VideoFrame& frame, qint64 cost) {
+    remove(key);
+    if (cost > maxTotalCost) {
+        return false;
+    }
+
+    trim(maxTotalCost - cost);
+    recency.push_front(key);
+    entries.insert(key, {frame, cost, recency.begin()});
+    frameIndices[{key.filePath, key.downscale}].insert(key.frameIndex);
+    currentCost += cost;
+    return true;
+}
+
+bool FrameStore::remove(const CacheKey& key) {
+    auto it = entries.find(key);
+    if (it == entries.end()) {
+        return false;
+    }
+    auto indices = frameIndices.find({key.filePath, key.downscale});
+    indices->second.erase(key.frameIndex);
+    if (indices->second.empty()) {
+        frameIndices.erase(indices);
+    }
+    
+    currentCost -= it->cost;
+    recency.erase(it->position);
+    entries.erase(it);
+    return true;
+}
+
+void FrameStore::clear() {
+    entries.clear();
+    recency.clear();
+    frameIndices.clear();
+    currentCost = 0;
+}
+
+bool FrameStore::findNearest(const CacheKey& key, CacheKey& found) const {
+    // The right picture at the wrong size beats a neighbour
+    for (int downscale = 1; downscale <= 8; downscale *= 2) {
+        CacheKey candidate{key.filePath, key.frameIndex, downscale};
+        if (entries.contains(candidate)) {
+            found = candidate;
+            return true;
+        }
+    }
+
+    auto indices = frameIndices.find({key.filePath, key.downscale});
+    if (indices == frameIndices.end()) {
+        return false;
+    }
+
+    const std::set<qint64>& cached = indices->second;
+    auto after = cached.lower_bound(key.frameIndex);
+    qint64 best = -1;
+    if (after != cached.begin()) {
+        best = *std::prev(after);
+    }
+    if (after != cached.end() &&
+        (best < 0 || *after - key.frameIndex < key.frameIndex - best)) {
+        best = *after;
+    }
+    if (best < 0) {
+        return false;
+    }
+    found = CacheKey{key.filePath, best, key.downscale};
+    return true;
+}
+
+void FrameStore::setPlayhead(const QString& filePath, qint64 frameIndex) {
+    playheadFile = filePath;
+    playheadFrame = frameIndex;
+}
+
+void FrameStore::trim(qint64 limit) {
+    while (currentCost > limit && !recency.empty()) {
+        auto victim = pickVictim();
+        if (victim == recency.end()) {
+            break;
+        }
+        CacheKey key = *victim;
+        remove(key);
+    }
+}
+
+std::list<CacheKey>::iterator FrameStore::pickVictim() {
+    // Candidates are the least recently used entries; LRU takes the oldest
+    auto victim = recency.end();
+    double lowest = std::numeric_limits<double>::max();
+    int examined = 0;
+    for (auto it = std::prev(recency.end()); examined < CANDIDATE_WINDOW; --it, examined++) {
+        if (policy == Policy::LRU) {
+            return it;
+        }
+        double value = retentionValue(*it, *entries.constFind(*it));
+        if (value < lowest) {
+            lowest = value;
+            victim = it;
+        }
+        if (it == recency.begin()) {
+            break;
+        }
+    }
+    return victim;
+}
+
+double FrameStore::retentionValue(const CacheKey& key, const Entry& entry) const {
+    // Time to rebuild per byte held, discounted with distance from the
+    // playhead; frames of other files count as far away
+    double rebuild = double(qMax<qint64>(entry.frame.getDecodeCost(), 1)) /
+                     double(qMax<qint64>(entry.cost, 1));
+    double distance = key.filePath == playheadFile
+        ? double(qAbs(key.frameIndex - playheadFrame))
+        : 100.0 * DISTANCE_SCALE;
+    return rebuild / (1.0 + distance / DISTANCE_SCALE);
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <QString>
+#include <QHash>
+#include <QList>
+#include <list>
+#include <map>
+#include <set>
+#include "videoframe.h"
+
+// Frames are keyed by index in the source's own frame cadence, so every
+// timestamp that lands on the same frame hits the same entry. Frames
+// decoded at a reduced size are kept apart from full-size ones.
+struct CacheKey {
+    QString filePath;
+    qint64 frameIndex;
+    int downscale = 1;
+
+    bool operator==(const CacheKey& other) const {
+        return filePath == other.filePath && frameIndex == other.frameIndex &&
+               downscale == other.downscale;
+    }
+};
+
+// Hash function for CacheKey
+inline uint qHash(const CacheKey& key) {
+    return qHash(key.filePath) ^ qHash(key.frameIndex) ^ (uint(key.downscale) << 24);
+}
+
+// Byte-bounded frame store used by FrameCache in place of QCache. Under
+// the DecodeCost policy, eviction weighs what a frame cost to decode (a
+// frame deep into a GOP is expensive to rebuild, a keyframe is cheap)
+// against its distance from the playhead. Not thread-safe.
+class FrameStore {
+public:
+    enum class Policy {
+        LRU,         // Least recently used first, like QCache
+        DecodeCost   // Cheapest to rebuild among the least recently used
+    };
+
+    explicit FrameStore(qint64 maxCost = 0);
+
+    void setPolicy(Policy value) { policy = value; }
+    Policy getPolicy() const { return policy; }
+
+    // Shrinking evicts straight away
+    void setMaxCost(qint64 bytes);
+    qint64 maxCost() const { return maxTotalCost; }
+    qint64 totalCost() const { return currentCost; }
+    int count() const { return entries.size(); }
+
+    bool contains(const CacheKey& key) const { return entries.contains(key); }
+
+    // Marks the entry as used; the pointer is valid until the next change
+    VideoFrame* object(const CacheKey& key);
+
+    // Returns false, storing nothing, when the frame alone exceeds the limit
+    bool insert(const CacheKey& key, const VideoFrame& frame, qint64 cost);
+    bool remove(const CacheKey& key);
+    void clear();
+    QList<CacheKey> keys() const { return entries.keys(); }
+
+    // Closest cached stand-in for a frame: the same frame at another size,
+    // else the nearest frame of the same file and size (earlier on a tie)
+    bool findNearest(const CacheKey& key, CacheKey& found) const;
+
+    // Frames near the playhead are kept longer
+    void setPlayhead(const QString& filePath, qint64 frameIndex);
+
+private:
+    struct Entry {
+        VideoFrame frame;
+        qint64 cost;
+        std::list<CacheKey>::iterator position;
+    };
+
+    QHash<CacheKey, Entry> entries;
+    std::list<CacheKey> recency;  // Most recently used first
+    std::map<std::pair<QString, int>, std::set<qint64>> frameIndices;  // By file and size
+    Policy policy;
+    qint64 maxTotalCost;
+    qint64 currentCost;
+    QString playheadFile;
+    qint64 playheadFrame;
+
+    void trim(qint64 limit);
+    std::list<CacheKey>::iterator pickVictim();
+    double retentionValue(const CacheKey& key, const Entry& entry) const;
+
+    // Constants
+    static const int CANDIDATE_WINDOW;
+    static const double DISTANCE_SCALE;
+};
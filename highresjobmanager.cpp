@@ -0,0 +1,271 @@
+#include "highresjobmanager.h"
+#include "parallelrows.h"
+#include <QThread>
+#include <QDeadlineTimer>
+#include <QRunnable>
+
+const int HighResJobManager::THREADS_PER_JOB = 8; // Past this, one more job gains more than more threads
+
+HighResJobManager::HighResJobManager(QObject* parent)
+    : QObject(parent)
+    , nextId(1)
+    , running(0)
+    , memoryInUse(0)
+    , cpuBudget(0)
+    , memoryBudget(0)
+    , maxConcurrentJobs(0)
+{
+}
+
+HighResJobManager::~HighResJobManager() {
+    cancelAll();
+    jobThreads.waitForDone();
+}
+
+void HighResJobManager::setCpuBudget(int threads) {
+    QMutexLocker locker(&mutex);
+    cpuBudget = qMax(0, threads);
+
+    // Bands already queued finish on the workers they have
+    if (cpuBudget > 0) {
+        ParallelRows::setThreadCount(cpuBudget);
+    }
+    startJobs();
+}
+
+int HighResJobManager::getCpuBudget() const {
+    QMutexLocker locker(&mutex);
+    return resolvedCpuBudget();
+}
+
+void HighResJobManager::setMemoryBudget(qint64 bytes) {
+    QMutexLocker locker(&mutex);
+    memoryBudget = qMax<qint64>(0, bytes);
+    startJobs();
+}
+
+qint64 HighResJobManager::getMemoryBudget() const {
+    QMutexLocker locker(&mutex);
+    return memoryBudget;
+}
+
+void HighResJobManager::setMaxConcurrentJobs(int count) {
+    QMutexLocker locker(&mutex);
+    maxConcurrentJobs = qMax(0, count);
+    startJobs();
+}
+
+int HighResJobManager::getMaxConcurrentJobs() const {
+    QMutexLocker locker(&mutex);
+    return resolvedMaxJobs();
+}
+
+int HighResJobManager::addJob(const QString& inputPath, const QString& outputPath,
+                              const HighResProcessor::ProcessingOptions& options) {
+    // Probing opens the file, so it is done before taking the lock
+    HighResProcessor::VideoInfo video = HighResProcessor::getVideoInfo(inputPath);
+
+    QMutexLocker locker(&mutex);
+    Job job;
+    job.id = nextId++;
+    job.inputPath = inputPath;
+    job.outputPath = outputPath;
+    job.options = options;
+    job.video = video;
+    jobs.insert(job.id, job);
+    queue.append(job.id);
+    startJobs();
+    return job.id;
+}
+
+bool HighResJobManager::cancelJob(int id) {
+    QMutexLocker locker(&mutex);
+    auto it = jobs.find(id);
+    if (it == jobs.end()) {
+        return false;
+    }
+
+    Job& job = it.value();
+    if (job.state == JobState::Queued) {
+        queue.removeOne(id);
+        job.state = JobState::Cancelled;
+        job.error = "Processing cancelled";
+        if (running == 0 && queue.isEmpty()) {
+            idle.wakeAll();
+        }
+        return true;
+    }
+    if (job.state != JobState::Running) {
+        return false;
+    }
+
+    // The processor may not have started its pipeline yet; the flag is
+    // checked again as frames complete
+    job.cancelRequested = true;
+    if (job.processor) {
+        job.processor->cancelProcessing();
+    }
+    return true;
+}
+
+void HighResJobManager::cancelAll() {
+    QList<int> ids;
+    {
+        QMutexLocker locker(&mutex);
+        ids = jobs.keys();
+    }
+    for (int id : ids) {
+        cancelJob(id);
+    }
+}
+
+HighResJobManager::JobState HighResJobManager::getJobState(int id) const {
+    QMutexLocker locker(&mutex);
+    auto it = jobs.constFind(id);
+    return it != jobs.constEnd() ? it->state : JobState::Failed;
+}
+
+QString HighResJobManager::getJobError(int id) const {
+    QMutexLocker locker(&mutex);
+    return jobs.value(id).error;
+}
+
+int HighResJobManager::getQueuedCount() const {
+    QMutexLocker locker(&mutex);
+    return queue.size();
+}
+
+int HighResJobManager::getRunningCount() const {
+    QMutexLocker locker(&mutex);
+    return running;
+}
+
+bool HighResJobManager::waitForAll(int timeoutMs) {
+    QDeadlineTimer deadline = timeoutMs < 0 ? QDeadlineTimer(QDeadlineTimer::Forever)
+                                            : QDeadlineTimer(timeoutMs);
+    QMutexLocker locker(&mutex);
+    while (running > 0 || !queue.isEmpty()) {
+        if (!idle.wait(&mutex, deadline)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int HighResJobManager::resolvedCpuBudget() const {
+    return cpuBudget > 0 ? cpuBudget : qMax(1, QThread::idealThreadCount());
+}
+
+int HighResJobManager::resolvedMaxJobs() const {
+    return maxConcurrentJobs > 0 ? maxConcurrentJobs : qMax(1, resolvedCpuBudget() / THREADS_PER_JOB);
+}
+
+HighResProcessor::ProcessingOptions HighResJobManager::startOptions(const Job& job) const {
+    HighResProcessor::ProcessingOptions options = job.options;
+    if (options.threadCount <= 0) {
+        options.threadCount = qMax(1, resolvedCpuBudget() / resolvedMaxJobs());
+    }
+    return options;
+}
+
+void HighResJobManager::startJobs() {
+    int slots = resolvedMaxJobs();
+    if (jobThreads.maxThreadCount() < slots) {
+        jobThreads.setMaxThreadCount(slots);
+    }
+
+    // In order: a large job waits for memory rather than be overtaken
+    while (!queue.isEmpty() && running < slots) {
+        // The share, and so the estimate, follow the budget as it is now
+        Job& job = jobs[queue.first()];
+        job.memory = HighResProcessor::estimateMemoryUsage(job.video, startOptions(job));
+        if (running > 0 && memoryBudget > 0 && memoryInUse + job.memory > memoryBudget) {
+            break;
+        }
+        queue.removeFirst();
+        job.options = startOptions(job);
+        job.state = JobState::Running;
+        running++;
+        memoryInUse += job.memory;
+
+        int id = job.id;
+        jobThreads.start(QRunnable::create([this, id] { runJob(id); }));
+    }
+}
+
+void HighResJobManager::runJob(int id) {
+    Job job;
+    {
+        QMutexLocker locker(&mutex);
+        job = jobs.value(id);
+    }
+
+    // Signals of the processor come from this thread and the pipeline's,
+    // so they are handled directly
+    HighResProcessor processor;
+    // The first error is the cause; stages that stop after it report more
+    QString error;
+    QMutex errorMutex;
+    connect(&processor, &HighResProcessor::errorOccurred, [&error, &errorMutex](const QString& message) {
+        QMutexLocker locker(&errorMutex);
+        if (error.isEmpty()) {
+            error = message;
+        }
+    });
+    connect(&processor, &HighResProcessor::processingProgress, [this, id, &processor](float progress) {
+        bool cancelled;
+        {
+            QMutexLocker locker(&mutex);
+            cancelled = jobs.value(id).cancelRequested;
+        }
+        if (cancelled) {
+            processor.cancelProcessing();
+        }
+        emit jobProgress(id, progress);
+    });
+
+    bool success;
+    {
+        QMutexLocker setup(&setupMutex);
+        success = processor.initialize();
+    }
+    processor.setProcessingOptions(job.options);
+
+    bool cancelled;
+    {
+        QMutexLocker locker(&mutex);
+        jobs[id].processor = &processor;
+        cancelled = jobs[id].cancelRequested;
+    }
+    emit jobStarted(id);
+    success = success && !cancelled && processor.processVideo(job.inputPath, job.outputPath);
+
+    bool idleNow;
+    {
+        QMutexLocker locker(&mutex);
+        Job& done = jobs[id];
+        done.processor = nullptr;
+        if (success) {
+            done.state = JobState::Finished;
+        } else if (done.cancelRequested) {
+            done.state = JobState::Cancelled;
+            done.error = "Processing cancelled";
+        } else {
+            done.state = JobState::Failed;
+            QMutexLocker errorLocker(&errorMutex);
+            done.error = error.isEmpty() ? QString("Processing failed") : error;
+        }
+        running--;
+        memoryInUse -= done.memory;
+        startJobs();
+        idleNow = running == 0 && queue.isEmpty();
+        if (idleNow) {
+            idle.wakeAll();
+        }
+    }
+
+    emit jobFinished(id, success);
+    if (idleNow) {
+        emit allJobsFinished();
+    }
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <QObject>
+#include <QString>
+#include <QMap>
+#include <QList>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QThreadPool>
+#include "highresprocessor.h"
+
+// Runs several HighResProcessor jobs at once, each with a processor of its
+// own, under a shared CPU and memory budget. One job rarely keeps a large
+// machine busy: codecs stop scaling at a dozen or so threads, and decode,
+// filtering and encode wait on one another. Jobs start in the order they
+// were added, as many as there are slots and as the memory budget allows;
+// a job too large for the budget still runs, alone. Each job's codecs get
+// an equal share of the CPU budget as it stands when the job starts, and
+// the CPU filters of all jobs share one pool of row workers, which a set
+// budget also bounds. Thread-safe; signals come from job threads.
+class HighResJobManager : public QObject {
+    Q_OBJECT
+
+public:
+    enum class JobState {
+        Queued,
+        Running,
+        Finished,
+        Failed,
+        Cancelled
+    };
+
+    explicit HighResJobManager(QObject* parent = nullptr);
+    ~HighResJobManager() override;  // Cancels what is left and waits for it
+
+    // Threads the jobs' codecs share; 0 = one per core. A set budget is
+    // also the number of ParallelRows workers, which are process-wide.
+    void setCpuBudget(int threads);
+    int getCpuBudget() const;
+
+    // Bytes of frames the running jobs may hold together, by
+    // HighResProcessor::estimateMemoryUsage; 0 = no limit
+    void setMemoryBudget(qint64 bytes);
+    qint64 getMemoryBudget() const;
+
+    // Jobs run at once; 0 = one per THREADS_PER_JOB threads of the budget
+    void setMaxConcurrentJobs(int count);
+    int getMaxConcurrentJobs() const;  // As resolved
+
+    // Options as for HighResProcessor; a threadCount of 0 takes the job's
+    // share of the CPU budget when it starts. Returns the job's id.
+    int addJob(const QString& inputPath, const QString& outputPath,
+               const HighResProcessor::ProcessingOptions& options);
+    bool cancelJob(int id);  // False once it has ended
+    void cancelAll();
+
+    JobState getJobState(int id) const;  // Failed for ids never added
+    QString getJobError(int id) const;
+    int getQueuedCount() const;
+    int getRunningCount() const;
+
+    // Blocks until no job is queued or running; false on timeout
+    bool waitForAll(int timeoutMs = -1);
+
+signals:
+    void jobStarted(int id);
+    void jobProgress(int id, float progress);
+    void jobFinished(int id, bool success);
+    void allJobsFinished();
+
+private:
+    struct Job {
+        int id = 0;
+        QString inputPath;
+        QString outputPath;
+        HighResProcessor::ProcessingOptions options;  // Thread count resolved when started
+        HighResProcessor::VideoInfo video;  // Probed when added
+        qint64 memory = 0;  // Estimated when next in line
+        JobState state = JobState::Queued;
+        QString error;
+        bool cancelRequested = false;
+        HighResProcessor* processor = nullptr;  // While running
+    };
+
+    QMap<int, Job> jobs;
+    QList<int> queue;  // Ids waiting, oldest first
+    int nextId;
+    int running;
+    qint64 memoryInUse;
+    int cpuBudget;
+    qint64 memoryBudget;
+    int maxConcurrentJobs;
+    QThreadPool jobThreads;
+    mutable QMutex mutex;
+    QWaitCondition idle;
+    QMutex setupMutex;  // Processor initialization touches shared GPU state
+
+    int resolvedCpuBudget() const;
+    int resolvedMaxJobs() const;
+    HighResProcessor::ProcessingOptions startOptions(const Job& job) const;
+    void startJobs();  // Called with the mutex held
+    void runJob(int id);
+
+    // Constants
+    static const int THREADS_PER_JOB;
+};
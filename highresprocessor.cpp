@@ -1,15 +1,77 @@
 #include "highresprocessor.h"
+#include "videoframe.h"
+#include "parallelrows.h"
 #include <QDebug>
 #include <QThread>
 #include <QImage>
 #include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QStandardPaths>
+#include <QCryptographicHash>
+#include <cstring>
+
+extern "C" {
+#include <libavutil/pixdesc.h>
+#include <libavutil/imgutils.h>
+}
 
 const int HighResProcessor::MAX_FRAME_SIZE = 8192; // Support up to 8K
 const int HighResProcessor::DEFAULT_BUFFER_SIZE = 32 * 1024 * 1024; // 32MB
+const int HighResProcessor::PIPELINE_QUEUE_DEPTH = 4; // Frames between stages
+const int HighResProcessor::ALLOCATION_WARMUP_FRAMES = 32; // Enough to fill the pipeline
+const int HighResProcessor::FRAMES_IN_FLIGHT = 40; // References, queues, stage buffers, encoder lookahead
+
+// Helper functions
+// The planar format with a semi-planar one's layout and depth; NONE if
+// the format is not semi-planar
+static AVPixelFormat planarEquivalent(AVPixelFormat format) {
+    switch (format) {
+    case AV_PIX_FMT_NV12:
+        return AV_PIX_FMT_YUV420P;
+    case AV_PIX_FMT_NV16:
+        return AV_PIX_FMT_YUV422P;
+    case AV_PIX_FMT_NV24:
+        return AV_PIX_FMT_YUV444P;
+    case AV_PIX_FMT_P010:
+        return AV_PIX_FMT_YUV420P10;
+    case AV_PIX_FMT_P016:
+        return AV_PIX_FMT_YUV420P16;
+    default:
+        return AV_PIX_FMT_NONE;
+    }
+}
 
-HighResProcessor& HighResProcessor::instance() {
-    static HighResProcessor instance;
-    return instance;
+// Luma copied, interleaved chroma split in two; samples kept in the high
+// bits of their words (P010) are moved down to the low ones
+template <typename Sample>
+static void unpackPlanes(const AVFrame* source, AVFrame* target, int shift,
+                         int chromaWidth, int chromaHeight) {
+    ParallelRows::run(source->height, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            auto in = reinterpret_cast<const Sample*>(source->data[0] + qint64(y) * source->linesize[0]);
+            auto out = reinterpret_cast<Sample*>(target->data[0] + qint64(y) * target->linesize[0]);
+            if (shift == 0) {
+                std::memcpy(out, in, size_t(source->width) * sizeof(Sample));
+                continue;
+            }
+            for (int x = 0; x < source->width; x++) {
+                out[x] = Sample(in[x] >> shift);
+            }
+        }
+    });
+    ParallelRows::run(chromaHeight, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            auto in = reinterpret_cast<const Sample*>(source->data[1] + qint64(y) * source->linesize[1]);
+            auto cb = reinterpret_cast<Sample*>(target->data[1] + qint64(y) * target->linesize[1]);
+            auto cr = reinterpret_cast<Sample*>(target->data[2] + qint64(y) * target->linesize[2]);
+            for (int x = 0; x < chromaWidth; x++) {
+                cb[x] = Sample(in[2 * x] >> shift);
+                cr[x] = Sample(in[2 * x + 1] >> shift);
+            }
+        }
+    });
 }
 
 HighResProcessor::HighResProcessor(QObject* parent)
@@ -18,19 +80,29 @@ HighResProcessor::HighResProcessor(QObject* parent)
     , formatContext(nullptr)
     , decoderContext(nullptr)
     , encoderContext(nullptr)
-    , scalerContext(nullptr)
+    , outputContext(nullptr)
+    , outputStream(nullptr)
+    , encoderScaler(nullptr)
     , filterGraph(nullptr)
     , bufferSrcContext(nullptr)
     , bufferSinkContext(nullptr)
     , inputFrame(nullptr)
     , processedFrame(nullptr)
     , outputFrame(nullptr)
+    , analysisDirectory(QDir(QStandardPaths::writableLocation(QStandardPaths::CacheLocation))
+                            .filePath("stabilization"))
+    , videoStreamIndex(-1)
+    , seekIndexes(nullptr)
+    , nextOutputPts(0)
+    , decoderDrained(false)
+    , pendingPacket(nullptr)
+    , decodeFailed(false)
     , totalFrames(0)
     , processedFrames(0)
     , processingCancelled(false)
 {
     // Initialize metrics
-    metrics = {0.0, 0.0, 0, 0.0};
+    metrics = {0.0, 0.0, 0, 0.0, 0, 0};
 }
 
 HighResProcessor::~HighResProcessor() {
@@ -58,6 +130,71 @@ bool HighResProcessor::initialize() {
     return true;
 }
 
+bool HighResProcessor::isInitialized() const {
+    return initialized;
+}
+
+bool HighResProcessor::setProcessingOptions(const ProcessingOptions& value) {
+    options = value;
+    return true;
+}
+
+HighResProcessor::VideoInfo HighResProcessor::getVideoInfo(const QString& filePath) {
+    VideoInfo info = VideoInfo();
+    AVFormatContext* context = nullptr;
+    if (avformat_open_input(&context, filePath.toUtf8().constData(), nullptr, nullptr) < 0) {
+        return info;
+    }
+    if (avformat_find_stream_info(context, nullptr) < 0) {
+        avformat_close_input(&context);
+        return info;
+    }
+
+    // The first video stream, as openVideo takes
+    for (unsigned int i = 0; i < context->nb_streams; i++) {
+        AVStream* stream = context->streams[i];
+        AVCodecParameters* codecParams = stream->codecpar;
+        if (codecParams->codec_type != AVMEDIA_TYPE_VIDEO) {
+            continue;
+        }
+        info.width = codecParams->width;
+        info.height = codecParams->height;
+        info.fps = av_q2d(stream->r_frame_rate);
+        info.bitrate = codecParams->bit_rate;
+        info.codec = avcodec_get_name(codecParams->codec_id);
+        info.isHDR = ToneMapper::isHDR(codecParams->color_trc);
+        info.colorSpace = av_color_space_name(codecParams->color_space);
+        info.pixelFormat = av_get_pix_fmt_name(AVPixelFormat(codecParams->format));
+        break;
+    }
+    avformat_close_input(&context);
+    return info;
+}
+
+qint64 HighResProcessor::estimateMemoryUsage(const VideoInfo& video, const ProcessingOptions& options) {
+    // Unknown formats are taken as 10-bit, the largest common case
+    AVPixelFormat format = av_get_pix_fmt(video.pixelFormat.toUtf8().constData());
+    if (format == AV_PIX_FMT_NONE) {
+        format = AV_PIX_FMT_YUV420P10;
+    }
+    qint64 frameBytes = av_image_get_buffer_size(format, video.width, video.height, 1);
+    if (options.outputSize.isValid()) {
+        frameBytes = qMax<qint64>(frameBytes, av_image_get_buffer_size(
+            format, options.outputSize.width(), options.outputSize.height(), 1));
+    }
+    if (frameBytes <= 0) {
+        return 0;
+    }
+
+    // Each frame thread of the decoder and the encoder holds a frame more
+    int threads = options.threadCount > 0 ? options.threadCount : QThread::idealThreadCount();
+    int frames = FRAMES_IN_FLIGHT + 2 * threads;
+    if (options.enableTemporalDenoising) {
+        frames += options.temporalFrames + 1;
+    }
+    return frameBytes * frames;
+}
+
 bool HighResProcessor::initializeCodecs() {
     // Allocate frame buffers
     inputFrame = av_frame_alloc();
@@ -82,6 +219,81 @@ bool HighResProcessor::initializeFilters() {
     return true;
 }
 
+bool HighResProcessor::processVideo(const QString& inputPath, const QString& outputPath) {
+    if (!openVideo(inputPath)) {
+        closeVideo();
+        return false;
+    }
+    if (!openOutput(outputPath)) {
+        discardOutput(outputPath);
+        return false;
+    }
+
+    // The cancel flag is left alone here: a cancel that came while the
+    // files were opening still stops the job
+    processedFrames = 0;
+    nextOutputPts = 0;
+    decoderDrained = false;
+    decodeFailed = false;
+
+    // Stabilization needs the whole camera path before the first frame
+    if (options.enableStabilization && !prepareStabilization(inputPath)) {
+        processingCancelled = false;
+        discardOutput(outputPath);
+        return false;
+    }
+
+    // Once every stage and queue holds its frames, nothing more should be
+    // allocated; count what is
+    qint64 allocationsAtStart = framePool.getAllocationCount();
+    qint64 allocationsAfterWarmup = -1;
+    int encoded = 0;
+
+    // Frames are handed from stage to stage; each runs on its own thread
+    auto job = std::make_unique<ProcessingPipeline>(PIPELINE_QUEUE_DEPTH);
+    job->setSource("decode", [this] { return decodeNextFrame(); });
+    job->addStage("process", [this](AVFrame* frame) { return processFrame(frame); });
+    job->addStage("convert", [this](AVFrame* frame) { return convertForEncoder(frame); });
+    job->setSink("encode", [&, this](AVFrame* frame) {
+        if (++encoded == ALLOCATION_WARMUP_FRAMES) {
+            allocationsAfterWarmup = framePool.getAllocationCount();
+        }
+        return writeFrame(frame);
+    });
+    job->setRelease([this](AVFrame* frame) { framePool.release(frame); });
+
+    ProcessingPipeline* running = job.get();
+    {
+        QMutexLocker locker(&pipelineMutex);
+        pipeline = std::move(job);
+    }
+    bool success = running->run() && !decodeFailed;
+
+    qint64 allocationCount = framePool.getAllocationCount();
+    metrics.allocations = allocationCount - allocationsAtStart;
+    metrics.steadyStateAllocations = allocationsAfterWarmup >= 0
+        ? allocationCount - allocationsAfterWarmup : 0;
+
+    QString summary;
+    {
+        QMutexLocker locker(&pipelineMutex);
+        lastPipelineStats = running->getStats();
+        summary = lastPipelineStats.toString();
+        pipeline.reset();
+    }
+    emit processingStats(summary);
+
+    if (!success) {
+        // The cancel has stopped this job; the next starts afresh
+        if (processingCancelled.exchange(false)) {
+            logError("Processing cancelled");
+        }
+        discardOutput(outputPath);
+        return false;
+    }
+    return finishProcessing();
+}
+
 bool HighResProcessor::openVideo(const QString& filePath) {
     if (!initialized) {
         logError("Processor not initialized");
@@ -117,6 +329,16 @@ bool HighResProcessor::openVideo(const QString& filePath) {
         return false;
     }
 
+    // Exact seeks when the file has been indexed
+    videoStreamIndex = videoStream;
+    seekIndex = seekIndexes ? seekIndexes->indexFor(filePath) : nullptr;
+    if (seekIndex && seekIndex->getStreamIndex() != videoStream) {
+        seekIndex.reset();
+    }
+    if (seekIndexes && !seekIndex) {
+        seekIndexes->buildIndex(filePath);  // For the next time it is opened
+    }
+
     // Get codec parameters
     AVCodecParameters* codecParams = formatContext->streams[videoStream]->codecpar;
     const AVCodec* codec = avcodec_find_decoder(codecParams->codec_id);
@@ -140,6 +362,7 @@ bool HighResProcessor::openVideo(const QString& filePath) {
     }
 
     // Initialize decoder
+    configureThreading(decoderContext, codec);
     ret = avcodec_open2(decoderContext, codec, nullptr);
     if (ret < 0) {
         logError("Could not open codec: " + getErrorString(ret));
@@ -152,7 +375,7 @@ bool HighResProcessor::openVideo(const QString& filePath) {
     currentVideo.fps = av_q2d(formatContext->streams[videoStream]->r_frame_rate);
     currentVideo.bitrate = codecParams->bit_rate;
     currentVideo.codec = codec->name;
-    currentVideo.isHDR = codecParams->color_trc == AVCOL_TRC_SMPTE2084;
+    currentVideo.isHDR = ToneMapper::isHDR(codecParams->color_trc);
     currentVideo.pixelFormat = av_get_pix_fmt_name((AVPixelFormat)codecParams->format);
 
     // Calculate total frames
@@ -163,36 +386,184 @@ bool HighResProcessor::openVideo(const QString& filePath) {
                                av_q2d(formatContext->streams[videoStream]->duration));
     }
 
-    return setupScaler();
+    return true;
+}
+
+bool HighResProcessor::seekTo(qint64 timestamp) {
+    if (!formatContext || !decoderContext || videoStreamIndex < 0) {
+        logError("No video open");
+        return false;
+    }
+
+    int ret;
+    if (seekIndex) {
+        ret = seekIndex->seek(formatContext, timestamp);
+    } else {
+        AVStream* stream = formatContext->streams[videoStreamIndex];
+        int64_t start = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+        int64_t target = start + av_rescale_q(timestamp, AVRational{1, 1000}, stream->time_base);
+        ret = av_seek_frame(formatContext, videoStreamIndex, target, AVSEEK_FLAG_BACKWARD);
+    }
+    if (ret < 0) {
+        logError("Seek failed: " + getErrorString(ret));
+        return false;
+    }
+
+    avcodec_flush_buffers(decoderContext);
+    framePool.release(pendingPacket);  // From before the seek
+    pendingPacket = nullptr;
+    temporalDenoiser.reset();  // The previous frames are no longer neighbours
+    return true;
 }
 
-bool HighResProcessor::setupScaler() {
+bool HighResProcessor::openOutput(const QString& filePath) {
     if (!decoderContext) {
+        logError("No video open");
+        return false;
+    }
+
+    // Container from the options, else guessed from the file name
+    QByteArray formatName = options.outputFormat.toUtf8();
+    int ret = avformat_alloc_output_context2(&outputContext, nullptr,
+                                             formatName.isEmpty() ? nullptr : formatName.constData(),
+                                             filePath.toUtf8().constData());
+    if (ret < 0 || !outputContext) {
+        logError("Could not create output context: " + getErrorString(ret));
+        return false;
+    }
+
+    const AVCodec* codec = options.outputCodec.isEmpty()
+        ? avcodec_find_encoder(outputContext->oformat->video_codec)
+        : avcodec_find_encoder_by_name(options.outputCodec.toUtf8().constData());
+    if (!codec) {
+        logError("Unsupported output codec: " + options.outputCodec);
+        return false;
+    }
+
+    encoderContext = avcodec_alloc_context3(codec);
+    if (!encoderContext) {
+        logError("Could not allocate encoder context");
+        return false;
+    }
+
+    // Source geometry, timing and colour unless told otherwise
+    QSize size = options.outputSize.isValid() ? options.outputSize
+                                              : QSize(decoderContext->width, decoderContext->height);
+    AVRational frameRate = av_guess_frame_rate(formatContext,
+                                               formatContext->streams[videoStreamIndex], nullptr);
+    if (frameRate.num <= 0 || frameRate.den <= 0) {
+        frameRate = AVRational{30, 1};
+    }
+    encoderContext->width = size.width() & ~1;
+    encoderContext->height = size.height() & ~1;
+    encoderContext->framerate = frameRate;
+    encoderContext->time_base = av_inv_q(frameRate);
+    encoderContext->sample_aspect_ratio = decoderContext->sample_aspect_ratio;
+    // HDR sources are tone mapped to SDR unless told to keep HDR
+    bool toSDR = currentVideo.isHDR && !options.preserveHDR;
+    toneMapper.setOutput(toSDR ? ToneMapper::Output::SDR : ToneMapper::Output::HDR);
+    // Semi-planar frames are unpacked before tone mapping, so it is the
+    // planar layout the tone mapper sees
+    AVPixelFormat mappedFormat = planarEquivalent(decoderContext->pix_fmt);
+    if (mappedFormat == AV_PIX_FMT_NONE) {
+        mappedFormat = decoderContext->pix_fmt;
+    }
+    AVPixelFormat processedFormat = toSDR ? toneMapper.outputFormat(mappedFormat)
+                                          : decoderContext->pix_fmt;
+    if (processedFormat == AV_PIX_FMT_NONE) {
+        logError(QString("Cannot tone map %1 to SDR").arg(av_get_pix_fmt_name(decoderContext->pix_fmt)));
         return false;
     }
+    encoderContext->pix_fmt = codec->pix_fmts
+        ? avcodec_find_best_pix_fmt_of_list(codec->pix_fmts, processedFormat, 0, nullptr)
+        : processedFormat;
+    encoderContext->color_primaries = toSDR ? AVCOL_PRI_BT709 : decoderContext->color_primaries;
+    encoderContext->color_trc = toSDR ? AVCOL_TRC_BT709 : decoderContext->color_trc;
+    encoderContext->colorspace = toSDR ? AVCOL_SPC_BT709 : decoderContext->colorspace;
+    encoderContext->color_range = toSDR ? AVCOL_RANGE_MPEG : decoderContext->color_range;
+    if (options.outputBitrate > 0) {
+        encoderContext->bit_rate = int64_t(options.outputBitrate) * 1000;
+    }
+    if (outputContext->oformat->flags & AVFMT_GLOBALHEADER) {
+        encoderContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
 
-    // Set up scaler context for format conversion
-    scalerContext = sws_getContext(
-        decoderContext->width,
-        decoderContext->height,
-        decoderContext->pix_fmt,
-        options.outputSize.width(),
-        options.outputSize.height(),
-        AV_PIX_FMT_RGB24,
-        SWS_BICUBIC,
-        nullptr,
-        nullptr,
-        nullptr
-    );
+    configureThreading(encoderContext, codec);
+    ret = avcodec_open2(encoderContext, codec, nullptr);
+    if (ret < 0) {
+        logError("Could not open encoder: " + getErrorString(ret));
+        return false;
+    }
+    if (!framePool.setGeometry(encoderContext->width, encoderContext->height,
+                               encoderContext->pix_fmt)) {
+        logError("Could not size frame pool");
+        return false;
+    }
 
-    if (!scalerContext) {
-        logError("Could not initialize scaler");
+    outputStream = avformat_new_stream(outputContext, nullptr);
+    if (!outputStream) {
+        logError("Could not create output stream");
+        return false;
+    }
+    ret = avcodec_parameters_from_context(outputStream->codecpar, encoderContext);
+    if (ret < 0) {
+        logError("Could not copy encoder params: " + getErrorString(ret));
         return false;
     }
+    outputStream->time_base = encoderContext->time_base;
+
+    if (!(outputContext->oformat->flags & AVFMT_NOFILE)) {
+        ret = avio_open(&outputContext->pb, filePath.toUtf8().constData(), AVIO_FLAG_WRITE);
+        if (ret < 0) {
+            logError("Could not open output file: " + getErrorString(ret));
+            return false;
+        }
+    }
 
+    ret = avformat_write_header(outputContext, nullptr);
+    if (ret < 0) {
+        logError("Could not write header: " + getErrorString(ret));
+        return false;
+    }
     return true;
 }
 
+void HighResProcessor::configureThreading(AVCodecContext* context, const AVCodec* codec) const {
+    if (options.threading == ThreadingPolicy::None) {
+        context->thread_count = 1;
+        return;
+    }
+
+    int wanted = 0;
+    switch (options.threading) {
+        case ThreadingPolicy::Frame:
+            wanted = FF_THREAD_FRAME;
+            break;
+        case ThreadingPolicy::Slice:
+            wanted = FF_THREAD_SLICE;
+            break;
+        default:
+            wanted = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    }
+
+    // Codecs with their own threading (libx264, libx265) take the count
+    // and pick frame or slice threads from thread_type themselves
+    int supported = 0;
+    if (codec->capabilities & AV_CODEC_CAP_FRAME_THREADS) {
+        supported |= FF_THREAD_FRAME;
+    }
+    if (codec->capabilities & AV_CODEC_CAP_SLICE_THREADS) {
+        supported |= FF_THREAD_SLICE;
+    }
+    if (codec->capabilities & AV_CODEC_CAP_OTHER_THREADS) {
+        supported |= FF_THREAD_FRAME | FF_THREAD_SLICE;
+    }
+
+    context->thread_type = wanted & supported;
+    context->thread_count = context->thread_type == 0 ? 1
+        : options.threadCount > 0 ? options.threadCount : QThread::idealThreadCount();
+}
+
 bool HighResProcessor::processFrame(AVFrame* frame) {
     if (!frame || processingCancelled) {
         return false;
@@ -200,12 +571,26 @@ bool HighResProcessor::processFrame(AVFrame* frame) {
 
     QDateTime startTime = QDateTime::currentDateTime();
 
-    bool success = false;
+    bool success = true;
     if (options.useGPU && GPUManager::instance().isInitialized()) {
-        success = processFrameGPU(frame);
+        // Tone mapping stays on the CPU; the encoder was set up for its output
+        if (currentVideo.isHDR) {
+            success = unpackSemiPlanar(frame) && processHDRFrame(frame);
+        }
+        success = success && processFrameGPU(frame);
+    } else if (!unpackSemiPlanar(frame)) {
+        success = false;
+    } else if (options.tiledProcessing && TileScheduler::isSupported(frame)) {
+        success = processFrameTiled(frame);
     } else {
-        // CPU processing
-        if (options.enableDenoising) {
+        // CPU processing; tone mapping first, so the filters see SDR
+        if (currentVideo.isHDR) {
+            success = processHDRFrame(frame);
+        }
+        if (success && options.enableTemporalDenoising) {
+            success = temporalDenoiseFrame(frame);
+        }
+        if (success && options.enableDenoising) {
             success = denoiseFrame(frame);
         }
         if (success && options.enableSharpening) {
@@ -243,17 +628,53 @@ bool HighResProcessor::processFrameGPU(AVFrame* frame) {
         return false;
     }
 
-    // Calculate frame size
-    int frameSize = frame->width * frame->height * 3; // Assuming RGB24
+    // Plane by plane in the frame's own samples, whatever their depth; no
+    // conversion to RGB on the way
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(AVPixelFormat(frame->format));
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL))) {
+        logError(QString("GPU processing not supported for %1")
+                 .arg(av_get_pix_fmt_name(AVPixelFormat(frame->format))));
+        return false;
+    }
 
-    // Process frame using GPU
-    return GPUManager::instance().processFrame(
-        frame->data[0],
-        processedFrame->data[0],
-        frame->width,
-        frame->height,
-        3
-    );
+    int planes = av_pix_fmt_count_planes(AVPixelFormat(frame->format));
+    return filterIntoPooledFrame(frame, [&](const AVFrame* source, AVFrame* target) {
+        if (av_frame_copy(target, source) < 0) {
+            return false;
+        }
+        for (int plane = 0; plane < planes; plane++) {
+            // Whole lines, padding included, as rows of one-byte channels
+            int height = plane == 1 || plane == 2 ? AV_CEIL_RSHIFT(target->height, desc->log2_chroma_h)
+                                                  : target->height;
+            if (!GPUManager::instance().processFrame(target->data[plane], target->data[plane],
+                                                     target->linesize[plane], height, 1)) {
+                return false;
+            }
+        }
+        return true;
+    });
+}
+
+bool HighResProcessor::unpackSemiPlanar(AVFrame* frame) {
+    AVPixelFormat planar = planarEquivalent(AVPixelFormat(frame->format));
+    bool cpuStages = currentVideo.isHDR || options.enableTemporalDenoising || options.enableDenoising ||
+                     options.enableSharpening || options.enableStabilization;
+    if (planar == AV_PIX_FMT_NONE || !cpuStages) {
+        return true;
+    }
+
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(AVPixelFormat(frame->format));
+    int shift = desc->comp[0].shift;
+    int chromaWidth = AV_CEIL_RSHIFT(frame->width, desc->log2_chroma_w);
+    int chromaHeight = AV_CEIL_RSHIFT(frame->height, desc->log2_chroma_h);
+    return filterIntoPooledFrame(frame, [&](const AVFrame* source, AVFrame* target) {
+        if (desc->comp[0].depth > 8) {
+            unpackPlanes<uint16_t>(source, target, shift, chromaWidth, chromaHeight);
+        } else {
+            unpackPlanes<uint8_t>(source, target, shift, chromaWidth, chromaHeight);
+        }
+        return true;
+    }, planar);
 }
 
 bool HighResProcessor::processHDRFrame(AVFrame* frame) {
@@ -269,37 +690,374 @@ bool HighResProcessor::processHDRFrame(AVFrame* frame) {
 }
 
 bool HighResProcessor::convertHDRtoSDR(AVFrame* frame) {
-    // Implement HDR to SDR conversion
-    // This is a placeholder for actual HDR conversion
-    return true;
+    bool needed;
+    if (!prepareToneMapping(frame, ToneMapper::Output::SDR, needed)) {
+        return false;
+    }
+
+    return filterIntoPooledFrame(frame, [this](const AVFrame* source, AVFrame* target) {
+        return toneMapper.process(source, target);
+    }, toneMapper.outputFormat(AVPixelFormat(frame->format)));
 }
 
 bool HighResProcessor::applyHDRToneMapping(AVFrame* frame) {
-    // Implement HDR tone mapping
-    // This is a placeholder for actual tone mapping
+    // Stays HDR; only highlights above the target peak are brought down
+    bool needed;
+    if (!prepareToneMapping(frame, ToneMapper::Output::HDR, needed)) {
+        return false;
+    }
+    if (!needed) {
+        return true;
+    }
+
+    return filterIntoPooledFrame(frame, [this](const AVFrame* source, AVFrame* target) {
+        return toneMapper.process(source, target);
+    });
+}
+
+bool HighResProcessor::prepareToneMapping(AVFrame* frame, ToneMapper::Output output, bool& needed) {
+    // Some decoders leave the transfer to the stream
+    if (frame->color_trc == AVCOL_TRC_UNSPECIFIED && decoderContext) {
+        frame->color_trc = decoderContext->color_trc;
+    }
+
+    toneMapper.setCurve(options.toneMapping);
+    toneMapper.setOutput(output);
+    toneMapper.setTargetPeak(options.hdrTargetPeak);
+    needed = output == ToneMapper::Output::SDR || toneMapper.isNeeded(frame);
+    if (needed && !ToneMapper::isSupported(frame)) {
+        logError(QString("HDR tone mapping not supported for %1")
+                 .arg(av_get_pix_fmt_name(AVPixelFormat(frame->format))));
+        return false;
+    }
     return true;
 }
 
 bool HighResProcessor::denoiseFrame(AVFrame* frame) {
-    // Implement denoising
-    // This is a placeholder for actual denoising
-    return true;
+    if (!SpatialDenoiser::isSupported(frame)) {
+        logError(QString("Denoising not supported for %1")
+                 .arg(av_get_pix_fmt_name(AVPixelFormat(frame->format))));
+        return false;
+    }
+
+    denoiser.setStrength(options.denoiseStrength, options.denoiseStrength * 4 / 3);
+    return filterIntoPooledFrame(frame, [this](const AVFrame* source, AVFrame* target) {
+        return denoiser.process(source, target);
+    });
+}
+
+bool HighResProcessor::temporalDenoiseFrame(AVFrame* frame) {
+    if (!TemporalDenoiser::isSupported(frame)) {
+        logError(QString("Temporal denoising not supported for %1")
+                 .arg(av_get_pix_fmt_name(AVPixelFormat(frame->format))));
+        return false;
+    }
+
+    temporalDenoiser.setHistory(options.temporalFrames);
+    temporalDenoiser.setStrength(options.denoiseStrength);
+    return filterIntoPooledFrame(frame, [this](const AVFrame* source, AVFrame* target) {
+        return temporalDenoiser.process(source, target);
+    });
 }
 
 bool HighResProcessor::sharpenFrame(AVFrame* frame) {
-    // Implement sharpening
-    // This is a placeholder for actual sharpening
-    return true;
+    if (!UnsharpMask::isSupported(frame)) {
+        logError(QString("Sharpening not supported for %1")
+                 .arg(av_get_pix_fmt_name(AVPixelFormat(frame->format))));
+        return false;
+    }
+
+    sharpener.setAmount(options.sharpenAmount);
+    if (av_frame_is_writable(frame)) {
+        return sharpener.process(frame, frame);
+    }
+    return filterIntoPooledFrame(frame, [this](const AVFrame* source, AVFrame* target) {
+        return sharpener.process(source, target);
+    });
 }
 
 bool HighResProcessor::stabilizeFrame(AVFrame* frame) {
-    // Implement stabilization
-    // This is a placeholder for actual stabilization
+    if (!cameraPath.isValid()) {
+        logError("No stabilization analysis for this video");
+        return false;
+    }
+    if (!Stabilizer::isSupported(frame)) {
+        logError(QString("Stabilization not supported for %1")
+                 .arg(av_get_pix_fmt_name(AVPixelFormat(frame->format))));
+        return false;
+    }
+
+    CameraPath::Transform correction = cameraPath.correctionAt(frame->best_effort_timestamp);
+    stabilizer.setZoom(options.stabilizationZoom);
+    return filterIntoPooledFrame(frame, [&](const AVFrame* source, AVFrame* target) {
+        return stabilizer.process(source, target, correction);
+    });
+}
+
+bool HighResProcessor::processFrameTiled(AVFrame* frame) {
+    // The stages of the CPU path in processFrame, but runs of those that
+    // read only a few pixels around each output pixel go through the frame
+    // together, a tile at a time, while the tile is still in cache.
+    // Temporal denoising and stabilization need whole frames, so they end
+    // a run.
+    std::vector<TileScheduler::Stage> stages;
+    bool toneMapped = false;
+
+    // What the next stage will be given; support depends on the format alone
+    AVFrame shape = AVFrame();
+    shape.format = frame->format;
+
+    if (currentVideo.isHDR) {
+        bool needed;
+        ToneMapper::Output output = options.preserveHDR ? ToneMapper::Output::HDR : ToneMapper::Output::SDR;
+        if (!prepareToneMapping(frame, output, needed)) {
+            return false;
+        }
+        if (needed) {
+            TileScheduler::Stage stage;
+            stage.filter = [this](const AVFrame* source, AVFrame* target) {
+                return toneMapper.process(source, target);
+            };
+            stage.format = toneMapper.outputFormat(AVPixelFormat(frame->format));
+            stages.push_back(stage);
+            shape.format = stage.format;
+            toneMapped = true;
+        }
+    }
+    if (options.enableTemporalDenoising) {
+        if (!runTiles(frame, stages, toneMapped) || !temporalDenoiseFrame(frame)) {
+            return false;
+        }
+        stages.clear();
+        toneMapped = false;
+    }
+    if (options.enableDenoising) {
+        if (!SpatialDenoiser::isSupported(&shape)) {
+            logError(QString("Denoising not supported for %1")
+                     .arg(av_get_pix_fmt_name(AVPixelFormat(shape.format))));
+            return false;
+        }
+        denoiser.setStrength(options.denoiseStrength, options.denoiseStrength * 4 / 3);
+        TileScheduler::Stage stage;
+        stage.filter = [this](const AVFrame* source, AVFrame* target) {
+            return denoiser.process(source, target);
+        };
+        stage.halo = 1;  // 3x3 window
+        stages.push_back(stage);
+    }
+    if (options.enableSharpening) {
+        if (!UnsharpMask::isSupported(&shape)) {
+            logError(QString("Sharpening not supported for %1")
+                     .arg(av_get_pix_fmt_name(AVPixelFormat(shape.format))));
+            return false;
+        }
+        sharpener.setAmount(options.sharpenAmount);
+        TileScheduler::Stage stage;
+        stage.filter = [this](const AVFrame* source, AVFrame* target) {
+            return sharpener.process(source, target);
+        };
+        stage.halo = 2;  // 5x5 blur
+        stages.push_back(stage);
+    }
+
+    if (!runTiles(frame, stages, toneMapped)) {
+        return false;
+    }
+    if (options.enableStabilization) {
+        return stabilizeFrame(frame);
+    }
+    return true;
+}
+
+bool HighResProcessor::runTiles(AVFrame* frame, const std::vector<TileScheduler::Stage>& stages,
+                                bool toneMapped) {
+    if (stages.empty()) {
+        return true;
+    }
+
+    AVPixelFormat format = AVPixelFormat(frame->format);
+    for (const TileScheduler::Stage& stage : stages) {
+        if (stage.format != AV_PIX_FMT_NONE) {
+            format = stage.format;
+        }
+    }
+    return filterIntoPooledFrame(frame, [&](const AVFrame* source, AVFrame* target) {
+        if (!tileScheduler.process(source, target, stages)) {
+            logError("Tiled processing failed");
+            return false;
+        }
+        // Tiles carry colour properties but not side data
+        if (toneMapped) {
+            toneMapper.tagOutput(source, target);
+        }
+        return true;
+    }, format);
+}
+
+bool HighResProcessor::prepareStabilization(const QString& filePath) {
+    QString pathFile = cameraPathFile(filePath);
+    CameraPath path;
+    if (path.load(pathFile, filePath)) {
+        qDebug() << "Reusing stabilization analysis for" << filePath;
+    } else {
+        path = CameraPath::analyze(filePath, [this] { return processingCancelled.load(); });
+        if (!path.isValid()) {
+            logError(processingCancelled ? "Processing cancelled" : "Stabilization analysis failed");
+            return false;
+        }
+        if (!QDir().mkpath(analysisDirectory) || !path.save(pathFile)) {
+            qDebug() << "Failed to save stabilization analysis for" << filePath;
+        }
+    }
+
+    path.smooth(options.stabilizationSmoothing);
+    cameraPath = path;
+    return true;
+}
+
+QString HighResProcessor::cameraPathFile(const QString& filePath) const {
+    QByteArray hash = QCryptographicHash::hash(
+        QFileInfo(filePath).absoluteFilePath().toUtf8(), QCryptographicHash::Md5).toHex();
+    return QDir(analysisDirectory).filePath(QString("%1.campath").arg(QString(hash)));
+}
+
+bool HighResProcessor::filterIntoPooledFrame(AVFrame* frame,
+                                             const std::function<bool(const AVFrame*, AVFrame*)>& filter,
+                                             AVPixelFormat format) {
+    if (format == AV_PIX_FMT_NONE) {
+        format = AVPixelFormat(frame->format);
+    }
+    AVFrame* target = framePool.acquireBuffer(frame->width, frame->height, format);
+    if (!target) {
+        logError("Failed to allocate frame for filtering");
+        return false;
+    }
+    av_frame_copy_props(target, frame);
+
+    bool success = filter(frame, target);
+    if (success) {
+        av_frame_unref(frame);
+        av_frame_move_ref(frame, target);
+    }
+    framePool.release(target);
+    return success;
+}
+
+AVFrame* HighResProcessor::decodeNextFrame() {
+    AVFrame* frame = framePool.acquireFrame();
+    AVPacket* packet = framePool.acquirePacket();
+    if (!frame || !packet) {
+        framePool.release(frame);
+        framePool.release(packet);
+        logError("Failed to allocate decode buffers");
+        decodeFailed = true;
+        return nullptr;
+    }
+
+    while (true) {
+        int ret = avcodec_receive_frame(decoderContext, frame);
+        if (ret == 0) {
+            framePool.release(packet);
+            return frame;
+        }
+        if (ret == AVERROR_EOF) {
+            break;
+        }
+        if (ret != AVERROR(EAGAIN)) {
+            logError("Error decoding frame: " + getErrorString(ret));
+            decodeFailed = true;
+            break;
+        }
+
+        // Decoder needs more input; a packet it turned away goes first,
+        // and at the end, drain what it holds
+        if (pendingPacket) {
+            framePool.release(packet);
+            packet = pendingPacket;
+            pendingPacket = nullptr;
+        } else {
+            ret = av_read_frame(formatContext, packet);
+            if (ret < 0) {
+                if (decoderDrained) {
+                    break;
+                }
+                decoderDrained = true;
+                avcodec_send_packet(decoderContext, nullptr);
+                continue;
+            }
+            if (packet->stream_index != videoStreamIndex) {
+                av_packet_unref(packet);
+                continue;
+            }
+        }
+
+        // EAGAIN: output is waiting to be received; keep the packet, as
+        // FrameDecoder does, and send it again once it has been
+        ret = avcodec_send_packet(decoderContext, packet);
+        if (ret == AVERROR(EAGAIN)) {
+            pendingPacket = packet;
+            packet = nullptr;
+            continue;
+        }
+        av_packet_unref(packet);
+        if (ret < 0) {
+            logError("Error sending packet to decoder: " + getErrorString(ret));
+            decodeFailed = true;
+            break;
+        }
+    }
+
+    framePool.release(packet);
+    framePool.release(frame);
+    return nullptr;
+}
+
+bool HighResProcessor::convertForEncoder(AVFrame* frame) {
+    // Source timing in the encoder's time base, kept strictly increasing
+    AVStream* input = formatContext->streams[videoStreamIndex];
+    int64_t pts = frame->best_effort_timestamp;
+    if (pts != AV_NOPTS_VALUE) {
+        int64_t start = input->start_time != AV_NOPTS_VALUE ? input->start_time : 0;
+        pts = av_rescale_q(pts - start, input->time_base, encoderContext->time_base);
+    }
+    if (pts == AV_NOPTS_VALUE || pts < nextOutputPts) {
+        pts = nextOutputPts;
+    }
+    nextOutputPts = pts + 1;
+
+    // Scale and convert only when the encoder wants something else
+    if (frame->width != encoderContext->width || frame->height != encoderContext->height ||
+        frame->format != encoderContext->pix_fmt) {
+        encoderScaler = sws_getCachedContext(encoderScaler,
+            frame->width, frame->height, AVPixelFormat(frame->format),
+            encoderContext->width, encoderContext->height, encoderContext->pix_fmt,
+            SWS_BICUBIC, nullptr, nullptr, nullptr);
+        if (!encoderScaler) {
+            logError("Could not initialize output scaler");
+            return false;
+        }
+
+        AVFrame* converted = framePool.acquireBuffer();
+        if (!converted) {
+            logError("Failed to allocate output frame");
+            return false;
+        }
+        av_frame_copy_props(converted, frame);
+        sws_scale(encoderScaler, frame->data, frame->linesize, 0, frame->height,
+                  converted->data, converted->linesize);
+        av_frame_unref(frame);
+        av_frame_move_ref(frame, converted);
+        framePool.release(converted);
+    }
+
+    frame->pts = pts;
+    frame->pict_type = AV_PICTURE_TYPE_NONE;
     return true;
 }
 
 bool HighResProcessor::writeFrame(AVFrame* frame) {
-    if (!frame || !encoderContext) {
+    // A null frame flushes the encoder
+    if (!encoderContext || !outputContext) {
         return false;
     }
 
@@ -309,27 +1067,33 @@ bool HighResProcessor::writeFrame(AVFrame* frame) {
         return false;
     }
 
+    AVPacket* pkt = framePool.acquirePacket();
+    if (!pkt) {
+        logError("Failed to allocate encode packet");
+        return false;
+    }
     while (ret >= 0) {
-        AVPacket* pkt = av_packet_alloc();
         ret = avcodec_receive_packet(encoderContext, pkt);
         if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-            av_packet_free(&pkt);
             break;
         } else if (ret < 0) {
-            av_packet_free(&pkt);
+            framePool.release(pkt);
             logError("Error encoding frame: " + getErrorString(ret));
             return false;
         }
 
         // Write packet
-        ret = av_interleaved_write_frame(formatContext, pkt);
-        av_packet_free(&pkt);
+        av_packet_rescale_ts(pkt, encoderContext->time_base, outputStream->time_base);
+        pkt->stream_index = outputStream->index;
+        ret = av_interleaved_write_frame(outputContext, pkt);
         if (ret < 0) {
+            framePool.release(pkt);
             logError("Error writing frame: " + getErrorString(ret));
             return false;
         }
     }
 
+    framePool.release(pkt);
     return true;
 }
 
@@ -338,34 +1102,22 @@ bool HighResProcessor::finishProcessing() {
         return false;
     }
 
-    // Flush encoder
-    writeFrame(nullptr);
-
-    // Write trailer
-    if (formatContext) {
-        av_write_trailer(formatContext);
+    // Flush encoder and write trailer
+    if (outputContext) {
+        writeFrame(nullptr);
+        av_write_trailer(outputContext);
     }
 
-    cleanupResources();
+    closeVideo();
     emit processingFinished();
 
     return true;
 }
 
-void HighResProcessor::cleanupResources() {
-    if (scalerContext) {
-        sws_freeContext(scalerContext);
-        scalerContext = nullptr;
-    }
-
-    if (inputFrame) {
-        av_frame_free(&inputFrame);
-    }
-    if (processedFrame) {
-        av_frame_free(&processedFrame);
-    }
-    if (outputFrame) {
-        av_frame_free(&outputFrame);
+void HighResProcessor::closeVideo() {
+    if (encoderScaler) {
+        sws_freeContext(encoderScaler);
+        encoderScaler = nullptr;
     }
 
     if (decoderContext) {
@@ -378,6 +1130,43 @@ void HighResProcessor::cleanupResources() {
     if (formatContext) {
         avformat_close_input(&formatContext);
     }
+    if (outputContext) {
+        if (!(outputContext->oformat->flags & AVFMT_NOFILE)) {
+            avio_closep(&outputContext->pb);
+        }
+        avformat_free_context(outputContext);
+        outputContext = nullptr;
+        outputStream = nullptr;
+    }
+    framePool.release(pendingPacket);
+    pendingPacket = nullptr;
+    videoStreamIndex = -1;
+    seekIndex.reset();
+    temporalDenoiser.reset();
+    cameraPath = CameraPath();
+}
+
+void HighResProcessor::discardOutput(const QString& filePath) {
+    // Only a file this job opened is removed; its header is already written
+    bool opened = outputContext && outputContext->pb;
+    closeVideo();
+    if (opened) {
+        QFile::remove(filePath);
+    }
+}
+
+void HighResProcessor::cleanupResources() {
+    closeVideo();
+
+    if (inputFrame) {
+        av_frame_free(&inputFrame);
+    }
+    if (processedFrame) {
+        av_frame_free(&processedFrame);
+    }
+    if (outputFrame) {
+        av_frame_free(&outputFrame);
+    }
 
     if (filterGraph) {
         avfilter_graph_free(&filterGraph);
@@ -388,12 +1177,15 @@ void HighResProcessor::cleanupResources() {
 
 QString HighResProcessor::getProcessingStats() const {
     return QString("Processed Frames: %1/%2, FPS: %3, "
-                  "Avg Processing Time: %4ms, Dropped Frames: %5")
+                  "Avg Processing Time: %4ms, Dropped Frames: %5, "
+                  "Allocations: %6 (%7 after warm-up)")
         .arg(processedFrames)
         .arg(totalFrames)
         .arg(metrics.fps, 0, 'f', 1)
         .arg(metrics.averageProcessingTime, 0, 'f', 1)
-        .arg(metrics.droppedFrames);
+        .arg(metrics.droppedFrames)
+        .arg(metrics.allocations)
+        .arg(metrics.steadyStateAllocations);
 }
 
 float HighResProcessor::getProcessingProgress() const {
@@ -403,11 +1195,26 @@ float HighResProcessor::getProcessingProgress() const {
     return float(processedFrames) / float(totalFrames);
 }
 
+ProcessingPipeline::Stats HighResProcessor::getPipelineStats() const {
+    QMutexLocker locker(&pipelineMutex);
+    return pipeline ? pipeline->getStats() : lastPipelineStats;
+}
+
 bool HighResProcessor::cancelProcessing() {
     processingCancelled = true;
+    QMutexLocker locker(&pipelineMutex);
+    if (pipeline) {
+        pipeline->cancel();
+    }
     return true;
 }
 
+bool HighResProcessor::convertFrameToRGB(AVFrame* frame, QImage& image) {
+    // Same conversion the frame cache uses at display time
+    image = VideoFrame::convertToImage(frame);
+    return !image.isNull();
+}
+
 QString HighResProcessor::getErrorString(int error) const {
     char errbuf[AV_ERROR_MAX_STRING_SIZE];
     av_strerror(error, errbuf, AV_ERROR_MAX_STRING_SIZE);
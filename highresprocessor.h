@@ -4,9 +4,21 @@
 #include <QString>
 #include <QSize>
 #include <QImage>
+#include <QMutex>
 #include <memory>
+#include <atomic>
 #include <vector>
 #include "gpumanager.h"
+#include "seekindex.h"
+#include "processingpipeline.h"
+#include "framepool.h"
+#include "spatialdenoiser.h"
+#include "temporaldenoiser.h"
+#include "unsharpmask.h"
+#include "tonemapper.h"
+#include "stabilizer.h"
+#include "tilescheduler.h"
+#include <functional>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -15,6 +27,10 @@ extern "C" {
 #include <libavfilter/avfilter.h>
 }
 
+// Decodes, processes and encodes one video at a time. Each instance owns
+// its FFmpeg contexts, frames and filters, so several can run at once on
+// threads of their own; HighResJobManager schedules them under a shared
+// budget. Only the row workers of the CPU filters are shared.
 class HighResProcessor : public QObject {
     Q_OBJECT
 
@@ -30,6 +46,14 @@ public:
         QString pixelFormat;
     };
 
+    // How the decoder and encoder spread work over cores
+    enum class ThreadingPolicy {
+        Auto,    // Frame and slice threads, whichever the codec supports
+        Frame,   // Several frames at once; best throughput, adds latency
+        Slice,   // Parts of one frame at once; no added latency
+        None     // Single-threaded
+    };
+
     struct ProcessingOptions {
         bool useGPU;
         bool preserveHDR;
@@ -41,18 +65,49 @@ public:
         bool enableDenoising;
         bool enableSharpening;
         bool enableStabilization;
+        int denoiseStrength = 12;  // Largest difference, in 8-bit levels, treated as noise
+        bool enableTemporalDenoising = false;  // Blend motion-aligned previous frames
+        int temporalFrames = 2;  // Previous frames blended in, 1 to 4
+        double sharpenAmount = 1.0;  // As SharpenEffect's "amount", 0 to 5
+        ToneMapper::Curve toneMapping = ToneMapper::Curve::BT2390;
+        double hdrTargetPeak = 1000.0;  // Nits; HDR output is mapped down to this
+        int stabilizationSmoothing = 15;  // Frames either side averaged into the camera path
+        double stabilizationZoom = 1.0;   // 1 to 2; crops the borders the correction uncovers
+        bool tiledProcessing = true;  // Run neighbouring CPU stages tile by tile, on all cores
+        ThreadingPolicy threading = ThreadingPolicy::Auto;
+        int threadCount = 0;  // Per codec; 0 = one per core
     };
 
-    static HighResProcessor& instance();
+    explicit HighResProcessor(QObject* parent = nullptr);
+    ~HighResProcessor() override;
 
     // Initialization and setup
     bool initialize();
     bool isInitialized() const;
-    VideoInfo getVideoInfo(const QString& filePath) const;
+    static VideoInfo getVideoInfo(const QString& filePath);  // Width 0 if it has no video
     bool setProcessingOptions(const ProcessingOptions& options);
+    const ProcessingOptions& getProcessingOptions() const { return options; }
+
+    // Rough peak of the frame memory a job on this video holds, for
+    // deciding how many run at once
+    static qint64 estimateMemoryUsage(const VideoInfo& video, const ProcessingOptions& options);
+    
+    // Keyframe indexes used for seeking; not owned
+    void setSeekIndexStore(SeekIndexStore* store) { seekIndexes = store; }
 
+    // Where camera path analyses are kept for the next export of a file
+    void setAnalysisDirectory(const QString& directory) { analysisDirectory = directory; }
+    QString getAnalysisDirectory() const { return analysisDirectory; }
+
+    // Decode, process and encode a whole file. Decoding, the processing
+    // stages and encoding run on threads of their own, joined by bounded
+    // queues; blocks until the output is finished.
+    bool processVideo(const QString& inputPath, const QString& outputPath);
+    
     // Video processing
     bool openVideo(const QString& filePath);
+    bool openOutput(const QString& filePath);
+    bool seekTo(qint64 timestamp);  // Milliseconds; decoding resumes at the keyframe before
     bool processFrame(AVFrame* frame);
     bool processFrameGPU(AVFrame* frame);
     bool writeFrame(AVFrame* frame);
@@ -66,12 +121,14 @@ public:
     // Frame operations
     bool scaleFrame(AVFrame* src, AVFrame* dst);
     bool denoiseFrame(AVFrame* frame);
+    bool temporalDenoiseFrame(AVFrame* frame);  // Frames in decode order; keeps references
     bool sharpenFrame(AVFrame* frame);
     bool stabilizeFrame(AVFrame* frame);
 
     // Performance monitoring
     float getProcessingProgress() const;
     QString getProcessingStats() const;
+    ProcessingPipeline::Stats getPipelineStats() const;  // Stage occupancy of the last job
     bool cancelProcessing();
 
 signals:
@@ -82,16 +139,42 @@ signals:
     void processingFinished();
 
 private:
-    explicit HighResProcessor(QObject* parent = nullptr);
-    ~HighResProcessor();
-
     // Internal helper functions
     bool initializeCodecs();
     bool initializeFilters();
-    bool setupScaler();
     bool allocateFrameBuffers();
+    void closeVideo();
+    void discardOutput(const QString& filePath);  // Closes and removes a partial output
     void cleanupResources();
 
+    // Pipeline stages
+    AVFrame* decodeNextFrame();
+    bool unpackSemiPlanar(AVFrame* frame);  // NV12, P010 and the like to planar, for the CPU stages
+    bool processFrameTiled(AVFrame* frame);
+    bool convertForEncoder(AVFrame* frame);
+    
+    // Runs an out-of-place filter into a pooled frame of the same geometry,
+    // which then takes the place of the input. Decoded frames share buffers
+    // with the decoder's reference frames, so they are never written to.
+    bool filterIntoPooledFrame(AVFrame* frame,
+                               const std::function<bool(const AVFrame*, AVFrame*)>& filter,
+                               AVPixelFormat format = AV_PIX_FMT_NONE);  // NONE keeps the input's
+
+    // Runs stages over a frame tile by tile into a pooled frame; toneMapped
+    // when one of them is the tone mapper, whose output tags are then set
+    bool runTiles(AVFrame* frame, const std::vector<TileScheduler::Stage>& stages, bool toneMapped);
+
+    // Configures the tone mapper for an HDR frame; needed is false when the
+    // frame is already within what the output can show
+    bool prepareToneMapping(AVFrame* frame, ToneMapper::Output output, bool& needed);
+
+    // First pass of stabilization, or its saved result
+    bool prepareStabilization(const QString& filePath);
+    QString cameraPathFile(const QString& filePath) const;
+
+    // Threading for a codec context; call before avcodec_open2
+    void configureThreading(AVCodecContext* context, const AVCodec* codec) const;
+    
     // Frame conversion helpers
     bool convertFrameToRGB(AVFrame* frame, QImage& image);
     bool convertRGBToFrame(const QImage& image, AVFrame* frame);
@@ -110,7 +193,9 @@ private:
     AVFormatContext* formatContext;
     AVCodecContext* decoderContext;
     AVCodecContext* encoderContext;
-    SwsContext* scalerContext;
+    AVFormatContext* outputContext;
+    AVStream* outputStream;
+    SwsContext* encoderScaler;
     AVFilterGraph* filterGraph;
     AVFilterContext* bufferSrcContext;
     AVFilterContext* bufferSinkContext;
@@ -120,10 +205,37 @@ private:
     AVFrame* processedFrame;
     AVFrame* outputFrame;
 
+    // CPU filters
+    SpatialDenoiser denoiser;
+    TemporalDenoiser temporalDenoiser;
+    UnsharpMask sharpener;
+    ToneMapper toneMapper;
+    Stabilizer stabilizer;
+    TileScheduler tileScheduler;
+
+    // Stabilization
+    QString analysisDirectory;
+    CameraPath cameraPath;  // Of the open video, smoothed
+
+    // Seeking
+    int videoStreamIndex;
+    SeekIndexStore* seekIndexes;
+    std::shared_ptr<const SeekIndex> seekIndex;
+
+    // Pipeline state; frames and packets are recycled through the pool
+    FramePool framePool;
+    std::unique_ptr<ProcessingPipeline> pipeline;
+    ProcessingPipeline::Stats lastPipelineStats;
+    int64_t nextOutputPts;
+    bool decoderDrained;
+    bool decodeFailed;
+    AVPacket* pendingPacket;  // Refused with EAGAIN; sent again before reading on
+    mutable QMutex pipelineMutex;
+
     // Processing state
     int64_t totalFrames;
     int64_t processedFrames;
-    bool processingCancelled;
+    std::atomic<bool> processingCancelled;  // Set from any thread; cleared by the job it stops
 
     // Performance metrics
     struct ProcessingMetrics {
@@ -131,9 +243,14 @@ private:
         double peakMemoryUsage;
         int droppedFrames;
         double fps;
+        qint64 allocations;             // Pooled objects created by the last job
+        qint64 steadyStateAllocations;  // Of those, after the warm-up frames
     } metrics;
 
     // Constants
     static const int MAX_FRAME_SIZE;
     static const int DEFAULT_BUFFER_SIZE;
+    static const int PIPELINE_QUEUE_DEPTH;
+    static const int ALLOCATION_WARMUP_FRAMES;
+    static const int FRAMES_IN_FLIGHT;
 };
@@ -0,0 +1,87 @@
+#include "parallelrows.h"
+#include <QThreadPool>
+#include <QThread>
+#include <QSemaphore>
+#include <QRunnable>
+#include <QAtomicInteger>
+
+const int ParallelRows::DEFAULT_MIN_BAND_ROWS = 32; // Below this, threading costs more than it saves
+
+static QAtomicInteger<int> threadCount(0);  // 0 = one per core
+static thread_local bool insideBand = false;  // Set while this thread runs a band
+
+// Helper functions
+static QThreadPool& rowPool() {
+    // Kept apart from the global pool, which thumbnailing and exports share
+    static QThreadPool pool;
+    return pool;
+}
+
+void ParallelRows::run(int rows, const Work& work, int minBandRows) {
+    run(split(rows, minBandRows), work);
+}
+
+std::vector<int> ParallelRows::split(int rows, int minBandRows) {
+    std::vector<int> bounds;
+    if (rows <= 0) {
+        return bounds;
+    }
+
+    // A kernel called from a band (a tile, say) already has its core
+    int maxBands = insideBand ? 1 : rows / qMax(1, minBandRows);
+    int bands = qBound(1, maxBands, getThreadCount());
+    for (int band = 0; band <= bands; band++) {
+        bounds.push_back(int(qint64(rows) * band / bands));
+    }
+    return bounds;
+}
+
+void ParallelRows::run(const std::vector<int>& bounds, const Work& work) {
+    int bands = int(bounds.size()) - 1;
+    if (bands < 1) {
+        return;
+    }
+    auto runBand = [&work](int begin, int end) {
+        bool nested = insideBand;
+        insideBand = true;
+        work(begin, end);
+        insideBand = nested;
+    };
+    if (bands == 1 || insideBand) {
+        for (int band = 0; band < bands; band++) {
+            runBand(bounds[band], bounds[band + 1]);
+        }
+        return;
+    }
+
+    // The calling thread takes the first band, so a worker fewer
+    QThreadPool& pool = rowPool();
+    if (pool.maxThreadCount() < bands - 1) {
+        pool.setMaxThreadCount(bands - 1);
+    }
+
+    QSemaphore done;
+    for (int band = 1; band < bands; band++) {
+        int begin = bounds[band];
+        int end = bounds[band + 1];
+        pool.start(QRunnable::create([&runBand, &done, begin, end] {
+            runBand(begin, end);
+            done.release();
+        }));
+    }
+    runBand(bounds[0], bounds[1]);
+    done.acquire(bands - 1);
+}
+
+int ParallelRows::getThreadCount() {
+    int count = threadCount.loadRelaxed();
+    return count > 0 ? count : qMax(1, QThread::idealThreadCount());
+}
+
+void ParallelRows::setThreadCount(int count) {
+    threadCount.storeRelaxed(qMax(0, count));
+
+    // run() only grows the pool, so a smaller count is applied here; the
+    // calling thread of each run() takes a band of its own
+    rowPool().setMaxThreadCount(qMax(1, getThreadCount() - 1));
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <functional>
+#include <vector>
+
+// Splits the rows of an image into bands and filters them on a shared pool
+// of worker threads, one band on the calling thread. Bands never overlap,
+// so kernels that read one buffer and write another need no locking.
+// Calls made from inside a band run inline, so whole-frame kernels can be
+// reused on tiles that are themselves spread over the workers.
+class ParallelRows {
+public:
+    // Called once per band with rows [begin, end)
+    using Work = std::function<void(int begin, int end)>;
+
+    // Blocks until every band is done. Runs inline when the image is too
+    // small to be worth splitting.
+    static void run(int rows, const Work& work, int minBandRows = DEFAULT_MIN_BAND_ROWS);
+
+    // The bands run() would use: band i covers [bounds[i], bounds[i + 1]).
+    // For kernels that must prepare each band's borders before any runs.
+    static std::vector<int> split(int rows, int minBandRows = DEFAULT_MIN_BAND_ROWS);
+    static void run(const std::vector<int>& bounds, const Work& work);
+
+    // Workers shared by all kernels, callers included; one per core by
+    // default. Lowering it takes effect for the next bands queued.
+    static int getThreadCount();
+    static void setThreadCount(int count);
+
+private:
+    // Constants
+    static const int DEFAULT_MIN_BAND_ROWS;
+};
@@ -0,0 +1,321 @@
+#include "processingpipeline.h"
+#include <QThread>
+#include <QStringList>
+#include <vector>
+
+const int ProcessingPipeline::DEFAULT_QUEUE_CAPACITY = 4;
+
+FrameQueue::FrameQueue(int capacity, const Release& release)
+    : release(release)
+    , maxSize(qMax(1, capacity))
+    , closed(false)
+    , aborted(false)
+    , lastChange(0)
+    , fillTime(0.0)
+{
+    clock.start();
+}
+
+FrameQueue::~FrameQueue() {
+    for (AVFrame* frame : frames) {
+        dispose(frame);
+    }
+}
+
+bool FrameQueue::push(AVFrame* frame) {
+    QMutexLocker locker(&mutex);
+    while (!aborted && int(frames.size()) >= maxSize) {
+        notFull.wait(&mutex);
+    }
+    if (aborted) {
+        dispose(frame);
+        return false;
+    }
+
+    recordFill();
+    frames.push_back(frame);
+    notEmpty.wakeOne();
+    return true;
+}
+
+AVFrame* FrameQueue::pop() {
+    QMutexLocker locker(&mutex);
+    while (!aborted && !closed && frames.empty()) {
+        notEmpty.wait(&mutex);
+    }
+    if (aborted || frames.empty()) {
+        return nullptr;
+    }
+
+    recordFill();
+    AVFrame* frame = frames.front();
+    frames.pop_front();
+    notFull.wakeOne();
+    return frame;
+}
+
+void FrameQueue::close() {
+    QMutexLocker locker(&mutex);
+    closed = true;
+    notEmpty.wakeAll();
+}
+
+void FrameQueue::abort() {
+    QMutexLocker locker(&mutex);
+    recordFill();
+    aborted = true;
+    for (AVFrame* frame : frames) {
+        dispose(frame);
+    }
+    frames.clear();
+    notEmpty.wakeAll();
+    notFull.wakeAll();
+}
+
+int FrameQueue::size() const {
+    QMutexLocker locker(&mutex);
+    return int(frames.size());
+}
+
+double FrameQueue::averageFill() const {
+    QMutexLocker locker(&mutex);
+    qint64 now = clock.nsecsElapsed();
+    double total = fillTime + double(frames.size()) * double(now - lastChange);
+    return now > 0 ? total / double(now) : 0.0;
+}
+
+void FrameQueue::recordFill() {
+    // Called with the lock held, before the size changes
+    qint64 now = clock.nsecsElapsed();
+    fillTime += double(frames.size()) * double(now - lastChange);
+    lastChange = now;
+}
+
+void FrameQueue::dispose(AVFrame* frame) const {
+    if (release) {
+        release(frame);
+    } else {
+        av_frame_free(&frame);
+    }
+}
+
+QString ProcessingPipeline::Stats::bottleneck() const {
+    QString name;
+    double busiest = -1.0;
+    for (const StageStats& stage : stages) {
+        if (stage.busy > busiest) {
+            busiest = stage.busy;
+            name = stage.name;
+        }
+    }
+    return name;
+}
+
+QString ProcessingPipeline::Stats::toString() const {
+    QStringList parts;
+    for (int i = 0; i < stages.size(); i++) {
+        const StageStats& stage = stages[i];
+        parts << QString("%1: %2% busy, %3% starved, %4% blocked")
+            .arg(stage.name)
+            .arg(stage.busy * 100.0, 0, 'f', 0)
+            .arg(stage.starved * 100.0, 0, 'f', 0)
+            .arg(stage.blocked * 100.0, 0, 'f', 0);
+        if (i < queueFill.size()) {
+            parts << QString("queue %1% full").arg(queueFill[i] * 100.0, 0, 'f', 0);
+        }
+    }
+    return QString("Pipeline %1 fps, bottleneck %2 [%3]")
+        .arg(fps, 0, 'f', 1)
+        .arg(bottleneck())
+        .arg(parts.join(" | "));
+}
+
+ProcessingPipeline::ProcessingPipeline(int queueCapacity)
+    : queueCapacity(qMax(1, queueCapacity))
+    , cancelled(0)
+    , failed(0)
+    , runTime(0)
+{
+}
+
+ProcessingPipeline::~ProcessingPipeline() {
+    cancel();
+}
+
+void ProcessingPipeline::setSource(const QString& name, const Source& value) {
+    auto state = std::make_shared<StageState>();
+    state->name = name;
+    if (source) {
+        stages.first() = state;
+    } else {
+        stages.prepend(state);
+    }
+    source = value;
+}
+
+void ProcessingPipeline::addStage(const QString& name, const Stage& stage) {
+    auto state = std::make_shared<StageState>();
+    state->name = name;
+    state->work = stage;
+    stages.append(state);
+}
+
+void ProcessingPipeline::setSink(const QString& name, const Stage& sink) {
+    addStage(name, sink);
+}
+
+void ProcessingPipeline::setRelease(const Release& value) {
+    release = value;
+}
+
+bool ProcessingPipeline::run() {
+    if (!source || stages.size() < 2) {
+        return false;
+    }
+
+    {
+        QMutexLocker locker(&mutex);
+        if (!queues.isEmpty()) {
+            return false;
+        }
+        for (int i = 0; i + 1 < stages.size(); i++) {
+            queues << std::make_shared<FrameQueue>(queueCapacity, release);
+        }
+        clock.start();
+    }
+    if (isCancelled()) {
+        return false;
+    }
+
+    // One thread per stage; the source runs on the calling thread
+    std::vector<std::unique_ptr<QThread>> threads;
+    for (int i = 1; i < stages.size(); i++) {
+        FrameQueue* output = i < queues.size() ? queues[i].get() : nullptr;
+        threads.emplace_back(QThread::create([this, i, output] {
+            runStage(*stages[i], *queues[i - 1], output);
+        }));
+        threads.back()->start();
+    }
+    runSource(*stages.first(), *queues.first());
+
+    for (auto& thread : threads) {
+        thread->wait();
+    }
+    QMutexLocker locker(&mutex);
+    runTime.storeRelease(clock.nsecsElapsed());
+    return !failed.loadAcquire() && !cancelled.loadAcquire();
+}
+
+void ProcessingPipeline::cancel() {
+    cancelled.storeRelease(1);
+    QMutexLocker locker(&mutex);
+    for (const auto& queue : queues) {
+        queue->abort();
+    }
+}
+
+ProcessingPipeline::Stats ProcessingPipeline::getStats() const {
+    Stats stats;
+    QMutexLocker locker(&mutex);
+    if (!clock.isValid()) {
+        return stats;
+    }
+
+    qint64 wall = runTime.loadAcquire();
+    if (wall == 0) {
+        wall = clock.nsecsElapsed();
+    }
+    double scale = wall > 0 ? 1.0 / double(wall) : 0.0;
+
+    for (const auto& state : stages) {
+        StageStats stage;
+        stage.name = state->name;
+        stage.frames = state->frames.loadRelaxed();
+        stage.busy = double(state->busyTime.loadRelaxed()) * scale;
+        stage.starved = double(state->starvedTime.loadRelaxed()) * scale;
+        stage.blocked = double(state->blockedTime.loadRelaxed()) * scale;
+        stats.stages << stage;
+    }
+    for (const auto& queue : queues) {
+        stats.queueFill << queue->averageFill() / queue->capacity();
+    }
+
+    stats.elapsed = wall / 1000000;
+    if (!stats.stages.isEmpty() && wall > 0) {
+        stats.fps = double(stats.stages.last().frames) * 1e9 / double(wall);
+    }
+    return stats;
+}
+
+void ProcessingPipeline::runSource(StageState& state, FrameQueue& output) {
+    QElapsedTimer timer;
+    while (!isCancelled()) {
+        timer.start();
+        AVFrame* frame = source();
+        state.busyTime.fetchAndAddRelaxed(timer.nsecsElapsed());
+        if (!frame) {
+            break;
+        }
+        state.frames.fetchAndAddRelaxed(1);
+
+        timer.start();
+        bool pushed = output.push(frame);
+        state.blockedTime.fetchAndAddRelaxed(timer.nsecsElapsed());
+        if (!pushed) {
+            break;
+        }
+    }
+    output.close();
+}
+
+void ProcessingPipeline::runStage(StageState& state, FrameQueue& input, FrameQueue* output) {
+    QElapsedTimer timer;
+    while (true) {
+        timer.start();
+        AVFrame* frame = input.pop();
+        state.starvedTime.fetchAndAddRelaxed(timer.nsecsElapsed());
+        if (!frame) {
+            break;
+        }
+
+        timer.start();
+        bool success = state.work(frame);
+        state.busyTime.fetchAndAddRelaxed(timer.nsecsElapsed());
+        if (!success) {
+            dispose(frame);
+            fail();
+            break;
+        }
+        state.frames.fetchAndAddRelaxed(1);
+
+        if (!output) {
+            dispose(frame);
+            continue;
+        }
+        timer.start();
+        bool pushed = output->push(frame);
+        state.blockedTime.fetchAndAddRelaxed(timer.nsecsElapsed());
+        if (!pushed) {
+            break;
+        }
+    }
+    if (output) {
+        output->close();
+    }
+}
+
+void ProcessingPipeline::fail() {
+    failed.storeRelease(1);
+    QMutexLocker locker(&mutex);
+    for (const auto& queue : queues) {
+        queue->abort();
+    }
+}
+
+void ProcessingPipeline::dispose(AVFrame* frame) const {
+    if (release) {
+        release(frame);
+    } else {
+        av_frame_free(&frame);
+    }
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <QString>
+#include <QList>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QElapsedTimer>
+#include <QAtomicInteger>
+#include <functional>
+#include <memory>
+#include <deque>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+// Bounded hand-off between two pipeline stages. push() blocks while the
+// queue is full, which holds a fast producer back to a slow consumer and
+// caps the number of frames alive at once. Owns the frames it holds.
+class FrameQueue {
+public:
+    // Where frames go once done with; av_frame_free when empty
+    using Release = std::function<void(AVFrame* frame)>;
+
+    explicit FrameQueue(int capacity, const Release& release = Release());
+    ~FrameQueue();
+
+    FrameQueue(const FrameQueue&) = delete;
+    FrameQueue& operator=(const FrameQueue&) = delete;
+
+    // Takes ownership. Returns false, releasing the frame, once aborted.
+    bool push(AVFrame* frame);
+
+    // Null when closed and drained, or aborted
+    AVFrame* pop();
+
+    // No more frames will be pushed; consumers drain what is left
+    void close();
+
+    // Drop everything and release both sides
+    void abort();
+
+    int capacity() const { return maxSize; }
+    int size() const;
+
+    // Time-weighted average number of frames held since construction
+    double averageFill() const;
+
+private:
+    std::deque<AVFrame*> frames;
+    Release release;
+    int maxSize;
+    bool closed;
+    bool aborted;
+    QWaitCondition notEmpty;
+    QWaitCondition notFull;
+    QElapsedTimer clock;
+    qint64 lastChange;   // Nanoseconds on clock
+    double fillTime;     // Frames held × nanoseconds
+    mutable QMutex mutex;
+
+    void recordFill();
+    void dispose(AVFrame* frame) const;
+};
+
+// Runs a source, any number of in-place processing stages and a sink on
+// threads of their own, joined by FrameQueues. Stages overlap, so a job
+// takes as long as its slowest stage rather than the sum of all of them.
+// Each stage reports how its time splits between working, waiting for
+// input and waiting for room downstream, which shows the bottleneck.
+class ProcessingPipeline {
+public:
+    // Next frame, or null at the end of the input. The pipeline owns it.
+    using Source = std::function<AVFrame*()>;
+    // Work on a frame in place; false stops the pipeline
+    using Stage = std::function<bool(AVFrame* frame)>;
+    using Release = FrameQueue::Release;
+
+    struct StageStats {
+        QString name;
+        qint64 frames = 0;
+        double busy = 0.0;     // Fraction of wall time spent working
+        double starved = 0.0;  // Waiting for the previous stage
+        double blocked = 0.0;  // Waiting for room in the next queue
+    };
+
+    struct Stats {
+        QList<StageStats> stages;   // Source first, sink last
+        QList<double> queueFill;    // Average fraction full, per queue
+        qint64 elapsed = 0;         // Milliseconds
+        double fps = 0.0;           // Frames through the sink per second
+
+        // The busiest stage; the one to speed up
+        QString bottleneck() const;
+        QString toString() const;
+    };
+
+    explicit ProcessingPipeline(int queueCapacity = DEFAULT_QUEUE_CAPACITY);
+    ~ProcessingPipeline();
+
+    ProcessingPipeline(const ProcessingPipeline&) = delete;
+    ProcessingPipeline& operator=(const ProcessingPipeline&) = delete;
+
+    void setSource(const QString& name, const Source& source);
+    void addStage(const QString& name, const Stage& stage);
+    void setSink(const QString& name, const Stage& sink);
+
+    // Frames past the sink, or dropped, go here (to a FramePool, say)
+    void setRelease(const Release& release);
+
+    // Blocks until every frame has reached the sink. Returns false when a
+    // stage failed or the pipeline was cancelled. A pipeline runs once.
+    bool run();
+
+    // Stop all stages at the next frame; callable from any thread
+    void cancel();
+    bool isCancelled() const { return cancelled.loadAcquire() != 0; }
+
+    // Safe to call while running
+    Stats getStats() const;
+
+private:
+    struct StageState {
+        QString name;
+        Stage work;
+        QAtomicInteger<qint64> frames{0};
+        QAtomicInteger<qint64> busyTime{0};     // Nanoseconds
+        QAtomicInteger<qint64> starvedTime{0};
+        QAtomicInteger<qint64> blockedTime{0};
+    };
+
+    int queueCapacity;
+    Source source;
+    Release release;
+    QList<std::shared_ptr<StageState>> stages;  // Source, stages, sink
+    QList<std::shared_ptr<FrameQueue>> queues;  // queues[i] feeds stages[i + 1]
+    QAtomicInteger<int> cancelled;
+    QAtomicInteger<int> failed;
+    QElapsedTimer clock;
+    QAtomicInteger<qint64> runTime;  // Nanoseconds, once finished
+    mutable QMutex mutex;            // Guards queues and clock
+
+    // Helper functions
+    void runSource(StageState& state, FrameQueue& output);
+    void runStage(StageState& state, FrameQueue& input, FrameQueue* output);
+    void fail();
+    void dispose(AVFrame* frame) const;
+
+    // Constants
+    static const int DEFAULT_QUEUE_CAPACITY;
+};
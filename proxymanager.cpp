@@ -10,6 +10,7 @@ ProxyManager::ProxyManager(const QString& cacheDir, QObject* parent)
     : QObject(parent)
     , cacheDir(cacheDir)
     , proxyProcess(std::make_unique<QProcess>())
+    , seekIndexes(std::make_unique<SeekIndexStore>(cacheDir))
     , progress(0.0)
 {
     // Set up process
@@ -53,6 +54,9 @@ bool ProxyManager::createProxy(const QString& sourceFile) {
         return false;
     }
     
+    // Index keyframes of the original while the proxy encodes
+    seekIndexes->buildIndex(sourceFile);
+    
     // Generate proxy path
     QString proxyPath = generateProxyPath(sourceFile);
     proxyFiles[sourceFile] = proxyPath;
@@ -110,6 +114,8 @@ void ProxyManager::setCacheDirectory(const QString& dir) {
         
         cacheDir = dir;
         ensureCacheDirectory();
+        // Retargeted rather than replaced: loaders hold on to the store
+        seekIndexes->setDirectory(cacheDir);
     }
 }
 
@@ -126,6 +132,7 @@ qint64 ProxyManager::getCacheSize() const {
 
 void ProxyManager::clearCache() {
     clearAllProxies();
+    seekIndexes->clear();
     
     // Remove cache directory
     QDir dir(cacheDir);
@@ -6,6 +6,7 @@
 #include <QProcess>
 #include <memory>
 #include <optional>
+#include "seekindex.h"
 
 struct ProxySettings {
     QSize resolution{640, 360};  // Default proxy resolution
@@ -38,6 +39,11 @@ public:
     qint64 getCacheSize() const;
     void clearCache();
     
+    // Keyframe indexes, kept in the cache directory and built in the
+    // background when a proxy is requested or a FrameCache using the
+    // store first opens a file
+    SeekIndexStore* getSeekIndexStore() const { return seekIndexes.get(); }  // Lives as long as the manager
+    
     // Status
     bool isGeneratingProxy() const;
     double getProgress() const { return progress; }
@@ -59,6 +65,7 @@ private:
     QString cacheDir;
     ProxySettings proxySettings;
     std::unique_ptr<QProcess> proxyProcess;
+    std::unique_ptr<SeekIndexStore> seekIndexes;
     QString currentSourceFile;
     double progress;
     QString lastError;
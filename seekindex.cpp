@@ -0,0 +1,325 @@
+#include "seekindex.h"
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QDataStream>
+#include <QSaveFile>
+#include <QCryptographicHash>
+#include <QDeadlineTimer>
+#include <QDebug>
+#include <algorithm>
+
+namespace {
+
+const quint32 SEEK_INDEX_MAGIC = 0x534B4958;  // "SKIX"
+const quint32 SEEK_INDEX_VERSION = 1;
+
+} // namespace
+
+SeekIndex::SeekIndex()
+    : sourceSize(-1)
+    , sourceModified(0)
+    , streamIndex(-1)
+    , timeBase{1, 1000}
+{
+}
+
+SeekIndex SeekIndex::build(const QString& filePath, const CancelCheck& cancelled) {
+    SeekIndex index;
+    QFileInfo info(filePath);
+    index.sourcePath = info.absoluteFilePath();
+    index.sourceSize = info.size();
+    index.sourceModified = info.lastModified().toMSecsSinceEpoch();
+
+    AVFormatContext* context = nullptr;
+    if (avformat_open_input(&context, filePath.toUtf8().constData(), nullptr, nullptr) < 0) {
+        return SeekIndex();
+    }
+    if (avformat_find_stream_info(context, nullptr) < 0) {
+        avformat_close_input(&context);
+        return SeekIndex();
+    }
+
+    // Same stream the decoders pick
+    int stream = av_find_best_stream(context, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    if (stream < 0) {
+        avformat_close_input(&context);
+        return SeekIndex();
+    }
+    index.streamIndex = stream;
+    index.timeBase = context->streams[stream]->time_base;
+    int64_t startTime = context->streams[stream]->start_time != AV_NOPTS_VALUE
+        ? context->streams[stream]->start_time : 0;
+
+    // Only the video stream's packets are wanted; headers are enough
+    for (unsigned int i = 0; i < context->nb_streams; i++) {
+        if (int(i) != stream) {
+            context->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+
+    AVPacket* packet = av_packet_alloc();
+    bool aborted = false;
+    int packets = 0;
+    while (packet && av_read_frame(context, packet) >= 0) {
+        if (packet->stream_index == stream && (packet->flags & AV_PKT_FLAG_KEY) &&
+            packet->pts != AV_NOPTS_VALUE) {
+            qint64 timestamp = av_rescale_q(packet->pts - startTime, index.timeBase,
+                                            AVRational{1, 1000});
+            index.keyframes.append({timestamp, packet->pts, packet->pos});
+        }
+        av_packet_unref(packet);
+
+        if (cancelled && ++packets % 256 == 0 && cancelled()) {
+            aborted = true;
+            break;
+        }
+    }
+    av_packet_free(&packet);
+    avformat_close_input(&context);
+
+    if (aborted) {
+        return SeekIndex();
+    }
+
+    // Demux order is decode order; open-GOP streams can reorder keyframes
+    std::sort(index.keyframes.begin(), index.keyframes.end(),
+              [](const Keyframe& a, const Keyframe& b) { return a.timestamp < b.timestamp; });
+    return index;
+}
+
+bool SeekIndex::load(const QString& indexPath, const QString& path) {
+    QFile file(indexPath);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    QDataStream in(&file);
+    quint32 magic, version;
+    in >> magic >> version;
+    if (magic != SEEK_INDEX_MAGIC || version != SEEK_INDEX_VERSION) {
+        return false;
+    }
+
+    SeekIndex loaded;
+    qint32 stream, count;
+    in >> loaded.sourcePath >> loaded.sourceSize >> loaded.sourceModified
+       >> stream >> loaded.timeBase.num >> loaded.timeBase.den >> count;
+    loaded.streamIndex = stream;
+    if (in.status() != QDataStream::Ok || count < 0 || !loaded.matchesSource(path)) {
+        return false;
+    }
+
+    loaded.keyframes.reserve(count);
+    for (int i = 0; i < count && in.status() == QDataStream::Ok; i++) {
+        qint64 timestamp, pts, position;
+        in >> timestamp >> pts >> position;
+        loaded.keyframes.append({timestamp, pts, position});
+    }
+    if (in.status() != QDataStream::Ok) {
+        return false;
+    }
+
+    *this = loaded;
+    return true;
+}
+
+bool SeekIndex::save(const QString& indexPath) const {
+    QSaveFile file(indexPath);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+
+    QDataStream out(&file);
+    out << SEEK_INDEX_MAGIC << SEEK_INDEX_VERSION;
+    out << sourcePath << sourceSize << sourceModified
+        << qint32(streamIndex) << qint32(timeBase.num) << qint32(timeBase.den)
+        << qint32(keyframes.size());
+    for (const Keyframe& keyframe : keyframes) {
+        out << qint64(keyframe.timestamp) << qint64(keyframe.pts) << qint64(keyframe.position);
+    }
+    return file.commit();
+}
+
+bool SeekIndex::isCurrent() const {
+    return isValid() && matchesSource(sourcePath);
+}
+
+const SeekIndex::Keyframe* SeekIndex::keyframeAt(qint64 timestamp) const {
+    auto after = std::upper_bound(keyframes.begin(), keyframes.end(), timestamp,
+        [](qint64 value, const Keyframe& keyframe) { return value < keyframe.timestamp; });
+    return after != keyframes.begin() ? &*std::prev(after) : nullptr;
+}
+
+int SeekIndex::seek(AVFormatContext* context, qint64 timestamp) const {
+    const Keyframe* keyframe = keyframeAt(timestamp);
+    if (!keyframe) {
+        keyframe = isValid() ? &keyframes.first() : nullptr;
+    }
+    if (!keyframe || streamIndex < 0 || streamIndex >= int(context->nb_streams)) {
+        return AVERROR(EINVAL);
+    }
+
+    // Formats with unreliable timestamps (MPEG-TS/PS) bisect the file on a
+    // pts seek; the packet's offset takes us there in one jump
+    const AVInputFormat* format = context->iformat;
+    if (keyframe->position >= 0 && (format->flags & AVFMT_TS_DISCONT) &&
+        !(format->flags & AVFMT_NO_BYTE_SEEK)) {
+        int ret = av_seek_frame(context, streamIndex, keyframe->position, AVSEEK_FLAG_BYTE);
+        if (ret >= 0) {
+            return ret;
+        }
+    }
+
+    // Otherwise ask for the keyframe's exact pts, which the demuxer's own
+    // index resolves without searching
+    return av_seek_frame(context, streamIndex, keyframe->pts, AVSEEK_FLAG_BACKWARD);
+}
+
+bool SeekIndex::matchesSource(const QString& path) const {
+    QFileInfo info(path);
+    return info.exists() && info.absoluteFilePath() == sourcePath &&
+           info.size() == sourceSize &&
+           info.lastModified().toMSecsSinceEpoch() == sourceModified;
+}
+
+SeekIndexStore::SeekIndexStore(const QString& directory, QObject* parent)
+    : QObject(parent)
+    , running(true)
+{
+    setDirectory(directory);
+
+    builder.reset(QThread::create([this] { builderLoop(); }));
+    builder->start(QThread::LowPriority);
+}
+
+SeekIndexStore::~SeekIndexStore() {
+    {
+        QMutexLocker locker(&mutex);
+        running = false;
+        pendingBuilds.clear();
+        buildAvailable.wakeAll();
+    }
+    builder->wait();
+}
+
+void SeekIndexStore::setDirectory(const QString& value) {
+    QDir dir(value);
+    if (!dir.exists() && !dir.mkpath(".")) {
+        qDebug() << "Failed to create seek index directory:" << value;
+    }
+
+    // A build under way finishes, but its index is not kept
+    QMutexLocker locker(&mutex);
+    directory = value;
+    pendingBuilds.clear();
+    indexes.clear();
+}
+
+QString SeekIndexStore::getDirectory() const {
+    QMutexLocker locker(&mutex);
+    return directory;
+}
+
+void SeekIndexStore::buildIndex(const QString& filePath) {
+    if (indexFor(filePath)) {
+        return;
+    }
+
+    QMutexLocker locker(&mutex);
+    if (!pendingBuilds.contains(filePath) && !building.contains(filePath)) {
+        pendingBuilds.append(filePath);
+        buildAvailable.wakeOne();
+    }
+}
+
+std::shared_ptr<const SeekIndex> SeekIndexStore::indexFor(const QString& filePath) {
+    QMutexLocker locker(&mutex);
+    auto it = indexes.constFind(filePath);
+    if (it != indexes.constEnd()) {
+        if ((*it)->isCurrent()) {
+            return *it;
+        }
+        indexes.erase(it);
+    }
+
+    auto index = std::make_shared<SeekIndex>();
+    if (!index->load(indexPath(filePath), filePath)) {
+        return nullptr;
+    }
+    indexes.insert(filePath, index);
+    return index;
+}
+
+bool SeekIndexStore::waitForIndex(const QString& filePath, int msecs) {
+    QDeadlineTimer deadline = msecs < 0 ? QDeadlineTimer(QDeadlineTimer::Forever)
+                                        : QDeadlineTimer(msecs);
+    QMutexLocker locker(&mutex);
+    while (pendingBuilds.contains(filePath) || building.contains(filePath)) {
+        if (!buildDone.wait(&mutex, deadline)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void SeekIndexStore::clear() {
+    QMutexLocker locker(&mutex);
+    pendingBuilds.clear();
+    indexes.clear();
+
+    QDir dir(directory);
+    for (const QString& name : dir.entryList({"*.seekidx"}, QDir::Files)) {
+        dir.remove(name);
+    }
+}
+
+QString SeekIndexStore::indexPath(const QString& filePath) const {
+    QByteArray hash = QCryptographicHash::hash(
+        QFileInfo(filePath).absoluteFilePath().toUtf8(), QCryptographicHash::Md5).toHex();
+    return QDir(directory).filePath(QString("%1.seekidx").arg(QString(hash)));
+}
+
+void SeekIndexStore::builderLoop() {
+    while (true) {
+        QString filePath;
+        QString targetPath;
+        {
+            QMutexLocker locker(&mutex);
+            while (running && pendingBuilds.isEmpty()) {
+                buildAvailable.wait(&mutex);
+            }
+            if (!running) {
+                break;
+            }
+            filePath = pendingBuilds.takeFirst();
+            targetPath = indexPath(filePath);
+            building.insert(filePath);
+        }
+
+        SeekIndex index = SeekIndex::build(filePath, [this] {
+            QMutexLocker locker(&mutex);
+            return !running;
+        });
+        bool saved = index.isValid() && index.save(targetPath);
+
+        {
+            QMutexLocker locker(&mutex);
+            if (index.isValid() && indexPath(filePath) == targetPath) {
+                indexes.insert(filePath, std::make_shared<SeekIndex>(index));
+            }
+            building.remove(filePath);
+            buildDone.wakeAll();
+        }
+
+        if (index.isValid()) {
+            if (!saved) {
+                qDebug() << "Failed to save seek index for" << filePath;
+            }
+            emit indexReady(filePath);
+        } else {
+            emit indexFailed(filePath);
+        }
+    }
+}
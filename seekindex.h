@@ -0,0 +1,115 @@
+#pragma once
+
+#include <QObject>
+#include <QString>
+#include <QVector>
+#include <QHash>
+#include <QSet>
+#include <QList>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QThread>
+#include <functional>
+#include <memory>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+// Keyframe positions of a file's video stream, gathered by one pass over
+// the packets (nothing is decoded). With it a decoder seeks straight to
+// the keyframe before a target instead of letting the demuxer search for
+// one, which is slow on MP4s with a large moov and slower still on
+// MPEG-TS. The source is identified by size and modification time, so an
+// index of an edited file is never used.
+class SeekIndex {
+public:
+    struct Keyframe {
+        qint64 timestamp;  // Milliseconds from the stream start
+        int64_t pts;       // In the stream's time base
+        int64_t position;  // Byte offset of the packet, -1 when unknown
+    };
+
+    using CancelCheck = std::function<bool()>;
+
+    SeekIndex();
+
+    // Demux the whole file; returns an invalid index on failure or when
+    // cancelled() returns true
+    static SeekIndex build(const QString& filePath, const CancelCheck& cancelled = CancelCheck());
+
+    // Fails when the file is unreadable or the source has changed since
+    bool load(const QString& indexPath, const QString& sourcePath);
+    bool save(const QString& indexPath) const;
+
+    bool isValid() const { return !keyframes.isEmpty(); }
+    bool isCurrent() const;  // Source unchanged on disk
+    QString getSourcePath() const { return sourcePath; }
+    int getStreamIndex() const { return streamIndex; }
+    const QVector<Keyframe>& getKeyframes() const { return keyframes; }
+
+    // Keyframe at or before a time; null when the time precedes the first
+    const Keyframe* keyframeAt(qint64 timestamp) const;
+
+    // Position the demuxer at the keyframe covering a time, by byte offset
+    // where the format allows it, otherwise by its exact pts. Returns the
+    // libavformat result.
+    int seek(AVFormatContext* context, qint64 timestamp) const;
+
+private:
+    QString sourcePath;
+    qint64 sourceSize;
+    qint64 sourceModified;  // Milliseconds since the epoch
+    int streamIndex;
+    AVRational timeBase;
+    QVector<Keyframe> keyframes;  // Ascending by timestamp
+
+    bool matchesSource(const QString& path) const;
+};
+
+// Seek indexes for imported media, kept as files in one directory. Builds
+// run on a background thread; decoders pick up whatever is ready when they
+// open a file. Thread-safe.
+class SeekIndexStore : public QObject {
+    Q_OBJECT
+
+public:
+    explicit SeekIndexStore(const QString& directory, QObject* parent = nullptr);
+    ~SeekIndexStore();
+
+    // Points the store at another directory; indexes and builds queued
+    // for the old one are dropped. Holders of the store keep using it.
+    void setDirectory(const QString& directory);
+    QString getDirectory() const;
+
+    // Queue a build unless a current index already exists
+    void buildIndex(const QString& filePath);
+
+    // Current index for a file, loaded from disk on first use; null while
+    // none is available
+    std::shared_ptr<const SeekIndex> indexFor(const QString& filePath);
+
+    // Block until queued builds for a file are done (-1 waits forever)
+    bool waitForIndex(const QString& filePath, int msecs = -1);
+
+    void clear();
+
+signals:
+    void indexReady(const QString& filePath);
+    void indexFailed(const QString& filePath);
+
+private:
+    QString directory;
+    QHash<QString, std::shared_ptr<const SeekIndex>> indexes;
+    QList<QString> pendingBuilds;
+    QSet<QString> building;
+    std::unique_ptr<QThread> builder;
+    QWaitCondition buildAvailable;
+    QWaitCondition buildDone;
+    bool running;
+    mutable QMutex mutex;
+
+    // Helper functions
+    QString indexPath(const QString& filePath) const;
+    void builderLoop();
+};
@@ -0,0 +1,327 @@
+#include "spatialdenoiser.h"
+#include "parallelrows.h"
+#include <cstdlib>
+
+#if defined(HAVE_AVX2_KERNELS)
+#include <immintrin.h>
+#endif
+#if defined(HAVE_NEON_KERNELS)
+#include <arm_neon.h>
+#endif
+
+extern "C" {
+#include <libavutil/pixdesc.h>
+#include <libavutil/imgutils.h>
+}
+
+const int SpatialDenoiser::DEFAULT_LUMA_STRENGTH = 12;   // Levels; visible grain at ISO 3200
+const int SpatialDenoiser::DEFAULT_CHROMA_STRENGTH = 16; // Chroma noise is coarser
+const int SpatialDenoiser::MAX_STRENGTH = 255;
+
+// The weight of a neighbour is its spatial weight (1-2-1 by 1-2-1) times
+// max(0, strength - |neighbour - centre|). Sums stay in 32-bit integers
+// and the one division is done in float the same way by every kernel,
+// which keeps their output identical. Above 8 bits the second factor is
+// shifted down to 8-bit precision, so weights mean the same at every depth
+// and 16-bit sums still fit.
+template <typename Sample>
+using RowKernel = void (*)(const Sample* above, const Sample* row, const Sample* below,
+                           Sample* out, int width, int strength, int shift);
+
+// Helper functions
+template <typename Sample>
+static inline Sample denoisePixel(const Sample* above, const Sample* row, const Sample* below,
+                                  int left, int x, int right, int strength, int shift) {
+    const Sample* rows[3] = {above, row, below};
+    const int columns[3] = {left, x, right};
+    static const int spatial[3][3] = {{1, 2, 1}, {2, 4, 2}, {1, 2, 1}};
+
+    int centre = row[x];
+    int sumWeights = 0;
+    int sumWeighted = 0;
+    for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 3; c++) {
+            int neighbour = rows[r][columns[c]];
+            int weight = (strength - std::abs(neighbour - centre)) >> shift;
+            if (weight > 0) {
+                weight *= spatial[r][c];
+                sumWeights += weight;
+                sumWeighted += weight * neighbour;
+            }
+        }
+    }
+    // The centre always counts, so sumWeights > 0
+    return Sample(int(float(sumWeighted) / float(sumWeights) + 0.5f));
+}
+
+template <typename Sample>
+static void denoiseEdges(const Sample* above, const Sample* row, const Sample* below,
+                         Sample* out, int from, int width, int strength, int shift) {
+    // Columns from `from` to the end, and the first, clamping at the borders
+    for (int x = from; x < width; x++) {
+        out[x] = denoisePixel(above, row, below, qMax(x - 1, 0), x, qMin(x + 1, width - 1), strength, shift);
+    }
+    if (from > 0) {
+        out[0] = denoisePixel(above, row, below, 0, 0, qMin(1, width - 1), strength, shift);
+    }
+}
+
+template <typename Sample>
+static void denoiseRowScalar(const Sample* above, const Sample* row, const Sample* below,
+                             Sample* out, int width, int strength, int shift) {
+    denoiseEdges(above, row, below, out, 0, width, strength, shift);
+}
+
+#if defined(HAVE_AVX2_KERNELS)
+AVX2_TARGET static inline __m256i load8x32(const uint8_t* p) {
+    return _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)));
+}
+
+AVX2_TARGET static inline __m256i load8x32(const uint16_t* p) {
+    return _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+}
+
+AVX2_TARGET static inline void store8(uint8_t* p, __m128i words) {
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(p), _mm_packus_epi16(words, words));
+}
+
+AVX2_TARGET static inline void store8(uint16_t* p, __m128i words) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(p), words);
+}
+
+template <typename Sample>
+AVX2_TARGET static inline void accumulate8(const Sample* p, __m256i centre, __m256i strength, __m128i depthShift,
+                                           int shift, __m256i& sumWeights, __m256i& sumWeighted) {
+    __m256i neighbour = load8x32(p);
+    __m256i weight = _mm256_sub_epi32(strength, _mm256_abs_epi32(_mm256_sub_epi32(neighbour, centre)));
+    if (sizeof(Sample) > 1) {
+        weight = _mm256_sra_epi32(weight, depthShift);
+    }
+    weight = _mm256_max_epi32(weight, _mm256_setzero_si256());
+    weight = _mm256_sll_epi32(weight, _mm_cvtsi32_si128(shift));
+    sumWeights = _mm256_add_epi32(sumWeights, weight);
+    sumWeighted = _mm256_add_epi32(sumWeighted, _mm256_mullo_epi32(weight, neighbour));
+}
+
+template <typename Sample>
+AVX2_TARGET static inline void denoiseBlockAVX2(const Sample* above, const Sample* row, const Sample* below,
+                                                Sample* out, int x, __m256i limit, __m128i depthShift) {
+    __m256i centre = load8x32(row + x);
+    __m256i sumWeights = _mm256_setzero_si256();
+    __m256i sumWeighted = _mm256_setzero_si256();
+    accumulate8(above + x - 1, centre, limit, depthShift, 0, sumWeights, sumWeighted);
+    accumulate8(above + x,     centre, limit, depthShift, 1, sumWeights, sumWeighted);
+    accumulate8(above + x + 1, centre, limit, depthShift, 0, sumWeights, sumWeighted);
+    accumulate8(row + x - 1,   centre, limit, depthShift, 1, sumWeights, sumWeighted);
+    accumulate8(row + x,       centre, limit, depthShift, 2, sumWeights, sumWeighted);
+    accumulate8(row + x + 1,   centre, limit, depthShift, 1, sumWeights, sumWeighted);
+    accumulate8(below + x - 1, centre, limit, depthShift, 0, sumWeights, sumWeighted);
+    accumulate8(below + x,     centre, limit, depthShift, 1, sumWeights, sumWeighted);
+    accumulate8(below + x + 1, centre, limit, depthShift, 0, sumWeights, sumWeighted);
+
+    __m256 mean = _mm256_div_ps(_mm256_cvtepi32_ps(sumWeighted), _mm256_cvtepi32_ps(sumWeights));
+    __m256i result = _mm256_cvttps_epi32(_mm256_add_ps(mean, _mm256_set1_ps(0.5f)));
+    store8(out + x, _mm_packus_epi32(_mm256_castsi256_si128(result), _mm256_extracti128_si256(result, 1)));
+}
+
+template <typename Sample>
+AVX2_TARGET static void denoiseRowAVX2(const Sample* above, const Sample* row, const Sample* below,
+                                       Sample* out, int width, int strength, int shift) {
+    if (width < 10) {
+        denoiseEdges(above, row, below, out, 0, width, strength, shift);
+        return;
+    }
+
+    // Interior columns eight at a time; every tap stays inside the row. The
+    // last block overlaps the one before rather than leave a scalar tail,
+    // which on narrow tiles costs as much as the rest of the row.
+    const __m256i limit = _mm256_set1_epi32(strength);
+    const __m128i depthShift = _mm_cvtsi32_si128(shift);
+    for (int x = 1; x < width - 9; x += 8) {
+        denoiseBlockAVX2(above, row, below, out, x, limit, depthShift);
+    }
+    denoiseBlockAVX2(above, row, below, out, width - 9, limit, depthShift);
+    denoiseEdges(above, row, below, out, width - 1, width, strength, shift);
+}
+#endif
+
+#if defined(HAVE_NEON_KERNELS)
+static inline void accumulate4(int32x4_t neighbour, int32x4_t centre, int32x4_t strength, int32x4_t depthShift,
+                               int spatial, int32x4_t& sumWeights, int32x4_t& sumWeighted) {
+    // depthShift is negative, for a right shift
+    int32x4_t weight = vshlq_s32(vsubq_s32(strength, vabdq_s32(neighbour, centre)), depthShift);
+    weight = vmulq_n_s32(vmaxq_s32(weight, vdupq_n_s32(0)), spatial);
+    sumWeights = vaddq_s32(sumWeights, weight);
+    sumWeighted = vmlaq_s32(sumWeighted, weight, neighbour);
+}
+
+static inline uint16x8_t load8(const uint8_t* p) {
+    return vmovl_u8(vld1_u8(p));
+}
+
+static inline uint16x8_t load8(const uint16_t* p) {
+    return vld1q_u16(p);
+}
+
+static inline void store8(uint8_t* p, uint16x8_t words) {
+    vst1_u8(p, vqmovn_u16(words));
+}
+
+static inline void store8(uint16_t* p, uint16x8_t words) {
+    vst1q_u16(p, words);
+}
+
+template <typename Sample>
+static inline void widen8(const Sample* p, int32x4_t& low, int32x4_t& high) {
+    uint16x8_t words = load8(p);
+    low = vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(words)));
+    high = vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(words)));
+}
+
+template <typename Sample>
+static inline void denoiseBlockNEON(const Sample* const* rows, Sample* out, int x, int32x4_t limit,
+                                    int32x4_t depthShift) {
+    static const int spatial[3][3] = {{1, 2, 1}, {2, 4, 2}, {1, 2, 1}};
+    int32x4_t centreLow, centreHigh;
+    widen8(rows[1] + x, centreLow, centreHigh);
+    int32x4_t weightsLow = vdupq_n_s32(0), weightsHigh = vdupq_n_s32(0);
+    int32x4_t weightedLow = vdupq_n_s32(0), weightedHigh = vdupq_n_s32(0);
+    for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 3; c++) {
+            int32x4_t low, high;
+            widen8(rows[r] + x + c - 1, low, high);
+            accumulate4(low, centreLow, limit, depthShift, spatial[r][c], weightsLow, weightedLow);
+            accumulate4(high, centreHigh, limit, depthShift, spatial[r][c], weightsHigh, weightedHigh);
+        }
+    }
+
+    const float32x4_t half = vdupq_n_f32(0.5f);
+    float32x4_t meanLow = vdivq_f32(vcvtq_f32_s32(weightedLow), vcvtq_f32_s32(weightsLow));
+    float32x4_t meanHigh = vdivq_f32(vcvtq_f32_s32(weightedHigh), vcvtq_f32_s32(weightsHigh));
+    int32x4_t resultLow = vcvtq_s32_f32(vaddq_f32(meanLow, half));
+    int32x4_t resultHigh = vcvtq_s32_f32(vaddq_f32(meanHigh, half));
+    store8(out + x, vcombine_u16(vqmovun_s32(resultLow), vqmovun_s32(resultHigh)));
+}
+
+template <typename Sample>
+static void denoiseRowNEON(const Sample* above, const Sample* row, const Sample* below,
+                           Sample* out, int width, int strength, int shift) {
+    if (width < 10) {
+        denoiseEdges(above, row, below, out, 0, width, strength, shift);
+        return;
+    }
+
+    // As the AVX2 kernel, the last block overlaps instead of a scalar tail
+    const int32x4_t limit = vdupq_n_s32(strength);
+    const int32x4_t depthShift = vdupq_n_s32(-shift);
+    const Sample* rows[3] = {above, row, below};
+    for (int x = 1; x < width - 9; x += 8) {
+        denoiseBlockNEON(rows, out, x, limit, depthShift);
+    }
+    denoiseBlockNEON(rows, out, width - 9, limit, depthShift);
+    denoiseEdges(above, row, below, out, width - 1, width, strength, shift);
+}
+#endif
+
+template <typename Sample>
+static RowKernel<Sample> rowKernel(SimdKernel kernel) {
+    switch (kernel) {
+#if defined(HAVE_AVX2_KERNELS)
+    case SimdKernel::AVX2:
+        return denoiseRowAVX2<Sample>;
+#endif
+#if defined(HAVE_NEON_KERNELS)
+    case SimdKernel::NEON:
+        return denoiseRowNEON<Sample>;
+#endif
+    default:
+        return denoiseRowScalar<Sample>;
+    }
+}
+
+template <typename Sample>
+static void filterPlane(SimdKernel kernel, const uint8_t* source, int sourceStride,
+                        uint8_t* target, int targetStride, int width, int height, int strength, int shift) {
+    RowKernel<Sample> filterRow = rowKernel<Sample>(kernel);
+    ParallelRows::run(height, [=](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            auto row = reinterpret_cast<const Sample*>(source + qint64(y) * sourceStride);
+            auto above = y > 0 ? reinterpret_cast<const Sample*>(source + qint64(y - 1) * sourceStride) : row;
+            auto below = y + 1 < height ? reinterpret_cast<const Sample*>(source + qint64(y + 1) * sourceStride)
+                                        : row;
+            filterRow(above, row, below, reinterpret_cast<Sample*>(target + qint64(y) * targetStride),
+                      width, strength, shift);
+        }
+    });
+}
+
+SpatialDenoiser::SpatialDenoiser()
+    : lumaStrength(DEFAULT_LUMA_STRENGTH)
+    , chromaStrength(DEFAULT_CHROMA_STRENGTH)
+    , kernel(bestKernel())
+{
+}
+
+void SpatialDenoiser::setStrength(int luma, int chroma) {
+    lumaStrength = qBound(0, luma, MAX_STRENGTH);
+    chromaStrength = qBound(0, chroma, MAX_STRENGTH);
+}
+
+void SpatialDenoiser::setKernel(SimdKernel value) {
+    kernel = CpuFeatures::resolve(value);
+}
+
+bool SpatialDenoiser::isSupported(const AVFrame* frame) {
+    if (!frame) {
+        return false;
+    }
+    // Samples of 8 bits, or 9 to 16 in the low bits of native-endian words
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(AVPixelFormat(frame->format));
+    return desc && (desc->flags & AV_PIX_FMT_FLAG_PLANAR) && !(desc->flags & AV_PIX_FMT_FLAG_RGB) &&
+           !(desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BE)) &&
+           av_pix_fmt_count_planes(AVPixelFormat(frame->format)) == desc->nb_components &&
+           desc->comp[0].shift == 0 && desc->comp[0].depth >= 8 && desc->comp[0].depth <= 16;
+}
+
+bool SpatialDenoiser::process(const AVFrame* source, AVFrame* target) const {
+    if (!isSupported(source) || !target || target->format != source->format ||
+        target->width != source->width || target->height != source->height) {
+        return false;
+    }
+
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(AVPixelFormat(source->format));
+    int planes = av_pix_fmt_count_planes(AVPixelFormat(source->format));
+    for (int plane = 0; plane < planes; plane++) {
+        bool chroma = plane == 1 || plane == 2;
+        int width = chroma ? AV_CEIL_RSHIFT(source->width, desc->log2_chroma_w) : source->width;
+        int height = chroma ? AV_CEIL_RSHIFT(source->height, desc->log2_chroma_h) : source->height;
+        // Alpha is left alone
+        int strength = plane == 0 ? lumaStrength : (chroma ? chromaStrength : 0);
+        processPlane(source->data[plane], source->linesize[plane],
+                     target->data[plane], target->linesize[plane],
+                     width, height, strength, desc->comp[0].depth);
+    }
+    return true;
+}
+
+void SpatialDenoiser::processPlane(const uint8_t* source, int sourceStride,
+                                   uint8_t* target, int targetStride,
+                                   int width, int height, int strength, int depth) const {
+    if (width <= 0 || height <= 0) {
+        return;
+    }
+    int bytes = depth > 8 ? 2 : 1;
+    if (strength <= 0) {
+        av_image_copy_plane(target, targetStride, source, sourceStride, width * bytes, height);
+        return;
+    }
+
+    // Strength in the plane's own levels
+    int shift = depth - 8;
+    if (bytes == 1) {
+        filterPlane<uint8_t>(kernel, source, sourceStride, target, targetStride, width, height, strength, 0);
+    } else {
+        filterPlane<uint16_t>(kernel, source, sourceStride, target, targetStride, width, height,
+                              strength << shift, shift);
+    }
+}
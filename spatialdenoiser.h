@@ -0,0 +1,52 @@
+#pragma once
+
+#include <QString>
+#include <cstdint>
+#include "cpufeatures.h"
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+// Edge-preserving spatial denoiser for planar YUV of 8 to 16 bits. Each pixel
+// becomes a weighted mean of its 3x3 neighbourhood, where neighbours that
+// differ from it by more than the strength get no weight, so noise
+// flattens and edges stay. Rows are filtered in bands across cores, eight
+// (AVX2) or four (NEON) pixels at a time, chosen at run time. Every kernel
+// gives bit-identical output.
+class SpatialDenoiser {
+public:
+    SpatialDenoiser();
+
+    // Largest difference, in 8-bit levels, still treated as noise; 0 copies
+    // the plane unchanged. Scaled to the depth of the frame.
+    void setStrength(int luma, int chroma);
+    int getLumaStrength() const { return lumaStrength; }
+    int getChromaStrength() const { return chromaStrength; }
+
+    // Falls back to Scalar when the CPU lacks the requested set
+    void setKernel(SimdKernel kernel);
+    SimdKernel getKernel() const { return kernel; }
+    static SimdKernel bestKernel() { return CpuFeatures::resolve(SimdKernel::Auto); }
+
+    static bool isSupported(const AVFrame* frame);
+
+    // Filters source into target, which must have the same geometry and
+    // format; planes may not overlap
+    bool process(const AVFrame* source, AVFrame* target) const;
+
+    // Width in samples; above 8 bits a sample is a native-endian word
+    void processPlane(const uint8_t* source, int sourceStride,
+                      uint8_t* target, int targetStride,
+                      int width, int height, int strength, int depth = 8) const;
+
+private:
+    int lumaStrength;
+    int chromaStrength;
+    SimdKernel kernel;
+
+    // Constants
+    static const int DEFAULT_LUMA_STRENGTH;
+    static const int DEFAULT_CHROMA_STRENGTH;
+    static const int MAX_STRENGTH;
+};
@@ -0,0 +1,685 @@
+#include "stabilizer.h"
+#include "parallelrows.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QDataStream>
+#include <QSaveFile>
+#include <QHash>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/imgutils.h>
+#include <libswscale/swscale.h>
+}
+
+namespace {
+
+const quint32 CAMERA_PATH_MAGIC = 0x53544142;  // "STAB"
+const quint32 CAMERA_PATH_VERSION = 1;
+
+const int ANALYSIS_WIDTH = 480;     // Frames are matched at about this width
+const int BATCH_FRAMES = 32;        // Decoded before their pairs are matched in parallel
+const int BLOCK_SIZE = 16;
+const int COARSE_RANGE = 12;        // Half-resolution pixels, either way
+const int FINE_RANGE = 3;           // Analysis pixels around the coarse estimate
+const int MIN_GRADIENT = 4;         // Average per pixel; flatter blocks match anywhere
+const int MAX_MATCH_ERROR = 24;     // Average per pixel; worse matches are occlusions
+const int MIN_BLOCKS = 6;           // Matches needed to fit more than a translation
+const int FIT_ITERATIONS = 3;
+
+// Grey image without padding
+struct Plane {
+    int width = 0;
+    int height = 0;
+    std::vector<uint8_t> pixels;
+
+    const uint8_t* at(int x, int y) const { return pixels.data() + y * width + x; }
+};
+
+// Analysis resolution, and half of it for the coarse search
+struct Pyramid {
+    int64_t pts = 0;
+    Plane full;
+    Plane half;
+};
+
+struct Match {
+    double x, y;    // Block centre in the previous frame
+    double tx, ty;  // Where it is in this one
+};
+
+// Helper functions
+uint32_t blockSad(const Plane& a, int ax, int ay, const Plane& b, int bx, int by) {
+    uint32_t sum = 0;
+    for (int y = 0; y < BLOCK_SIZE; y++) {
+        const uint8_t* rowA = a.at(ax, ay + y);
+        const uint8_t* rowB = b.at(bx, by + y);
+        for (int x = 0; x < BLOCK_SIZE; x++) {
+            sum += uint32_t(std::abs(rowA[x] - rowB[x]));
+        }
+    }
+    return sum;
+}
+
+uint32_t blockGradient(const Plane& plane, int bx, int by) {
+    uint32_t sum = 0;
+    for (int y = 0; y < BLOCK_SIZE; y++) {
+        const uint8_t* row = plane.at(bx, by + y);
+        const uint8_t* below = plane.at(bx, std::min(by + y + 1, plane.height - 1));
+        for (int x = 0; x < BLOCK_SIZE; x++) {
+            int right = row[std::min(x + 1, plane.width - bx - 1)];
+            sum += uint32_t(std::abs(right - row[x]) + std::abs(below[x] - row[x]));
+        }
+    }
+    return sum;
+}
+
+// Offset of a minimum from the middle of three samples, under half a pixel
+double parabolaOffset(uint32_t before, uint32_t at, uint32_t after) {
+    double curvature = double(before) - 2.0 * double(at) + double(after);
+    if (curvature <= 0.0) {
+        return 0.0;
+    }
+    return std::max(-0.5, std::min(0.5, (double(before) - double(after)) / (2.0 * curvature)));
+}
+
+double median(std::vector<double> values) {
+    if (values.empty()) {
+        return 0.0;
+    }
+    auto middle = values.begin() + values.size() / 2;
+    std::nth_element(values.begin(), middle, values.end());
+    return *middle;
+}
+
+Plane halve(const Plane& plane) {
+    Plane half;
+    half.width = plane.width / 2;
+    half.height = plane.height / 2;
+    half.pixels.resize(size_t(half.width) * half.height);
+    for (int y = 0; y < half.height; y++) {
+        const uint8_t* top = plane.at(0, 2 * y);
+        const uint8_t* bottom = plane.at(0, 2 * y + 1);
+        uint8_t* out = half.pixels.data() + y * half.width;
+        for (int x = 0; x < half.width; x++) {
+            out[x] = uint8_t((top[2 * x] + top[2 * x + 1] + bottom[2 * x] + bottom[2 * x + 1] + 2) >> 2);
+        }
+    }
+    return half;
+}
+
+// Least-squares similarity from previous to current positions, about the
+// frame centre, refitted without the blocks that disagree with it
+CameraPath::Transform fitSimilarity(const std::vector<Match>& matches) {
+    CameraPath::Transform result;
+    std::vector<const Match*> inliers;
+    for (const Match& match : matches) {
+        inliers.push_back(&match);
+    }
+
+    for (int iteration = 0; iteration < FIT_ITERATIONS && int(inliers.size()) >= MIN_BLOCKS; iteration++) {
+        double meanX = 0, meanY = 0, meanTX = 0, meanTY = 0;
+        for (const Match* match : inliers) {
+            meanX += match->x;
+            meanY += match->y;
+            meanTX += match->tx;
+            meanTY += match->ty;
+        }
+        double count = double(inliers.size());
+        meanX /= count;
+        meanY /= count;
+        meanTX /= count;
+        meanTY /= count;
+
+        double spread = 0, dot = 0, cross = 0;
+        for (const Match* match : inliers) {
+            double x = match->x - meanX, y = match->y - meanY;
+            double tx = match->tx - meanTX, ty = match->ty - meanTY;
+            spread += x * x + y * y;
+            dot += x * tx + y * ty;
+            cross += x * ty - y * tx;
+        }
+        if (spread <= 0.0) {
+            break;
+        }
+        double a = dot / spread;
+        double b = cross / spread;
+        result.dx = meanTX - (a * meanX - b * meanY);
+        result.dy = meanTY - (b * meanX + a * meanY);
+        result.angle = std::atan2(b, a);
+        result.scale = std::hypot(a, b);
+
+        std::vector<double> residuals;
+        for (const Match* match : inliers) {
+            residuals.push_back(std::hypot(a * match->x - b * match->y + result.dx - match->tx,
+                                           b * match->x + a * match->y + result.dy - match->ty));
+        }
+        double limit = std::max(1.0, 3.0 * median(residuals));
+        std::vector<const Match*> kept;
+        for (size_t i = 0; i < inliers.size(); i++) {
+            if (residuals[i] <= limit) {
+                kept.push_back(inliers[i]);
+            }
+        }
+        if (kept.size() == inliers.size()) {
+            break;
+        }
+        inliers.swap(kept);
+    }
+    return result;
+}
+
+// Motion from previous to current, in analysis pixels
+CameraPath::Transform estimateMotion(const Pyramid& previous, const Pyramid& current) {
+    // Coarse: each textured block searched exhaustively at half resolution
+    std::vector<double> coarseX, coarseY;
+    const Plane& halfPrev = previous.half;
+    const Plane& halfCur = current.half;
+    for (int by = COARSE_RANGE; by + BLOCK_SIZE + COARSE_RANGE <= halfCur.height; by += BLOCK_SIZE) {
+        for (int bx = COARSE_RANGE; bx + BLOCK_SIZE + COARSE_RANGE <= halfCur.width; bx += BLOCK_SIZE) {
+            if (blockGradient(halfCur, bx, by) < uint32_t(MIN_GRADIENT * BLOCK_SIZE * BLOCK_SIZE)) {
+                continue;
+            }
+            uint32_t best = UINT32_MAX;
+            int bestX = 0, bestY = 0;
+            for (int vy = -COARSE_RANGE; vy <= COARSE_RANGE; vy++) {
+                for (int vx = -COARSE_RANGE; vx <= COARSE_RANGE; vx++) {
+                    uint32_t sad = blockSad(halfCur, bx, by, halfPrev, bx + vx, by + vy);
+                    if (sad < best) {
+                        best = sad;
+                        bestX = vx;
+                        bestY = vy;
+                    }
+                }
+            }
+            coarseX.push_back(bestX);
+            coarseY.push_back(bestY);
+        }
+    }
+    if (coarseX.empty()) {
+        return CameraPath::Transform();
+    }
+    int globalX = int(std::lround(median(coarseX))) * 2;
+    int globalY = int(std::lround(median(coarseY))) * 2;
+
+    // Fine: every block refined around it, to a fraction of a pixel
+    const Plane& prev = previous.full;
+    const Plane& cur = current.full;
+    double centreX = (cur.width - 1) * 0.5;
+    double centreY = (cur.height - 1) * 0.5;
+    int reach = FINE_RANGE + 1;
+    std::vector<Match> matches;
+    for (int by = 0; by + BLOCK_SIZE <= cur.height; by += BLOCK_SIZE) {
+        for (int bx = 0; bx + BLOCK_SIZE <= cur.width; bx += BLOCK_SIZE) {
+            int left = bx + globalX - reach;
+            int top = by + globalY - reach;
+            if (left < 0 || top < 0 || left + BLOCK_SIZE + 2 * reach > prev.width ||
+                top + BLOCK_SIZE + 2 * reach > prev.height ||
+                blockGradient(cur, bx, by) < uint32_t(MIN_GRADIENT * BLOCK_SIZE * BLOCK_SIZE)) {
+                continue;
+            }
+
+            // Costs over the window plus a one-pixel ring for interpolation
+            const int span = 2 * reach + 1;
+            uint32_t costs[2 * (FINE_RANGE + 1) + 1][2 * (FINE_RANGE + 1) + 1];
+            for (int j = 0; j < span; j++) {
+                for (int i = 0; i < span; i++) {
+                    costs[j][i] = blockSad(cur, bx, by, prev, left + i, top + j);
+                }
+            }
+            int bestI = reach, bestJ = reach;
+            for (int j = 1; j < span - 1; j++) {
+                for (int i = 1; i < span - 1; i++) {
+                    if (costs[j][i] < costs[bestJ][bestI]) {
+                        bestI = i;
+                        bestJ = j;
+                    }
+                }
+            }
+            if (costs[bestJ][bestI] > uint32_t(MAX_MATCH_ERROR * BLOCK_SIZE * BLOCK_SIZE)) {
+                continue;
+            }
+
+            double vx = globalX + bestI - reach +
+                        parabolaOffset(costs[bestJ][bestI - 1], costs[bestJ][bestI], costs[bestJ][bestI + 1]);
+            double vy = globalY + bestJ - reach +
+                        parabolaOffset(costs[bestJ - 1][bestI], costs[bestJ][bestI], costs[bestJ + 1][bestI]);
+            double x = bx + BLOCK_SIZE * 0.5 - centreX;
+            double y = by + BLOCK_SIZE * 0.5 - centreY;
+            matches.push_back({x + vx, y + vy, x, y});
+        }
+    }
+
+    if (int(matches.size()) < MIN_BLOCKS) {
+        // Too little to fit rotation; the coarse shift is better than nothing
+        CameraPath::Transform shift;
+        shift.dx = -globalX;
+        shift.dy = -globalY;
+        return shift;
+    }
+    return fitSimilarity(matches);
+}
+
+// Bilinear in 8.8 weights; sums stay within 32 bits unsigned at 16 bits a sample
+template <typename Sample>
+void warpPlane(const uint8_t* sourceBytes, int sourceStride, uint8_t* targetBytes, int targetStride,
+               int width, int height, const double matrix[6]) {
+    auto source = reinterpret_cast<const Sample*>(sourceBytes);
+    auto target = reinterpret_cast<Sample*>(targetBytes);
+    sourceStride /= int(sizeof(Sample));
+    targetStride /= int(sizeof(Sample));
+
+    // 16.16 fixed point, stepped along each row
+    const int64_t one = int64_t(1) << 16;
+    const int64_t stepX = std::llround(matrix[0] * one);
+    const int64_t stepY = std::llround(matrix[3] * one);
+    const int64_t maxX = int64_t(width - 1) << 16;
+    const int64_t maxY = int64_t(height - 1) << 16;
+
+    ParallelRows::run(height, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            int64_t sx = std::llround((matrix[1] * y + matrix[2]) * one);
+            int64_t sy = std::llround((matrix[4] * y + matrix[5]) * one);
+            Sample* out = target + qint64(y) * targetStride;
+
+            // Samples move in a straight line, so both ends inside the
+            // frame (less the last row and column) means every one is
+            int64_t lastX = sx + stepX * (width - 1);
+            int64_t lastY = sy + stepY * (width - 1);
+            if (std::min(sx, lastX) >= 0 && std::max(sx, lastX) < maxX &&
+                std::min(sy, lastY) >= 0 && std::max(sy, lastY) < maxY) {
+                for (int x = 0; x < width; x++, sx += stepX, sy += stepY) {
+                    int wx = int(sx >> 8) & 255;
+                    int wy = int(sy >> 8) & 255;
+                    const Sample* top = source + (sy >> 16) * sourceStride + (sx >> 16);
+                    uint32_t upper = top[0] * uint32_t(256 - wx) + top[1] * wx;
+                    uint32_t lower = top[sourceStride] * uint32_t(256 - wx) + top[sourceStride + 1] * wx;
+                    out[x] = Sample((upper * uint32_t(256 - wy) + lower * wy + 32768) >> 16);
+                }
+                continue;
+            }
+
+            for (int x = 0; x < width; x++, sx += stepX, sy += stepY) {
+                int64_t cx = std::min(std::max(sx, int64_t(0)), maxX);
+                int64_t cy = std::min(std::max(sy, int64_t(0)), maxY);
+                int ix = int(cx >> 16);
+                int iy = int(cy >> 16);
+                int wx = int(cx >> 8) & 255;
+                int wy = int(cy >> 8) & 255;
+                int nextX = ix + 1 < width ? 1 : 0;
+                const Sample* top = source + qint64(iy) * sourceStride + ix;
+                const Sample* bottom = iy + 1 < height ? top + sourceStride : top;
+                uint32_t upper = top[0] * uint32_t(256 - wx) + top[nextX] * wx;
+                uint32_t lower = bottom[0] * uint32_t(256 - wx) + bottom[nextX] * wx;
+                out[x] = Sample((upper * uint32_t(256 - wy) + lower * wy + 32768) >> 16);
+            }
+        }
+    });
+}
+
+} // namespace
+
+CameraPath::CameraPath()
+    : sourceSize(-1)
+    , sourceModified(0)
+    , width(0)
+    , height(0)
+    , smoothingRadius(-1)
+{
+}
+
+CameraPath CameraPath::analyze(const QString& filePath, const CancelCheck& cancelled) {
+    CameraPath path;
+    QFileInfo info(filePath);
+    path.sourcePath = info.absoluteFilePath();
+    path.sourceSize = info.size();
+    path.sourceModified = info.lastModified().toMSecsSinceEpoch();
+
+    AVFormatContext* context = nullptr;
+    if (avformat_open_input(&context, filePath.toUtf8().constData(), nullptr, nullptr) < 0) {
+        return CameraPath();
+    }
+    if (avformat_find_stream_info(context, nullptr) < 0) {
+        avformat_close_input(&context);
+        return CameraPath();
+    }
+
+    // Same stream the processor picks
+    int stream = av_find_best_stream(context, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    const AVCodec* codec = stream >= 0
+        ? avcodec_find_decoder(context->streams[stream]->codecpar->codec_id) : nullptr;
+    AVCodecContext* decoder = codec ? avcodec_alloc_context3(codec) : nullptr;
+    if (!decoder || avcodec_parameters_to_context(decoder, context->streams[stream]->codecpar) < 0) {
+        avcodec_free_context(&decoder);
+        avformat_close_input(&context);
+        return CameraPath();
+    }
+    decoder->thread_count = 0;
+    decoder->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    if (avcodec_open2(decoder, codec, nullptr) < 0) {
+        avcodec_free_context(&decoder);
+        avformat_close_input(&context);
+        return CameraPath();
+    }
+    for (unsigned int i = 0; i < context->nb_streams; i++) {
+        if (int(i) != stream) {
+            context->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+    path.width = decoder->width;
+    path.height = decoder->height;
+
+    // One factor for both axes, so rotation survives the downscale
+    int analysisWidth = std::min(path.width, ANALYSIS_WIDTH) & ~1;
+    double factor = double(path.width) / double(std::max(analysisWidth, 2));
+    int analysisHeight = int(std::lround(path.height / factor)) & ~1;
+    SwsContext* scaler = nullptr;
+
+    AVPacket* packet = av_packet_alloc();
+    AVFrame* frame = av_frame_alloc();
+    std::vector<Pyramid> batch;  // batch[0] is the last frame of the one before
+    bool draining = false;
+    bool failed = !packet || !frame || analysisWidth < 2 * BLOCK_SIZE || analysisHeight < 2 * BLOCK_SIZE;
+    bool aborted = false;
+
+    auto matchBatch = [&] {
+        // Each pair is independent; spread them over the cores
+        int first = path.frames.size();
+        int pairs = int(batch.size()) - 1;
+        path.frames.resize(first + pairs);
+        Frame* results = path.frames.data() + first;
+        ParallelRows::run(pairs, [&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                Transform motion = estimateMotion(batch[i], batch[i + 1]);
+                motion.dx *= factor;
+                motion.dy *= factor;
+                results[i] = {batch[i + 1].pts, motion};
+            }
+        }, 1);
+        batch.erase(batch.begin(), batch.end() - 1);
+    };
+
+    while (!failed) {
+        int ret = avcodec_receive_frame(decoder, frame);
+        if (ret == 0) {
+            scaler = sws_getCachedContext(scaler, frame->width, frame->height, AVPixelFormat(frame->format),
+                                          analysisWidth, analysisHeight, AV_PIX_FMT_GRAY8,
+                                          SWS_AREA, nullptr, nullptr, nullptr);
+            if (!scaler) {
+                failed = true;
+                break;
+            }
+            Pyramid pyramid;
+            pyramid.pts = frame->best_effort_timestamp;
+            pyramid.full.width = analysisWidth;
+            pyramid.full.height = analysisHeight;
+            pyramid.full.pixels.resize(size_t(analysisWidth) * analysisHeight);
+            uint8_t* planes[4] = {pyramid.full.pixels.data(), nullptr, nullptr, nullptr};
+            int strides[4] = {analysisWidth, 0, 0, 0};
+            sws_scale(scaler, frame->data, frame->linesize, 0, frame->height, planes, strides);
+            pyramid.half = halve(pyramid.full);
+            av_frame_unref(frame);
+
+            if (path.frames.isEmpty() && batch.empty()) {
+                // The first frame moves nowhere
+                path.frames.append({pyramid.pts, Transform()});
+            }
+            batch.push_back(std::move(pyramid));
+            if (int(batch.size()) > BATCH_FRAMES) {
+                matchBatch();
+                if (cancelled && cancelled()) {
+                    aborted = true;
+                    break;
+                }
+            }
+            continue;
+        }
+        if (ret == AVERROR_EOF) {
+            break;
+        }
+        if (ret != AVERROR(EAGAIN)) {
+            failed = true;
+            break;
+        }
+
+        // Decoder needs more input; at the end, drain what it holds
+        ret = av_read_frame(context, packet);
+        if (ret < 0) {
+            if (draining) {
+                break;
+            }
+            draining = true;
+            avcodec_send_packet(decoder, nullptr);
+            continue;
+        }
+        if (packet->stream_index == stream) {
+            ret = avcodec_send_packet(decoder, packet);
+            if (ret < 0 && ret != AVERROR(EAGAIN)) {
+                failed = true;
+            }
+        }
+        av_packet_unref(packet);
+    }
+    if (!failed && !aborted && batch.size() > 1) {
+        matchBatch();
+    }
+
+    sws_freeContext(scaler);
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    avcodec_free_context(&decoder);
+    avformat_close_input(&context);
+
+    if (failed || aborted) {
+        return CameraPath();
+    }
+    return path;
+}
+
+bool CameraPath::load(const QString& pathFile, const QString& path) {
+    QFile file(pathFile);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    QDataStream in(&file);
+    quint32 magic, version;
+    in >> magic >> version;
+    if (magic != CAMERA_PATH_MAGIC || version != CAMERA_PATH_VERSION) {
+        return false;
+    }
+
+    CameraPath loaded;
+    qint32 frameWidth, frameHeight, count;
+    in >> loaded.sourcePath >> loaded.sourceSize >> loaded.sourceModified
+       >> frameWidth >> frameHeight >> count;
+    loaded.width = frameWidth;
+    loaded.height = frameHeight;
+    if (in.status() != QDataStream::Ok || count < 0 || !loaded.matchesSource(path)) {
+        return false;
+    }
+
+    loaded.frames.reserve(count);
+    for (int i = 0; i < count && in.status() == QDataStream::Ok; i++) {
+        qint64 pts;
+        Transform motion;
+        in >> pts >> motion.dx >> motion.dy >> motion.angle >> motion.scale;
+        loaded.frames.append({pts, motion});
+    }
+    if (in.status() != QDataStream::Ok) {
+        return false;
+    }
+
+    *this = loaded;
+    return true;
+}
+
+bool CameraPath::save(const QString& pathFile) const {
+    QSaveFile file(pathFile);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+
+    QDataStream out(&file);
+    out << CAMERA_PATH_MAGIC << CAMERA_PATH_VERSION;
+    out << sourcePath << sourceSize << sourceModified
+        << qint32(width) << qint32(height) << qint32(frames.size());
+    for (const Frame& frame : frames) {
+        out << qint64(frame.pts) << frame.motion.dx << frame.motion.dy
+            << frame.motion.angle << frame.motion.scale;
+    }
+    return file.commit();
+}
+
+bool CameraPath::isCurrent() const {
+    return isValid() && matchesSource(sourcePath);
+}
+
+void CameraPath::smooth(int radius) {
+    radius = std::max(radius, 0);
+    smoothingRadius = radius;
+    int count = frames.size();
+
+    // Where the camera is, as running sums of the motion: x, y, angle, log scale
+    std::vector<std::array<double, 4>> position(count);
+    std::array<double, 4> sum{0.0, 0.0, 0.0, 0.0};
+    for (int i = 0; i < count; i++) {
+        const Transform& motion = frames[i].motion;
+        sum[0] += motion.dx;
+        sum[1] += motion.dy;
+        sum[2] += motion.angle;
+        sum[3] += std::log(std::max(motion.scale, 1e-3));
+        position[i] = sum;
+    }
+
+    // Moving average through prefix sums; the window shrinks at the ends
+    std::vector<std::array<double, 4>> prefix(count + 1, {0.0, 0.0, 0.0, 0.0});
+    for (int i = 0; i < count; i++) {
+        for (int c = 0; c < 4; c++) {
+            prefix[i + 1][c] = prefix[i][c] + position[i][c];
+        }
+    }
+    corrections.resize(count);
+    for (int i = 0; i < count; i++) {
+        int begin = std::max(i - radius, 0);
+        int end = std::min(i + radius + 1, count);
+        double smoothed[4];
+        for (int c = 0; c < 4; c++) {
+            smoothed[c] = (prefix[end][c] - prefix[begin][c]) / double(end - begin);
+        }
+        Transform& correction = corrections[i];
+        correction.dx = smoothed[0] - position[i][0];
+        correction.dy = smoothed[1] - position[i][1];
+        correction.angle = smoothed[2] - position[i][2];
+        correction.scale = std::exp(smoothed[3] - position[i][3]);
+    }
+}
+
+CameraPath::Transform CameraPath::correctionAt(int64_t pts) const {
+    if (corrections.size() != frames.size()) {
+        return Transform();
+    }
+    // Presentation order, so usually ascending; fall back to a scan
+    auto it = std::lower_bound(frames.begin(), frames.end(), pts,
+        [](const Frame& frame, int64_t value) { return frame.pts < value; });
+    if (it == frames.end() || it->pts != pts) {
+        it = std::find_if(frames.begin(), frames.end(),
+                          [pts](const Frame& frame) { return frame.pts == pts; });
+        if (it == frames.end()) {
+            return Transform();
+        }
+    }
+    return corrections[int(it - frames.begin())];
+}
+
+bool CameraPath::matchesSource(const QString& path) const {
+    QFileInfo info(path);
+    return info.exists() && info.absoluteFilePath() == sourcePath &&
+           info.size() == sourceSize &&
+           info.lastModified().toMSecsSinceEpoch() == sourceModified;
+}
+
+Stabilizer::Stabilizer()
+    : zoom(1.0)
+{
+}
+
+void Stabilizer::setZoom(double value) {
+    zoom = std::max(1.0, std::min(value, 2.0));
+}
+
+bool Stabilizer::isSupported(const AVFrame* frame) {
+    if (!frame) {
+        return false;
+    }
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(AVPixelFormat(frame->format));
+    // Samples of 8 bits, or 9 to 16 in the low bits of native-endian words
+    return desc && (desc->flags & AV_PIX_FMT_FLAG_PLANAR) && !(desc->flags & AV_PIX_FMT_FLAG_RGB) &&
+           !(desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BE)) &&
+           av_pix_fmt_count_planes(AVPixelFormat(frame->format)) == desc->nb_components &&
+           desc->comp[0].shift == 0 && desc->comp[0].depth >= 8 && desc->comp[0].depth <= 16;
+}
+
+bool Stabilizer::process(const AVFrame* source, AVFrame* target,
+                         const CameraPath::Transform& correction) const {
+    if (!isSupported(source) || !target || target == source || target->format != source->format ||
+        target->width != source->width || target->height != source->height) {
+        return false;
+    }
+    if (correction.dx == 0.0 && correction.dy == 0.0 && correction.angle == 0.0 &&
+        correction.scale == 1.0 && zoom == 1.0) {
+        return av_frame_copy(target, source) >= 0;
+    }
+
+    // Output back to source, about the centre: p = R(-angle) (o / zoom - d) / scale
+    double scale = std::max(correction.scale, 1e-3);
+    double cosine = std::cos(correction.angle);
+    double sine = std::sin(correction.angle);
+    double inverse[4] = {cosine / (scale * zoom), sine / (scale * zoom),
+                         -sine / (scale * zoom), cosine / (scale * zoom)};
+    double shift[2] = {-(cosine * correction.dx + sine * correction.dy) / scale,
+                       -(-sine * correction.dx + cosine * correction.dy) / scale};
+
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(AVPixelFormat(source->format));
+    int planes = av_pix_fmt_count_planes(AVPixelFormat(source->format));
+    for (int plane = 0; plane < planes; plane++) {
+        bool chroma = plane == 1 || plane == 2;
+        int shiftX = chroma ? desc->log2_chroma_w : 0;
+        int shiftY = chroma ? desc->log2_chroma_h : 0;
+        int width = AV_CEIL_RSHIFT(source->width, shiftX);
+        int height = AV_CEIL_RSHIFT(source->height, shiftY);
+
+        // The same warp in the plane's own pixels
+        double fx = 1.0 / (1 << shiftX);
+        double fy = 1.0 / (1 << shiftY);
+        double a = inverse[0], b = inverse[1] * fx / fy;
+        double c = inverse[2] * fy / fx, d = inverse[3];
+        double centreX = (width - 1) * 0.5;
+        double centreY = (height - 1) * 0.5;
+        double matrix[6] = {
+            a, b, centreX - a * centreX - b * centreY + shift[0] * fx,
+            c, d, centreY - c * centreX - d * centreY + shift[1] * fy,
+        };
+        processPlane(source->data[plane], source->linesize[plane],
+                     target->data[plane], target->linesize[plane], width, height, matrix,
+                     desc->comp[0].depth);
+    }
+    return true;
+}
+
+void Stabilizer::processPlane(const uint8_t* source, int sourceStride, uint8_t* target, int targetStride,
+                              int width, int height, const double matrix[6], int depth) const {
+    if (depth > 8) {
+        warpPlane<uint16_t>(source, sourceStride, target, targetStride, width, height, matrix);
+    } else {
+        warpPlane<uint8_t>(source, sourceStride, target, targetStride, width, height, matrix);
+    }
+}
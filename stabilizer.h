@@ -0,0 +1,96 @@
+#pragma once
+
+#include <QString>
+#include <QVector>
+#include <functional>
+#include <cstdint>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+// Camera motion of a file's video stream, found by one pass that decodes
+// every frame at reduced resolution and matches it against the one
+// before. Pairs of frames are matched in parallel. Only the raw motion is
+// kept, so a different smoothing strength needs no new analysis. Saved as
+// a sidecar; the source is identified by size and modification time, so
+// the analysis of an edited file is never used.
+class CameraPath {
+public:
+    // Similarity transform about the frame centre, in source pixels
+    struct Transform {
+        double dx = 0.0;
+        double dy = 0.0;
+        double angle = 0.0;  // Radians, clockwise on screen
+        double scale = 1.0;
+    };
+
+    struct Frame {
+        int64_t pts;       // best_effort_timestamp, in the stream's time base
+        Transform motion;  // From the frame before to this one
+    };
+
+    using CancelCheck = std::function<bool()>;
+
+    CameraPath();
+
+    // Decode and match the whole file; returns an invalid path on failure
+    // or when cancelled() returns true
+    static CameraPath analyze(const QString& filePath, const CancelCheck& cancelled = CancelCheck());
+
+    // Fails when the file is unreadable or the source has changed since
+    bool load(const QString& pathFile, const QString& sourcePath);
+    bool save(const QString& pathFile) const;
+
+    bool isValid() const { return !frames.isEmpty(); }
+    bool isCurrent() const;  // Source unchanged on disk
+    QString getSourcePath() const { return sourcePath; }
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    const QVector<Frame>& getFrames() const { return frames; }
+
+    // Camera position of every frame relative to the first, and a moving
+    // average of it over radius frames either side; corrections take one
+    // to the other
+    void smooth(int radius);
+    int getSmoothingRadius() const { return smoothingRadius; }
+
+    // Correction for the frame with this pts; identity when unknown
+    Transform correctionAt(int64_t pts) const;
+
+private:
+    QString sourcePath;
+    qint64 sourceSize;
+    qint64 sourceModified;  // Milliseconds since the epoch
+    int width;
+    int height;
+    QVector<Frame> frames;            // In presentation order
+    QVector<Transform> corrections;   // Per frame, once smoothed
+    int smoothingRadius;
+
+    bool matchesSource(const QString& path) const;
+};
+
+// Warps planar YUV frames of 8 to 16 bits by a camera path correction, with
+// bilinear interpolation. Edges are repeated where the warp uncovers the
+// border, unless a zoom crops it away. Rows are split across cores.
+class Stabilizer {
+public:
+    Stabilizer();
+
+    // Extra magnification, 1 to 2, to hide uncovered borders
+    void setZoom(double zoom);
+    double getZoom() const { return zoom; }
+
+    static bool isSupported(const AVFrame* frame);
+
+    // Target has the source's geometry and format; never the same frame
+    bool process(const AVFrame* source, AVFrame* target,
+                 const CameraPath::Transform& correction) const;
+
+private:
+    double zoom;
+
+    void processPlane(const uint8_t* source, int sourceStride, uint8_t* target, int targetStride,
+                      int width, int height, const double matrix[6], int depth) const;
+};
@@ -0,0 +1,389 @@
+#include "temporaldenoiser.h"
+#include "parallelrows.h"
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+
+#if defined(HAVE_AVX2_KERNELS)
+#include <immintrin.h>
+#endif
+#if defined(HAVE_NEON_KERNELS)
+#include <arm_neon.h>
+#endif
+
+extern "C" {
+#include <libavutil/pixdesc.h>
+#include <libavutil/imgutils.h>
+}
+
+static const int MAX_REFERENCES = 4;
+
+const int TemporalDenoiser::MAX_HISTORY = MAX_REFERENCES;
+const int TemporalDenoiser::DEFAULT_HISTORY = 2;
+const int TemporalDenoiser::DEFAULT_STRENGTH = 12; // As SpatialDenoiser
+
+static const int BLOCK_SIZE = 16;
+static const int SEARCH_RANGE = 32;       // Pixels, either way
+static const int MATCH_THRESHOLD = 75;    // Usable blocks differ on average by under this % of strength
+
+using SadKernel = uint32_t (*)(const uint8_t* a, int strideA, const uint8_t* b, int strideB);
+
+// Helper functions
+static uint32_t sadScalar(const uint8_t* a, int strideA, const uint8_t* b, int strideB,
+                          int width, int height) {
+    uint32_t sum = 0;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            sum += uint32_t(std::abs(a[x] - b[x]));
+        }
+        a += strideA;
+        b += strideB;
+    }
+    return sum;
+}
+
+static uint32_t sadBlockScalar(const uint8_t* a, int strideA, const uint8_t* b, int strideB) {
+    return sadScalar(a, strideA, b, strideB, BLOCK_SIZE, BLOCK_SIZE);
+}
+
+#if defined(HAVE_AVX2_KERNELS)
+AVX2_TARGET static inline __m256i loadTwoRows(const uint8_t* p, int stride) {
+    __m128i first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i second = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + stride));
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(first), second, 1);
+}
+
+AVX2_TARGET static uint32_t sadBlockAVX2(const uint8_t* a, int strideA, const uint8_t* b, int strideB) {
+    __m256i sum = _mm256_setzero_si256();
+    for (int y = 0; y < BLOCK_SIZE; y += 2) {
+        __m256i rowsA = loadTwoRows(a + y * strideA, strideA);
+        __m256i rowsB = loadTwoRows(b + y * strideB, strideB);
+        sum = _mm256_add_epi64(sum, _mm256_sad_epu8(rowsA, rowsB));
+    }
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    return uint32_t(_mm_cvtsi128_si64(half) + _mm_extract_epi64(half, 1));
+}
+#endif
+
+#if defined(HAVE_NEON_KERNELS)
+static uint32_t sadBlockNEON(const uint8_t* a, int strideA, const uint8_t* b, int strideB) {
+    uint16x8_t sum = vdupq_n_u16(0);
+    for (int y = 0; y < BLOCK_SIZE; y++) {
+        sum = vpadalq_u8(sum, vabdq_u8(vld1q_u8(a + y * strideA), vld1q_u8(b + y * strideB)));
+    }
+    return vaddlvq_u16(sum);
+}
+#endif
+
+static SadKernel sadKernel(SimdKernel kernel) {
+    switch (kernel) {
+#if defined(HAVE_AVX2_KERNELS)
+    case SimdKernel::AVX2:
+        return sadBlockAVX2;
+#endif
+#if defined(HAVE_NEON_KERNELS)
+    case SimdKernel::NEON:
+        return sadBlockNEON;
+#endif
+    default:
+        return sadBlockScalar;
+    }
+}
+
+namespace {
+
+// One block of the current frame against one earlier frame
+struct BlockSearch {
+    const uint8_t* current;
+    int currentStride;
+    const uint8_t* reference;
+    int referenceStride;
+    int width;
+    int height;
+    int x;
+    int y;
+    int blockWidth;
+    int blockHeight;
+    SadKernel sadBlock;
+
+    uint32_t sadAt(int dx, int dy) const {
+        if (std::abs(dx) > SEARCH_RANGE || std::abs(dy) > SEARCH_RANGE ||
+            x + dx < 0 || y + dy < 0 ||
+            x + dx + blockWidth > width || y + dy + blockHeight > height) {
+            return UINT32_MAX;
+        }
+        const uint8_t* a = current + qint64(y) * currentStride + x;
+        const uint8_t* b = reference + qint64(y + dy) * referenceStride + x + dx;
+        if (blockWidth == BLOCK_SIZE && blockHeight == BLOCK_SIZE) {
+            return sadBlock(a, currentStride, b, referenceStride);
+        }
+        return sadScalar(a, currentStride, b, referenceStride, blockWidth, blockHeight);
+    }
+
+    // Best of the predictors, refined by shrinking diamond steps
+    TemporalDenoiser::MotionVector search(const TemporalDenoiser::MotionVector* candidates, int count) const {
+        TemporalDenoiser::MotionVector best = {0, 0, sadAt(0, 0), false};
+        for (int i = 0; i < count; i++) {
+            uint32_t sad = sadAt(candidates[i].x, candidates[i].y);
+            if (sad < best.sad) {
+                best = {candidates[i].x, candidates[i].y, sad, false};
+            }
+        }
+
+        static const int steps[] = {4, 2, 1};
+        static const int directions[4][2] = {{1, 0}, {-1, 0}, {0, 1}, {0, -1}};
+        for (int step : steps) {
+            for (int iteration = 0; iteration < SEARCH_RANGE / step; iteration++) {
+                TemporalDenoiser::MotionVector next = best;
+                for (const auto& direction : directions) {
+                    int dx = best.x + direction[0] * step;
+                    int dy = best.y + direction[1] * step;
+                    uint32_t sad = sadAt(dx, dy);
+                    if (sad < next.sad) {
+                        next = {dx, dy, sad, false};
+                    }
+                }
+                if (next.x == best.x && next.y == best.y) {
+                    break;
+                }
+                best = next;
+            }
+        }
+        return best;
+    }
+};
+
+// Averages each pixel of a block with the aligned pixels of the usable
+// earlier frames that lie within the strength of it
+struct BlockBlend {
+    const uint8_t* references[MAX_REFERENCES];
+    int referenceStrides[MAX_REFERENCES];
+    int offsetsX[MAX_REFERENCES];
+    int offsetsY[MAX_REFERENCES];
+    int count;
+
+    void run(const uint8_t* source, int sourceStride, uint8_t* target, int targetStride,
+             int x0, int y0, int x1, int y1, int width, int height, int strength) const {
+        // Aligned blocks are nearly always inside the frame; clamp only when not
+        bool inside = true;
+        for (int i = 0; i < count; i++) {
+            inside = inside && x0 + offsetsX[i] >= 0 && x1 + offsetsX[i] <= width &&
+                     y0 + offsetsY[i] >= 0 && y1 + offsetsY[i] <= height;
+        }
+
+        const uint8_t* rows[MAX_REFERENCES];
+        for (int y = y0; y < y1; y++) {
+            const uint8_t* row = source + qint64(y) * sourceStride;
+            uint8_t* out = target + qint64(y) * targetStride;
+            for (int i = 0; i < count; i++) {
+                int ry = std::min(std::max(y + offsetsY[i], 0), height - 1);
+                rows[i] = references[i] + qint64(ry) * referenceStrides[i] + offsetsX[i];
+            }
+            for (int x = x0; x < x1; x++) {
+                int centre = row[x];
+                int sumWeights = strength;
+                int sumWeighted = strength * centre;
+                for (int i = 0; i < count; i++) {
+                    int aligned = inside ? rows[i][x]
+                                         : rows[i][std::min(std::max(x + offsetsX[i], 0), width - 1) - offsetsX[i]];
+                    int weight = std::max(strength - std::abs(aligned - centre), 0);
+                    sumWeights += weight;
+                    sumWeighted += weight * aligned;
+                }
+                out[x] = uint8_t((sumWeighted + sumWeights / 2) / sumWeights);
+            }
+        }
+    }
+};
+
+}
+
+TemporalDenoiser::TemporalDenoiser()
+    : newest(-1)
+    , historySize(0)
+    , historyLimit(DEFAULT_HISTORY)
+    , strength(DEFAULT_STRENGTH)
+    , kernel(CpuFeatures::resolve(SimdKernel::Auto))
+{
+    for (int i = 0; i < MAX_HISTORY; i++) {
+        ring.push_back(av_frame_alloc());
+    }
+}
+
+TemporalDenoiser::~TemporalDenoiser() {
+    for (AVFrame* frame : ring) {
+        av_frame_free(&frame);
+    }
+}
+
+void TemporalDenoiser::setHistory(int frames) {
+    historyLimit = qBound(1, frames, MAX_HISTORY);
+    // Drop the oldest beyond the new limit
+    while (historySize > historyLimit) {
+        av_frame_unref(ring[(newest - historySize + 1 + MAX_HISTORY) % MAX_HISTORY]);
+        historySize--;
+    }
+}
+
+void TemporalDenoiser::setStrength(int value) {
+    strength = qBound(1, value, 255);
+}
+
+void TemporalDenoiser::setKernel(SimdKernel value) {
+    kernel = CpuFeatures::resolve(value);
+}
+
+bool TemporalDenoiser::isSupported(const AVFrame* frame) {
+    if (!frame) {
+        return false;
+    }
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(AVPixelFormat(frame->format));
+    return desc && (desc->flags & AV_PIX_FMT_FLAG_PLANAR) && !(desc->flags & AV_PIX_FMT_FLAG_RGB) &&
+           !(desc->flags & AV_PIX_FMT_FLAG_HWACCEL) && desc->comp[0].depth == 8;
+}
+
+void TemporalDenoiser::reset() {
+    for (AVFrame* frame : ring) {
+        av_frame_unref(frame);
+    }
+    newest = -1;
+    historySize = 0;
+}
+
+const AVFrame* TemporalDenoiser::historyFrame(int age) const {
+    return ring[(newest - age + MAX_HISTORY) % MAX_HISTORY];
+}
+
+void TemporalDenoiser::push(const AVFrame* frame) {
+    // A reference to the same buffers, not a copy
+    newest = (newest + 1) % MAX_HISTORY;
+    av_frame_unref(ring[newest]);
+    if (av_frame_ref(ring[newest], frame) < 0) {
+        reset();
+        return;
+    }
+    historySize = std::min(historySize + 1, historyLimit);
+    if (historyLimit < MAX_HISTORY) {
+        // Let go of anything older than the limit straight away
+        av_frame_unref(ring[(newest - historyLimit + MAX_HISTORY) % MAX_HISTORY]);
+    }
+}
+
+bool TemporalDenoiser::process(const AVFrame* source, AVFrame* target) {
+    if (!isSupported(source) || !target || target->format != source->format ||
+        target->width != source->width || target->height != source->height) {
+        return false;
+    }
+
+    // A new size or format starts over
+    if (historySize > 0) {
+        const AVFrame* last = historyFrame(0);
+        if (last->width != source->width || last->height != source->height ||
+            last->format != source->format) {
+            reset();
+        }
+    }
+    if (historySize == 0) {
+        if (av_frame_copy(target, source) < 0) {
+            return false;
+        }
+        push(source);
+        return true;
+    }
+
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(AVPixelFormat(source->format));
+    int width = source->width;
+    int height = source->height;
+    int blocksX = (width + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int blocksY = (height + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int ages = historySize;
+    motion.resize(ages);
+    for (auto& vectors : motion) {
+        vectors.resize(size_t(blocksX) * blocksY);
+    }
+    SadKernel sadBlock = sadKernel(kernel);
+    int shiftX = desc->log2_chroma_w;
+    int shiftY = desc->log2_chroma_h;
+    int chromaWidth = AV_CEIL_RSHIFT(width, shiftX);
+    int chromaHeight = AV_CEIL_RSHIFT(height, shiftY);
+    bool hasChroma = av_pix_fmt_count_planes(AVPixelFormat(source->format)) >= 3;
+
+    // Tiles of whole block rows; predictors only come from the same tile
+    ParallelRows::run(blocksY, [&](int begin, int end) {
+        for (int by = begin; by < end; by++) {
+            for (int bx = 0; bx < blocksX; bx++) {
+                int index = by * blocksX + bx;
+                int x0 = bx * BLOCK_SIZE;
+                int y0 = by * BLOCK_SIZE;
+                int x1 = std::min(x0 + BLOCK_SIZE, width);
+                int y1 = std::min(y0 + BLOCK_SIZE, height);
+
+                BlockBlend luma = {};
+                BlockBlend chroma[2] = {};
+                for (int age = 0; age < ages; age++) {
+                    const AVFrame* reference = historyFrame(age);
+                    BlockSearch block = {source->data[0], source->linesize[0],
+                                         reference->data[0], reference->linesize[0],
+                                         width, height, x0, y0, x1 - x0, y1 - y0, sadBlock};
+
+                    MotionVector candidates[4];
+                    int count = 0;
+                    if (bx > 0) {
+                        candidates[count++] = motion[age][index - 1];
+                    }
+                    if (by > begin) {
+                        candidates[count++] = motion[age][index - blocksX];
+                    }
+                    if (age > 0) {
+                        // Motion to an older frame is roughly proportionally longer
+                        MotionVector nearer = motion[age - 1][index];
+                        candidates[count++] = {nearer.x * (age + 1) / age, nearer.y * (age + 1) / age, 0, false};
+                    }
+
+                    MotionVector vector = block.search(candidates, count);
+                    uint32_t pixels = uint32_t((x1 - x0) * (y1 - y0));
+                    vector.usable = vector.sad != UINT32_MAX &&
+                                    uint64_t(vector.sad) * 100 <= uint64_t(pixels) * strength * MATCH_THRESHOLD;
+                    motion[age][index] = vector;
+                    if (!vector.usable) {
+                        continue;
+                    }
+
+                    luma.references[luma.count] = reference->data[0];
+                    luma.referenceStrides[luma.count] = reference->linesize[0];
+                    luma.offsetsX[luma.count] = vector.x;
+                    luma.offsetsY[luma.count] = vector.y;
+                    luma.count++;
+                    for (int plane = 0; plane < 2 && hasChroma; plane++) {
+                        BlockBlend& blend = chroma[plane];
+                        blend.references[blend.count] = reference->data[plane + 1];
+                        blend.referenceStrides[blend.count] = reference->linesize[plane + 1];
+                        blend.offsetsX[blend.count] = vector.x / (1 << shiftX);
+                        blend.offsetsY[blend.count] = vector.y / (1 << shiftY);
+                        blend.count++;
+                    }
+                }
+
+                luma.run(source->data[0], source->linesize[0], target->data[0], target->linesize[0],
+                         x0, y0, x1, y1, width, height, strength);
+                for (int plane = 0; plane < 2 && hasChroma; plane++) {
+                    chroma[plane].run(source->data[plane + 1], source->linesize[plane + 1],
+                                      target->data[plane + 1], target->linesize[plane + 1],
+                                      x0 >> shiftX, y0 >> shiftY,
+                                      std::min(AV_CEIL_RSHIFT(x1, shiftX), chromaWidth),
+                                      std::min(AV_CEIL_RSHIFT(y1, shiftY), chromaHeight),
+                                      chromaWidth, chromaHeight, strength);
+                }
+            }
+        }
+    }, 1);
+
+    // Alpha is copied as is
+    if (desc->flags & AV_PIX_FMT_FLAG_ALPHA) {
+        av_image_copy_plane(target->data[3], target->linesize[3], source->data[3], source->linesize[3],
+                            width, height);
+    }
+
+    push(source);
+    return true;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include "cpufeatures.h"
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+// Motion-compensated temporal denoiser for 8-bit planar YUV. Keeps the
+// last few source frames by reference in a fixed ring, finds where each
+// 16x16 block of the new frame sits in each of them, and averages the
+// aligned pixels that agree with it. Blocks that match badly (occlusion,
+// a cut) fall back to the frame alone, so moving detail is not smeared.
+// Block rows are split across cores; block matching uses AVX2 or NEON.
+class TemporalDenoiser {
+public:
+    TemporalDenoiser();
+    ~TemporalDenoiser();
+
+    TemporalDenoiser(const TemporalDenoiser&) = delete;
+    TemporalDenoiser& operator=(const TemporalDenoiser&) = delete;
+
+    // Previous frames blended in, 1 to MAX_HISTORY; the most ever held
+    void setHistory(int frames);
+    int getHistory() const { return historyLimit; }
+
+    // Largest difference, in 8-bit levels, still treated as noise
+    void setStrength(int strength);
+    int getStrength() const { return strength; }
+
+    void setKernel(SimdKernel kernel);
+    SimdKernel getKernel() const { return kernel; }
+
+    static bool isSupported(const AVFrame* frame);
+
+    // Denoises source into target (same geometry and format), then keeps a
+    // reference to source for the frames that follow
+    bool process(const AVFrame* source, AVFrame* target);
+
+    // Forget the history; after a seek or when the input changes
+    void reset();
+    int getHistorySize() const { return historySize; }
+
+    struct MotionVector {
+        int x;
+        int y;
+        uint32_t sad;      // Over the luma block
+        bool usable;       // Matches well enough to blend
+    };
+
+private:
+    std::vector<AVFrame*> ring;   // MAX_HISTORY frames, reused
+    int newest;                   // Slot of the latest frame
+    int historySize;
+    int historyLimit;
+    int strength;
+    SimdKernel kernel;
+    std::vector<std::vector<MotionVector>> motion;  // Per history frame, per block
+
+    const AVFrame* historyFrame(int age) const;  // 0 = newest
+    void push(const AVFrame* frame);
+
+    // Constants
+    static const int MAX_HISTORY;
+    static const int DEFAULT_HISTORY;
+    static const int DEFAULT_STRENGTH;
+};
@@ -0,0 +1,263 @@
+#include "tilescheduler.h"
+#include "parallelrows.h"
+#include <QAtomicInteger>
+#include <algorithm>
+
+extern "C" {
+#include <libavutil/pixdesc.h>
+#include <libavutil/imgutils.h>
+}
+
+const int TileScheduler::DEFAULT_TILE_WIDTH = 0;    // Whole rows, which the prefetcher streams
+const int TileScheduler::DEFAULT_TILE_HEIGHT = 128; // Tall enough that halos stay cheap
+
+static const int TILE_ALIGNMENT = 16;  // Tile sizes are rounded to this
+
+struct TileRect {
+    int x0, y0, x1, y1;  // Luma pixels, end exclusive
+
+    int width() const { return x1 - x0; }
+    int height() const { return y1 - y0; }
+};
+
+// Helper functions
+static bool onePlanePerComponent(const AVPixFmtDescriptor* desc) {
+    // Not NV12 and the like, whose chroma planes interleave two components
+    return desc && (desc->flags & AV_PIX_FMT_FLAG_PLANAR) &&
+           av_pix_fmt_count_planes(av_pix_fmt_desc_get_id(desc)) == desc->nb_components;
+}
+
+static TileRect expand(const TileRect& rect, int marginX, int marginY,
+                       int alignX, int alignY, int width, int height) {
+    // Outward to whole chroma samples, so every plane lines up
+    TileRect grown;
+    grown.x0 = std::max(rect.x0 - marginX, 0) / alignX * alignX;
+    grown.y0 = std::max(rect.y0 - marginY, 0) / alignY * alignY;
+    grown.x1 = std::min((rect.x1 + marginX + alignX - 1) / alignX * alignX, width);
+    grown.y1 = std::min((rect.y1 + marginY + alignY - 1) / alignY * alignY, height);
+    return grown;
+}
+
+// A frame struct over part of another frame's planes; never unreferenced.
+// x and y are luma pixels from the frame's origin, on chroma sample bounds.
+static void makeView(const AVFrame* frame, int x, int y, int width, int height, AVFrame* view) {
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(AVPixelFormat(frame->format));
+    int bytes = (desc->comp[0].depth + 7) / 8;
+    int planes = av_pix_fmt_count_planes(AVPixelFormat(frame->format));
+
+    *view = AVFrame();
+    view->format = frame->format;
+    view->width = width;
+    view->height = height;
+    for (int plane = 0; plane < planes; plane++) {
+        bool chroma = plane == 1 || plane == 2;
+        int shiftX = chroma ? desc->log2_chroma_w : 0;
+        int shiftY = chroma ? desc->log2_chroma_h : 0;
+        view->data[plane] = frame->data[plane] + qint64(y >> shiftY) * frame->linesize[plane] +
+                            (x >> shiftX) * bytes;
+        view->linesize[plane] = frame->linesize[plane];
+    }
+}
+
+static void copyColorProperties(const AVFrame* from, AVFrame* to) {
+    to->color_range = from->color_range;
+    to->color_primaries = from->color_primaries;
+    to->color_trc = from->color_trc;
+    to->colorspace = from->colorspace;
+    to->chroma_location = from->chroma_location;
+}
+
+TileScheduler::TileScheduler()
+    : tileWidth(DEFAULT_TILE_WIDTH)
+    , tileHeight(DEFAULT_TILE_HEIGHT)
+    , tileCount(0)
+{
+}
+
+TileScheduler::~TileScheduler() {
+    freeScratch();
+}
+
+void TileScheduler::setTileSize(int width, int height) {
+    tileWidth = width <= 0 ? 0 : (width + TILE_ALIGNMENT - 1) / TILE_ALIGNMENT * TILE_ALIGNMENT;
+    tileHeight = std::max((height + TILE_ALIGNMENT - 1) / TILE_ALIGNMENT, 1) * TILE_ALIGNMENT;
+}
+
+bool TileScheduler::isSupported(const AVFrame* frame) {
+    if (!frame) {
+        return false;
+    }
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(AVPixelFormat(frame->format));
+    return onePlanePerComponent(desc) && !(desc->flags & AV_PIX_FMT_FLAG_HWACCEL) &&
+           !(desc->flags & AV_PIX_FMT_FLAG_PAL) && desc->comp[0].depth <= 16;
+}
+
+bool TileScheduler::process(const AVFrame* source, AVFrame* target, const std::vector<Stage>& stages) {
+    if (!isSupported(source) || !target || target == source ||
+        target->width != source->width || target->height != source->height) {
+        return false;
+    }
+
+    // Every stage's format must share the source's chroma layout
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(AVPixelFormat(source->format));
+    std::vector<AVPixelFormat> formats;
+    AVPixelFormat format = AVPixelFormat(source->format);
+    for (const Stage& stage : stages) {
+        if (stage.format != AV_PIX_FMT_NONE) {
+            format = stage.format;
+        }
+        const AVPixFmtDescriptor* stageDesc = av_pix_fmt_desc_get(format);
+        if (!onePlanePerComponent(stageDesc) ||
+            stageDesc->log2_chroma_w != desc->log2_chroma_w ||
+            stageDesc->log2_chroma_h != desc->log2_chroma_h) {
+            return false;
+        }
+        formats.push_back(format);
+    }
+    if (target->format != format) {
+        return false;
+    }
+    if (stages.empty()) {
+        return av_frame_copy(target, source) >= 0;
+    }
+
+    // Halos in luma pixels; a chroma pixel covers several
+    int count = int(stages.size());
+    int alignX = 1 << desc->log2_chroma_w;
+    int alignY = 1 << desc->log2_chroma_h;
+    std::vector<int> marginX(count), marginY(count);
+    int columns = tileWidth > 0 ? tileWidth : source->width;
+    int scratchWidth = columns;
+    int scratchHeight = tileHeight;
+    for (int k = count - 1; k >= 0; k--) {
+        marginX[k] = stages[k].halo << desc->log2_chroma_w;
+        marginY[k] = stages[k].halo << desc->log2_chroma_h;
+        scratchWidth += 2 * (marginX[k] + alignX);
+        scratchHeight += 2 * (marginY[k] + alignY);
+    }
+    scratchWidth = std::min(scratchWidth, source->width);
+    scratchHeight = std::min(scratchHeight, source->height);
+
+    int tilesX = (source->width + columns - 1) / columns;
+    int tilesY = (source->height + tileHeight - 1) / tileHeight;
+    tileCount = tilesX * tilesY;
+    int workers = std::min(ParallelRows::getThreadCount(), tileCount);
+    if (!prepareScratch(workers, scratchWidth, scratchHeight, formats)) {
+        return false;
+    }
+
+    auto runTile = [&](int worker, int index) {
+        TileRect tile;
+        tile.x0 = (index % tilesX) * columns;
+        tile.y0 = (index / tilesX) * tileHeight;
+        tile.x1 = std::min(tile.x0 + columns, source->width);
+        tile.y1 = std::min(tile.y0 + tileHeight, source->height);
+
+        // What each stage works on: what the next needs, plus its halo
+        std::vector<TileRect> regions(count);
+        TileRect needed = tile;
+        for (int k = count - 1; k >= 0; k--) {
+            needed = expand(needed, marginX[k], marginY[k], alignX, alignY, source->width, source->height);
+            regions[k] = needed;
+        }
+
+        // The first stage reads the source in place, with its side data
+        AVFrame input, output;
+        makeView(source, regions[0].x0, regions[0].y0, regions[0].width(), regions[0].height(), &input);
+        copyColorProperties(source, &input);
+        input.side_data = source->side_data;
+        input.nb_side_data = source->nb_side_data;
+
+        for (int k = 0; k < count; k++) {
+            AVFrame* buffer = scratch[worker][k];
+            makeView(buffer, 0, 0, regions[k].width(), regions[k].height(), &output);
+            copyColorProperties(&input, &output);
+            if (!stages[k].filter(&input, &output)) {
+                return false;
+            }
+
+            const TileRect& next = k + 1 < count ? regions[k + 1] : tile;
+            makeView(buffer, next.x0 - regions[k].x0, next.y0 - regions[k].y0,
+                     next.width(), next.height(), &input);
+            copyColorProperties(&output, &input);
+        }
+
+        // Only the tile itself is exact; the halo is dropped
+        const AVPixFmtDescriptor* outDesc = av_pix_fmt_desc_get(formats.back());
+        int bytes = (outDesc->comp[0].depth + 7) / 8;
+        int planes = av_pix_fmt_count_planes(formats.back());
+        for (int plane = 0; plane < planes; plane++) {
+            bool chroma = plane == 1 || plane == 2;
+            int shiftX = chroma ? outDesc->log2_chroma_w : 0;
+            int shiftY = chroma ? outDesc->log2_chroma_h : 0;
+            uint8_t* destination = target->data[plane] + qint64(tile.y0 >> shiftY) * target->linesize[plane] +
+                                   (tile.x0 >> shiftX) * bytes;
+            av_image_copy_plane(destination, target->linesize[plane], input.data[plane], input.linesize[plane],
+                                AV_CEIL_RSHIFT(tile.width(), shiftX) * bytes,
+                                AV_CEIL_RSHIFT(tile.height(), shiftY));
+        }
+        if (index == 0) {
+            copyColorProperties(&input, target);
+        }
+        return true;
+    };
+
+    if (!runTile(0, 0)) {
+        return false;
+    }
+
+    // One band per worker; each takes the next tile until none are left
+    QAtomicInteger<int> next(1);
+    QAtomicInteger<int> failed(0);
+    ParallelRows::run(workers, [&](int begin, int) {
+        int index;
+        while (!failed.loadRelaxed() && (index = next.fetchAndAddRelaxed(1)) < tileCount) {
+            if (!runTile(begin, index)) {
+                failed.storeRelaxed(1);
+            }
+        }
+    }, 1);
+    return !failed.loadRelaxed();
+}
+
+bool TileScheduler::prepareScratch(int workers, int width, int height,
+                                   const std::vector<AVPixelFormat>& formats) {
+    std::vector<int> key = {workers, width, height};
+    key.insert(key.end(), formats.begin(), formats.end());
+    if (key == scratchKey) {
+        return true;
+    }
+
+    // Sized for the largest tile with all its halos; reused frame to frame
+    freeScratch();
+    scratch.resize(workers);
+    for (std::vector<AVFrame*>& buffers : scratch) {
+        for (AVPixelFormat format : formats) {
+            AVFrame* frame = av_frame_alloc();
+            if (!frame) {
+                freeScratch();
+                return false;
+            }
+            buffers.push_back(frame);
+            frame->width = width;
+            frame->height = height;
+            frame->format = format;
+            if (av_frame_get_buffer(frame, 64) < 0) {
+                freeScratch();
+                return false;
+            }
+        }
+    }
+    scratchKey = key;
+    return true;
+}
+
+void TileScheduler::freeScratch() {
+    for (std::vector<AVFrame*>& buffers : scratch) {
+        for (AVFrame* frame : buffers) {
+            av_frame_free(&frame);
+        }
+    }
+    scratch.clear();
+    scratchKey.clear();
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <vector>
+#include <functional>
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+}
+
+// Runs a chain of frame filters tile by tile rather than pass by pass, so
+// each tile goes through every filter while it is still in cache. Tiles
+// carry a halo wide enough for every later filter's neighbourhood and are
+// trimmed when written out, so the result is the same as whole-frame
+// passes. Filters see each tile as a small frame of its own (planes
+// pointing into the source, or into per-worker scratch) and must not keep
+// it. Tiles are handed out to all cores as workers come free.
+class TileScheduler {
+public:
+    struct Stage {
+        // Reads source, writes target of the same geometry
+        std::function<bool(const AVFrame* source, AVFrame* target)> filter;
+        int halo = 0;  // Radius read around each output pixel, in the pixels of each plane
+        AVPixelFormat format = AV_PIX_FMT_NONE;  // Written by the filter; NONE keeps the input's
+    };
+
+    TileScheduler();
+    ~TileScheduler();
+
+    TileScheduler(const TileScheduler&) = delete;
+    TileScheduler& operator=(const TileScheduler&) = delete;
+
+    // Output tile in luma pixels; a width of 0 means whole rows. The
+    // default is strips of whole rows: narrower tiles break the long runs
+    // the hardware prefetcher needs to stream the source, and cost more halo.
+    void setTileSize(int width, int height);
+    int getTileWidth() const { return tileWidth; }  // 0 for whole rows
+    int getTileHeight() const { return tileHeight; }
+
+    // Formats with each component in a plane of its own, of any depth
+    static bool isSupported(const AVFrame* frame);
+
+    // Target has the source geometry and the last stage's format. The first
+    // tile runs alone, so filters that build tables on first use have done
+    // so before the rest run concurrently. Not reentrant.
+    bool process(const AVFrame* source, AVFrame* target, const std::vector<Stage>& stages);
+
+    int getTileCount() const { return tileCount; }  // Of the last frame
+
+private:
+    int tileWidth;
+    int tileHeight;
+    int tileCount;
+    std::vector<std::vector<AVFrame*>> scratch;  // Per worker, per stage
+    std::vector<int> scratchKey;                 // Geometry and formats it was made for
+
+    bool prepareScratch(int workers, int width, int height, const std::vector<AVPixelFormat>& formats);
+    void freeScratch();
+
+    // Constants
+    static const int DEFAULT_TILE_WIDTH;
+    static const int DEFAULT_TILE_HEIGHT;
+};
@@ -0,0 +1,578 @@
+#include "tonemapper.h"
+#include "parallelrows.h"
+#include <algorithm>
+#include <cmath>
+
+#if defined(HAVE_AVX2_KERNELS)
+#include <immintrin.h>
+#endif
+#if defined(HAVE_NEON_KERNELS)
+#include <arm_neon.h>
+#endif
+
+extern "C" {
+#include <libavutil/pixdesc.h>
+#include <libavutil/mastering_display_metadata.h>
+}
+
+const double ToneMapper::SDR_WHITE = 203.0;    // Nits; BT.2408 reference white
+const double ToneMapper::DEFAULT_PEAK = 1000.0; // Nits; HLG nominal display, PQ without metadata
+
+// Transfer functions, in nits
+static const double PQ_M1 = 2610.0 / 16384.0;
+static const double PQ_M2 = 2523.0 / 4096.0 * 128.0;
+static const double PQ_C1 = 3424.0 / 4096.0;
+static const double PQ_C2 = 2413.0 / 4096.0 * 32.0;
+static const double PQ_C3 = 2392.0 / 4096.0 * 32.0;
+static const double HLG_A = 0.17883277;
+static const double HLG_B = 0.28466892;
+static const double HLG_C = 0.55991073;
+static const double HLG_GAMMA = 1.2;  // System gamma for a 1000-nit display
+static const double HLG_DISPLAY_PEAK = 1000.0;
+
+// Entries per lookup table; two bits finer than 10-bit input
+static const int LUT_SIZE = 4096;
+
+// Linear BT.2020 to linear BT.709 primaries
+static const float BT2020_TO_BT709[9] = {
+     1.6605f, -0.5876f, -0.0728f,
+    -0.1246f,  1.1329f, -0.0083f,
+    -0.0182f, -0.1006f,  1.1187f
+};
+static const float IDENTITY[9] = {1.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f};
+
+// Helper functions
+static double pqToNits(double value) {
+    double p = std::pow(std::max(value, 0.0), 1.0 / PQ_M2);
+    return 10000.0 * std::pow(std::max(p - PQ_C1, 0.0) / (PQ_C2 - PQ_C3 * p), 1.0 / PQ_M1);
+}
+
+static double nitsToPQ(double nits) {
+    double y = std::pow(std::max(nits, 0.0) / 10000.0, PQ_M1);
+    return std::pow((PQ_C1 + PQ_C2 * y) / (1.0 + PQ_C3 * y), PQ_M2);
+}
+
+static double hlgToNits(double value) {
+    // Inverse OETF, then the OOTF applied per channel, as BT.2390 allows
+    double scene = value <= 0.5 ? value * value / 3.0
+                                : (std::exp((value - HLG_C) / HLG_A) + HLG_B) / 12.0;
+    return HLG_DISPLAY_PEAK * std::pow(scene, HLG_GAMMA);
+}
+
+static double bt709Encode(double linear) {
+    return linear < 0.018 ? 4.5 * linear : 1.099 * std::pow(linear, 0.45) - 0.099;
+}
+
+static double hable(double x) {
+    const double a = 0.15, b = 0.50, c = 0.10, d = 0.20, e = 0.02, f = 0.30;
+    return (x * (a * x + c * b) + d * e) / (x * (a * x + b) + d * f) - e / f;
+}
+
+// Maps nits in [0, sourcePeak] to [0, targetPeak]
+static double toneMap(ToneMapper::Curve curve, double nits, double sourcePeak, double targetPeak) {
+    nits = std::min(nits, sourcePeak);
+    if (sourcePeak <= targetPeak) {
+        return nits;
+    }
+
+    double x = nits / targetPeak;
+    double white = sourcePeak / targetPeak;
+    switch (curve) {
+    case ToneMapper::Curve::Hable:
+        return targetPeak * hable(x) / hable(white);
+    case ToneMapper::Curve::Reinhard:
+        return targetPeak * x * (1.0 + x / (white * white)) / (1.0 + x);
+    case ToneMapper::Curve::BT2390:
+        break;
+    }
+
+    // Hermite spline above the knee, in PQ space normalised to the source peak
+    double sourcePQ = nitsToPQ(sourcePeak);
+    double e = nitsToPQ(nits) / sourcePQ;
+    double maxLum = nitsToPQ(targetPeak) / sourcePQ;
+    double knee = std::max(1.5 * maxLum - 0.5, 0.0);
+    if (e > knee) {
+        double t = (e - knee) / (1.0 - knee);
+        double t2 = t * t;
+        double t3 = t2 * t;
+        e = (2.0 * t3 - 3.0 * t2 + 1.0) * knee + (t3 - 2.0 * t2 + t) * (1.0 - knee) +
+            (-2.0 * t3 + 3.0 * t2) * maxLum;
+    }
+    return pqToNits(e * sourcePQ);
+}
+
+static inline int lutIndex(float value) {
+    value = std::min(std::max(value, 0.0f), 1.0f);
+    return int(value * float(LUT_SIZE - 1) + 0.5f);
+}
+
+// One source pixel to an output luma code and normalised chroma
+static inline void mapPixel(const ToneMapper::Tables& t, int y, int cb, int cr,
+                            int& lumaOut, float& cbOut, float& crOut) {
+    float luma = (float(y) - t.yOffset) * t.yScale;
+    float blue = (float(cb) - t.cOffset) * t.cScale;
+    float red = (float(cr) - t.cOffset) * t.cScale;
+    float r = t.linearize[lutIndex(luma + t.crToR * red)];
+    float g = t.linearize[lutIndex(luma - t.cbToG * blue - t.crToG * red)];
+    float b = t.linearize[lutIndex(luma + t.cbToB * blue)];
+
+    const float* m = t.gamut;
+    float outR = std::min(std::max(m[0] * r + m[1] * g + m[2] * b, 0.0f), 1.0f);
+    float outG = std::min(std::max(m[3] * r + m[4] * g + m[5] * b, 0.0f), 1.0f);
+    float outB = std::min(std::max(m[6] * r + m[7] * g + m[8] * b, 0.0f), 1.0f);
+    outR = t.encode[lutIndex(std::sqrt(outR))];
+    outG = t.encode[lutIndex(std::sqrt(outG))];
+    outB = t.encode[lutIndex(std::sqrt(outB))];
+
+    float outY = t.outKr * outR + t.outKg * outG + t.outKb * outB;
+    lumaOut = std::min(std::max(int(t.outYOffset + t.outYScale * outY + 0.5f), 0), t.outMax);
+    cbOut = (outB - outY) * t.outCbScale;
+    crOut = (outR - outY) * t.outCrScale;
+}
+
+template <typename Out>
+static void mapRowScalar(const ToneMapper::Tables& t, const uint16_t* y, const uint16_t* cb,
+                         const uint16_t* cr, int chromaShift, Out* lumaOut,
+                         float* cbOut, float* crOut, int from, int width) {
+    for (int x = from; x < width; x++) {
+        int luma;
+        mapPixel(t, y[x], cb[x >> chromaShift], cr[x >> chromaShift], luma, cbOut[x], crOut[x]);
+        lumaOut[x] = Out(luma);
+    }
+}
+
+#if defined(HAVE_AVX2_KERNELS)
+AVX2_TARGET static inline __m256 lookup8(const std::vector<float>& table, __m256 value) {
+    const __m256 scale = _mm256_set1_ps(float(LUT_SIZE - 1));
+    value = _mm256_min_ps(_mm256_max_ps(value, _mm256_setzero_ps()), _mm256_set1_ps(1.0f));
+    __m256i index = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(value, scale), _mm256_set1_ps(0.5f)));
+    return _mm256_i32gather_ps(table.data(), index, 4);
+}
+
+AVX2_TARGET static inline __m256 load8Codes(const uint16_t* p) {
+    return _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))));
+}
+
+AVX2_TARGET static inline __m256 load8Chroma(const uint16_t* p, int chromaShift) {
+    if (!chromaShift) {
+        return load8Codes(p);
+    }
+    // Four samples, each repeated for two luma columns
+    __m256i four = _mm256_cvtepu16_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)));
+    __m256i spread = _mm256_permutevar8x32_epi32(four, _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3));
+    return _mm256_cvtepi32_ps(spread);
+}
+
+AVX2_TARGET static inline __m256 clamp01(__m256 value) {
+    return _mm256_min_ps(_mm256_max_ps(value, _mm256_setzero_ps()), _mm256_set1_ps(1.0f));
+}
+
+AVX2_TARGET static inline __m256 dot3(const float* row, __m256 r, __m256 g, __m256 b) {
+    __m256 sum = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(row[0]), r),
+                               _mm256_mul_ps(_mm256_set1_ps(row[1]), g));
+    return _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(row[2]), b));
+}
+
+template <typename Out>
+AVX2_TARGET static inline void storeLuma8(Out* out, __m256i codes) {
+    __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(codes), _mm256_extracti128_si256(codes, 1));
+    if (sizeof(Out) == 1) {
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(out), _mm_packus_epi16(words, words));
+    } else {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), words);
+    }
+}
+
+template <typename Out>
+AVX2_TARGET static void mapRowAVX2(const ToneMapper::Tables& t, const uint16_t* y, const uint16_t* cb,
+                                   const uint16_t* cr, int chromaShift, Out* lumaOut,
+                                   float* cbOut, float* crOut, int from, int width) {
+    const __m256 yOffset = _mm256_set1_ps(t.yOffset);
+    const __m256 yScale = _mm256_set1_ps(t.yScale);
+    const __m256 cOffset = _mm256_set1_ps(t.cOffset);
+    const __m256 cScale = _mm256_set1_ps(t.cScale);
+    const float outK[3] = {t.outKr, t.outKg, t.outKb};
+
+    int x = from;
+    for (; x + 8 <= width; x += 8) {
+        __m256 luma = _mm256_mul_ps(_mm256_sub_ps(load8Codes(y + x), yOffset), yScale);
+        __m256 blue = _mm256_mul_ps(_mm256_sub_ps(load8Chroma(cb + (x >> chromaShift), chromaShift), cOffset), cScale);
+        __m256 red = _mm256_mul_ps(_mm256_sub_ps(load8Chroma(cr + (x >> chromaShift), chromaShift), cOffset), cScale);
+
+        __m256 r = _mm256_add_ps(luma, _mm256_mul_ps(_mm256_set1_ps(t.crToR), red));
+        __m256 g = _mm256_sub_ps(_mm256_sub_ps(luma, _mm256_mul_ps(_mm256_set1_ps(t.cbToG), blue)),
+                                 _mm256_mul_ps(_mm256_set1_ps(t.crToG), red));
+        __m256 b = _mm256_add_ps(luma, _mm256_mul_ps(_mm256_set1_ps(t.cbToB), blue));
+        r = lookup8(t.linearize, r);
+        g = lookup8(t.linearize, g);
+        b = lookup8(t.linearize, b);
+
+        __m256 outR = clamp01(dot3(t.gamut, r, g, b));
+        __m256 outG = clamp01(dot3(t.gamut + 3, r, g, b));
+        __m256 outB = clamp01(dot3(t.gamut + 6, r, g, b));
+        outR = lookup8(t.encode, _mm256_sqrt_ps(outR));
+        outG = lookup8(t.encode, _mm256_sqrt_ps(outG));
+        outB = lookup8(t.encode, _mm256_sqrt_ps(outB));
+
+        __m256 outY = dot3(outK, outR, outG, outB);
+        __m256 code = _mm256_add_ps(_mm256_add_ps(_mm256_set1_ps(t.outYOffset),
+                                                  _mm256_mul_ps(_mm256_set1_ps(t.outYScale), outY)),
+                                    _mm256_set1_ps(0.5f));
+        __m256i codes = _mm256_min_epi32(_mm256_max_epi32(_mm256_cvttps_epi32(code), _mm256_setzero_si256()),
+                                         _mm256_set1_epi32(t.outMax));
+        storeLuma8(lumaOut + x, codes);
+        _mm256_storeu_ps(cbOut + x, _mm256_mul_ps(_mm256_sub_ps(outB, outY), _mm256_set1_ps(t.outCbScale)));
+        _mm256_storeu_ps(crOut + x, _mm256_mul_ps(_mm256_sub_ps(outR, outY), _mm256_set1_ps(t.outCrScale)));
+    }
+    mapRowScalar(t, y, cb, cr, chromaShift, lumaOut, cbOut, crOut, x, width);
+}
+#endif
+
+#if defined(HAVE_NEON_KERNELS)
+static inline float32x4_t lookup4(const std::vector<float>& table, float32x4_t value) {
+    value = vminq_f32(vmaxq_f32(value, vdupq_n_f32(0.0f)), vdupq_n_f32(1.0f));
+    int32x4_t index = vcvtq_s32_f32(vaddq_f32(vmulq_n_f32(value, float(LUT_SIZE - 1)), vdupq_n_f32(0.5f)));
+    float values[4] = {table[vgetq_lane_s32(index, 0)], table[vgetq_lane_s32(index, 1)],
+                       table[vgetq_lane_s32(index, 2)], table[vgetq_lane_s32(index, 3)]};
+    return vld1q_f32(values);
+}
+
+static inline float32x4_t load4Chroma(const uint16_t* p, int chromaShift) {
+    if (!chromaShift) {
+        return vcvtq_f32_u32(vmovl_u16(vld1_u16(p)));
+    }
+    uint16x4_t two = vreinterpret_u16_u32(vdup_n_u32(uint32_t(p[0]) | (uint32_t(p[1]) << 16)));
+    return vcvtq_f32_u32(vmovl_u16(vzip1_u16(two, two)));
+}
+
+static inline float32x4_t clamp01(float32x4_t value) {
+    return vminq_f32(vmaxq_f32(value, vdupq_n_f32(0.0f)), vdupq_n_f32(1.0f));
+}
+
+static inline float32x4_t dot3(const float* row, float32x4_t r, float32x4_t g, float32x4_t b) {
+    float32x4_t sum = vaddq_f32(vmulq_n_f32(r, row[0]), vmulq_n_f32(g, row[1]));
+    return vaddq_f32(sum, vmulq_n_f32(b, row[2]));
+}
+
+template <typename Out>
+static void mapRowNEON(const ToneMapper::Tables& t, const uint16_t* y, const uint16_t* cb,
+                       const uint16_t* cr, int chromaShift, Out* lumaOut,
+                       float* cbOut, float* crOut, int from, int width) {
+    const float outK[3] = {t.outKr, t.outKg, t.outKb};
+
+    int x = from;
+    for (; x + 4 <= width; x += 4) {
+        float32x4_t luma = vmulq_n_f32(vsubq_f32(vcvtq_f32_u32(vmovl_u16(vld1_u16(y + x))),
+                                                 vdupq_n_f32(t.yOffset)), t.yScale);
+        float32x4_t blue = vmulq_n_f32(vsubq_f32(load4Chroma(cb + (x >> chromaShift), chromaShift),
+                                                 vdupq_n_f32(t.cOffset)), t.cScale);
+        float32x4_t red = vmulq_n_f32(vsubq_f32(load4Chroma(cr + (x >> chromaShift), chromaShift),
+                                                vdupq_n_f32(t.cOffset)), t.cScale);
+
+        float32x4_t r = vaddq_f32(luma, vmulq_n_f32(red, t.crToR));
+        float32x4_t g = vsubq_f32(vsubq_f32(luma, vmulq_n_f32(blue, t.cbToG)), vmulq_n_f32(red, t.crToG));
+        float32x4_t b = vaddq_f32(luma, vmulq_n_f32(blue, t.cbToB));
+        r = lookup4(t.linearize, r);
+        g = lookup4(t.linearize, g);
+        b = lookup4(t.linearize, b);
+
+        float32x4_t outR = lookup4(t.encode, vsqrtq_f32(clamp01(dot3(t.gamut, r, g, b))));
+        float32x4_t outG = lookup4(t.encode, vsqrtq_f32(clamp01(dot3(t.gamut + 3, r, g, b))));
+        float32x4_t outB = lookup4(t.encode, vsqrtq_f32(clamp01(dot3(t.gamut + 6, r, g, b))));
+
+        float32x4_t outY = dot3(outK, outR, outG, outB);
+        float32x4_t code = vaddq_f32(vaddq_f32(vdupq_n_f32(t.outYOffset), vmulq_n_f32(outY, t.outYScale)),
+                                     vdupq_n_f32(0.5f));
+        int32x4_t codes = vminq_s32(vmaxq_s32(vcvtq_s32_f32(code), vdupq_n_s32(0)), vdupq_n_s32(t.outMax));
+        uint16x4_t words = vqmovun_s32(codes);
+        if (sizeof(Out) == 1) {
+            uint8x8_t bytes = vqmovn_u16(vcombine_u16(words, words));
+            vst1_lane_u32(reinterpret_cast<uint32_t*>(lumaOut + x), vreinterpret_u32_u8(bytes), 0);
+        } else {
+            vst1_u16(reinterpret_cast<uint16_t*>(lumaOut + x), words);
+        }
+        vst1q_f32(cbOut + x, vmulq_n_f32(vsubq_f32(outB, outY), t.outCbScale));
+        vst1q_f32(crOut + x, vmulq_n_f32(vsubq_f32(outR, outY), t.outCrScale));
+    }
+    mapRowScalar(t, y, cb, cr, chromaShift, lumaOut, cbOut, crOut, x, width);
+}
+#endif
+
+template <typename Out>
+using RowKernel = void (*)(const ToneMapper::Tables& t, const uint16_t* y, const uint16_t* cb,
+                           const uint16_t* cr, int chromaShift, Out* lumaOut,
+                           float* cbOut, float* crOut, int from, int width);
+
+template <typename Out>
+static RowKernel<Out> rowKernel(SimdKernel kernel) {
+    switch (kernel) {
+#if defined(HAVE_AVX2_KERNELS)
+    case SimdKernel::AVX2:
+        return mapRowAVX2<Out>;
+#endif
+#if defined(HAVE_NEON_KERNELS)
+    case SimdKernel::NEON:
+        return mapRowNEON<Out>;
+#endif
+    default:
+        return mapRowScalar<Out>;
+    }
+}
+
+template <typename Out>
+static void mapFrame(const ToneMapper::Tables& t, SimdKernel kernel,
+                     const AVFrame* source, AVFrame* target) {
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(AVPixelFormat(source->format));
+    int shiftX = desc->log2_chroma_w;
+    int shiftY = desc->log2_chroma_h;
+    int width = source->width;
+    int height = source->height;
+    int chromaWidth = AV_CEIL_RSHIFT(width, shiftX);
+    int chromaHeight = AV_CEIL_RSHIFT(height, shiftY);
+    RowKernel<Out> mapRow = rowKernel<Out>(kernel);
+
+    // Bands of whole chroma rows; chroma is the average over each block
+    ParallelRows::run(chromaHeight, [&](int begin, int end) {
+        static thread_local std::vector<float> chroma;
+        int blockRows = 1 << shiftY;
+        chroma.resize(size_t(2) * blockRows * width);
+
+        for (int cy = begin; cy < end; cy++) {
+            const uint16_t* cb = reinterpret_cast<const uint16_t*>(source->data[1] + qint64(cy) * source->linesize[1]);
+            const uint16_t* cr = reinterpret_cast<const uint16_t*>(source->data[2] + qint64(cy) * source->linesize[2]);
+            int rows = std::min(blockRows, height - (cy << shiftY));
+            for (int i = 0; i < rows; i++) {
+                int y = (cy << shiftY) + i;
+                mapRow(t, reinterpret_cast<const uint16_t*>(source->data[0] + qint64(y) * source->linesize[0]),
+                       cb, cr, shiftX,
+                       reinterpret_cast<Out*>(target->data[0] + qint64(y) * target->linesize[0]),
+                       chroma.data() + size_t(2 * i) * width, chroma.data() + size_t(2 * i + 1) * width,
+                       0, width);
+            }
+
+            // Sum the block's rows into the first, then its columns
+            float* cbSum = chroma.data();
+            float* crSum = chroma.data() + width;
+            for (int i = 1; i < rows; i++) {
+                const float* cbRow = chroma.data() + size_t(2 * i) * width;
+                const float* crRow = cbRow + width;
+                for (int x = 0; x < width; x++) {
+                    cbSum[x] += cbRow[x];
+                    crSum[x] += crRow[x];
+                }
+            }
+            if (shiftX) {
+                for (int cx = 0; cx < width / 2; cx++) {
+                    cbSum[cx] = cbSum[2 * cx] + cbSum[2 * cx + 1];
+                    crSum[cx] = crSum[2 * cx] + crSum[2 * cx + 1];
+                }
+                if (width & 1) {
+                    // The last block is half as wide
+                    cbSum[width / 2] = cbSum[width - 1] * 2.0f;
+                    crSum[width / 2] = crSum[width - 1] * 2.0f;
+                }
+            }
+
+            Out* cbOut = reinterpret_cast<Out*>(target->data[1] + qint64(cy) * target->linesize[1]);
+            Out* crOut = reinterpret_cast<Out*>(target->data[2] + qint64(cy) * target->linesize[2]);
+            float scale = t.outCScale / float(rows << shiftX);
+            for (int cx = 0; cx < chromaWidth; cx++) {
+                int codeCb = int(t.outCOffset + cbSum[cx] * scale + 0.5f);
+                int codeCr = int(t.outCOffset + crSum[cx] * scale + 0.5f);
+                cbOut[cx] = Out(std::min(std::max(codeCb, 0), t.outMax));
+                crOut[cx] = Out(std::min(std::max(codeCr, 0), t.outMax));
+            }
+        }
+    }, 8);
+}
+
+ToneMapper::ToneMapper()
+    : curve(Curve::BT2390)
+    , output(Output::SDR)
+    , targetPeak(DEFAULT_PEAK)
+    , kernel(CpuFeatures::resolve(SimdKernel::Auto))
+{
+}
+
+void ToneMapper::setCurve(Curve value) {
+    curve = value;
+}
+
+void ToneMapper::setOutput(Output value) {
+    output = value;
+}
+
+void ToneMapper::setTargetPeak(double nits) {
+    targetPeak = std::max(nits, SDR_WHITE);
+}
+
+void ToneMapper::setKernel(SimdKernel value) {
+    kernel = CpuFeatures::resolve(value);
+}
+
+bool ToneMapper::isHDR(AVColorTransferCharacteristic transfer) {
+    return transfer == AVCOL_TRC_SMPTE2084 || transfer == AVCOL_TRC_ARIB_STD_B67;
+}
+
+bool ToneMapper::isSupported(const AVFrame* frame) {
+    if (!frame || !isHDR(frame->color_trc)) {
+        return false;
+    }
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(AVPixelFormat(frame->format));
+    return desc && desc->nb_components >= 3 && (desc->flags & AV_PIX_FMT_FLAG_PLANAR) &&
+           !(desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BE)) &&
+           av_pix_fmt_count_planes(AVPixelFormat(frame->format)) == desc->nb_components &&
+           desc->comp[0].shift == 0 && desc->comp[0].depth > 8 && desc->comp[0].depth <= 16 &&
+           desc->log2_chroma_w <= 1;
+}
+
+AVPixelFormat ToneMapper::outputFormat(AVPixelFormat input) const {
+    if (output == Output::HDR) {
+        return input;
+    }
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(input);
+    if (!desc) {
+        return AV_PIX_FMT_NONE;
+    }
+    if (desc->log2_chroma_h) {
+        return AV_PIX_FMT_YUV420P;
+    }
+    return desc->log2_chroma_w ? AV_PIX_FMT_YUV422P : AV_PIX_FMT_YUV444P;
+}
+
+bool ToneMapper::isNeeded(const AVFrame* frame) const {
+    if (!frame || !isHDR(frame->color_trc)) {
+        return false;
+    }
+    if (output == Output::SDR) {
+        return true;
+    }
+    return frame->color_trc == AVCOL_TRC_SMPTE2084 && sourcePeak(frame) > targetPeak;
+}
+
+double ToneMapper::sourcePeak(const AVFrame* frame) {
+    if (frame->color_trc != AVCOL_TRC_SMPTE2084) {
+        return DEFAULT_PEAK;
+    }
+    AVFrameSideData* light = av_frame_get_side_data(frame, AV_FRAME_DATA_CONTENT_LIGHT_LEVEL);
+    if (light) {
+        auto* level = reinterpret_cast<const AVContentLightMetadata*>(light->data);
+        if (level->MaxCLL > 0) {
+            return level->MaxCLL;
+        }
+    }
+    AVFrameSideData* mastering = av_frame_get_side_data(frame, AV_FRAME_DATA_MASTERING_DISPLAY_METADATA);
+    if (mastering) {
+        auto* display = reinterpret_cast<const AVMasteringDisplayMetadata*>(mastering->data);
+        if (display->has_luminance && av_q2d(display->max_luminance) > 0.0) {
+            return av_q2d(display->max_luminance);
+        }
+    }
+    return DEFAULT_PEAK;
+}
+
+bool ToneMapper::process(const AVFrame* source, AVFrame* target) {
+    if (!isSupported(source) || !target || target->format != outputFormat(AVPixelFormat(source->format)) ||
+        target->width != source->width || target->height != source->height) {
+        return false;
+    }
+
+    prepare(source);
+    if (output == Output::SDR) {
+        mapFrame<uint8_t>(tables, kernel, source, target);
+    } else {
+        mapFrame<uint16_t>(tables, kernel, source, target);
+    }
+    tagOutput(source, target);
+    return true;
+}
+
+void ToneMapper::tagOutput(const AVFrame* source, AVFrame* target) const {
+    if (output == Output::SDR) {
+        target->color_primaries = AVCOL_PRI_BT709;
+        target->color_trc = AVCOL_TRC_BT709;
+        target->colorspace = AVCOL_SPC_BT709;
+        target->color_range = AVCOL_RANGE_MPEG;
+        av_frame_remove_side_data(target, AV_FRAME_DATA_MASTERING_DISPLAY_METADATA);
+    } else {
+        target->color_primaries = AVCOL_PRI_BT2020;
+        target->color_trc = AVCOL_TRC_SMPTE2084;
+        target->colorspace = AVCOL_SPC_BT2020_NCL;
+        target->color_range = source->color_range;
+        AVFrameSideData* mastering = av_frame_get_side_data(target, AV_FRAME_DATA_MASTERING_DISPLAY_METADATA);
+        if (mastering) {
+            auto* display = reinterpret_cast<AVMasteringDisplayMetadata*>(mastering->data);
+            display->max_luminance = av_d2q(targetPeak, 100000);
+        }
+    }
+    av_frame_remove_side_data(target, AV_FRAME_DATA_CONTENT_LIGHT_LEVEL);
+}
+
+void ToneMapper::prepare(const AVFrame* source) {
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(AVPixelFormat(source->format));
+    int depth = desc->comp[0].depth;
+    bool fullRange = source->color_range == AVCOL_RANGE_JPEG;
+    bool bt709Source = source->colorspace == AVCOL_SPC_BT709;
+    double peak = sourcePeak(source);
+    double outPeak = output == Output::SDR ? SDR_WHITE : targetPeak;
+
+    std::vector<double> key = {double(source->color_trc), double(depth), double(fullRange),
+                               double(bt709Source), peak, outPeak, double(curve), double(output)};
+    if (key == tableKey) {
+        return;
+    }
+    tableKey = key;
+    Tables& t = tables;
+
+    // Source R'G'B' through the EOTF and the tone curve
+    bool pq = source->color_trc == AVCOL_TRC_SMPTE2084;
+    t.linearize.resize(LUT_SIZE);
+    for (int i = 0; i < LUT_SIZE; i++) {
+        double value = double(i) / (LUT_SIZE - 1);
+        double nits = pq ? pqToNits(value) : hlgToNits(value);
+        t.linearize[i] = float(std::min(toneMap(curve, nits, peak, outPeak) / outPeak, 1.0));
+    }
+
+    // Linear output, indexed by its square root for precision in the shadows
+    t.encode.resize(LUT_SIZE);
+    for (int i = 0; i < LUT_SIZE; i++) {
+        double root = double(i) / (LUT_SIZE - 1);
+        double linear = root * root;
+        t.encode[i] = float(output == Output::SDR ? bt709Encode(linear) : nitsToPQ(linear * outPeak));
+    }
+
+    // Source codes to normalised Y'CbCr, and on to R'G'B'
+    double unit = double(1 << (depth - 8));
+    double maxCode = double((1 << depth) - 1);
+    t.yOffset = float(fullRange ? 0.0 : 16.0 * unit);
+    t.yScale = float(1.0 / (fullRange ? maxCode : 219.0 * unit));
+    t.cOffset = float(128.0 * unit);
+    t.cScale = float(1.0 / (fullRange ? maxCode : 224.0 * unit));
+    double kr = bt709Source ? 0.2126 : 0.2627;
+    double kb = bt709Source ? 0.0722 : 0.0593;
+    double kg = 1.0 - kr - kb;
+    t.crToR = float(2.0 * (1.0 - kr));
+    t.cbToB = float(2.0 * (1.0 - kb));
+    t.cbToG = float(2.0 * kb * (1.0 - kb) / kg);
+    t.crToG = float(2.0 * kr * (1.0 - kr) / kg);
+
+    // Output primaries, matrix and codes
+    bool toBT709 = output == Output::SDR && !bt709Source;
+    std::copy(toBT709 ? BT2020_TO_BT709 : IDENTITY, (toBT709 ? BT2020_TO_BT709 : IDENTITY) + 9, t.gamut);
+    double outKr = output == Output::SDR ? 0.2126 : 0.2627;
+    double outKb = output == Output::SDR ? 0.0722 : 0.0593;
+    t.outKr = float(outKr);
+    t.outKb = float(outKb);
+    t.outKg = float(1.0 - outKr - outKb);
+    t.outCbScale = float(1.0 / (2.0 * (1.0 - outKb)));
+    t.outCrScale = float(1.0 / (2.0 * (1.0 - outKr)));
+
+    int outDepth = output == Output::SDR ? 8 : depth;
+    bool outFull = output == Output::HDR && fullRange;
+    double outUnit = double(1 << (outDepth - 8));
+    t.outMax = (1 << outDepth) - 1;
+    t.outYOffset = float(outFull ? 0.0 : 16.0 * outUnit);
+    t.outYScale = float(outFull ? t.outMax : 219.0 * outUnit);
+    t.outCOffset = float(128.0 * outUnit);
+    t.outCScale = float(outFull ? t.outMax : 224.0 * outUnit);
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <vector>
+#include "cpufeatures.h"
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+}
+
+// Tone maps PQ and HLG video, either down to SDR (8-bit BT.709) or to a
+// PQ master with a lower peak. Works on 10- to 16-bit planar YUV. Each
+// channel's transfer function and tone curve are folded into one lookup
+// table, rebuilt only when the source or settings change. The colour
+// matrices and gamut conversion run eight pixels at a time (AVX2 gathers)
+// or four (NEON), with a scalar fallback.
+class ToneMapper {
+public:
+    enum class Curve {
+        Hable,     // Filmic; soft shoulder, darker midtones
+        Reinhard,  // Extended, with the source peak as white point
+        BT2390     // ITU-R BT.2390 EETF; leaves everything below the knee alone
+    };
+
+    enum class Output {
+        SDR,  // BT.709, 8-bit, limited range
+        HDR   // PQ BT.2020 at the target peak, same depth as the source
+    };
+
+    ToneMapper();
+
+    void setCurve(Curve curve);
+    Curve getCurve() const { return curve; }
+    void setOutput(Output output);
+    Output getOutput() const { return output; }
+
+    // Nits; the peak an HDR output is mapped to
+    void setTargetPeak(double nits);
+    double getTargetPeak() const { return targetPeak; }
+
+    void setKernel(SimdKernel kernel);
+    SimdKernel getKernel() const { return kernel; }
+
+    // PQ or HLG
+    static bool isHDR(AVColorTransferCharacteristic transfer);
+    static bool isSupported(const AVFrame* frame);
+
+    // Pixel format process() writes for a given source format
+    AVPixelFormat outputFormat(AVPixelFormat input) const;
+
+    // False when the output would equal the input: HDR output from HLG,
+    // or from a source that already fits under the target peak
+    bool isNeeded(const AVFrame* frame) const;
+
+    // Source peak in nits: MaxCLL, else the mastering display, else 1000
+    static double sourcePeak(const AVFrame* frame);
+
+    // Target must be allocated in outputFormat() with the source geometry.
+    // Sets its colour properties to match the output.
+    bool process(const AVFrame* source, AVFrame* target);
+
+    // The colour properties and HDR metadata process() gives its output;
+    // for callers that map a frame in parts
+    void tagOutput(const AVFrame* source, AVFrame* target) const;
+
+    // What the row kernels work from; built by prepare()
+    struct Tables {
+        std::vector<float> linearize;  // Source R'G'B' to tone mapped linear, 1.0 = target peak
+        std::vector<float> encode;     // sqrt(linear) to output R'G'B'
+        float yOffset, yScale;         // Source codes to normalised Y'CbCr
+        float cOffset, cScale;
+        float crToR, cbToG, crToG, cbToB;
+        float gamut[9];                // Linear source primaries to output primaries
+        float outKr, outKg, outKb;
+        float outCbScale, outCrScale;
+        float outYOffset, outYScale;   // Normalised to output codes
+        float outCOffset, outCScale;
+        int outMax;
+    };
+
+private:
+    Curve curve;
+    Output output;
+    double targetPeak;
+    SimdKernel kernel;
+    Tables tables;
+    std::vector<double> tableKey;  // Settings the tables were built for
+
+    void prepare(const AVFrame* source);
+
+    // Constants
+    static const double SDR_WHITE;
+    static const double DEFAULT_PEAK;
+};
@@ -0,0 +1,510 @@
+#include "unsharpmask.h"
+#include "parallelrows.h"
+#include <algorithm>
+#include <vector>
+
+#if defined(HAVE_AVX2_KERNELS)
+#include <immintrin.h>
+#endif
+#if defined(HAVE_NEON_KERNELS)
+#include <arm_neon.h>
+#endif
+
+extern "C" {
+#include <libavutil/pixdesc.h>
+#include <libavutil/imgutils.h>
+}
+
+const double UnsharpMask::MAX_AMOUNT = 5.0; // SharpenEffect's range
+
+// The blur is 1-4-6-4-1 across, then down, with edge pixels repeated:
+// FFmpeg's 5x5 unsharp matrix. Horizontal sums (up to 16 times the largest
+// sample) are kept as rows of 16-bit words at 8 bits and 32-bit above; the
+// vertical pass scales the 2^8 total back down and applies the amount in
+// 16.16 fixed point.
+static const int TAPS = 5;
+
+template <typename Sample> struct BlurSum { using Type = uint32_t; };
+template <> struct BlurSum<uint8_t> { using Type = uint16_t; };
+
+template <typename Sample>
+using HorizontalKernel = void (*)(const Sample* source, typename BlurSum<Sample>::Type* out, int width);
+template <typename Sample>
+using VerticalKernel = void (*)(const typename BlurSum<Sample>::Type* const* rows, const Sample* source,
+                                Sample* out, int width, int amount, int maximum);
+
+// Helper functions
+template <typename Sample>
+static inline typename BlurSum<Sample>::Type blurPixel(const Sample* source, int x, int width) {
+    auto at = [&](int i) { return uint32_t(source[std::min(std::max(i, 0), width - 1)]); };
+    return typename BlurSum<Sample>::Type(at(x - 2) + 4 * at(x - 1) + 6 * at(x) + 4 * at(x + 1) + at(x + 2));
+}
+
+template <typename Sum, typename Sample>
+static inline Sample sharpenPixel(const Sum* const* rows, int x, int centre, int amount, int maximum) {
+    uint32_t sum = rows[0][x] + 4u * rows[1][x] + 6u * rows[2][x] + 4u * rows[3][x] + rows[4][x];
+    int blurred = int((sum + 128) >> 8);
+    int result = centre + int((int64_t(centre - blurred) * amount) >> 16);
+    return Sample(std::min(std::max(result, 0), maximum));
+}
+
+template <typename Sample>
+static void blurRowScalar(const Sample* source, typename BlurSum<Sample>::Type* out, int width) {
+    for (int x = 0; x < width; x++) {
+        out[x] = blurPixel(source, x, width);
+    }
+}
+
+template <typename Sample>
+static void sharpenRowScalar(const typename BlurSum<Sample>::Type* const* rows, const Sample* source,
+                             Sample* out, int width, int amount, int maximum) {
+    for (int x = 0; x < width; x++) {
+        out[x] = sharpenPixel<typename BlurSum<Sample>::Type, Sample>(rows, x, source[x], amount, maximum);
+    }
+}
+
+#if defined(HAVE_AVX2_KERNELS)
+AVX2_TARGET static inline __m256i load16x16(const uint8_t* p) {
+    return _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+}
+
+AVX2_TARGET static inline void blurBlockAVX2(const uint8_t* source, uint16_t* out, int x) {
+    __m256i outer = _mm256_add_epi16(load16x16(source + x - 2), load16x16(source + x + 2));
+    __m256i inner = _mm256_add_epi16(load16x16(source + x - 1), load16x16(source + x + 1));
+    __m256i centre = load16x16(source + x);
+    __m256i sum = _mm256_add_epi16(outer, _mm256_slli_epi16(inner, 2));
+    sum = _mm256_add_epi16(sum, _mm256_add_epi16(_mm256_slli_epi16(centre, 2),
+                                                 _mm256_slli_epi16(centre, 1)));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + x), sum);
+}
+
+AVX2_TARGET static void blurRowAVX2(const uint8_t* source, uint16_t* out, int width) {
+    if (width < 20) {
+        blurRowScalar<uint8_t>(source, out, width);
+        return;
+    }
+
+    // Interior columns sixteen at a time, the last block overlapping the one
+    // before rather than leave a scalar tail; the first and last two repeat
+    // edges
+    for (int x = 2; x < width - 18; x += 16) {
+        blurBlockAVX2(source, out, x);
+    }
+    blurBlockAVX2(source, out, width - 18);
+    for (int i = 0; i < 2; i++) {
+        out[i] = blurPixel<uint8_t>(source, i, width);
+        out[width - 1 - i] = blurPixel<uint8_t>(source, width - 1 - i, width);
+    }
+}
+
+AVX2_TARGET static inline __m256i load16(const uint16_t* p) {
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+}
+
+AVX2_TARGET static inline __m128i sharpenBlockAVX2(const uint16_t* const* rows, const uint8_t* source,
+                                                   int x, __m256i scale) {
+    const __m256i half = _mm256_set1_epi16(128);
+    __m256i middle = load16(rows[2] + x);
+    __m256i sum = _mm256_add_epi16(load16(rows[0] + x), load16(rows[4] + x));
+    sum = _mm256_add_epi16(sum, _mm256_slli_epi16(_mm256_add_epi16(load16(rows[1] + x),
+                                                                    load16(rows[3] + x)), 2));
+    sum = _mm256_add_epi16(sum, _mm256_add_epi16(_mm256_slli_epi16(middle, 2),
+                                                 _mm256_slli_epi16(middle, 1)));
+    __m256i blurred = _mm256_srli_epi16(_mm256_add_epi16(sum, half), 8);
+
+    // Widen to 32 bits for the 16.16 amount
+    __m256i centre = load16x16(source + x);
+    __m256i difference = _mm256_sub_epi16(centre, blurred);
+    __m256i centreLow = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(centre));
+    __m256i centreHigh = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(centre, 1));
+    __m256i low = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(difference));
+    __m256i high = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(difference, 1));
+    low = _mm256_add_epi32(centreLow, _mm256_srai_epi32(_mm256_mullo_epi32(low, scale), 16));
+    high = _mm256_add_epi32(centreHigh, _mm256_srai_epi32(_mm256_mullo_epi32(high, scale), 16));
+
+    // Packing works within 128-bit lanes, hence the permutes
+    __m256i words = _mm256_permute4x64_epi64(_mm256_packs_epi32(low, high), 0xD8);
+    __m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(words, words), 0x08);
+    return _mm256_castsi256_si128(bytes);
+}
+
+AVX2_TARGET static void sharpenRowAVX2(const uint16_t* const* rows, const uint8_t* source,
+                                       uint8_t* out, int width, int amount, int maximum) {
+    if (width < 16) {
+        sharpenRowScalar<uint8_t>(rows, source, out, width, amount, maximum);
+        return;
+    }
+
+    // The last block overlaps the one before rather than leave a scalar
+    // tail. Out may be the source, so it is worked out before the loop
+    // overwrites what it reads.
+    const __m256i scale = _mm256_set1_epi32(amount);
+    __m128i last = sharpenBlockAVX2(rows, source, width - 16, scale);
+    for (int x = 0; x < width - 16; x += 16) {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x), sharpenBlockAVX2(rows, source, x, scale));
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + width - 16), last);
+}
+
+// Above 8 bits: eight 32-bit sums at a time
+AVX2_TARGET static inline __m256i load8x32(const uint16_t* p) {
+    return _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+}
+
+AVX2_TARGET static inline void blurBlockAVX2(const uint16_t* source, uint32_t* out, int x) {
+    __m256i outer = _mm256_add_epi32(load8x32(source + x - 2), load8x32(source + x + 2));
+    __m256i inner = _mm256_add_epi32(load8x32(source + x - 1), load8x32(source + x + 1));
+    __m256i centre = load8x32(source + x);
+    __m256i sum = _mm256_add_epi32(outer, _mm256_slli_epi32(inner, 2));
+    sum = _mm256_add_epi32(sum, _mm256_add_epi32(_mm256_slli_epi32(centre, 2),
+                                                 _mm256_slli_epi32(centre, 1)));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + x), sum);
+}
+
+AVX2_TARGET static void blurRowAVX2(const uint16_t* source, uint32_t* out, int width) {
+    if (width < 12) {
+        blurRowScalar<uint16_t>(source, out, width);
+        return;
+    }
+
+    for (int x = 2; x < width - 10; x += 8) {
+        blurBlockAVX2(source, out, x);
+    }
+    blurBlockAVX2(source, out, width - 10);
+    for (int i = 0; i < 2; i++) {
+        out[i] = blurPixel<uint16_t>(source, i, width);
+        out[width - 1 - i] = blurPixel<uint16_t>(source, width - 1 - i, width);
+    }
+}
+
+AVX2_TARGET static inline __m256i load32(const uint32_t* p) {
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+}
+
+AVX2_TARGET static inline __m256i multiplyShift16(__m256i value, __m256i amount) {
+    // (value × amount) >> 16 through 64-bit products of the even and odd
+    // lanes; the low halves of logical and arithmetic shifts agree
+    __m256i even = _mm256_srli_epi64(_mm256_mul_epi32(value, amount), 16);
+    __m256i odd = _mm256_srli_epi64(_mm256_mul_epi32(_mm256_srli_epi64(value, 32), amount), 16);
+    return _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA);
+}
+
+AVX2_TARGET static inline __m128i sharpenBlockAVX2(const uint32_t* const* rows, const uint16_t* source,
+                                                   int x, __m256i scale, __m256i maximum) {
+    __m256i middle = load32(rows[2] + x);
+    __m256i sum = _mm256_add_epi32(load32(rows[0] + x), load32(rows[4] + x));
+    sum = _mm256_add_epi32(sum, _mm256_slli_epi32(_mm256_add_epi32(load32(rows[1] + x),
+                                                                    load32(rows[3] + x)), 2));
+    sum = _mm256_add_epi32(sum, _mm256_add_epi32(_mm256_slli_epi32(middle, 2),
+                                                 _mm256_slli_epi32(middle, 1)));
+    __m256i blurred = _mm256_srli_epi32(_mm256_add_epi32(sum, _mm256_set1_epi32(128)), 8);
+
+    __m256i centre = load8x32(source + x);
+    __m256i result = _mm256_add_epi32(centre, multiplyShift16(_mm256_sub_epi32(centre, blurred), scale));
+    result = _mm256_min_epi32(_mm256_max_epi32(result, _mm256_setzero_si256()), maximum);
+    return _mm_packus_epi32(_mm256_castsi256_si128(result), _mm256_extracti128_si256(result, 1));
+}
+
+AVX2_TARGET static void sharpenRowAVX2(const uint32_t* const* rows, const uint16_t* source,
+                                       uint16_t* out, int width, int amount, int maximum) {
+    if (width < 8) {
+        sharpenRowScalar<uint16_t>(rows, source, out, width, amount, maximum);
+        return;
+    }
+
+    // As the 8-bit kernel, the overlapping last block is worked out first
+    const __m256i scale = _mm256_set1_epi32(amount);
+    const __m256i limit = _mm256_set1_epi32(maximum);
+    __m128i last = sharpenBlockAVX2(rows, source, width - 8, scale, limit);
+    for (int x = 0; x < width - 8; x += 8) {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x), sharpenBlockAVX2(rows, source, x, scale, limit));
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + width - 8), last);
+}
+#endif
+
+#if defined(HAVE_NEON_KERNELS)
+static inline void blurBlockNEON(const uint8_t* source, uint16_t* out, int x) {
+    uint16x8_t outer = vaddl_u8(vld1_u8(source + x - 2), vld1_u8(source + x + 2));
+    uint16x8_t inner = vaddl_u8(vld1_u8(source + x - 1), vld1_u8(source + x + 1));
+    uint16x8_t sum = vmlaq_n_u16(outer, inner, 4);
+    sum = vmlaq_n_u16(sum, vmovl_u8(vld1_u8(source + x)), 6);
+    vst1q_u16(out + x, sum);
+}
+
+static void blurRowNEON(const uint8_t* source, uint16_t* out, int width) {
+    if (width < 12) {
+        blurRowScalar<uint8_t>(source, out, width);
+        return;
+    }
+
+    // As the AVX2 kernel, with an overlapping last block
+    for (int x = 2; x < width - 10; x += 8) {
+        blurBlockNEON(source, out, x);
+    }
+    blurBlockNEON(source, out, width - 10);
+    for (int i = 0; i < 2; i++) {
+        out[i] = blurPixel<uint8_t>(source, i, width);
+        out[width - 1 - i] = blurPixel<uint8_t>(source, width - 1 - i, width);
+    }
+}
+
+static inline int32x4_t sharpen4(int16x4_t centre, int16x4_t difference, int amount) {
+    int32x4_t scaled = vshrq_n_s32(vmulq_n_s32(vmovl_s16(difference), amount), 16);
+    return vaddq_s32(vmovl_s16(centre), scaled);
+}
+
+static inline uint8x8_t sharpenBlockNEON(const uint16_t* const* rows, const uint8_t* source,
+                                         int x, int amount) {
+    uint16x8_t sum = vaddq_u16(vld1q_u16(rows[0] + x), vld1q_u16(rows[4] + x));
+    sum = vmlaq_n_u16(sum, vaddq_u16(vld1q_u16(rows[1] + x), vld1q_u16(rows[3] + x)), 4);
+    sum = vmlaq_n_u16(sum, vld1q_u16(rows[2] + x), 6);
+    uint16x8_t blurred = vshrq_n_u16(vaddq_u16(sum, vdupq_n_u16(128)), 8);
+
+    int16x8_t centre = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(source + x)));
+    int16x8_t difference = vsubq_s16(centre, vreinterpretq_s16_u16(blurred));
+    int32x4_t low = sharpen4(vget_low_s16(centre), vget_low_s16(difference), amount);
+    int32x4_t high = sharpen4(vget_high_s16(centre), vget_high_s16(difference), amount);
+    return vqmovn_u16(vcombine_u16(vqmovun_s32(low), vqmovun_s32(high)));
+}
+
+static void sharpenRowNEON(const uint16_t* const* rows, const uint8_t* source,
+                           uint8_t* out, int width, int amount, int maximum) {
+    if (width < 8) {
+        sharpenRowScalar<uint8_t>(rows, source, out, width, amount, maximum);
+        return;
+    }
+
+    // As the AVX2 kernel, the overlapping last block is worked out first
+    uint8x8_t last = sharpenBlockNEON(rows, source, width - 8, amount);
+    for (int x = 0; x < width - 8; x += 8) {
+        vst1_u8(out + x, sharpenBlockNEON(rows, source, x, amount));
+    }
+    vst1_u8(out + width - 8, last);
+}
+
+// Above 8 bits: eight 32-bit sums at a time, as two halves
+static inline void blurBlockNEON(const uint16_t* source, uint32_t* out, int x) {
+    uint16x8_t outerLeft = vld1q_u16(source + x - 2), innerLeft = vld1q_u16(source + x - 1);
+    uint16x8_t centre = vld1q_u16(source + x);
+    uint16x8_t innerRight = vld1q_u16(source + x + 1), outerRight = vld1q_u16(source + x + 2);
+    uint32x4_t low = vaddl_u16(vget_low_u16(outerLeft), vget_low_u16(outerRight));
+    uint32x4_t high = vaddl_u16(vget_high_u16(outerLeft), vget_high_u16(outerRight));
+    low = vmlal_n_u16(vmlal_n_u16(low, vget_low_u16(innerLeft), 4), vget_low_u16(innerRight), 4);
+    high = vmlal_n_u16(vmlal_n_u16(high, vget_high_u16(innerLeft), 4), vget_high_u16(innerRight), 4);
+    vst1q_u32(out + x, vmlal_n_u16(low, vget_low_u16(centre), 6));
+    vst1q_u32(out + x + 4, vmlal_n_u16(high, vget_high_u16(centre), 6));
+}
+
+static void blurRowNEON(const uint16_t* source, uint32_t* out, int width) {
+    if (width < 12) {
+        blurRowScalar<uint16_t>(source, out, width);
+        return;
+    }
+
+    for (int x = 2; x < width - 10; x += 8) {
+        blurBlockNEON(source, out, x);
+    }
+    blurBlockNEON(source, out, width - 10);
+    for (int i = 0; i < 2; i++) {
+        out[i] = blurPixel<uint16_t>(source, i, width);
+        out[width - 1 - i] = blurPixel<uint16_t>(source, width - 1 - i, width);
+    }
+}
+
+static inline uint16x4_t sharpenHalfNEON(const uint32_t* const* rows, const uint16_t* source, int x,
+                                         int amount, int32x4_t maximum) {
+    uint32x4_t sum = vaddq_u32(vld1q_u32(rows[0] + x), vld1q_u32(rows[4] + x));
+    sum = vmlaq_n_u32(sum, vaddq_u32(vld1q_u32(rows[1] + x), vld1q_u32(rows[3] + x)), 4);
+    sum = vmlaq_n_u32(sum, vld1q_u32(rows[2] + x), 6);
+    int32x4_t blurred = vreinterpretq_s32_u32(vshrq_n_u32(vaddq_u32(sum, vdupq_n_u32(128)), 8));
+
+    int32x4_t centre = vreinterpretq_s32_u32(vmovl_u16(vld1_u16(source + x)));
+    int32x4_t difference = vsubq_s32(centre, blurred);
+    int32x4_t scaled = vcombine_s32(vshrn_n_s64(vmull_n_s32(vget_low_s32(difference), amount), 16),
+                                    vshrn_n_s64(vmull_n_s32(vget_high_s32(difference), amount), 16));
+    return vqmovun_s32(vminq_s32(vaddq_s32(centre, scaled), maximum));
+}
+
+static void sharpenRowNEON(const uint32_t* const* rows, const uint16_t* source,
+                           uint16_t* out, int width, int amount, int maximum) {
+    if (width < 8) {
+        sharpenRowScalar<uint16_t>(rows, source, out, width, amount, maximum);
+        return;
+    }
+
+    // As the 8-bit kernel, the overlapping last block is worked out first
+    const int32x4_t limit = vdupq_n_s32(maximum);
+    auto block = [&](int x) {
+        return vcombine_u16(sharpenHalfNEON(rows, source, x, amount, limit),
+                            sharpenHalfNEON(rows, source, x + 4, amount, limit));
+    };
+    uint16x8_t last = block(width - 8);
+    for (int x = 0; x < width - 8; x += 8) {
+        vst1q_u16(out + x, block(x));
+    }
+    vst1q_u16(out + width - 8, last);
+}
+#endif
+
+template <typename Sample>
+static void selectKernels(SimdKernel kernel, HorizontalKernel<Sample>& blur, VerticalKernel<Sample>& sharpen) {
+    switch (kernel) {
+#if defined(HAVE_AVX2_KERNELS)
+    case SimdKernel::AVX2:
+        blur = blurRowAVX2;
+        sharpen = sharpenRowAVX2;
+        return;
+#endif
+#if defined(HAVE_NEON_KERNELS)
+    case SimdKernel::NEON:
+        blur = blurRowNEON;
+        sharpen = sharpenRowNEON;
+        return;
+#endif
+    default:
+        blur = blurRowScalar<Sample>;
+        sharpen = sharpenRowScalar<Sample>;
+        return;
+    }
+}
+
+template <typename Sample>
+static void sharpenPlane(SimdKernel kernel, const uint8_t* source, int sourceStride,
+                         uint8_t* target, int targetStride, int width, int height, int amount, int maximum) {
+    using Sum = typename BlurSum<Sample>::Type;
+    HorizontalKernel<Sample> blurRow;
+    VerticalKernel<Sample> sharpenRow;
+    selectKernels<Sample>(kernel, blurRow, sharpenRow);
+    auto sourceRow = [=](int y) { return reinterpret_cast<const Sample*>(source + qint64(y) * sourceStride); };
+    auto targetRow = [=](int y) { return reinterpret_cast<Sample*>(target + qint64(y) * targetStride); };
+
+    // Each band needs blurred rows up to two beyond either end. Those
+    // belong to neighbouring bands, which may overwrite them when working
+    // in place, so they are blurred before any band starts.
+    std::vector<int> bounds = ParallelRows::split(height);
+    int bands = int(bounds.size()) - 1;
+    std::vector<Sum> halo(size_t(bands) * 4 * width);
+    auto haloRow = [&](int band, int slot) { return halo.data() + (size_t(band) * 4 + slot) * width; };
+    for (int band = 0; band < bands; band++) {
+        int begin = bounds[band];
+        int end = bounds[band + 1];
+        const int outside[4] = {begin - 2, begin - 1, end, end + 1};
+        for (int slot = 0; slot < 4; slot++) {
+            int y = qBound(0, outside[slot], height - 1);
+            if (y < begin || y >= end) {
+                blurRow(sourceRow(y), haloRow(band, slot), width);
+            }
+        }
+    }
+
+    ParallelRows::run(bounds, [&](int begin, int end) {
+        int band = int(std::upper_bound(bounds.begin(), bounds.end(), begin) - bounds.begin()) - 1;
+
+        // Rows of the band itself are blurred just ahead of use, into a ring
+        static thread_local std::vector<Sum> ring;
+        ring.resize(size_t(TAPS) * width);
+        auto blurred = [&](int y) -> const Sum* {
+            y = qBound(0, y, height - 1);
+            if (y < begin) {
+                return haloRow(band, y - begin + 2);
+            }
+            if (y >= end) {
+                return haloRow(band, y - end + 2);
+            }
+            return ring.data() + size_t(y % TAPS) * width;
+        };
+
+        for (int y = begin; y < qMin(begin + 2, end); y++) {
+            blurRow(sourceRow(y), ring.data() + size_t(y % TAPS) * width, width);
+        }
+        for (int y = begin; y < end; y++) {
+            // Blur the row two ahead before this one is overwritten
+            if (y + 2 < end) {
+                blurRow(sourceRow(y + 2), ring.data() + size_t((y + 2) % TAPS) * width, width);
+            }
+            const Sum* rows[TAPS] = {blurred(y - 2), blurred(y - 1), blurred(y),
+                                     blurred(y + 1), blurred(y + 2)};
+            sharpenRow(rows, sourceRow(y), targetRow(y), width, amount, maximum);
+        }
+    });
+}
+
+UnsharpMask::UnsharpMask()
+    : amount(0.0)
+    , fixedAmount(0)
+    , kernel(CpuFeatures::resolve(SimdKernel::Auto))
+{
+    setAmount(1.0);
+}
+
+void UnsharpMask::setAmount(double value) {
+    amount = qBound(0.0, value, MAX_AMOUNT);
+    fixedAmount = int(amount * 65536.0);
+}
+
+void UnsharpMask::setKernel(SimdKernel value) {
+    kernel = CpuFeatures::resolve(value);
+}
+
+bool UnsharpMask::isSupported(const AVFrame* frame) {
+    if (!frame) {
+        return false;
+    }
+    // Samples of 8 bits, or 9 to 16 in the low bits of native-endian words
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(AVPixelFormat(frame->format));
+    return desc && (desc->flags & AV_PIX_FMT_FLAG_PLANAR) && !(desc->flags & AV_PIX_FMT_FLAG_RGB) &&
+           !(desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BE)) &&
+           av_pix_fmt_count_planes(AVPixelFormat(frame->format)) == desc->nb_components &&
+           desc->comp[0].shift == 0 && desc->comp[0].depth >= 8 && desc->comp[0].depth <= 16;
+}
+
+bool UnsharpMask::process(const AVFrame* source, AVFrame* target) const {
+    if (!isSupported(source) || !target || target->format != source->format ||
+        target->width != source->width || target->height != source->height) {
+        return false;
+    }
+
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(AVPixelFormat(source->format));
+    int depth = desc->comp[0].depth;
+    processPlane(source->data[0], source->linesize[0], target->data[0], target->linesize[0],
+                 source->width, source->height, depth);
+    if (target == source) {
+        return true;
+    }
+
+    int bytes = depth > 8 ? 2 : 1;
+    int planes = av_pix_fmt_count_planes(AVPixelFormat(source->format));
+    for (int plane = 1; plane < planes; plane++) {
+        bool chroma = plane == 1 || plane == 2;
+        int width = chroma ? AV_CEIL_RSHIFT(source->width, desc->log2_chroma_w) : source->width;
+        int height = chroma ? AV_CEIL_RSHIFT(source->height, desc->log2_chroma_h) : source->height;
+        av_image_copy_plane(target->data[plane], target->linesize[plane],
+                            source->data[plane], source->linesize[plane], width * bytes, height);
+    }
+    return true;
+}
+
+void UnsharpMask::processPlane(const uint8_t* source, int sourceStride,
+                               uint8_t* target, int targetStride,
+                               int width, int height, int depth) const {
+    if (width <= 0 || height <= 0) {
+        return;
+    }
+    int bytes = depth > 8 ? 2 : 1;
+    if (fixedAmount == 0) {
+        if (target != source) {
+            av_image_copy_plane(target, targetStride, source, sourceStride, width * bytes, height);
+        }
+        return;
+    }
+
+    int maximum = (1 << depth) - 1;
+    if (bytes == 1) {
+        sharpenPlane<uint8_t>(kernel, source, sourceStride, target, targetStride, width, height,
+                              fixedAmount, maximum);
+    } else {
+        sharpenPlane<uint16_t>(kernel, source, sourceStride, target, targetStride, width, height,
+                               fixedAmount, maximum);
+    }
+}
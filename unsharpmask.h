@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include "cpufeatures.h"
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+// Unsharp mask on the luma of planar YUV of 8 to 16 bits: each pixel
+// moves away from a 5x5 Gaussian blur of its surroundings by `amount`
+// times the difference. At 8 bits, the same arithmetic as FFmpeg's
+// unsharp=5:5:amount, which SharpenEffect uses, so preview and export
+// match to the bit. The blur is separable, rows run in bands across
+// cores, and the kernels are AVX2 or NEON where the CPU has them.
+class UnsharpMask {
+public:
+    UnsharpMask();
+
+    // As SharpenEffect's "amount": 0 leaves the frame alone, 5 is the most
+    void setAmount(double amount);
+    double getAmount() const { return amount; }
+
+    void setKernel(SimdKernel kernel);
+    SimdKernel getKernel() const { return kernel; }
+
+    static bool isSupported(const AVFrame* frame);
+
+    // Sharpens luma from source into target, which may be the same frame
+    // to work in place. Otherwise target needs the same geometry and
+    // format, and gets the chroma planes copied over.
+    bool process(const AVFrame* source, AVFrame* target) const;
+
+    // One plane; source and target may be the same. Width in samples;
+    // above 8 bits a sample is a native-endian word.
+    void processPlane(const uint8_t* source, int sourceStride,
+                      uint8_t* target, int targetStride,
+                      int width, int height, int depth = 8) const;
+
+private:
+    double amount;
+    int fixedAmount;  // amount × 65536, truncated as FFmpeg does
+    SimdKernel kernel;
+
+    // Constants
+    static const double MAX_AMOUNT;
+};
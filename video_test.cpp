@@ -1,9 +1,39 @@
 #include <gtest/gtest.h>
 #include <QTemporaryFile>
 #include <QDir>
+#include <QFileInfo>
+#include <QElapsedTimer>
+#include <QDateTime>
+#include <QSignalSpy>
+#include <QTest>
+#include <QMap>
+#include <algorithm>
+#include <random>
+#include <cmath>
+#include <cstring>
 #include "../src/videoexporter.h"
 #include "../src/proxymanager.h"
 #include "../src/framecache.h"
+#include "../src/framedecoder.h"
+#include "../src/diskframecache.h"
+#include "../src/seekindex.h"
+#include "../src/processingpipeline.h"
+#include "../src/framepool.h"
+#include "../src/highresprocessor.h"
+#include "../src/spatialdenoiser.h"
+#include "../src/cpufeatures.h"
+#include "../src/unsharpmask.h"
+#include "../src/parallelrows.h"
+#include "../src/tonemapper.h"
+#include "../src/temporaldenoiser.h"
+#include "../src/stabilizer.h"
+#include "../src/tilescheduler.h"
+#include "../src/highresjobmanager.h"
+#include "../src/videoeffect.h"
+
+extern "C" {
+#include <libavutil/pixdesc.h>
+}
 
 class VideoTest : public ::testing::Test {
 protected:
@@ -97,6 +127,357 @@ TEST_F(VideoTest, TestFrameCaching) {
     ASSERT_GT(frameCache->getCacheHits(), 0);
 }
 
+TEST_F(VideoTest, TestSequentialFrameDecode) {
+    QString inputPath = createTestVideo("input.mp4");
+    
+    FrameDecoder decoder;
+    ASSERT_TRUE(decoder.open(inputPath));
+    
+    // One second worth of frames, requested out of order
+    QList<qint64> timestamps;
+    for (int i = 29; i >= 0; i--) {
+        timestamps << i * 1000 / 30;
+    }
+    
+    QList<qint64> delivered;
+    int count = decoder.decodeFrames(timestamps, [&](qint64 timestamp, const VideoFrame& frame) {
+        ASSERT_FALSE(frame.isNull());
+        delivered << timestamp;
+    });
+    
+    ASSERT_EQ(count, 30);
+    ASSERT_EQ(delivered.size(), 30);
+    ASSERT_TRUE(std::is_sorted(delivered.begin(), delivered.end()));
+}
+
+TEST_F(VideoTest, TestPlayheadJumpCancelsRequests) {
+    QString inputPath = createTestVideo("input.mp4");
+    
+    FrameLoader loader;
+    QSignalSpy loadedSpy(&loader, &FrameLoader::frameLoaded);
+    QSignalSpy cancelledSpy(&loader, &FrameLoader::frameLoadCancelled);
+    
+    // Queue a second of prefetches, then jump elsewhere
+    loader.setPlayhead(inputPath, 0);
+    for (int i = 0; i < 60; i++) {
+        loader.requestFrame(inputPath, i * 1000 / 30);
+    }
+    quint64 generation = loader.getGeneration();
+    ASSERT_EQ(loader.bumpGeneration(), generation + 1);
+    
+    // Every request is either delivered before the jump or cancelled
+    QElapsedTimer timer;
+    timer.start();
+    while (loadedSpy.count() + cancelledSpy.count() < 60 && timer.elapsed() < 5000) {
+        QTest::qWait(10);
+    }
+    ASSERT_EQ(loadedSpy.count() + cancelledSpy.count(), 60);
+    ASSERT_GT(cancelledSpy.count(), 0);
+}
+
+TEST_F(VideoTest, TestFrameIndexMapping) {
+    const AVRational rates[] = {{24000, 1001}, {25, 1}, {30000, 1001}, {50, 1}, {60, 1}};
+    for (const AVRational& rate : rates) {
+        VideoStreamInfo info;
+        info.frameRate = rate;
+        
+        // Rounded millisecond timestamps always land on the same frame
+        for (qint64 i = 0; i < 10000; i++) {
+            ASSERT_EQ(info.nearestFrame(info.frameStart(i)), i);
+            ASSERT_EQ(info.frameAt(info.frameCenter(i)), i);
+        }
+    }
+}
+
+TEST_F(VideoTest, TestStreamInfoProbe) {
+    QString inputPath = createTestVideo("input.mp4");
+    
+    // The lavfi color source runs at 25fps
+    VideoStreamInfo info = frameCache->getStreamInfo(inputPath);
+    ASSERT_TRUE(info.probed);
+    ASSERT_EQ(info.frameRate.num / info.frameRate.den, 25);
+    ASSERT_EQ(info.width, 1280);
+    ASSERT_EQ(info.height, 720);
+    ASSERT_EQ(info.nearestFrame(1000), 25);
+}
+
+TEST_F(VideoTest, TestNativeFrameStorage) {
+    QString inputPath = createTestVideo("input.mp4");
+    
+    FrameDecoder decoder;
+    ASSERT_TRUE(decoder.open(inputPath));
+    
+    VideoFrame native;
+    decoder.setOutputFormat(FrameDecoder::OutputFormat::Native);
+    decoder.decodeFrames({500}, [&](qint64, const VideoFrame& frame) { native = frame; });
+    ASSERT_TRUE(native.isNative());
+    
+    // yuv420p holds 1.5 bytes per pixel against 4 for RGB32
+    QImage rgb = native.toImage();
+    ASSERT_EQ(rgb.size(), QSize(1280, 720));
+    ASSERT_GT(double(rgb.sizeInBytes()) / native.sizeInBytes(), 2.0);
+}
+
+TEST_F(VideoTest, TestDiskCacheSurvivesRestart) {
+    QString sourcePath = tempDir->filePath("source.mp4");
+    QFile source(sourcePath);
+    ASSERT_TRUE(source.open(QIODevice::WriteOnly));
+    source.write("not really a video");
+    source.close();
+    
+    QImage image(320, 240, QImage::Format_RGB32);
+    image.fill(Qt::red);
+    QString cacheDir = tempDir->filePath("frames");
+    
+    {
+        DiskFrameCache cache(cacheDir, 256);
+        ASSERT_TRUE(cache.isValid());
+        cache.store(sourcePath, 42, VideoFrame(image));
+        cache.flush();
+        ASSERT_TRUE(cache.contains(sourcePath, 42));
+    }
+    
+    // A fresh instance finds the frame through the saved index
+    DiskFrameCache reopened(cacheDir, 256);
+    VideoFrame frame = reopened.lookup(sourcePath, 42);
+    ASSERT_FALSE(frame.isNull());
+    ASSERT_EQ(frame.toImage(), image);
+    ASSERT_TRUE(reopened.lookup(sourcePath, 43).isNull());
+}
+
+TEST_F(VideoTest, TestSeekIndex) {
+    // MPEG-TS with a keyframe every second at 25fps
+    QString inputPath = tempDir->filePath("input.ts");
+    QString command = QString("ffmpeg -f lavfi -i testsrc=s=640x360:d=10 -c:v libx264 -g 25 %1")
+                     .arg(inputPath);
+    system(qPrintable(command));
+    QString indexDir = tempDir->filePath("indexes");
+    
+    {
+        SeekIndexStore store(indexDir);
+        store.buildIndex(inputPath);
+        ASSERT_TRUE(store.waitForIndex(inputPath, 30000));
+        
+        auto index = store.indexFor(inputPath);
+        ASSERT_TRUE(index);
+        ASSERT_EQ(index->getKeyframes().size(), 10);
+        ASSERT_EQ(index->keyframeAt(2500)->timestamp, 2000);
+        ASSERT_GE(index->keyframeAt(2500)->position, 0);
+        
+        // Indexed seeks land on the same frames as searched ones
+        FrameDecoder plain;
+        FrameDecoder indexed;
+        ASSERT_TRUE(plain.open(inputPath));
+        ASSERT_TRUE(indexed.open(inputPath));
+        indexed.setSeekIndex(index);
+        ASSERT_TRUE(indexed.hasSeekIndex());
+        for (qint64 timestamp : {7300, 1200, 9960, 40, 4500}) {
+            QImage expected = plain.decodeFrame(timestamp);
+            QImage actual = indexed.decodeFrame(timestamp);
+            ASSERT_FALSE(actual.isNull());
+            ASSERT_EQ(indexed.getPosition(), plain.getPosition());
+            ASSERT_EQ(actual, expected);
+        }
+    }
+    
+    // A later session reads the index back instead of rebuilding it
+    SeekIndexStore reopened(indexDir);
+    ASSERT_TRUE(reopened.indexFor(inputPath));
+    
+    // Touching the source invalidates it
+    QFile source(inputPath);
+    ASSERT_TRUE(source.open(QIODevice::ReadWrite));
+    ASSERT_TRUE(source.setFileTime(QDateTime::currentDateTime().addSecs(60),
+                                   QFileDevice::FileModificationTime));
+    source.close();
+    ASSERT_FALSE(reopened.indexFor(inputPath));
+}
+
+TEST_F(VideoTest, TestShuttlePrefetchWindow) {
+    frameCache->setCacheAhead(30);
+    frameCache->setCacheBehind(30);
+    
+    // Paused: symmetric window, every frame
+    frameCache->setPlaybackSpeed(0.0);
+    FrameCache::PrefetchStats stats = frameCache->getPrefetchStats();
+    ASSERT_EQ(stats.window.ahead, 30);
+    ASSERT_EQ(stats.window.behind, 30);
+    ASSERT_EQ(stats.window.step, 1);
+    
+    // Shuttling back at 4x: skewed backwards, every fourth frame
+    frameCache->setPlaybackSpeed(-4.0);
+    stats = frameCache->getPrefetchStats();
+    ASSERT_FALSE(stats.speedMeasured);
+    ASSERT_GT(stats.window.behind, stats.window.ahead);
+    ASSERT_EQ(stats.window.ahead + stats.window.behind, 60);
+    ASSERT_EQ(stats.window.step, 4);
+    
+    // Played-through frames are counted as prefetch hits
+    QString inputPath = createTestVideo("input.mp4");
+    frameCache->clearPlaybackSpeed();
+    frameCache->getFrame(inputPath, 0);
+    QTest::qWait(2000);
+    for (int i = 1; i < 10; i++) {
+        frameCache->getFrame(inputPath, i * 40);
+        QTest::qWait(40);
+    }
+    stats = frameCache->getPrefetchStats();
+    ASSERT_TRUE(stats.speedMeasured);
+    ASSERT_GT(stats.speed, 0.0);
+    ASSERT_GT(stats.used, 0);
+    ASSERT_GT(stats.efficiency(), 0.0);
+}
+
+TEST_F(VideoTest, TestInFlightRequestsCoalesce) {
+    QString inputPath = createTestVideo("input.mp4");
+    QSignalSpy availableSpy(frameCache.get(), &FrameCache::frameAvailable);
+    
+    // Repeated requests for the same frame attach to the first load
+    for (int i = 0; i < 10; i++) {
+        frameCache->getFrame(inputPath, 1000);
+    }
+    ASSERT_GT(frameCache->getDuplicatesSuppressed(), 0);
+    
+    QElapsedTimer timer;
+    timer.start();
+    while (frameCache->getInFlightCount() > 0 && timer.elapsed() < 10000) {
+        QTest::qWait(10);
+    }
+    ASSERT_EQ(frameCache->getInFlightCount(), 0);
+    
+    // Each frame is announced exactly once
+    QSet<qint64> announced;
+    for (const QList<QVariant>& arguments : availableSpy) {
+        qint64 timestamp = arguments.at(1).toLongLong();
+        ASSERT_FALSE(announced.contains(timestamp));
+        announced.insert(timestamp);
+    }
+    ASSERT_TRUE(announced.contains(1000));
+}
+
+TEST_F(VideoTest, TestBlockingFrameAccess) {
+    QString inputPath = createTestVideo("input.mp4");
+    
+    // A zero deadline on a cold frame gives up immediately
+    ASSERT_TRUE(frameCache->waitForFrame(inputPath, 2000, 0).isNull());
+    
+    // Waiting works on the cache's own thread, without an event loop
+    VideoFrame frame = frameCache->waitForFrame(inputPath, 1000);
+    ASSERT_FALSE(frame.isNull());
+    ASSERT_EQ(frame.width(), 1280);
+    
+    // ...and from other threads, several requests pipelined at once
+    VideoFrame fromThread;
+    std::unique_ptr<QThread> thread(QThread::create([&] {
+        QList<std::shared_future<VideoFrame>> futures;
+        for (int i = 0; i < 10; i++) {
+            futures << frameCache->requestFrame(inputPath, 3000 + i * 40);
+        }
+        for (const auto& future : futures) {
+            fromThread = future.get();
+        }
+    }));
+    thread->start();
+    ASSERT_TRUE(thread->wait(10000));
+    ASSERT_FALSE(fromThread.isNull());
+    
+    // Hits are ready straight away
+    std::shared_future<VideoFrame> hit = frameCache->requestFrame(inputPath, 1000);
+    ASSERT_EQ(hit.wait_for(std::chrono::seconds(0)), std::future_status::ready);
+}
+
+TEST_F(VideoTest, TestLatencyPercentiles) {
+    LatencyHistogram histogram;
+    for (int i = 1; i <= 100; i++) {
+        histogram.record(i);
+    }
+    
+    // Percentiles are accurate to one bucket (~19%)
+    LatencyHistogram::Summary summary = histogram.summarize();
+    ASSERT_EQ(summary.count, 100);
+    ASSERT_NEAR(summary.mean, 50.5, 0.01);
+    ASSERT_NEAR(summary.p50, 50, 10);
+    ASSERT_NEAR(summary.p95, 95, 5);
+    ASSERT_EQ(summary.max, 100);
+}
+
+TEST_F(VideoTest, TestCacheStatistics) {
+    QString inputPath = createTestVideo("input.mp4");
+    QSignalSpy statsSpy(frameCache.get(), &FrameCache::statisticsUpdated);
+    frameCache->setStatisticsInterval(50);
+    
+    for (int i = 0; i < 5; i++) {
+        ASSERT_FALSE(frameCache->waitForFrame(inputPath, i * 40).isNull());
+    }
+    frameCache->waitForFrame(inputPath, 0);
+    
+    FrameCacheStats stats = frameCache->getStatistics();
+    ASSERT_GE(stats.hits, 1);
+    ASSERT_GE(stats.misses, 5);
+    ASSERT_GE(stats.framesDecoded, 5);
+    ASSERT_GT(stats.bytesDecoded, 0);
+    ASSERT_GT(stats.bytesServed, 0);
+    ASSERT_GE(stats.visibleLatency.count, 5);
+    ASSERT_TRUE(stats.files.contains(inputPath));
+    ASSERT_EQ(stats.files[inputPath].misses, stats.misses);
+    
+    // Clearing evicts but keeps counting
+    frameCache->clearCache();
+    stats = frameCache->getStatistics();
+    ASSERT_GE(stats.evictionCount(EvictionReason::Cleared), 5);
+    ASSERT_GE(stats.hits, 1);
+    ASSERT_EQ(stats.cachedFrames, 0);
+    
+    ASSERT_TRUE(statsSpy.wait(1000));
+}
+
+TEST_F(VideoTest, TestViewerResolutionDecode) {
+    VideoStreamInfo uhd;
+    uhd.width = 3840;
+    uhd.height = 2160;
+    ASSERT_EQ(FrameDecoder::downscaleFor(uhd, QSize(960, 540)), 4);
+    ASSERT_EQ(FrameDecoder::downscaleFor(uhd, QSize(1280, 720)), 2);
+    ASSERT_EQ(FrameDecoder::downscaleFor(uhd, QSize()), 1);
+    
+    QString inputPath = createTestVideo("input.mp4");
+    
+    // Decoding at half size on a codec without lowres support
+    FrameDecoder decoder;
+    ASSERT_TRUE(decoder.open(inputPath));
+    decoder.setDownscale(2);
+    QImage half = decoder.decodeFrame(500);
+    ASSERT_EQ(half.size(), QSize(640, 360));
+    
+    // Full and reduced frames are cached separately
+    VideoFrame full = frameCache->waitForFrame(inputPath, 1000);
+    VideoFrame small = frameCache->waitForFrame(inputPath, 1000, 30000, QSize(640, 360));
+    ASSERT_EQ(full.width(), 1280);
+    ASSERT_EQ(small.width(), 640);
+    ASSERT_EQ(frameCache->getStatistics().framesDecoded, 2);
+    ASSERT_GE(full.sizeInBytes(), 4 * small.sizeInBytes());
+}
+
+TEST_F(VideoTest, TestScrubModeNearestFrame) {
+    QString inputPath = createTestVideo("input.mp4");
+    ASSERT_FALSE(frameCache->waitForFrame(inputPath, 1000).isNull());
+    frameCache->setScrubMode(true);
+    
+    // A miss is answered at once with the closest cached frame
+    bool approximate = false;
+    QElapsedTimer timer;
+    timer.start();
+    QImage standIn = frameCache->getFrame(inputPath, 1200, &approximate);
+    qDebug() << "Scrub stand-in served in" << timer.elapsed() << "ms";
+    ASSERT_FALSE(standIn.isNull());
+    ASSERT_TRUE(approximate);
+    ASSERT_EQ(frameCache->getStatistics().approximateHits, 1);
+    
+    // ...while the exact frame keeps loading
+    ASSERT_FALSE(frameCache->waitForFrame(inputPath, 1200).isNull());
+    ASSERT_FALSE(frameCache->getFrame(inputPath, 1200, &approximate).isNull());
+    ASSERT_FALSE(approximate);
+}
+
 TEST_F(VideoTest, TestCacheSize) {
     frameCache->setMaxCacheSize(100); // 100MB
     ASSERT_EQ(frameCache->getMaxCacheSize(), 100);
@@ -149,6 +530,959 @@ TEST_F(VideoTest, TestProxyPerformance) {
     ASSERT_LT(elapsed, 30000); // Should take less than 30 seconds
 }
 
+TEST_F(VideoTest, TestFrameDecodePerformance) {
+    QString inputPath = createTestVideo("input.mp4");
+    const int frameCount = 10;
+    
+    FrameLoader loader;
+    QElapsedTimer timer;
+    
+    // In-process libavcodec decode
+    loader.setBackend(FrameLoader::Backend::InProcess);
+    timer.start();
+    for (int i = 0; i < frameCount; i++) {
+        ASSERT_FALSE(loader.loadFrame(inputPath, i * 500).isNull());
+    }
+    qint64 inProcessTime = timer.elapsed();
+    
+    // Legacy ffmpeg process with PNG round trip
+    loader.setBackend(FrameLoader::Backend::ExternalProcess);
+    timer.restart();
+    for (int i = 0; i < frameCount; i++) {
+        ASSERT_FALSE(loader.loadFrame(inputPath, i * 500).isNull());
+    }
+    qint64 externalTime = timer.elapsed();
+    
+    // Timings are reported, not asserted; a loaded machine would make
+    // any limit flaky. Spawning a process per frame is expected to lose.
+    qDebug() << "Frame decode time for" << frameCount << "frames:"
+             << "in-process" << inProcessTime << "ms,"
+             << "external" << externalTime << "ms,"
+             << "speedup" << double(externalTime) / qMax<qint64>(1, inProcessTime);
+}
+
+TEST_F(VideoTest, TestEvictionPolicyReplay) {
+    // Replay a recorded access trace (FrameCache::startAccessTrace) when
+    // one is given, otherwise a synthetic session: play a few seconds,
+    // scrub back, play on, then move to another part of the timeline
+    QList<CacheKey> trace;
+    QFile traceFile(qEnvironmentVariable("FRAMECACHE_TRACE"));
+    if (traceFile.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        while (!traceFile.atEnd()) {
+            QList<QByteArray> fields = traceFile.readLine().trimmed().split('\t');
+            if (fields.size() == 4) {
+                trace << CacheKey{QString::fromUtf8(fields[1]), fields[2].toLongLong(),
+                                  fields[3].toInt()};
+            }
+        }
+    } else {
+        const qint64 regions[] = {200, 1200, 2400, 600};
+        for (int round = 0; round < 24; round++) {
+            qint64 start = regions[round % 4];
+            for (int i = 0; i < 75; i++) trace << CacheKey{"clip.mp4", start + i};
+            for (int i = 0; i < 30; i++) trace << CacheKey{"clip.mp4", start + 75 - i};
+            for (int i = 0; i < 50; i++) trace << CacheKey{"clip.mp4", start + 45 + i};
+        }
+    }
+    ASSERT_FALSE(trace.isEmpty());
+    
+    // Re-decode cost grows with the distance from a keyframe (12-frame GOP)
+    struct Result { int hits; qint64 rebuildTime; };
+    auto replay = [&](FrameStore::Policy policy) {
+        FrameStore store(200);
+        store.setPolicy(policy);
+        Result result{0, 0};
+        for (const CacheKey& key : trace) {
+            store.setPlayhead(key.filePath, key.frameIndex);
+            if (store.object(key)) {
+                result.hits++;
+                continue;
+            }
+            VideoFrame frame;
+            frame.setDecodeCost((key.frameIndex % 12 + 1) * 1000);
+            result.rebuildTime += frame.getDecodeCost();
+            store.insert(key, frame, 1);
+        }
+        return result;
+    };
+    
+    Result lru = replay(FrameStore::Policy::LRU);
+    Result costAware = replay(FrameStore::Policy::DecodeCost);
+    qDebug() << "Eviction replay over" << trace.size() << "accesses:"
+             << "LRU hit rate" << double(lru.hits) / trace.size()
+             << "decode" << lru.rebuildTime / 1000 << "ms,"
+             << "decode-cost hit rate" << double(costAware.hits) / trace.size()
+             << "decode" << costAware.rebuildTime / 1000 << "ms";
+    
+    ASSERT_GE(costAware.hits, lru.hits);
+    ASSERT_LE(costAware.rebuildTime, lru.rebuildTime);
+}
+
+TEST_F(VideoTest, TestPipelineStageOccupancy) {
+    const int frameCount = 40;
+    int produced = 0;
+    int consumed = 0;
+    
+    // Decode 2ms, process 6ms, encode 2ms per frame: 400ms if run in turn
+    ProcessingPipeline pipeline(4);
+    pipeline.setSource("decode", [&]() -> AVFrame* {
+        if (produced == frameCount) {
+            return nullptr;
+        }
+        QThread::msleep(2);
+        produced++;
+        return av_frame_alloc();
+    });
+    pipeline.addStage("process", [](AVFrame*) {
+        QThread::msleep(6);
+        return true;
+    });
+    pipeline.setSink("encode", [&](AVFrame*) {
+        QThread::msleep(2);
+        consumed++;
+        return true;
+    });
+    
+    ASSERT_TRUE(pipeline.run());
+    ASSERT_EQ(consumed, frameCount);
+    
+    // Stages overlap, so the slowest one sets the pace
+    ProcessingPipeline::Stats stats = pipeline.getStats();
+    qDebug() << stats.toString();
+    ASSERT_LT(stats.elapsed, frameCount * (2 + 6 + 2));  // Faster than in turn
+    ASSERT_EQ(stats.bottleneck(), QString("process"));
+    ASSERT_GT(stats.stages[1].busy, 0.8);
+    
+    // Backpressure: decode waits on a full queue, encode waits for input
+    ASSERT_GT(stats.queueFill[0], 0.5);
+    ASSERT_GT(stats.stages[0].blocked, 0.4);
+    ASSERT_GT(stats.stages[2].starved, 0.4);
+}
+
+TEST_F(VideoTest, TestFramePoolSteadyState) {
+    FramePool pool;
+    ASSERT_TRUE(pool.setGeometry(3840, 2160, AV_PIX_FMT_YUV420P));
+    
+    // 4K frames through a three-stage pipeline, recycled through the pool
+    const int frameCount = 200;
+    int produced = 0;
+    qint64 afterWarmup = -1;
+    ProcessingPipeline pipeline(4);
+    pipeline.setSource("decode", [&]() -> AVFrame* {
+        if (produced == frameCount) {
+            return nullptr;
+        }
+        if (++produced == 50) {
+            afterWarmup = pool.getAllocationCount();
+        }
+        AVFrame* frame = pool.acquireBuffer();
+        AVPacket* packet = pool.acquirePacket();
+        pool.release(packet);
+        return frame;
+    });
+    pipeline.addStage("process", [](AVFrame* frame) {
+        return frame->data[0] != nullptr && frame->width == 3840;
+    });
+    pipeline.setSink("encode", [](AVFrame*) {
+        // A slow sink keeps every queue full from the start
+        QThread::usleep(500);
+        return true;
+    });
+    pipeline.setRelease([&](AVFrame* frame) { pool.release(frame); });
+    
+    ASSERT_TRUE(pipeline.run());
+    ASSERT_GT(afterWarmup, 0);
+    ASSERT_EQ(pool.getAllocationCount(), afterWarmup);
+}
+
+TEST_F(VideoTest, TestThreadingThroughput) {
+    HighResProcessor processor;
+    ASSERT_TRUE(processor.initialize());
+    
+    struct Sample { const char* name; int width; int height; int frames; };
+    const Sample samples[] = {{"4K", 3840, 2160, 24}, {"8K", 7680, 4320, 8}};
+    int cores = QThread::idealThreadCount();
+    
+    for (const Sample& sample : samples) {
+        QString inputPath = tempDir->filePath(QString("%1.mp4").arg(sample.name));
+        QString command = QString("ffmpeg -f lavfi -i testsrc=s=%1x%2:r=24 -frames:v %3 "
+                                  "-c:v libx264 -preset ultrafast %4")
+                         .arg(sample.width).arg(sample.height).arg(sample.frames).arg(inputPath);
+        system(qPrintable(command));
+        
+        // Frames per second, decode to encode, against threads per codec
+        QList<int> threadCounts = {1};
+        for (int threads = 2; threads < cores; threads *= 2) {
+            threadCounts << threads;
+        }
+        if (cores > 1) {
+            threadCounts << cores;
+        }
+        
+        QList<double> fps;
+        for (int threads : threadCounts) {
+            HighResProcessor::ProcessingOptions options{};
+            options.outputCodec = "libx264";
+            options.threading = HighResProcessor::ThreadingPolicy::Auto;
+            options.threadCount = threads;
+            processor.setProcessingOptions(options);
+            
+            QString outputPath = tempDir->filePath(QString("%1_%2.mp4").arg(sample.name).arg(threads));
+            QElapsedTimer timer;
+            timer.start();
+            ASSERT_TRUE(processor.processVideo(inputPath, outputPath));
+            fps << sample.frames * 1000.0 / qMax<qint64>(1, timer.elapsed());
+            qDebug() << sample.name << threads << "threads:" << fps.last() << "fps";
+        }
+        
+        // Reported, not asserted: shared hosts and codecs that cap their
+        // own threads make any comparison flaky
+        qDebug() << sample.name << "scaling" << fps.first() << "->" << fps.last() << "fps over"
+                 << threadCounts.last() << "threads";
+    }
+}
+
+TEST_F(VideoTest, TestUnsharpMaskBenchmark) {
+    // Milliseconds per 4K frame, by kernel and thread count
+    FramePool pool;
+    AVFrame* frame = pool.acquireBuffer(3840, 2160, AV_PIX_FMT_YUV420P);
+    ASSERT_TRUE(frame);
+    std::mt19937 random(3);
+    for (int y = 0; y < 2160; y++) {
+        uint8_t* row = frame->data[0] + y * frame->linesize[0];
+        for (int x = 0; x < 3840; x++) {
+            row[x] = uint8_t(random());
+        }
+    }
+    
+    const int iterations = 20;
+    int cores = QThread::idealThreadCount();
+    QList<SimdKernel> kernels = {SimdKernel::Scalar};
+    if (CpuFeatures::resolve(SimdKernel::Auto) != SimdKernel::Scalar) {
+        kernels << SimdKernel::Auto;
+    }
+    
+    UnsharpMask sharpener;
+    QMap<QString, double> timings;
+    for (SimdKernel kernel : kernels) {
+        sharpener.setKernel(kernel);
+        for (int threads : {1, cores}) {
+            ParallelRows::setThreadCount(threads);
+            sharpener.process(frame, frame);  // Warm up
+            
+            QElapsedTimer timer;
+            timer.start();
+            for (int i = 0; i < iterations; i++) {
+                ASSERT_TRUE(sharpener.process(frame, frame));
+            }
+            double ms = timer.nsecsElapsed() / 1e6 / iterations;
+            QString name = QString("%1 x%2").arg(CpuFeatures::kernelName(sharpener.getKernel())).arg(threads);
+            timings[name] = ms;
+            qDebug() << "Unsharp mask" << name << ":" << ms << "ms per 4K frame";
+        }
+    }
+    ParallelRows::setThreadCount(0);
+    pool.release(frame);
+    
+    if (kernels.size() > 1) {
+        QString simd = CpuFeatures::kernelName(sharpener.getKernel());
+        ASSERT_LT(timings[simd + " x1"], timings["Scalar x1"]);
+    }
+}
+
+TEST_F(VideoTest, TestDenoiserSimdMatchesScalar) {
+    // An odd width makes the last vector block overlap the one before
+    FramePool pool;
+    const int width = 1283;
+    const int height = 723;
+    AVFrame* source = pool.acquireBuffer(width, height, AV_PIX_FMT_YUV420P);
+    AVFrame* scalar = pool.acquireBuffer(width, height, AV_PIX_FMT_YUV420P);
+    AVFrame* simd = pool.acquireBuffer(width, height, AV_PIX_FMT_YUV420P);
+    ASSERT_TRUE(source && scalar && simd);
+    
+    // A gradient with noise, and hard edges every 64 columns
+    std::mt19937 random(42);
+    std::normal_distribution<double> noise(0.0, 4.0);
+    for (int plane = 0; plane < 3; plane++) {
+        int planeWidth = plane ? (width + 1) / 2 : width;
+        int planeHeight = plane ? (height + 1) / 2 : height;
+        for (int y = 0; y < planeHeight; y++) {
+            uint8_t* row = source->data[plane] + y * source->linesize[plane];
+            for (int x = 0; x < planeWidth; x++) {
+                double value = (x / 64) % 2 ? 200.0 : 40.0 + y % 32;
+                row[x] = uint8_t(qBound(0.0, value + noise(random), 255.0));
+            }
+        }
+    }
+    
+    SpatialDenoiser denoiser;
+    denoiser.setKernel(SimdKernel::Scalar);
+    ASSERT_TRUE(denoiser.process(source, scalar));
+    
+    if (SpatialDenoiser::bestKernel() == SimdKernel::Scalar) {
+        pool.release(source);
+        pool.release(scalar);
+        pool.release(simd);
+        GTEST_SKIP() << "No SIMD kernels on this CPU";
+    }
+    denoiser.setKernel(SimdKernel::Auto);
+    ASSERT_TRUE(denoiser.process(source, simd));
+    
+    for (int plane = 0; plane < 3; plane++) {
+        int planeWidth = plane ? (width + 1) / 2 : width;
+        int planeHeight = plane ? (height + 1) / 2 : height;
+        for (int y = 0; y < planeHeight; y++) {
+            ASSERT_EQ(memcmp(scalar->data[plane] + y * scalar->linesize[plane],
+                             simd->data[plane] + y * simd->linesize[plane], planeWidth), 0)
+                << "plane " << plane << " row " << y;
+        }
+    }
+    
+    // Noise goes down; the edges stay
+    auto roughness = [&](AVFrame* frame) {
+        double sum = 0.0;
+        for (int y = 0; y < height; y++) {
+            const uint8_t* row = frame->data[0] + y * frame->linesize[0];
+            for (int x = 1; x < 63; x++) {
+                sum += std::abs(row[x] - row[x - 1]);
+            }
+        }
+        return sum;
+    };
+    ASSERT_LT(roughness(simd), roughness(source) * 0.7);
+    ASSERT_LT(simd->data[0][10 * simd->linesize[0] + 63], 100);
+    ASSERT_GT(simd->data[0][10 * simd->linesize[0] + 64], 150);
+    
+    pool.release(source);
+    pool.release(scalar);
+    pool.release(simd);
+    
+    // Throughput on 4K frames, for batch planning
+    AVFrame* input = pool.acquireBuffer(3840, 2160, AV_PIX_FMT_YUV420P);
+    AVFrame* output = pool.acquireBuffer(3840, 2160, AV_PIX_FMT_YUV420P);
+    ASSERT_TRUE(input && output);
+    for (int plane = 0; plane < 3; plane++) {
+        int planeHeight = plane ? 1080 : 2160;
+        for (int y = 0; y < planeHeight; y++) {
+            uint8_t* row = input->data[plane] + y * input->linesize[plane];
+            for (int x = 0; x < input->linesize[plane]; x++) {
+                row[x] = uint8_t(128 + random() % 16);
+            }
+        }
+    }
+    const int frames = 20;
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < frames; i++) {
+        ASSERT_TRUE(denoiser.process(input, output));
+    }
+    qDebug() << "Denoiser" << CpuFeatures::kernelName(denoiser.getKernel()) << "4K:"
+             << frames * 1000.0 / qMax<qint64>(1, timer.elapsed()) << "fps";
+    pool.release(input);
+    pool.release(output);
+}
+
+TEST_F(VideoTest, TestUnsharpMaskMatchesSharpenEffect) {
+    // Native sharpening must look exactly like the FFmpeg filter the
+    // preview and export use
+    const int width = 643;
+    const int height = 361;
+    std::mt19937 random(7);
+    QByteArray plane(width * height, Qt::Uninitialized);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            int value = ((x / 16 + y / 16) % 2 ? 180 : 60) + int(random() % 24);
+            plane[y * width + x] = char(value);
+        }
+    }
+    QString inputPath = tempDir->filePath("sharpen_in.raw");
+    QString outputPath = tempDir->filePath("sharpen_out.raw");
+    QFile input(inputPath);
+    ASSERT_TRUE(input.open(QIODevice::WriteOnly));
+    input.write(plane);
+    input.close();
+    
+    SharpenEffect effect;
+    effect.setParameter("amount", 1.5);
+    QString command = QString("ffmpeg -y -f rawvideo -pix_fmt gray -s %1x%2 -i %3 -vf %4 "
+                              "-f rawvideo -pix_fmt gray %5")
+                     .arg(width).arg(height).arg(inputPath)
+                     .arg(effect.getFFmpegFilter()).arg(outputPath);
+    system(qPrintable(command));
+    QFile output(outputPath);
+    ASSERT_TRUE(output.open(QIODevice::ReadOnly));
+    QByteArray expected = output.readAll();
+    ASSERT_EQ(expected.size(), plane.size());
+    
+    UnsharpMask sharpener;
+    sharpener.setAmount(effect.getParameter("amount"));
+    const uint8_t* source = reinterpret_cast<const uint8_t*>(plane.constData());
+    for (SimdKernel kernel : {SimdKernel::Scalar, SimdKernel::Auto}) {
+        sharpener.setKernel(kernel);
+        QByteArray separate(plane.size(), Qt::Uninitialized);
+        sharpener.processPlane(source, width, reinterpret_cast<uint8_t*>(separate.data()), width,
+                               width, height);
+        ASSERT_EQ(separate, expected) << qPrintable(CpuFeatures::kernelName(sharpener.getKernel()));
+        
+        QByteArray inPlace = plane;
+        uint8_t* data = reinterpret_cast<uint8_t*>(inPlace.data());
+        sharpener.processPlane(data, width, data, width, width, height);
+        ASSERT_EQ(inPlace, expected) << "in place";
+    }
+}
+
+TEST_F(VideoTest, TestToneMapperSimdMatchesScalar) {
+    FramePool pool;
+    const int width = 1283;
+    const int height = 723;
+    AVFrame* source = pool.acquireBuffer(width, height, AV_PIX_FMT_YUV420P10LE);
+    ASSERT_TRUE(source);
+    source->color_range = AVCOL_RANGE_MPEG;
+    source->colorspace = AVCOL_SPC_BT2020_NCL;
+    
+    // Limited-range 10-bit codes, with saturated chroma to exercise the gamut clip
+    std::mt19937 random(11);
+    for (int plane = 0; plane < 3; plane++) {
+        int planeWidth = plane ? (width + 1) / 2 : width;
+        int planeHeight = plane ? (height + 1) / 2 : height;
+        for (int y = 0; y < planeHeight; y++) {
+            uint16_t* row = reinterpret_cast<uint16_t*>(source->data[plane] + y * source->linesize[plane]);
+            for (int x = 0; x < planeWidth; x++) {
+                row[x] = uint16_t(plane ? 64 + random() % 897 : 64 + random() % 877);
+            }
+        }
+    }
+    
+    ToneMapper mapper;
+    bool simd = CpuFeatures::resolve(SimdKernel::Auto) != SimdKernel::Scalar;
+    for (AVColorTransferCharacteristic transfer : {AVCOL_TRC_SMPTE2084, AVCOL_TRC_ARIB_STD_B67}) {
+        for (ToneMapper::Curve curve : {ToneMapper::Curve::Hable, ToneMapper::Curve::Reinhard,
+                                        ToneMapper::Curve::BT2390}) {
+            source->color_trc = transfer;
+            mapper.setCurve(curve);
+            mapper.setOutput(ToneMapper::Output::SDR);
+            AVPixelFormat format = mapper.outputFormat(AV_PIX_FMT_YUV420P10LE);
+            ASSERT_EQ(format, AV_PIX_FMT_YUV420P);
+            AVFrame* scalar = pool.acquireBuffer(width, height, format);
+            AVFrame* vector = pool.acquireBuffer(width, height, format);
+            
+            mapper.setKernel(SimdKernel::Scalar);
+            ASSERT_TRUE(mapper.process(source, scalar));
+            ASSERT_EQ(scalar->color_trc, AVCOL_TRC_BT709);
+            mapper.setKernel(SimdKernel::Auto);
+            ASSERT_TRUE(mapper.process(source, vector));
+            
+            // Identical but for FMA contraction, which may move a code by one
+            int worst = 0;
+            for (int plane = 0; plane < 3 && simd; plane++) {
+                int planeWidth = plane ? (width + 1) / 2 : width;
+                int planeHeight = plane ? (height + 1) / 2 : height;
+                for (int y = 0; y < planeHeight; y++) {
+                    const uint8_t* a = scalar->data[plane] + y * scalar->linesize[plane];
+                    const uint8_t* b = vector->data[plane] + y * vector->linesize[plane];
+                    for (int x = 0; x < planeWidth; x++) {
+                        worst = qMax(worst, std::abs(a[x] - b[x]));
+                    }
+                }
+            }
+            ASSERT_LE(worst, 1);
+            pool.release(scalar);
+            pool.release(vector);
+        }
+    }
+    
+    // Brighter in, brighter out, and PQ peaks land on SDR white
+    source->color_trc = AVCOL_TRC_SMPTE2084;
+    mapper.setCurve(ToneMapper::Curve::BT2390);
+    const int greys[] = {64, 300, 500, 600, 650, 940};  // 0 to 10000 nits
+    int previous = -1;
+    for (int code : greys) {
+        AVFrame* grey = pool.acquireBuffer(16, 16, AV_PIX_FMT_YUV420P10LE);
+        AVFrame* mapped = pool.acquireBuffer(16, 16, AV_PIX_FMT_YUV420P);
+        grey->color_trc = AVCOL_TRC_SMPTE2084;
+        grey->color_range = AVCOL_RANGE_MPEG;
+        for (int plane = 0; plane < 3; plane++) {
+            for (int y = 0; y < (plane ? 8 : 16); y++) {
+                uint16_t* row = reinterpret_cast<uint16_t*>(grey->data[plane] + y * grey->linesize[plane]);
+                std::fill(row, row + (plane ? 8 : 16), uint16_t(plane ? 512 : code));
+            }
+        }
+        ASSERT_TRUE(mapper.process(grey, mapped));
+        int luma = mapped->data[0][0];
+        ASSERT_GT(luma, previous);
+        ASSERT_NEAR(mapped->data[1][0], 128, 1);
+        previous = luma;
+        pool.release(grey);
+        pool.release(mapped);
+    }
+    ASSERT_GE(previous, 234);
+    pool.release(source);
+    
+    // Throughput on 4K HDR10, against real time
+    AVFrame* input = pool.acquireBuffer(3840, 2160, AV_PIX_FMT_YUV420P10LE);
+    AVFrame* output = pool.acquireBuffer(3840, 2160, AV_PIX_FMT_YUV420P);
+    ASSERT_TRUE(input && output);
+    input->color_trc = AVCOL_TRC_SMPTE2084;
+    input->color_range = AVCOL_RANGE_MPEG;
+    for (int plane = 0; plane < 3; plane++) {
+        for (int y = 0; y < (plane ? 1080 : 2160); y++) {
+            uint16_t* row = reinterpret_cast<uint16_t*>(input->data[plane] + y * input->linesize[plane]);
+            for (int x = 0; x < (plane ? 1920 : 3840); x++) {
+                row[x] = uint16_t(plane ? 448 + random() % 128 : 64 + random() % 877);
+            }
+        }
+    }
+    const int frames = 20;
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < frames; i++) {
+        ASSERT_TRUE(mapper.process(input, output));
+    }
+    qDebug() << "Tone mapping" << CpuFeatures::kernelName(mapper.getKernel()) << "4K:"
+             << frames * 1000.0 / qMax<qint64>(1, timer.elapsed()) << "fps on"
+             << ParallelRows::getThreadCount() << "threads";
+    pool.release(input);
+    pool.release(output);
+}
+
+TEST_F(VideoTest, TestHLGConvertsToSDR) {
+    // HLG was not recognised as HDR, and went out tagged as HLG
+    QString inputPath = tempDir->filePath("hlg.mkv");
+    QString command = QString("ffmpeg -f lavfi -i testsrc=s=640x360:r=25 -frames:v 10 "
+                              "-pix_fmt yuv420p10le -color_primaries bt2020 -color_trc arib-std-b67 "
+                              "-colorspace bt2020nc -c:v ffv1 %1").arg(inputPath);
+    system(qPrintable(command));
+    
+    HighResProcessor processor;
+    ASSERT_TRUE(processor.initialize());
+    HighResProcessor::ProcessingOptions options{};
+    options.outputCodec = "libx264";
+    processor.setProcessingOptions(options);
+    QString outputPath = tempDir->filePath("hlg_sdr.mp4");
+    ASSERT_TRUE(processor.processVideo(inputPath, outputPath));
+    
+    AVFormatContext* context = nullptr;
+    ASSERT_EQ(avformat_open_input(&context, outputPath.toUtf8().constData(), nullptr, nullptr), 0);
+    ASSERT_GE(avformat_find_stream_info(context, nullptr), 0);
+    int stream = av_find_best_stream(context, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    ASSERT_GE(stream, 0);
+    AVCodecParameters* params = context->streams[stream]->codecpar;
+    EXPECT_EQ(params->color_trc, AVCOL_TRC_BT709);
+    EXPECT_EQ(params->color_primaries, AVCOL_PRI_BT709);
+    EXPECT_EQ(params->format, AV_PIX_FMT_YUV420P);
+    avformat_close_input(&context);
+}
+
+TEST_F(VideoTest, TestTemporalDenoiserTracksMotion) {
+    // Texture panning 3 pixels right and 2 down per frame, with noise
+    FramePool pool;
+    const int width = 643;
+    const int height = 361;
+    const int frames = 6;
+    auto clean = [](int x, int y, int t) {
+        double u = x - 3.0 * t;
+        double v = y - 2.0 * t;
+        int checker = (int(std::floor(u / 40)) + int(std::floor(v / 40))) % 2;
+        return 128.0 + 60.0 * std::sin(u * 0.21) * std::cos(v * 0.17) + (checker ? 30.0 : -30.0);
+    };
+    std::mt19937 random(1);
+    std::normal_distribution<double> noise(0.0, 4.0);
+    std::vector<AVFrame*> inputs;
+    for (int t = 0; t < frames; t++) {
+        AVFrame* frame = pool.acquireBuffer(width, height, AV_PIX_FMT_YUV420P);
+        ASSERT_TRUE(frame);
+        for (int plane = 0; plane < 3; plane++) {
+            int planeWidth = plane ? (width + 1) / 2 : width;
+            int planeHeight = plane ? (height + 1) / 2 : height;
+            for (int y = 0; y < planeHeight; y++) {
+                uint8_t* row = frame->data[plane] + y * frame->linesize[plane];
+                for (int x = 0; x < planeWidth; x++) {
+                    double value = plane ? 128.0 : clean(x, y, t);
+                    row[x] = uint8_t(qBound(0.0, value + noise(random), 255.0));
+                }
+            }
+        }
+        inputs.push_back(frame);
+    }
+    auto error = [&](const AVFrame* frame, int t) {
+        double sum = 0.0;
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                double diff = frame->data[0][y * frame->linesize[0] + x] - qBound(0.0, clean(x, y, t), 255.0);
+                sum += diff * diff;
+            }
+        }
+        return sum / (width * height);
+    };
+    
+    QList<SimdKernel> kernels{SimdKernel::Scalar};
+    if (CpuFeatures::resolve(SimdKernel::Auto) != SimdKernel::Scalar) {
+        kernels << SimdKernel::Auto;
+    }
+    std::vector<std::vector<uint8_t>> results(kernels.size());
+    for (int k = 0; k < kernels.size(); k++) {
+        TemporalDenoiser denoiser;
+        denoiser.setKernel(kernels[k]);
+        denoiser.setHistory(2);
+        for (int t = 0; t < frames; t++) {
+            AVFrame* output = pool.acquireBuffer(width, height, AV_PIX_FMT_YUV420P);
+            ASSERT_TRUE(output);
+            ASSERT_TRUE(denoiser.process(inputs[t], output));
+            ASSERT_LE(denoiser.getHistorySize(), 2);
+            if (t >= 2) {
+                // Only aligned blocks blend; a static blend would smear the texture
+                ASSERT_LT(error(output, t), error(inputs[t], t) * 0.8) << "frame " << t;
+            }
+            for (int y = 0; y < height; y++) {
+                const uint8_t* row = output->data[0] + y * output->linesize[0];
+                results[k].insert(results[k].end(), row, row + width);
+            }
+            pool.release(output);
+        }
+        
+        // History is held by reference, not copied
+        ASSERT_EQ(av_buffer_get_ref_count(inputs[frames - 1]->buf[0]), 2);
+        ASSERT_EQ(av_buffer_get_ref_count(inputs[0]->buf[0]), 1);
+        denoiser.reset();
+        ASSERT_EQ(denoiser.getHistorySize(), 0);
+        ASSERT_EQ(av_buffer_get_ref_count(inputs[frames - 1]->buf[0]), 1);
+    }
+    if (kernels.size() > 1) {
+        ASSERT_TRUE(results[0] == results[1]);
+    }
+    for (AVFrame* frame : inputs) {
+        pool.release(frame);
+    }
+}
+
+TEST_F(VideoTest, TestStabilizationReusesAnalysis) {
+    // A window shaking over a larger picture; crop offsets are exact
+    auto shakeX = [](int n) { return 160 + int(std::lround(24 * std::sin(n * 1.3))); };
+    auto shakeY = [](int n) { return 90 + int(std::lround(16 * std::cos(n * 1.7))); };
+    QString inputPath = tempDir->filePath("shaky.mkv");
+    QString command = QString("ffmpeg -f lavfi -i testsrc2=s=960x540:r=25 -frames:v 50 "
+                              "-vf \"crop=w=640:h=360:x='160+round(24*sin(n*1.3))':"
+                              "y='90+round(16*cos(n*1.7))':exact=1\" "
+                              "-pix_fmt yuv420p -c:v ffv1 %1").arg(inputPath);
+    system(qPrintable(command));
+    
+    CameraPath path = CameraPath::analyze(inputPath);
+    ASSERT_TRUE(path.isValid());
+    ASSERT_EQ(path.getFrames().size(), 50);
+    double inputShake = 0.0;
+    for (int n = 1; n < path.getFrames().size(); n++) {
+        // The picture moves against the window
+        const CameraPath::Transform& motion = path.getFrames()[n].motion;
+        EXPECT_NEAR(motion.dx, -(shakeX(n) - shakeX(n - 1)), 1.0) << "frame " << n;
+        EXPECT_NEAR(motion.dy, -(shakeY(n) - shakeY(n - 1)), 1.0) << "frame " << n;
+        EXPECT_NEAR(motion.angle, 0.0, 0.005);
+        EXPECT_NEAR(motion.scale, 1.0, 0.005);
+        inputShake += std::abs(motion.dx) + std::abs(motion.dy);
+    }
+    
+    HighResProcessor processor;
+    ASSERT_TRUE(processor.initialize());
+    QString analysisDir = tempDir->filePath("stabilization");
+    processor.setAnalysisDirectory(analysisDir);
+    HighResProcessor::ProcessingOptions options{};
+    options.outputCodec = "libx264";
+    options.enableStabilization = true;
+    options.stabilizationZoom = 1.1;
+    processor.setProcessingOptions(options);
+    
+    QString outputPath = tempDir->filePath("stable.mp4");
+    ASSERT_TRUE(processor.processVideo(inputPath, outputPath));
+    QStringList sidecars = QDir(analysisDir).entryList({"*.campath"}, QDir::Files);
+    ASSERT_EQ(sidecars.size(), 1);
+    QString sidecar = QDir(analysisDir).filePath(sidecars.first());
+    ASSERT_TRUE(CameraPath().load(sidecar, inputPath));
+    QDateTime analyzed = QFileInfo(sidecar).lastModified();
+    
+    // The output barely moves
+    CameraPath stable = CameraPath::analyze(outputPath);
+    ASSERT_TRUE(stable.isValid());
+    double outputShake = 0.0;
+    for (int n = 1; n < stable.getFrames().size(); n++) {
+        outputShake += std::abs(stable.getFrames()[n].motion.dx) + std::abs(stable.getFrames()[n].motion.dy);
+    }
+    ASSERT_LT(outputShake, inputShake * 0.3);
+    
+    // Exporting again, with other smoothing, reads the sidecar
+    QTest::qWait(20);
+    options.stabilizationSmoothing = 5;
+    processor.setProcessingOptions(options);
+    ASSERT_TRUE(processor.processVideo(inputPath, tempDir->filePath("stable2.mp4")));
+    ASSERT_EQ(QFileInfo(sidecar).lastModified(), analyzed);
+    ASSERT_EQ(QDir(analysisDir).entryList({"*.campath"}, QDir::Files).size(), 1);
+    
+    // An edited source is analysed afresh
+    QFile source(inputPath);
+    ASSERT_TRUE(source.open(QIODevice::Append));
+    source.write("edit");
+    source.close();
+    ASSERT_FALSE(CameraPath().load(sidecar, inputPath));
+}
+
+TEST_F(VideoTest, TestTiledProcessingMatchesWholeFrame) {
+    // 8K HDR10 through tone mapping, denoising and sharpening
+    const int width = 7680;
+    const int height = 4320;
+    FramePool pool;
+    AVFrame* source = pool.acquireBuffer(width, height, AV_PIX_FMT_YUV420P10LE);
+    ASSERT_TRUE(source);
+    source->color_trc = AVCOL_TRC_SMPTE2084;
+    source->color_range = AVCOL_RANGE_MPEG;
+    std::mt19937 random(23);
+    for (int plane = 0; plane < 3; plane++) {
+        for (int y = 0; y < (plane ? height / 2 : height); y++) {
+            uint16_t* row = reinterpret_cast<uint16_t*>(source->data[plane] + y * source->linesize[plane]);
+            for (int x = 0; x < (plane ? width / 2 : width); x++) {
+                int ramp = (x / 8 + y / 8) % 700;
+                row[x] = uint16_t(plane ? 448 + random() % 128 : 64 + ramp + random() % 64);
+            }
+        }
+    }
+
+    ToneMapper mapper;
+    SpatialDenoiser denoiser;
+    UnsharpMask sharpener;
+    mapper.setOutput(ToneMapper::Output::SDR);
+    AVPixelFormat format = mapper.outputFormat(AV_PIX_FMT_YUV420P10LE);
+    std::vector<TileScheduler::Stage> stages(3);
+    stages[0].filter = [&](const AVFrame* in, AVFrame* out) { return mapper.process(in, out); };
+    stages[0].format = format;
+    stages[1].filter = [&](const AVFrame* in, AVFrame* out) { return denoiser.process(in, out); };
+    stages[1].halo = 1;
+    stages[2].filter = [&](const AVFrame* in, AVFrame* out) { return sharpener.process(in, out); };
+    stages[2].halo = 2;
+
+    AVFrame* mapped = pool.acquireBuffer(width, height, format);
+    AVFrame* denoised = pool.acquireBuffer(width, height, format);
+    AVFrame* whole = pool.acquireBuffer(width, height, format);
+    AVFrame* tiled = pool.acquireBuffer(width, height, format);
+    ASSERT_TRUE(mapped && denoised && whole && tiled);
+    auto wholeFrame = [&] {
+        return mapper.process(source, mapped) && denoiser.process(mapped, denoised) &&
+               sharpener.process(denoised, whole);
+    };
+    auto samePixels = [&](const AVFrame* a, const AVFrame* b) {
+        for (int plane = 0; plane < 3; plane++) {
+            int planeWidth = plane ? width / 2 : width;
+            for (int y = 0; y < (plane ? height / 2 : height); y++) {
+                if (memcmp(a->data[plane] + y * a->linesize[plane],
+                           b->data[plane] + y * b->linesize[plane], planeWidth) != 0) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    };
+
+    // Identical for any tiling, ragged edges included
+    ASSERT_TRUE(wholeFrame());
+    TileScheduler scheduler;
+    for (QSize tile : {QSize(0, 0), QSize(100, 50), QSize(1000, 300)}) {
+        scheduler.setTileSize(tile.width(), tile.height());
+        ASSERT_TRUE(scheduler.process(source, tiled, stages));
+        ASSERT_TRUE(samePixels(whole, tiled)) << tile.width() << "x" << tile.height();
+        ASSERT_EQ(tiled->color_trc, AVCOL_TRC_BT709);
+    }
+
+    // Speedup over whole-frame passes, both on every core
+    scheduler.setTileSize(0, 128);
+    const int frames = 5;
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < frames; i++) {
+        ASSERT_TRUE(wholeFrame());
+    }
+    double wholeMs = timer.nsecsElapsed() / 1e6 / frames;
+    timer.restart();
+    for (int i = 0; i < frames; i++) {
+        ASSERT_TRUE(scheduler.process(source, tiled, stages));
+    }
+    double tiledMs = timer.nsecsElapsed() / 1e6 / frames;
+    qDebug() << "8K tone map, denoise and sharpen: whole frame" << wholeMs << "ms, tiled" << tiledMs
+             << "ms (" << scheduler.getTileCount() << "tiles), speedup" << wholeMs / tiledMs << "x on"
+             << ParallelRows::getThreadCount() << "threads";
+
+    pool.release(source);
+    pool.release(mapped);
+    pool.release(denoised);
+    pool.release(whole);
+    pool.release(tiled);
+}
+
+TEST_F(VideoTest, TestHighBitDepthFilters) {
+    // Denoising and sharpening on native 10- and 16-bit samples, the SIMD
+    // kernels matching the scalar ones, and agreeing with 8-bit processing
+    // of the same picture
+    const int width = 1283;
+    const int height = 363;
+    FramePool pool;
+    std::mt19937 random(24);
+    for (AVPixelFormat format : {AV_PIX_FMT_YUV420P10, AV_PIX_FMT_YUV444P16}) {
+        const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(format);
+        int shift = desc->comp[0].depth - 8;
+        AVFrame* narrow = pool.acquireBuffer(width, height, AV_PIX_FMT_YUV444P);
+        AVFrame* source = pool.acquireBuffer(width, height, format);
+        AVFrame* scalar = pool.acquireBuffer(width, height, format);
+        AVFrame* simd = pool.acquireBuffer(width, height, format);
+        AVFrame* narrowOut = pool.acquireBuffer(width, height, AV_PIX_FMT_YUV444P);
+        ASSERT_TRUE(narrow && source && scalar && simd && narrowOut);
+        ASSERT_TRUE(SpatialDenoiser::isSupported(source));
+        ASSERT_TRUE(UnsharpMask::isSupported(source));
+        ASSERT_TRUE(Stabilizer::isSupported(source));
+
+        // Luma: noisy blocks; the 8-bit picture scaled up
+        for (int y = 0; y < height; y++) {
+            uint8_t* row8 = narrow->data[0] + y * narrow->linesize[0];
+            uint16_t* row = reinterpret_cast<uint16_t*>(source->data[0] + y * source->linesize[0]);
+            for (int x = 0; x < width; x++) {
+                row8[x] = uint8_t(((x / 32 + y / 32) % 2 ? 180 : 60) + random() % 12);
+                row[x] = uint16_t(row8[x] << shift);
+            }
+        }
+        for (int plane = 1; plane < 3; plane++) {
+            for (int y = 0; y < AV_CEIL_RSHIFT(height, desc->log2_chroma_h); y++) {
+                uint16_t* row = reinterpret_cast<uint16_t*>(source->data[plane] + y * source->linesize[plane]);
+                for (int x = 0; x < AV_CEIL_RSHIFT(width, desc->log2_chroma_w); x++) {
+                    row[x] = uint16_t((128 + random() % 8) << shift);
+                }
+            }
+        }
+
+        auto sameLuma = [&](const AVFrame* a, const AVFrame* b) {
+            for (int y = 0; y < height; y++) {
+                if (memcmp(a->data[0] + y * a->linesize[0], b->data[0] + y * b->linesize[0], width * 2) != 0) {
+                    return false;
+                }
+            }
+            return true;
+        };
+        auto nearNarrow = [&](const AVFrame* wide, int tolerance) {
+            for (int y = 0; y < height; y++) {
+                const uint8_t* row8 = narrowOut->data[0] + y * narrowOut->linesize[0];
+                const uint16_t* row = reinterpret_cast<const uint16_t*>(wide->data[0] + y * wide->linesize[0]);
+                for (int x = 0; x < width; x++) {
+                    if (std::abs((row[x] >> shift) - row8[x]) > tolerance) {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        };
+
+        SpatialDenoiser denoiser;
+        denoiser.setKernel(SimdKernel::Scalar);
+        ASSERT_TRUE(denoiser.process(source, scalar));
+        denoiser.setKernel(SimdKernel::Auto);
+        ASSERT_TRUE(denoiser.process(source, simd));
+        ASSERT_TRUE(sameLuma(scalar, simd)) << av_get_pix_fmt_name(format);
+        ASSERT_TRUE(denoiser.process(narrow, narrowOut));
+        ASSERT_TRUE(nearNarrow(simd, 2)) << av_get_pix_fmt_name(format);
+
+        UnsharpMask sharpener;
+        sharpener.setAmount(2.0);
+        sharpener.setKernel(SimdKernel::Scalar);
+        ASSERT_TRUE(sharpener.process(source, scalar));
+        sharpener.setKernel(SimdKernel::Auto);
+        ASSERT_TRUE(sharpener.process(source, simd));
+        ASSERT_TRUE(sameLuma(scalar, simd)) << av_get_pix_fmt_name(format);
+        ASSERT_TRUE(sharpener.process(narrow, narrowOut));
+        ASSERT_TRUE(nearNarrow(simd, 1)) << av_get_pix_fmt_name(format);
+
+        pool.release(narrow);
+        pool.release(source);
+        pool.release(scalar);
+        pool.release(simd);
+        pool.release(narrowOut);
+    }
+
+    // Semi-planar frames are unpacked before these filters see them
+    AVFrame* p010 = pool.acquireBuffer(64, 64, AV_PIX_FMT_P010);
+    ASSERT_TRUE(p010);
+    ASSERT_FALSE(SpatialDenoiser::isSupported(p010));
+    ASSERT_FALSE(UnsharpMask::isSupported(p010));
+    ASSERT_FALSE(TileScheduler::isSupported(p010));
+    pool.release(p010);
+}
+
+TEST_F(VideoTest, TestJobManagerRunsJobsConcurrently) {
+    QString inputPath = tempDir->filePath("batch.mp4");
+    QString command = QString("ffmpeg -f lavfi -i testsrc=s=1920x1080:r=24 -frames:v 48 "
+                              "-c:v libx264 -preset ultrafast %1").arg(inputPath);
+    system(qPrintable(command));
+    HighResProcessor::ProcessingOptions options{};
+    options.outputCodec = "libx264";
+    options.enableSharpening = true;
+
+    // The same batch one job at a time, then on as many slots as the
+    // budget gives; never more running than allowed
+    const int jobCount = 4;
+    auto runBatch = [&](HighResJobManager& manager, const QString& name, int& peak) {
+        // Jobs start on threads of their own
+        peak = 0;
+        QMutex peakMutex;
+        QObject::connect(&manager, &HighResJobManager::jobStarted, [&manager, &peak, &peakMutex](int) {
+            int running = manager.getRunningCount();
+            QMutexLocker locker(&peakMutex);
+            peak = qMax(peak, running);
+        });
+        QList<int> ids;
+        QElapsedTimer timer;
+        timer.start();
+        for (int i = 0; i < jobCount; i++) {
+            ids << manager.addJob(inputPath, tempDir->filePath(QString("%1_%2.mp4").arg(name).arg(i)), options);
+        }
+        EXPECT_TRUE(manager.waitForAll(120000));
+        for (int id : ids) {
+            EXPECT_EQ(manager.getJobState(id), HighResJobManager::JobState::Finished) << manager.getJobError(id);
+        }
+        return timer.elapsed();
+    };
+
+    int peak;
+    qint64 serialMs;
+    {
+        HighResJobManager manager;
+        manager.setMaxConcurrentJobs(1);
+        serialMs = runBatch(manager, "serial", peak);
+        ASSERT_EQ(peak, 1);
+    }
+    qint64 concurrentMs;
+    int slots;
+    {
+        HighResJobManager manager;
+        manager.setMaxConcurrentJobs(qMax(2, QThread::idealThreadCount() / 4));
+        slots = manager.getMaxConcurrentJobs();
+        concurrentMs = runBatch(manager, "concurrent", peak);
+        ASSERT_LE(peak, slots);
+    }
+    qDebug() << jobCount << "1080p jobs: one at a time" << serialMs << "ms," << slots << "at once"
+             << concurrentMs << "ms, speedup" << double(serialMs) / qMax<qint64>(1, concurrentMs) << "x";
+
+    // A memory budget smaller than any job lets them through one by one
+    {
+        HighResJobManager manager;
+        manager.setMaxConcurrentJobs(jobCount);
+        manager.setMemoryBudget(1);
+        runBatch(manager, "budget", peak);
+        ASSERT_EQ(peak, 1);
+    }
+
+    // Queued jobs can be cancelled before they start
+    HighResJobManager manager;
+    manager.setMaxConcurrentJobs(1);
+    int first = manager.addJob(inputPath, tempDir->filePath("first.mp4"), options);
+    int second = manager.addJob(inputPath, tempDir->filePath("second.mp4"), options);
+    ASSERT_TRUE(manager.cancelJob(second));
+    ASSERT_TRUE(manager.waitForAll(120000));
+    EXPECT_EQ(manager.getJobState(first), HighResJobManager::JobState::Finished);
+    EXPECT_EQ(manager.getJobState(second), HighResJobManager::JobState::Cancelled);
+    EXPECT_FALSE(QFileInfo::exists(tempDir->filePath("second.mp4")));
+}
+
 // Error Handling Tests
 TEST_F(VideoTest, TestExportErrorHandling) {
     ExportSettings settings;
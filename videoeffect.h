@@ -79,7 +79,8 @@ public:
     }
     
     QString getFFmpegFilter() const override {
-        return QString("unsharp=%1:5:0:5:0").arg(getParameter("amount"));
+        // 5x5 luma matrix, chroma untouched; UnsharpMask does the same natively
+        return QString("unsharp=5:5:%1:5:5:0").arg(getParameter("amount"));
     }
 };
 
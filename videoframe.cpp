@@ -0,0 +1,151 @@
+#include "videoframe.h"
+#include <QDebug>
+
+extern "C" {
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+}
+
+namespace {
+
+// Scaler contexts are not thread-safe; each thread keeps its own
+struct ThreadScaler {
+    SwsContext* context = nullptr;
+    ~ThreadScaler() {
+        sws_freeContext(context);
+    }
+};
+
+thread_local ThreadScaler threadScaler;
+thread_local ThreadScaler threadDownscaler;
+
+// Fast bilinear is plenty for a shrinking preview and much cheaper
+int scalerFlags(const AVFrame* frame, const QSize& size) {
+    bool downscaling = size.width() < frame->width || size.height() < frame->height;
+    return downscaling ? SWS_FAST_BILINEAR : SWS_BILINEAR;
+}
+
+} // namespace
+
+VideoFrame::VideoFrame(const QImage& image)
+    : image(image)
+{
+}
+
+VideoFrame VideoFrame::fromAVFrame(const AVFrame* frame) {
+    VideoFrame result;
+    if (!frame) {
+        return result;
+    }
+
+    AVFrame* ref = av_frame_alloc();
+    if (!ref || av_frame_ref(ref, frame) < 0) {
+        av_frame_free(&ref);
+        return result;
+    }
+
+    result.avFrame.reset(ref, [](AVFrame* f) { av_frame_free(&f); });
+    return result;
+}
+
+bool VideoFrame::isNull() const {
+    return avFrame ? false : image.isNull();
+}
+
+int VideoFrame::width() const {
+    return avFrame ? avFrame->width : image.width();
+}
+
+int VideoFrame::height() const {
+    return avFrame ? avFrame->height : image.height();
+}
+
+qint64 VideoFrame::sizeInBytes() const {
+    if (!avFrame) {
+        return image.sizeInBytes();
+    }
+
+    // Count the buffers actually held, padding included
+    qint64 size = 0;
+    for (int i = 0; i < AV_NUM_DATA_POINTERS && avFrame->buf[i]; i++) {
+        size += avFrame->buf[i]->size;
+    }
+    if (size == 0) {
+        size = av_image_get_buffer_size(static_cast<AVPixelFormat>(avFrame->format),
+                                        avFrame->width, avFrame->height, 1);
+    }
+    return size;
+}
+
+QImage VideoFrame::toImage() const {
+    return avFrame ? convertToImage(avFrame.get()) : image;
+}
+
+QImage VideoFrame::convertToImage(const AVFrame* frame, const QSize& size) {
+    if (!frame || frame->width <= 0 || frame->height <= 0) {
+        return QImage();
+    }
+    QSize target = size.isValid() ? size : QSize(frame->width, frame->height);
+
+    // Convert straight into the QImage pixel buffer
+    threadScaler.context = sws_getCachedContext(threadScaler.context,
+                                                frame->width, frame->height,
+                                                static_cast<AVPixelFormat>(frame->format),
+                                                target.width(), target.height(),
+                                                AV_PIX_FMT_RGB32, scalerFlags(frame, target),
+                                                nullptr, nullptr, nullptr);
+    if (!threadScaler.context) {
+        qDebug() << "VideoFrame: could not initialize scaler for"
+                 << av_get_pix_fmt_name(static_cast<AVPixelFormat>(frame->format));
+        return QImage();
+    }
+
+    QImage result(target, QImage::Format_RGB32);
+    if (result.isNull()) {
+        return QImage();
+    }
+
+    uint8_t* dstData[1] = { result.bits() };
+    int dstLinesize[1] = { static_cast<int>(result.bytesPerLine()) };
+    sws_scale(threadScaler.context, frame->data, frame->linesize, 0, frame->height,
+              dstData, dstLinesize);
+
+    return result;
+}
+
+VideoFrame VideoFrame::scaled(const AVFrame* frame, const QSize& size) {
+    if (!frame || !size.isValid() || size.isEmpty()) {
+        return VideoFrame();
+    }
+
+    AVPixelFormat format = static_cast<AVPixelFormat>(frame->format);
+    threadDownscaler.context = sws_getCachedContext(threadDownscaler.context,
+                                                    frame->width, frame->height, format,
+                                                    size.width(), size.height(), format,
+                                                    scalerFlags(frame, size),
+                                                    nullptr, nullptr, nullptr);
+    if (!threadDownscaler.context) {
+        qDebug() << "VideoFrame: could not initialize downscaler for"
+                 << av_get_pix_fmt_name(format);
+        return VideoFrame();
+    }
+
+    AVFrame* output = av_frame_alloc();
+    if (!output) {
+        return VideoFrame();
+    }
+    output->format = frame->format;
+    output->width = size.width();
+    output->height = size.height();
+    if (av_frame_get_buffer(output, 0) < 0 || av_frame_copy_props(output, frame) < 0) {
+        av_frame_free(&output);
+        return VideoFrame();
+    }
+    sws_scale(threadDownscaler.context, frame->data, frame->linesize, 0, frame->height,
+              output->data, output->linesize);
+
+    VideoFrame result;
+    result.avFrame.reset(output, [](AVFrame* f) { av_frame_free(&f); });
+    return result;
+}
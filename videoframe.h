@@ -0,0 +1,50 @@
+#pragma once
+
+#include <QImage>
+#include <QMetaType>
+#include <memory>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+// A decoded frame, held either as a refcounted AVFrame in its native
+// (usually planar YUV) format or as an RGB QImage. Copies are cheap:
+// both representations share their pixel buffers.
+class VideoFrame {
+public:
+    VideoFrame() = default;
+    explicit VideoFrame(const QImage& image);
+
+    // Takes a new reference to the frame's buffers; no pixels are copied
+    static VideoFrame fromAVFrame(const AVFrame* frame);
+
+    bool isNull() const;
+    bool isNative() const { return avFrame != nullptr; }
+    int width() const;
+    int height() const;
+    qint64 sizeInBytes() const;
+    const AVFrame* getAVFrame() const { return avFrame.get(); }
+
+    // Time it takes to produce this frame again (microseconds): decoding
+    // from the preceding keyframe, or reading it back from disk
+    void setDecodeCost(qint64 usecs) { decodeCost = usecs; }
+    qint64 getDecodeCost() const { return decodeCost; }
+
+    // RGB view of the frame; native frames are converted on each call
+    QImage toImage() const;
+
+    // YUV to RGB32 conversion shared by every consumer that needs RGB;
+    // a smaller size downscales in the same pass
+    static QImage convertToImage(const AVFrame* frame, const QSize& size = QSize());
+
+    // Downscaled copy in the frame's own pixel format
+    static VideoFrame scaled(const AVFrame* frame, const QSize& size);
+
+private:
+    std::shared_ptr<AVFrame> avFrame;
+    QImage image;
+    qint64 decodeCost = 0;
+};
+
+Q_DECLARE_METATYPE(VideoFrame)